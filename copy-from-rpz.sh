@@ -9,16 +9,18 @@ PATH8600="${JSONSPATH}8600/"
 # Copy from device
 ## get index
 JSONFNAME="${RANDOM}.json" && touch "${PATH0001}${JSONFNAME}" && COUNT=$(find "${PATH0001}" -type f -name '*.json' | wc -l) && rm "${PATH0001}${JSONFNAME}" &&
-mv ./cmake-build-debug/session1.json "${PATH0001}session${COUNT}.json" &&
+./cmake-build-debug/tools/Ndjson2json ./cmake-build-debug/session1.ndjson "${PATH0001}session${COUNT}.json" &&
 echo "Copied from Laptop"
 
 # Copy from 1st device to JSONs directory
 JSONFNAME="${RANDOM}.json" && touch "${PATH9026}${JSONFNAME}" && COUNT=$(find "${PATH9026}" -type f -name '*.json' | wc -l) && rm "${PATH9026}${JSONFNAME}" &&
-sshpass -p espx2019 scp root@10.0.90.26:/root/session1.json "${PATH9026}session${COUNT}.json" &&
+sshpass -p espx2019 scp root@10.0.90.26:/root/session1.ndjson /tmp/session9026.ndjson &&
+./cmake-build-debug/tools/Ndjson2json /tmp/session9026.ndjson "${PATH9026}session${COUNT}.json" &&
 echo "Copied from 10.0.90.26"
 
 # Copy from 2nd device to JSONs directory
-sshpass -p espx2019 scp root@10.0.86.00:/root/session1.json "${PATH8600}session${COUNT}.json" &&
+sshpass -p espx2019 scp root@10.0.86.00:/root/session1.ndjson /tmp/session8600.ndjson &&
+./cmake-build-debug/tools/Ndjson2json /tmp/session8600.ndjson "${PATH8600}session${COUNT}.json" &&
 echo "Copied from 10.0.86.00"
 
 exit
\ No newline at end of file
@@ -0,0 +1,19 @@
+#ifndef FINAL_AEM_LIST_LOOPBACK_H
+#define FINAL_AEM_LIST_LOOPBACK_H
+
+// List of AEMs for running many devices on one host ( see run-loopback.sh ).
+// Device with AEM = 80yy gets IP 127.0.80.yy, which is always routed to the loopback interface.
+static const uint32_t CLIENT_AEM_LIST[] = {
+    8000, 8001, 8002, 8003, 8004, 8005, 8006, 8007,
+    8008, 8009, 8010, 8011, 8012, 8013, 8014, 8015,
+    8016, 8017, 8018, 8019, 8020, 8021, 8022, 8023,
+    8024, 8025, 8026, 8027, 8028, 8029, 8030, 8031,
+    8032, 8033, 8034, 8035, 8036, 8037, 8038, 8039,
+    8040, 8041, 8042, 8043, 8044, 8045, 8046, 8047,
+    8048, 8049, 8050, 8051, 8052, 8053, 8054, 8055,
+    8056, 8057, 8058, 8059, 8060, 8061, 8062, 8063
+};
+
+#define CLIENT_AEM_LIST_LENGTH ( uint32_t )( sizeof( CLIENT_AEM_LIST ) / sizeof( int ) )
+
+#endif //FINAL_AEM_LIST_LOOPBACK_H
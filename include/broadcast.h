@@ -0,0 +1,10 @@
+#ifndef FINAL_BROADCAST_H
+#define FINAL_BROADCAST_H
+
+#include "types.h"
+
+/// \brief Broadcast loop ( POSIX thread compatible function ). Disseminates messages to all neighbours at once over UDP
+/// multicast, receives the ones disseminated by them & repairs losses on negative acknowledgements ( NACKs ).
+void broadcast_worker(void);
+
+#endif //FINAL_BROADCAST_H
@@ -12,17 +12,42 @@ void communication_datetime_listener_worker();
 bool communication_datetime_receiver();
 
 /// \brief Handle communication staff with connected device ( POSIX thread compatible function ).
-/// \param thread_args pointer to communicate_args_t type
+/// \param thread_args pointer to heap-allocated communicate_args_t type ( freed before returning )
 void communication_worker(void *args);
 
+/// \brief Handles a single serialized message received from $connectedDevice: de-duplicates & stores it.
+/// \param messageSerialized
+/// \param connectedDevice
+/// \param metadata carried along with the message ( NULL if none: defaults of this device apply )
+void communication_receive(char *messageSerialized, Device connectedDevice, const MessageMetadata *metadata);
+
 /// \brief Receiver sub-worker of communication worker ( POSIX thread compatible function ).
 /// \param connectedSocket socket file descriptor with connected device
 /// \param connectedDevice connected device that will send messages
-void communication_receiver_worker(int32_t connectedSocket, Device connectedDevice);
+/// \param buffer partially received frames ( kept between calls )
+/// \param deadline contact deadline; reading stops once it passes
+/// \return TRUE if device signaled the end of its dump with a control frame, FALSE on EOF / timeout / error
+bool communication_receiver_worker(int32_t connectedSocket, Device connectedDevice, ReceiveBuffer *buffer, const ContactDeadline *deadline);
+
+/// \brief Marks $MESSAGES_BUFFER[$message_i] as transmitted to $connectedDevice & updates stats.
+/// \param connectedDevice
+/// \param message_i
+void communication_transmitted(Device connectedDevice, uint16_t message_i);
+
+/// \brief Same as communication_transmitted(), for callers that already hold messagesBufferLock: marks the message
+/// they decided to transmit, before the slot can be reused by another.
+/// \param connectedDevice
+/// \param message_i
+void communication_transmitted_locked(Device connectedDevice, uint16_t message_i);
 
 /// \brief Transmitter sub-worker of communication worker ( POSIX thread compatible function ).
 /// \param connectedSocket socket file descriptor with connected device
 /// \param connectedDevice connected device that will receive messages
-void communication_transmitter_worker(int32_t connectedSocket, Device connectedDevice);
+/// \param deadline contact deadline; transmission stops once it passes
+/// \param budget max messages to transmit ( see routing_plan() )
+/// \param framesSent result: frames sent, control frames included ( NULL if not needed )
+/// \return FALSE if the contact was abandoned, TRUE otherwise
+bool communication_transmitter_worker(int32_t connectedSocket, Device connectedDevice, const ContactDeadline *deadline,
+        uint16_t budget, uint64_t *framesSent);
 
 #endif //FINAL_COMMUNICATION_H
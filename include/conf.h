@@ -16,6 +16,64 @@
     #define SETUP_DATETIME_AEM 0001               // Device with AEM = 0001 will setup datetime with all connected devices
     #define SETUP_DATETIME_TIMEOUT 10             // secs
 #endif
+
+#ifndef SESSION_MODE
+    #define SESSION_MODE 0                        // 1: keep connections open while devices stay in range & push new
+                                                  // messages incrementally ( needs COMMUNICATION_WORKERS_MAX > 0 )
+    #define SESSION_KEEPALIVE_INTERVAL 1000       // ms of silence after which a keepalive frame is sent
+#endif
+// end
+
+// start: Broadcast.h
+#ifndef BROADCAST_MODE
+    #define BROADCAST_MODE 0                      // 1: also disseminate messages to all neighbours at once, over UDP
+                                                  // multicast ( TCP contacts skip what neighbours got this way )
+    #define BROADCAST_GROUP "239.255.80.1"        // multicast group of the neighbourhood
+    #define BROADCAST_PORT 2279
+    #define BROADCAST_INTERVAL 1000               // ms between rounds of batches ( & hellos )
+    #define BROADCAST_NEIGHBOUR_TIMEOUT 3000      // ms of silence after which a device is out of range
+    #define BROADCAST_NACK_DELAY 200              // ms after the last datagram of a batch before the missing ones are
+                                                  // NACKed ( plus up to as much at random, so that NACKs suppress each
+                                                  // other )
+    #define BROADCAST_NACKS_MAX 3                 // NACKs sent per batch before giving up on it
+    #define BROADCAST_BATCH_DATAGRAMS 16          // datagrams per batch ( <= 32 )
+    #define BROADCAST_BATCHES_KEPT 4              // batches kept for repairs ( also max batches per round )
+#endif
+// end
+
+// start: Fragment.h
+#ifndef FRAGMENT_REDUNDANCY
+    #define FRAGMENT_REDUNDANCY 0.5f              // parity fragments per data fragment of a payload
+#endif
+
+#ifndef FRAGMENT_PAYLOAD_MAX
+    #define FRAGMENT_PAYLOAD_MAX 16384            // bytes of the largest payload
+#endif
+// end
+
+// start: Routing.h
+#ifndef ROUTING_POLICY
+    #define ROUTING_POLICY "epidemic"             // "epidemic", "spray_and_wait", "prophet"
+    #define SPRAY_AND_WAIT_COPIES 8               // copies of each produced message, spray_and_wait only ( < 10000 )
+
+    #define PROPHET_P_INIT 0.75f                  // predictability gained on each encounter
+    #define PROPHET_BETA 0.25f                    // weight of transitive predictabilities
+    #define PROPHET_GAMMA 0.98f                   // aging factor, per PROPHET_AGING_UNIT
+    #define PROPHET_AGING_UNIT 30                 // secs
+    #define PROPHET_SUMMARY_FRAMES_MAX 4          // control frames advertising predictabilities ( 39 devices each )
+#endif
+
+#ifndef TRANSMIT_PRIORITY
+    #define TRANSMIT_PRIORITY "fewest_copies"     // order of messages after the ones for the connected device:
+                                                  // "slot", "fewest_copies", "oldest", "youngest"
+#endif
+
+#ifndef TRANSFER_PLANNING
+    #define TRANSFER_PLANNING 1                   // fit dumps in the expected window of each contact ( 0: send all )
+    #define PLANNING_EWMA_ALPHA 0.25f             // weight of the latest sample in estimates of contacts
+    #define PLANNING_MARGIN 0.8f                  // fraction of the expected window that is planned for
+    #define PLANNING_MESSAGES_MIN 8               // messages sent regardless of estimates
+#endif
 // end
 
 // start: Client.h
@@ -26,6 +84,11 @@
     #define CLIENT_AEM_RANGE_LENGTH (CLIENT_AEM_RANGE_MAX - CLIENT_AEM_RANGE_MIN + 1)
 #endif
 
+#ifdef CLIENT_AEM_LIST_HEADER
+    // Alternative list of AEMs, e.g. -DCLIENT_AEM_LIST_HEADER='"aem_list_loopback.h"'
+    #include CLIENT_AEM_LIST_HEADER
+#endif
+
 #ifndef CLIENT_AEM_LIST_LENGTH
     // Sorted list of AEMs
     static const uint32_t CLIENT_AEM_LIST[] = {
@@ -40,15 +103,15 @@
     #define CLIENT_AEM_SOURCE "list"    // "list", "range"
 #endif
 
-#ifndef MAX_CONNECTIONS_WITH_SAME_CLIENT
-    #define MAX_CONNECTIONS_WITH_SAME_CLIENT 1000
-#endif
-
 #ifndef PRODUCER_DELAY_RANGE    // in seconds
     #define PRODUCER_DELAY_RANGE_MIN 60     // 1 min
     #define PRODUCER_DELAY_RANGE_MAX 300    // 5 min
 #endif
 
+#ifndef PRODUCER_PAYLOAD_LEN
+    #define PRODUCER_PAYLOAD_LEN 0          // bytes of each payload produced, in fragments ( 0: single messages )
+#endif
+
 #ifndef MESSAGE_SERIALIZED_LEN
     #define MESSAGE_BODY_LEN 256
     #define MESSAGE_SERIALIZED_LEN 277  // length = 4 + 4 + 10 + 256 = 277 characters
@@ -57,7 +120,12 @@
 
 // start: Server.h
 #ifndef MESSAGES_PUSH_OVERRIDE_POLICY
-    #define MESSAGES_PUSH_OVERRIDE_POLICY "blind"   // "sent_only", "blind"
+    #define MESSAGES_PUSH_OVERRIDE_POLICY "blind"   // "blind", "sent_only", "most_replicated", "oldest", "shortest_ttl"
+#endif
+
+#ifndef MESSAGE_TTL
+    #define MESSAGE_TTL 0                       // secs produced messages live ( 0: never expire )
+    #define MESSAGES_EXPIRY_INTERVAL 1000       // max ms between purges of expired messages
 #endif
 
 #ifndef MESSAGES_SIZE
@@ -78,6 +146,16 @@
     #define SOCKET_PORT 2278
 #endif
 
+#ifndef AEM_IP_PREFIX
+    #define AEM_IP_PREFIX "10.0"        // IP of each device is {AEM_IP_PREFIX}.{xx}.{yy} ( e.g. "127.0" for loopback )
+#endif
+
+#ifndef SOCKET_TIMEOUTS     // in milliseconds
+    #define SOCKET_CONNECT_TIMEOUT 2000     // max time to wait for a peer to accept our connect()
+    #define SOCKET_IDLE_TIMEOUT 5000        // max time a single read() / send() may stall
+    #define SOCKET_TRANSFER_TIMEOUT 60000   // max total duration of a contact ( both directions )
+#endif
+
 #ifndef ACTIVE_SOCKET_CONNECTIONS_MAX
     #define ACTIVE_SOCKET_CONNECTIONS_MAX 2     // >=2: 1 ( server ) + 1 ( client ) + ...( other concurrent sockets )...
 #endif
@@ -93,20 +171,113 @@
     #define STRFTIME_STR_LEN 50
 #endif
 
+#ifndef STRFTIME_CACHE_SIZE
+    #define STRFTIME_CACHE_SIZE 8       // formatted timestamps each thread keeps ( power of 2 )
+#endif
+
+#ifndef STRFTIME_FORMAT_LEN
+    #define STRFTIME_FORMAT_LEN 24      // longest format cached, with its '\0'
+#endif
+
 #ifndef MESSAGE_BODY_ASCII_MIN
     #define MESSAGE_BODY_ASCII_MIN 32
     #define MESSAGE_BODY_ASCII_MAX 95
 #endif
 // end
 
+// start: Io.h
+#ifndef IO_PROBE_BACKEND
+    #define IO_PROBE_BACKEND "io_uring" // batched connects of polling: "io_uring", "epoll" ( io_uring falls back to
+                                        // epoll if not supported )
+#endif
+
+#ifndef IO_BATCH_LEN
+    #define IO_BATCH_LEN 32             // max messages per batched read() / send()
+#endif
+
+#ifndef IO_DRAIN_POLL_INTERVAL
+    #define IO_DRAIN_POLL_INTERVAL 2    // ms between checks of the send queue, while the peer acknowledges a dump
+#endif
+
+#ifndef IO_URING_ENTRIES
+    #define IO_URING_ENTRIES 64         // submission queue size ( 2 entries per probe )
+#endif
+// end
+
+// start: Metrics.h
+#ifndef METRICS_PORT
+    #define METRICS_PORT 9180                     // port of the metrics endpoint ( Prometheus text format over HTTP ),
+                                                  // 0 for none
+    #define METRICS_ADDRESS "127.0.0.1"           // local only: scraped by a collector running on the device
+    #define METRICS_RESPONSE_LEN 16384
+#endif
+// end
+
+// start: Span.h
+#ifndef SPAN_FILE_NAME
+    #define SPAN_FILE_NAME ""                     // trace of the phases of contacts ( Chrome trace format ), "" for none
+    #define SPAN_EVENT_LEN 256                    // max length of a single event of the trace
+    #define SPAN_FILE_BUFFER_LEN 65536
+    #define SPAN_THREAD_BUFFER_LEN 65536          // events each thread buffers until span_flush() ( >= SPAN_EVENT_LEN )
+#endif
+// end
+
+// start: Profile.h
+#ifndef PROFILE
+    #define PROFILE 0                             // 1 to time the hot paths of every thread ( see profile_dump() )
+#endif
+// end
+
+// start: Histogram.h
+#ifndef HISTOGRAM_PRECISION_BITS
+    #define HISTOGRAM_PRECISION_BITS 5  // 2^5 buckets per power of 2: values are kept within 1 / 2^5 ( ~3% )
+    #define HISTOGRAM_MAGNITUDE_BITS 36 // values ( usecs ) up to 2^36 ( ~19 hours ), larger ones are clamped
+#endif
+// end
+
 // start: Log.h
 #ifndef ALSO_LOG_TO_STDOUT
     #define ALSO_LOG_TO_STDOUT 1
 #endif
 
+#ifndef LOG_FILE_NAME
+    #define LOG_FILE_NAME "session1.ndjson"
+#endif
+
+#ifndef LOG_FORMAT
+    #define LOG_FORMAT "ndjson"                   // "ndjson", "binary" ( rendered by tools/decode.c )
+#endif
+
+#ifndef LOG_BINARY_MAGIC
+    #define LOG_BINARY_MAGIC "FLOG"               // head of a binary session log, followed by LOG_BINARY_VERSION
+    #define LOG_BINARY_VERSION 3
+    #define LOG_BINARY_NAME_OTHER 0xFF            // name not in the lists below, written out
+    #define LOG_BINARY_EVENT_TYPES { "connection", "session", "production", "datetime" }
+    #define LOG_BINARY_ACTIONS { "produced", "received", "transmitted" }
+    #define LOG_BINARY_HISTOGRAMS { "contact_duration", "transfer_time", "first_byte_time", "delivery_latency" }
+#endif
+
 #ifndef LOG_MESSAGE_MAX_LEN
     #define LOG_MESSAGE_MAX_LEN 512
 #endif
+
+#ifndef LOG_RING_SIZE
+    #define LOG_RING_SIZE 8192                    // records queued for the logger thread ( power of 2 ), more are dropped
+    #define LOG_IDLE_SLEEP 10                     // ms the logger thread sleeps when nothing is queued
+    #define LOG_BUFFER_LEN 65536                  // bytes of log buffered before they are written
+    #define LOG_FSYNC_INTERVAL 1000               // ms between flushes of the log to disk ( fsync() )
+    #define LOG_EVENT_TYPE_LEN 16
+    #define LOG_ACTION_LEN 16
+#endif
+
+#ifndef LOG_ROTATE_BYTES
+    #define LOG_ROTATE_BYTES ( 16L * 1024 * 1024 )      // size of a segment of the session log, 0 for no limit
+    #define LOG_ROTATE_INTERVAL 86400                     // secs a segment lasts at most, 0 for no limit
+    #define LOG_RETENTION_BYTES ( 256L * 1024 * 1024 )  // closed segments kept ( oldest are deleted ), 0 for no limit
+    #define LOG_SEGMENTS_MAX 1024                         // closed segments kept at most
+    #define LOG_COMPRESS_COMMAND "gzip"                   // compresses closed segments in the background, "" for none
+    #define LOG_COMPRESS_SUFFIX ".gz"
+#endif
 // end
 
 #endif //FINAL_CONF_H
@@ -0,0 +1,36 @@
+#ifndef FINAL_FRAGMENT_H
+#define FINAL_FRAGMENT_H
+
+#include "types.h"
+#include <stdbool.h>
+
+/// \brief Number of fragments ( data & parity ) a payload of $length bytes is split into.
+/// \param length bytes ( up to FRAGMENT_PAYLOAD_MAX )
+/// \return 0 if $length is out of range
+uint16_t fragment_count(size_t length);
+
+/// \brief Splits $payload into fragments with a systematic Reed-Solomon code over GF(256): the data fragments carry
+/// $payload as is & each parity fragment a combination of all of them, so that ANY $dataN of the fragments reconstruct
+/// $payload. Each fragment is a message body ( printable ASCII ), with its header at the head of it.
+/// \param payload
+/// \param length bytes ( up to FRAGMENT_PAYLOAD_MAX )
+/// \param id identifies the payload among those of its sender
+/// \param bodies result bodies ( room for fragment_count( $length ) )
+/// \return number of fragments, 0 if $length is out of range
+uint16_t fragment_encode(const uint8_t *payload, size_t length, uint32_t id, char (*bodies)[MESSAGE_BODY_LEN]);
+
+/// \brief Parses the header of a fragment.
+/// \param body message body
+/// \param header result header ( passed as pointer )
+/// \return FALSE if $body is not a fragment
+bool fragment_parse(const char *body, FragmentHeader *header);
+
+/// \brief Reconstructs a payload from $bodiesN fragments of it.
+/// \param bodies fragments of the same payload ( at least $dataN distinct ones )
+/// \param bodiesN
+/// \param payload result payload ( room for the length in the fragments' header, up to FRAGMENT_PAYLOAD_MAX bytes )
+/// \param length result bytes of payload
+/// \return FALSE if there are not enough distinct fragments
+bool fragment_decode(const char *const *bodies, uint16_t bodiesN, uint8_t *payload, size_t *length);
+
+#endif //FINAL_FRAGMENT_H
@@ -0,0 +1,39 @@
+#ifndef FINAL_HEAP_H
+#define FINAL_HEAP_H
+
+#include "types.h"
+
+/// \brief Empties $heap.
+/// \param heap
+void heap_clear(Heap *heap);
+
+/// \brief Entry of $heap with the smallest key.
+/// \param heap
+/// \return NULL if $heap is empty
+const HeapEntry* heap_peek(const Heap *heap);
+
+/// \brief Removes the entry of $heap with the smallest key.
+/// \param heap
+/// \param entry result removed entry
+/// \return FALSE if $heap is empty
+bool heap_pop(Heap *heap, HeapEntry *entry);
+
+/// \brief Adds $entry to $heap.
+/// \param heap
+/// \param entry
+/// \return FALSE if $heap is full
+bool heap_push(Heap *heap, HeapEntry entry);
+
+/// \brief Sets the key of $value in $heap, adding it if not there. Requires a heap that tracks positions.
+/// \param heap
+/// \param value
+/// \param key
+/// \return FALSE if $heap is full
+bool heap_update(Heap *heap, uint32_t value, uint64_t key);
+
+/// \brief Removes $value from $heap ( no-op if not there ). Requires a heap that tracks positions.
+/// \param heap
+/// \param value
+void heap_remove(Heap *heap, uint32_t value);
+
+#endif //FINAL_HEAP_H
@@ -0,0 +1,28 @@
+#ifndef FINAL_HISTOGRAM_H
+#define FINAL_HISTOGRAM_H
+
+#include "types.h"
+
+/// \brief Counts $value in $histogram. Any thread may record at any time ( relaxed atomic adds, no lock ).
+/// \param histogram
+/// \param value
+void histogram_record(Histogram *histogram, uint64_t value);
+
+/// \brief Counts the usecs elapsed since $since in $histogram.
+/// \param histogram
+/// \param since
+void histogram_record_elapsed(Histogram *histogram, const struct timeval *since);
+
+/// \brief Mean of the values counted in $histogram.
+/// \param histogram
+/// \return 0 if $histogram is empty
+uint64_t histogram_mean(const Histogram *histogram);
+
+/// \brief Value below or at which $percentile % of the values counted in $histogram are, as the highest value of its
+/// bucket ( 0: lowest value counted, 100: highest ).
+/// \param histogram
+/// \param percentile in [0, 100] ( clamped )
+/// \return 0 if $histogram is empty
+uint64_t histogram_percentile(const Histogram *histogram, double percentile);
+
+#endif //FINAL_HISTOGRAM_H
@@ -0,0 +1,56 @@
+#ifndef FINAL_IO_H
+#define FINAL_IO_H
+
+#include "types.h"
+#include <sys/uio.h>
+
+/// \brief Name of the probe backend actually in use ( after any fallback ).
+/// \return "io_uring" or "epoll"
+const char* io_probe_backend_name(void);
+
+/// \brief Tries to connect to all $aems at once. Connects are submitted as a single batch and each one is given
+/// SOCKET_CONNECT_TIMEOUT to complete. Must only be called from one thread ( polling_worker ).
+/// \param aems AEMs to probe
+/// \param N size of $aems
+/// \param port
+/// \param connected_fds result array of size $N: connected socket for i-th AEM, or -1 if unreachable
+/// \return number of connected sockets
+uint16_t io_probe(const uint32_t *aems, uint16_t N, uint16_t port, int32_t *connected_fds);
+
+/// \brief Single read() of up to $length bytes from $socket_fd, retried on EINTR.
+/// \param socket_fd
+/// \param buffer
+/// \param length
+/// \param deadline contact deadline ( NULL for none )
+/// \return number of bytes read, 0 on EOF / timeout / error / passed deadline
+size_t io_recv(int32_t socket_fd, void *buffer, size_t length, const ContactDeadline *deadline);
+
+/// \brief Sends all $N buffers of $iov to $socket_fd using as few syscalls as possible ( vectored write ).
+/// \param socket_fd
+/// \param iov
+/// \param N number of buffers in $iov ( at most IO_BATCH_LEN )
+/// \param deadline contact deadline ( NULL for none )
+/// \return TRUE if all bytes were sent, FALSE otherwise
+bool io_send_batch(int32_t socket_fd, const struct iovec *iov, int N, const ContactDeadline *deadline);
+
+/// \brief Waits until the peer of $socket_fd acknowledged every byte sent to it ( the send queue drained ), or $deadline
+/// passes, & tells how many of the last $bytes sent it did acknowledge. Unlike send() returning, which only means they
+/// were copied into the local send buffer, this tells how many the link actually carried.
+/// \param socket_fd
+/// \param bytes sent lately
+/// \param deadline contact deadline ( NULL for none )
+/// \return bytes of the last $bytes acknowledged ( all of them if the send queue cannot be read )
+uint64_t io_send_acked(int32_t socket_fd, uint64_t bytes, const ContactDeadline *deadline);
+
+/// \brief Bytes that can be sent to $socket_fd without blocking, as far as can be told: half of its send buffer ( the
+/// kernel doubles SO_SNDBUF to make room for its own bookkeeping ) less the bytes queued ( see io_send_acked() ).
+/// \param socket_fd
+/// \return 0 if the send buffer is full, or cannot be read
+size_t io_send_room(int32_t socket_fd);
+
+/// \brief Initializes the requested backend of io_probe(), falling back to epoll if $backend is unavailable. Reads &
+/// writes of contacts are blocking syscalls of their own thread, whatever the backend.
+/// \param backend "io_uring", "epoll"
+void io_probe_setup(const char *backend);
+
+#endif //FINAL_IO_H
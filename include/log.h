@@ -6,34 +6,50 @@
 #include <time.h>
 #include <types.h>
 
-/// \brief Logs the start of a new event in session.json file
+/// \brief Logs the start of a new event of this thread in session log ( queued for log_worker() ). The records this
+/// thread logs up to log_event_stop() belong to it.
 /// \param type
 /// \param server
 /// \param client
 void log_event_start( const char* type, uint32_t server, uint32_t client );
 
-/// \brief Logs $message to session.json file
+/// \brief Logs $message to session log
 /// \param action
 /// \param message
 void log_event_message( const char* action, const Message* message );
 
-/// \brief Logs datetime syncing to session.json file
+/// \brief Logs datetime syncing to session log
 /// \param previous_now
 /// \param new_now
 void log_event_message_datetime( uint64_t previous_now, uint64_t new_now );
 
-/// \brief Logs the end of a new event in session.json file
+/// \brief Logs the end of a new event in session log
 void log_event_stop(void);
 
-/// \brief Append end of session message and closes log file pointer
+/// \brief Logger loop ( POSIX thread compatible function ). Formats the records queued by the log_event_*() functions
+/// & appends them to the session log, so that no hot path waits for disk I/O or for another thread's event. The log
+/// is flushed to disk every LOG_FSYNC_INTERVAL ms. Returns once log_worker_stop() is called & nothing is left queued.
+void log_worker(void);
+
+/// \brief Makes log_worker() return, once it has written whatever is queued.
+void log_worker_stop(void);
+
+/// \brief Records dropped so far, as the logger's ring was full.
+/// \return
+uint64_t log_records_dropped(void);
+
+/// \brief Append end of session lines ( stats, devices & contents of buffers ) and closes log file pointer
 /// \param executionTimeActual
 void log_tearDown( double executionTimeActual);
 
-/// \brief Creates / Opens file and add the new session message
+/// \brief Initializes the requested format of the session log, falling back to "ndjson" if $format is unknown. Must be
+/// called before log_tearUp().
+/// \param format "ndjson", "binary" ( compact: bodies are replaced by fingerprints, see tools/decode.c )
+void log_format_setup(const char *format);
+
+/// \brief Creates / Opens file and add the new session line. The session log is newline-delimited JSON ( one record
+/// per line, appended only ): see tools/ndjson2json.c for the layout of a single JSON document.
 /// \param jsonFileName
 void log_tearUp(const char *jsonFileName);
 
-/// \brief Removes last character from session.json file
-void removeTrailingCommaFromJson(void);
-
 #endif //FINAL_LOG_H
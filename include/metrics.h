@@ -0,0 +1,17 @@
+#ifndef FINAL_METRICS_H
+#define FINAL_METRICS_H
+
+#include "types.h"
+
+/// \brief Metrics endpoint loop ( POSIX thread compatible function ). Serves the live state of this device over HTTP,
+/// on METRICS_ADDRESS : $metricsPort, in the Prometheus text format: occupancy of buffers, active contacts, counters of
+/// messagesStats & percentiles of its histograms. Returns at once if the endpoint cannot be opened.
+void metrics_worker(void);
+
+/// \brief Renders the metrics of this device in the Prometheus text format.
+/// \param buffer
+/// \param size of $buffer
+/// \return length of the metrics ( truncated to $size - 1 )
+size_t metrics_render(char *buffer, size_t size);
+
+#endif //FINAL_METRICS_H
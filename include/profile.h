@@ -0,0 +1,40 @@
+#ifndef FINAL_PROFILE_H
+#define FINAL_PROFILE_H
+
+#include <stdio.h>
+#include <time.h>
+#include "types.h"
+
+/* Timing of a hot path: PROFILE_BEGIN() at its start, PROFILE_END() on every way out. Compiled out unless PROFILE
+ * is 1, so that the hot paths cost nothing more by default. */
+#if 1 == PROFILE
+    #define PROFILE_BEGIN() profile_now()
+    #define PROFILE_END(function, startedAt) profile_record( function, startedAt )
+#else
+    #define PROFILE_BEGIN() ( (uint64_t) 0 )
+    #define PROFILE_END(function, startedAt) ( (void) ( startedAt ) )
+#endif
+
+/// \brief Current time of the raw monotonic clock ( not slewed by NTP / datetime syncing ), in nsecs. The cycle
+/// counter of the Pi Zero's ARM11 is not readable from user space, while this one is read without a syscall.
+/// \return
+static inline uint64_t profile_now(void)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC_RAW, &now );
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+/// \brief Counts a call of $function that started at $startedAt & returns now, in the timings of the calling thread
+/// ( thread-local: no lock, no cache line shared with other threads ).
+/// \param function
+/// \param startedAt as returned by profile_now()
+void profile_record(ProfileFunction function, uint64_t startedAt);
+
+/// \brief Writes the calls & distribution of times ( nsecs ) of each hot path to $stream, over all threads, whether
+/// running or exited. Writes nothing unless PROFILE is 1.
+/// \param stream
+void profile_dump(FILE *stream);
+
+#endif //FINAL_PROFILE_H
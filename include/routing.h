@@ -0,0 +1,91 @@
+#ifndef FINAL_ROUTING_H
+#define FINAL_ROUTING_H
+
+#include "types.h"
+
+/// \brief Number of copies a newly produced message starts with ( Spray-and-Wait ).
+/// \return
+uint16_t routing_copies_initial(void);
+
+/// \brief Checks if the selected routing policy hands out copies along with messages ( control frame per batch ).
+/// \return TRUE for Spray-and-Wait, FALSE for epidemic routing
+bool routing_copies_enabled(void);
+
+/// \brief Checks if the selected routing policy advertises its state to devices met ( see routing_summary() ).
+/// \return TRUE for PRoPHET, FALSE otherwise
+bool routing_summary_enabled(void);
+
+/// \brief Number of copies of $message handed to $connectedDevice along with the message.
+/// \param message
+/// \param connectedDevice
+/// \return
+uint16_t routing_copies_handed(const Message *message, Device connectedDevice);
+
+/// \brief Updates the estimated duration of contacts with $connectedDevice ( & with any device ) after one ended. A
+/// contact that ended before the device left ( both dumps completed ) only shows that the device stays at least that
+/// long: it never shortens the estimate.
+/// \param connectedDevice
+/// \param duration secs the contact lasted
+/// \param cut TRUE if the contact ended because the device left ( or stalled )
+void routing_contact_observed(Device connectedDevice, double duration, bool cut);
+
+/// \brief Updates routing state on the start of a contact with $connectedDevice. PRoPHET: predictability of meeting
+/// the device again increases.
+/// \param connectedDevice
+void routing_encounter(Device connectedDevice);
+
+/// \brief Plans the dump to $connectedDevice: how many messages of the transmit queue fit in what is expected to be left
+/// of the contact. The device that transmits first plans for half of it, to leave the rest to the other.
+/// \param connectedDevice
+/// \param first TRUE if the device will transmit after us, in the same contact
+/// \param elapsed secs since the contact started
+/// \return max messages to transmit ( MESSAGES_SIZE if there is nothing to plan with )
+uint16_t routing_plan(Device connectedDevice, bool first, double elapsed);
+
+/// \brief Initializes the requested order of transmissions, falling back to "fewest_copies" if $priority is unknown.
+/// \param priority "slot", "fewest_copies", "oldest", "youngest"
+void routing_priority_setup(const char *priority);
+
+/// \brief Builds the transmit queue for $connectedDevice: the messages of $MESSAGES_BUFFER that routing allows to
+/// transmit, those addressed to the device first, then the rest in the selected priority order.
+/// \param connectedDevice
+/// \param queue result indexes in $MESSAGES_BUFFER ( MESSAGES_SIZE at most )
+/// \return length of $queue
+uint16_t routing_queue(Device connectedDevice, uint16_t *queue);
+
+/// \brief Initializes the requested routing policy, falling back to epidemic routing if $policy is unknown.
+/// \param policy "epidemic", "spray_and_wait", "prophet"
+void routing_setup(const char *policy);
+
+/// \brief Routing decision: checks if $message should be transmitted to $connectedDevice.
+/// \param message
+/// \param connectedDevice
+/// \return TRUE if $message should be transmitted, FALSE otherwise
+bool routing_should_transmit(const Message *message, Device connectedDevice);
+
+/// \brief Serializes the routing state advertised to devices before the dumps of each contact. PRoPHET: the non-zero
+/// predictabilities of this device, as entries of AEM ( %04u ) & predictability in thousandths ( %03u ).
+/// \param frames result frames; the payload of each one starts at [1] ( [0] is left to the caller, for the frame type )
+/// \param framesMax
+/// \return number of frames used, 0 if the selected routing policy advertises nothing
+uint16_t routing_summary(char frames[][MESSAGE_SERIALIZED_LEN], uint16_t framesMax);
+
+/// \brief Handles the routing state advertised by $connectedDevice ( see routing_summary() ). PRoPHET: keeps the
+/// device's predictabilities & updates ours transitively ( if the device is likely to meet X, so are we ).
+/// \param connectedDevice
+/// \param payload frame payload
+/// \param first TRUE for the first frame of an advertisement ( previous one of the device is discarded )
+void routing_summary_receive(Device connectedDevice, const char *payload, bool first);
+
+/// \brief Updates the estimated throughput towards $connectedDevice ( & towards any device ) after a dump.
+/// \param connectedDevice
+/// \param bytes transmitted & acknowledged by the device ( not just handed to the socket )
+/// \param secs from the start of the dump until they were acknowledged
+void routing_throughput_observed(Device connectedDevice, uint64_t bytes, double secs);
+
+/// \brief Updates routing state of $message after it was transmitted to $connectedDevice ( e.g. copies left ).
+/// \param message
+/// \param connectedDevice
+void routing_transmitted(Message *message, Device connectedDevice);
+
+#endif //FINAL_ROUTING_H
@@ -31,10 +31,67 @@ void devices_remove(Device device);
 /// \param device used to keep stats of the first device that gave us our message
 void inbox_push(Message *message, Device *device);
 
+/// \brief Initializes the requested eviction policy, falling back to "blind" if $policy is unknown:
+///     - blind: overwrite the message at $messagesHead
+///     - sent_only: overwrite the next hole or transmitted message from $messagesHead on
+///     - most_replicated: evict the message transmitted to the most devices first
+///     - oldest: evict the oldest message first
+///     - shortest_ttl: evict the message closest to expiring first ( those that never expire last )
+/// Every policy but blind & sent_only fills holes & drops messages delivered to their recipient first, and evicts own
+/// messages ( produced by this device ) only once nothing else is left.
+/// \param policy
+void messages_eviction_setup(const char *policy);
+
+/// \brief Places $MESSAGES_BUFFER[$message_i] in the eviction order anew, after it changed.
+/// \param message_i
+void messages_eviction_update(messages_head_t message_i);
+
+/// \brief Rebuilds the eviction order from the messages of $MESSAGES_BUFFER.
+void messages_eviction_rebuild(void);
+
 /// \brief Push $message to $messages circle buffer. Updates $messageHead acc. to selected override policy.
 /// \param message
 void messages_push(Message *message);
 
+/// \brief Unlists $MESSAGES_BUFFER[$message_i] from its recipient's pending messages ( no-op if not listed ).
+/// \param message_i
+void messages_index_remove(messages_head_t message_i);
+
+/// \brief Finds the messages of $MESSAGES_BUFFER pending for $device as their recipient, in O(pending).
+/// \param device
+/// \param slots result slots in $MESSAGES_BUFFER ( room for MESSAGES_SIZE )
+/// \return number of messages found
+uint16_t messages_pending_for(Device device, uint16_t *slots);
+
+/// \brief Drops messages of $MESSAGES_BUFFER that expired by $now, leaving holes in their slots.
+/// \param now timestamp
+/// \return number of messages dropped
+uint16_t messages_expire(uint64_t now);
+
+/// \brief Expiry loop. Drops expired messages of $MESSAGES_BUFFER as soon as they expire ( at most
+/// MESSAGES_EXPIRY_INTERVAL later ), so that they neither take up slots nor airtime.
+void messages_expiry_worker(void);
+
+/// \brief Notify all open persistent sessions that new messages arrived in $MESSAGES_BUFFER.
+void sessions_notify(void);
+
+/// \brief Register the persistent session with $device, to be notified through $event_fd on new messages.
+/// \param device
+/// \param event_fd
+void sessions_register(Device device, int event_fd);
+
+/// \brief Unregister the persistent session with $device.
+/// \param device
+void sessions_unregister(Device device);
+
+/// \brief Makes $store the store of the running device.
+/// \param store
+void store_load(const Store *store);
+
+/// \brief Saves the store of the running device ( as modified since store_load() ) back to $store.
+/// \param store
+void store_save(Store *store);
+
 /// \brief Main server loop. Calls communication_thread() on each new connection.
 void listening_worker();
 
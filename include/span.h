@@ -0,0 +1,35 @@
+#ifndef FINAL_SPAN_H
+#define FINAL_SPAN_H
+
+#include <stdint.h>
+
+/// \brief Opens the trace of phases of this session ( see span_end() ): a JSON array of events in the Chrome trace
+/// format, loaded as is by chrome://tracing & ui.perfetto.dev. Events are appended only: a trace cut by a crash loads
+/// too. Spans are not traced unless this is called.
+/// \param fileName "" for none
+void span_tearUp(const char *fileName);
+
+/// \brief Starts a span of the calling thread.
+/// \return its start ( nsecs ), to be passed to span_end(); 0 if spans are not traced
+uint64_t span_begin(void);
+
+/// \brief Ends the span started at $startedAt by the calling thread & buffers it, as a complete event of this device
+/// ( process ) & thread. Buffered events are written to the trace by span_flush(), so that spans ended while holding
+/// a lock ( e.g. messagesBufferLock ) do no I/O; only a full buffer is written right away.
+/// \param name phase of the span ( a string literal )
+/// \param startedAt as returned by span_begin()
+void span_end(const char *name, uint64_t startedAt);
+
+/// \brief Writes the spans buffered by the calling thread to the trace. Called where the thread holds no lock, e.g.
+/// at the end of each contact; the spans of a thread that exits are written anyway.
+void span_flush(void);
+
+/// \brief Names the calling thread in the trace.
+/// \param name
+void span_thread_name(const char *name);
+
+/// \brief Closes the trace, with the spans buffered by the calling thread. Spans buffered by threads still running, or
+/// ended afterwards, are not traced.
+void span_tearDown(void);
+
+#endif //FINAL_SPAN_H
@@ -1,7 +1,9 @@
 #ifndef FINAL_TYPES_H
 #define FINAL_TYPES_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/time.h>
 #include "conf.h"
 
 #define error(status, msg) do { errno = status; perror(msg); exit(EXIT_FAILURE); } while (0)
@@ -9,6 +11,53 @@
 // start: Server.h
 typedef uint16_t messages_head_t;
 
+// start: Heap.h
+typedef struct heap_entry_t {
+    uint64_t key;
+    uint32_t value;
+} HeapEntry;
+
+/* Binary min-heap on a fixed-size array */
+typedef struct heap_t {
+    HeapEntry *entries;
+    size_t length;
+    size_t capacity;
+    size_t *positions;                  // position + 1 of each value's entry ( 0: not in heap ), NULL if not tracked
+} Heap;
+
+// start: Histogram.h
+#define HISTOGRAM_BUCKETS ( ( HISTOGRAM_MAGNITUDE_BITS - HISTOGRAM_PRECISION_BITS + 1 ) << HISTOGRAM_PRECISION_BITS )
+
+/* Log-linear histogram of values on a fixed-size array ( HDR-style ): each power of 2 is split into
+ * 2^HISTOGRAM_PRECISION_BITS equal buckets, values below 2^( HISTOGRAM_PRECISION_BITS + 1 ) are counted exactly */
+typedef struct histogram_t {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+} Histogram;
+
+// start: Profile.h
+/* Hot paths timed when PROFILE is 1 ( see profile_dump() ) */
+typedef enum profile_function_t {
+    PROFILE_EXPLODE,
+    PROFILE_IMPLODE,
+    PROFILE_IS_MESSAGE_EQUAL,
+    PROFILE_MESSAGES_PUSH,
+    PROFILE_INBOX_PUSH,
+    PROFILE_DUPLICATE_SCAN,             // duplicate check of a received message, see communication_receive()
+    PROFILE_FUNCTIONS_N
+} ProfileFunction;
+
+// start: Fragment.h
+/* Header of a fragment of a payload, at the head of a message's body */
+typedef struct fragment_header_t {
+    uint32_t id;                        // payload, among those of its sender
+    uint8_t index;                      // [0, dataN): data, [dataN, fragmentsN): parity
+    uint8_t dataN;                      // fragments that suffice to reconstruct the payload
+    uint8_t fragmentsN;
+    uint16_t length;                    // bytes of payload
+} FragmentHeader;
+
 // start: Utils.h
 typedef struct device_t {
     uint32_t AEM;
@@ -27,8 +76,17 @@ typedef struct message_t {
     uint8_t transmitted_devices[CLIENT_AEM_LIST_LENGTH];    // Boolean array, 1 if i-th device has received the message,
                                                             // 0 otherwise
     uint8_t transmitted_to_recipient;
+    uint16_t copies;                    // Copies this device may still hand out, itself included ( Spray-and-Wait )
+    uint16_t transmissions;             // Devices this device has transmitted the message to
+    uint32_t ttl;                       // Secs after created_at the message expires ( 0: never )
 } Message;
 
+/* Metadata carried along with a message in control frames */
+typedef struct message_metadata_t {
+    uint16_t copies;
+    uint32_t ttl;
+} MessageMetadata;
+
 typedef struct inbox_message_t {
     // Necessary fields
     uint32_t sender;                    // ΑΕΜ αποστολέα:       uint32
@@ -40,6 +98,81 @@ typedef struct inbox_message_t {
     uint32_t first_sender;              // ΑΕΜ της συσκευής που μετέδωσε το μήνυμα
 } InboxMessage;
 
+/* Payload of a sender, as its fragments reach $INBOX: reconstructed once $dataN of them did */
+typedef struct inbox_payload_t {
+    uint32_t sender;
+    uint32_t id;                        // payload, among those of its sender
+    uint8_t dataN;
+    uint8_t fragmentsN;
+    uint8_t fragmentsReceived;          // fragments of it in $INBOX
+    uint64_t saved_at;                  // time it was reconstructed ( 0: not yet )
+    size_t length;                      // bytes of $data
+    uint8_t *data;                      // NULL until reconstructed
+} InboxPayload;
+
+/* PRoPHET delivery predictabilities of a device, towards each device of CLIENT_AEM_LIST */
+typedef struct predictabilities_t {
+    float values[CLIENT_AEM_LIST_LENGTH];
+    uint64_t aged_at;                   // timestamp of last aging
+} Predictabilities;
+
+/* Estimates of the contacts with a device, as exponentially weighted moving averages */
+typedef struct contact_estimate_t {
+    float duration;                     // secs the device stays in range
+    float throughput;                   // bytes / sec the device acknowledged
+    uint16_t contacts;                  // contacts measured ( 0: no estimates yet )
+} ContactEstimate;
+
+/* Messages of $MESSAGES_BUFFER pending for each device of CLIENT_AEM_LIST ( not yet transmitted to it as their
+   recipient ): a doubly-linked list through the slots of the buffer, per recipient. Links are slot + 1 ( 0: none ), so
+   that a zeroed index is empty. */
+typedef struct recipient_index_t {
+    messages_head_t heads[CLIENT_AEM_LIST_LENGTH];
+    messages_head_t next[MESSAGES_SIZE];
+    messages_head_t prev[MESSAGES_SIZE];
+    int32_t recipients[MESSAGES_SIZE];  // aemIndex + 1 of the recipient each slot is listed under ( 0: none )
+} RecipientIndex;
+
+/* Message store of a device: whatever a device keeps between contacts ( swapped in & out by the simulator ) */
+typedef struct store_t {
+    uint32_t aem;
+    Message *messages;                  // MESSAGES_SIZE messages
+    messages_head_t messagesHead;
+    InboxMessage *inbox;                // INBOX_SIZE messages
+    messages_head_t inboxHead;
+    InboxPayload *payloads;             // INBOX_SIZE payloads
+    messages_head_t payloadsHead;
+    Predictabilities *predictabilities;
+    Heap expiries;                      // expiry of messages with a TTL ( 2 * MESSAGES_SIZE entries )
+    RecipientIndex *recipients;
+    Heap evictions;                     // eviction order of messages ( MESSAGES_SIZE entries & positions )
+    ContactEstimate *estimates;         // CLIENT_AEM_LIST_LENGTH + 1 estimates ( last: of any device )
+} Store;
+
+/* Per-contact I/O deadline */
+typedef struct contact_deadline_t {
+    struct timespec expires_at;         // CLOCK_MONOTONIC time after which the contact is abandoned ( unaffected by
+                                        // datetime syncing, see communication_datetime_receiver() )
+} ContactDeadline;
+
+/* Partially received frames of a contact */
+typedef struct receive_buffer_t {
+    char data[IO_BATCH_LEN * MESSAGE_SERIALIZED_LEN];
+    size_t length;
+
+    // Metadata of each of the next messages, from the control frames at the head of their batch
+    MessageMetadata metadata[IO_BATCH_LEN];
+    uint16_t metadataLength;
+    uint16_t metadata_i;
+    bool metadataReceiving;
+
+    // Predictabilities of device are being received ( PRoPHET )
+    bool summaryReceiving;
+
+    // Start of the contact, until its first byte is received ( then zero )
+    struct timeval startedAt;
+} ReceiveBuffer;
+
 /* pthread function arguments pointer */
 typedef struct communication_worker_args_t {
 
@@ -52,19 +185,82 @@ typedef struct communication_worker_args_t {
 // end
 
 // start: Log.h
+/* Stats of the session: any thread counts with stats_add(), read once the workers are done ( see log_tearDown() ) */
 typedef struct messages_stats_t {
 
     // Total
-    uint16_t produced;
-    uint16_t received;
-    uint16_t received_for_me;
-    uint16_t transmitted;
-    uint16_t transmitted_to_recipient;
+    uint64_t produced;                  // messages, fragments of payloads included
+    uint64_t productions;               // rounds of the producer: a message or a payload each
+    uint64_t received;
+    uint64_t received_for_me;
+    uint64_t transmitted;
+    uint64_t transmitted_to_recipient;
+    uint64_t payloads_received;
+    uint64_t duplicates;                // received messages dropped, as already in $MESSAGES_BUFFER
+    uint64_t evicted;                   // messages overwritten in $MESSAGES_BUFFER before reaching their recipient
 
-    // Time
+    // I/O of contacts
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t syscalls;                  // read() / send() / sendmsg() calls on connected sockets
+
+    // Time ( usecs )
+    Histogram contact_duration;
+    Histogram transfer_time;            // per transmitted message: its share of the time its batch took to send
+    Histogram first_byte_time;          // from the start of a contact to the first byte received in it
+    Histogram delivery_latency;         // from creation to reception of messages for this device ( secs resolution )
     float producedDelayAvg;
 
 } MessagesStats;
+
+/// \brief Adds $n to $counter of messagesStats: relaxed atomic add, no lock & no ordering ( counters are independent ).
+#define stats_add(counter, n) __atomic_fetch_add( &messagesStats.counter, (uint64_t) (n), __ATOMIC_RELAXED )
+
+/* Kinds of records of the session log */
+typedef enum log_record_kind_t {
+    LOG_RECORD_EVENT_START,
+    LOG_RECORD_MESSAGE,
+    LOG_RECORD_DATETIME,
+    LOG_RECORD_EVENT_STOP,
+
+    // Records of the whole session ( binary log only: written at tear up / down, never queued )
+    LOG_RECORD_SESSION,
+    LOG_RECORD_END,
+    LOG_RECORD_DEVICE,
+    LOG_RECORD_BUFFER_MESSAGE,
+    LOG_RECORD_INBOX_MESSAGE,
+    LOG_RECORD_HISTOGRAM,
+    LOG_RECORD_PAYLOAD
+} LogRecordKind;
+
+/* Fixed-size record of the session log: queued by the hot paths, formatted & written by the logger thread */
+typedef struct log_record_t {
+    uint8_t kind;                       // LogRecordKind
+    uint32_t event;                     // event the record belongs to
+    struct timeval at;
+
+    union {
+        struct {
+            char type[LOG_EVENT_TYPE_LEN];
+            uint32_t server;
+            uint32_t client;
+        } start;
+
+        struct {
+            char action[LOG_ACTION_LEN];
+            Message message;
+        } message;
+
+        struct {
+            uint64_t previous_now;
+            uint64_t new_now;
+        } datetime;
+
+        struct {
+            struct timeval startedAt;
+        } stop;
+    } data;
+} LogRecord;
 // end
 
 // start: Client.h
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 
 /// \brief Constructs IPv4 address from given AEM.
 /// \param aem uint32_t
@@ -19,6 +20,26 @@ const char* aem2ip(uint32_t aem);
 /// \return index [0, N-1] if found, -1 else
 int32_t binary_search_index(const uint32_t *haystack, size_t N, uint32_t needle);
 
+/// \brief Check if given contact $deadline has passed.
+/// \param deadline
+/// \return TRUE if the contact must be abandoned, FALSE otherwise
+bool deadline_expired(const ContactDeadline *deadline);
+
+/// \brief Milliseconds left until contact $deadline passes.
+/// \param deadline
+/// \return 0 if passed
+int deadline_remaining(const ContactDeadline *deadline);
+
+/// \brief Start a new contact deadline, $timeout milliseconds from now.
+/// \param deadline the result deadline ( passed as pointer )
+/// \param timeout in milliseconds
+void deadline_start(ContactDeadline *deadline, uint32_t timeout);
+
+/// \brief Secs elapsed since $since, on CLOCK_MONOTONIC ( unaffected by datetime syncing, as contact deadlines ).
+/// \param since as read by clock_gettime( CLOCK_MONOTONIC )
+/// \return
+double elapsed_since(const struct timespec *since);
+
 /// \brief Un-serializes message-as-a-string, re-creating initial message.
 /// \param message the result message ( passes as a pointer )
 /// \param glue the connective character(s); acts as the separator between successive message fields
@@ -40,6 +61,16 @@ void generateMessage(Message *message, uint32_t recipient, const char * body);
 /// \param message result message ( passed as pointer )
 void generateRandomMessage(Message *message);
 
+/// \brief Generates a new random payload of $payloadLength bytes towards a random recipient, as the messages of its
+/// fragments ( see fragment_encode() ).
+/// \param messages result messages ( room for UINT8_MAX )
+/// \return number of messages, 0 if $payloadLength is out of range
+uint16_t generateRandomPayload(Message *messages);
+
+/// \brief Generates a random recipient ( any device but this one ).
+/// \return AEM
+uint32_t generateRandomRecipient(void);
+
 /// \brief Get a string with CSV of transmitted devices of given $message
 /// \param message
 /// \return
@@ -66,19 +97,23 @@ uint32_t ip2aem(const char *ip);
 /// \param message1
 /// \param message2
 /// \return
-bool isMessageEqual(Message message1, Message message2);
+bool isMessageEqual(const Message *message1, const Message *message2);
 
 /// \brief Check if two messages of INBOX have exactly the same values in ALL of their fields ( metadata excluded ).
 /// \param message1
 /// \param message2
 /// \return
-bool isMessageEqualInbox(InboxMessage message1, InboxMessage message2);
+bool isMessageEqualInbox(const InboxMessage *message1, const InboxMessage *message2);
 
 /// Resolves AEM index (in $CLIENT_AEM_LIST array) of given $device, if not already resolved.
 /// \param device
 /// \return
 int32_t resolveAemIndex( Device device );
 
+/// \brief Binds $socket_fd to this device's own address, so that the other device can resolve our AEM from the connection.
+/// \param socket_fd
+void socket_bind_source( int32_t socket_fd );
+
 /// \brief Tries to connect via $socket_fd to given AEM (creating respective IP address) & port.
 /// \param socket_fd
 /// \param aem
@@ -86,10 +121,45 @@ int32_t resolveAemIndex( Device device );
 /// \return FALSE on error, TRUE on successful connect()
 bool socket_connect( int32_t socket_fd, uint32_t aem, uint16_t port );
 
-/// \brief Convert given UNIX timestamp to a formatted datetime string with given $format.
+/// \brief Reads exactly $length bytes from $socket_fd, unless EOF, an I/O timeout or the contact $deadline is reached.
+/// \param socket_fd
+/// \param buffer
+/// \param length
+/// \param deadline contact deadline ( NULL for none )
+/// \return number of bytes actually read
+size_t socket_read( int32_t socket_fd, void *buffer, size_t length, const ContactDeadline *deadline );
+
+/// \brief Sends exactly $length bytes to $socket_fd, unless an I/O timeout or the contact $deadline is reached.
+/// \param socket_fd
+/// \param buffer
+/// \param length
+/// \param deadline contact deadline ( NULL for none )
+/// \return TRUE if all bytes were sent, FALSE otherwise
+bool socket_send( int32_t socket_fd, const void *buffer, size_t length, const ContactDeadline *deadline );
+
+/// \brief Sets receive & send timeouts of $socket_fd, so that no read() / send() stalls for more than $timeout.
+/// \param socket_fd
+/// \param timeout in milliseconds
+/// \return FALSE on error, TRUE on success
+bool socket_set_timeouts( int32_t socket_fd, uint32_t timeout );
+
+/// \brief Current UNIX timestamp, from the virtual clock if one is set ( simulator ), otherwise from the system's clock.
+/// \return seconds since epoch
+uint64_t timestamp_now(void);
+
+/// \brief Sets the time zone of this process ( as the TZ environment variable ) & invalidates what timestamp2ftime()
+/// cached in any thread.
+/// \param zone e.g. "Europe/Athens"
+void timezone_set(const char *zone);
+
+/// \brief Convert given UNIX timestamp to a formatted datetime string with given $format, into $buffer. Allocates
+/// nothing: the timestamps formatted lately by the calling thread are cached, so formatting the same second again is a
+/// copy, & so is the local date & time of its hour. Caches are keyed by the contents of $format ( any string will do )
+/// & dropped when the time zone is changed through timezone_set().
 /// \param timestamp UNIX timestamp ( uint64 )
-/// \param format strftime-compatible format
-/// \return the resulting datetime string
-const char * timestamp2ftime( uint64_t timestamp, const char *format );
+/// \param format strftime-compatible format ( cached if shorter than STRFTIME_FORMAT_LEN characters )
+/// \param buffer result string ( room for STRFTIME_STR_LEN characters )
+/// \return $buffer
+const char * timestamp2ftime( uint64_t timestamp, const char *format, char *buffer );
 
 #endif //FINAL_UTILS_H
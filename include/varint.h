@@ -0,0 +1,64 @@
+#ifndef FINAL_VARINT_H
+#define FINAL_VARINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest varint: 64 bits, 7 per byte */
+#define VARINT_LEN_MAX 10
+
+/// \brief Encodes $value as a varint into $bytes: 7 bits per byte, least significant first, with the high bit set on all
+/// bytes but the last.
+/// \param value
+/// \param bytes room for VARINT_LEN_MAX bytes
+/// \return bytes written
+static inline size_t varint_encode(uint64_t value, uint8_t *bytes)
+{
+    size_t length = 0;
+
+    do
+    {
+        bytes[length++] = (uint8_t) ( ( value & 0x7F ) | ( value > 0x7F ? 0x80 : 0 ) );
+        value >>= 7;
+    } while ( value > 0 );
+
+    return length;
+}
+
+/// \brief Decodes a varint ( see varint_encode() ) from $bytes, up to $end.
+/// \param bytes
+/// \param end first byte past the input
+/// \param value result
+/// \return bytes read; 0 if the input ends first, or the varint is longer than VARINT_LEN_MAX bytes
+static inline size_t varint_decode(const uint8_t *bytes, const uint8_t *end, uint64_t *value)
+{
+    *value = 0;
+
+    for ( size_t length = 0; bytes + length < end && length < VARINT_LEN_MAX; length++ )
+    {
+        *value |= (uint64_t) ( bytes[length] & 0x7F ) << ( 7 * length );
+        if ( 0 == ( bytes[length] & 0x80 ) )
+            return length + 1;
+    }
+
+    return 0;
+}
+
+/// \brief Maps signed $value to an unsigned one of about twice its magnitude ( 0, -1, 1, -2, ... to 0, 1, 2, 3, ... ),
+/// so that small magnitudes take few varint bytes.
+/// \param value
+/// \return
+static inline uint64_t zigzag_encode(int64_t value)
+{
+    return ( (uint64_t) value << 1 ) ^ (uint64_t) ( value >> 63 );
+}
+
+/// \brief Reverses zigzag_encode().
+/// \param zigzag
+/// \return
+static inline int64_t zigzag_decode(uint64_t zigzag)
+{
+    return (int64_t) ( zigzag >> 1 ) ^ -(int64_t) ( zigzag & 1 );
+}
+
+#endif //FINAL_VARINT_H
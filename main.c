@@ -4,7 +4,14 @@
 #include "server.h"
 #include "utils.h"
 #include "communication.h"
+#include "io.h"
+#include "routing.h"
+#include "broadcast.h"
+#include "metrics.h"
+#include "profile.h"
+#include "span.h"
 #include <signal.h>
+#include <getopt.h>
 
 //------------------------------------------------------------------------------------------------
 
@@ -14,24 +21,38 @@ static struct timespec executionTimeActualStart, executionTimeActualFinish;
 pthread_t communicationThreads[COMMUNICATION_WORKERS_MAX];
 uint8_t communicationThreadsAvailable = COMMUNICATION_WORKERS_MAX;
 
-static pthread_t pollingThread, producerThread, datetimeListenerThread;
-pthread_mutex_t messagesBufferLock, activeDevicesLock, availableThreadsLock, messagesStatsLock, logLock, logEventLock;
+static pthread_t pollingThread, producerThread, expiryThread, broadcastThread, datetimeListenerThread, alarmThread,
+    loggerThread, metricsThread;
+static sigset_t alarmSignals;
+static volatile bool executionStarted = false;
+pthread_mutex_t messagesBufferLock, activeDevicesLock, availableThreadsLock, logLock, logEventLock;
 
 MessagesStats messagesStats;
 
 uint32_t CLIENT_AEM;
 uint32_t setupDatetimeAem;
 
-// Communication time for each device
-struct timeval CLIENT_AEM_CONN_START_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT] = {0, 0};
-struct timeval CLIENT_AEM_CONN_END_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT] = {0, 0};
-uint8_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH] = {0};
+// Contacts with each device & their total duration ( usecs ): distribution of durations is in messagesStats
+uint32_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH] = {0};
+uint64_t CLIENT_AEM_CONN_DURATION_LIST[CLIENT_AEM_LIST_LENGTH] = {0};
 
 //------------------------------------------------------------------------------------------------
 
 extern messages_head_t messagesHead;
 extern messages_head_t inboxHead;
 
+extern const char *aemIpPrefix;
+extern uint16_t socketPort, socketPeerPort;
+extern uint32_t messageTtl;
+extern bool broadcastMode;
+extern uint32_t payloadLength;
+extern float fragmentRedundancy;
+extern uint16_t metricsPort;
+
+/// \brief Alarm thread. Waits for SIGALRM ( blocked in every other thread ), so that termination never interrupts a
+/// thread in the middle of a locked section.
+static void *alarm_worker(void);
+
 /// \brief Handler of SIGALRM signal. Used to terminate execution when MAX_EXECUTION_TIME finishes.
 /// \param signo
 /// \return void - Actually this function terminates program execution.
@@ -44,6 +65,26 @@ static void onSetupAlarm(int signo);
 
 /// \brief
 /// \example ./Final [MAX_EXECUTION_TIME] [SETUP_DATE_TIME_AEM]
+/// \example ./Final -a 8001 -n 127.0 -p 9001 -P 2278 -o session_8001.ndjson -i epoll -r spray_and_wait -t 1800 -e oldest -B -m 9181 -T trace_8001.json 60 0
+/// Options ( to run many devices on the same host ):
+///     -a AEM      : AEM of this device ( default: resolved from the IP of wlan0 )
+///     -n PREFIX   : first two octets of every device's IP ( default: AEM_IP_PREFIX )
+///     -p PORT     : port this device listens on ( default: SOCKET_PORT )
+///     -P PORT     : port other devices listen on ( default: SOCKET_PORT )
+///     -o FILE     : session log file ( default: LOG_FILE_NAME )
+///     -L FORMAT   : session log format, "ndjson" or "binary" ( default: LOG_FORMAT )
+///     -i BACKEND  : backend of the batched connects of polling, "io_uring" or "epoll" ( default: IO_PROBE_BACKEND )
+///     -r POLICY   : routing policy, "epidemic", "spray_and_wait" or "prophet" ( default: ROUTING_POLICY )
+///     -q PRIORITY : order of transmissions, "slot", "fewest_copies", "oldest" or "youngest" ( default: TRANSMIT_PRIORITY )
+///     -t SECS     : TTL of produced messages, 0 to never expire ( default: MESSAGE_TTL )
+///     -e POLICY   : eviction policy of a full buffer, "blind", "sent_only", "most_replicated", "oldest" or
+///                   "shortest_ttl" ( default: MESSAGES_PUSH_OVERRIDE_POLICY )
+///     -B          : also disseminate messages to all neighbours at once, over UDP multicast ( default: BROADCAST_MODE )
+///     -F BYTES    : produce payloads of BYTES, split into fragments, instead of single messages ( default:
+///                   PRODUCER_PAYLOAD_LEN )
+///     -f RATIO    : parity fragments per data fragment of payloads ( default: FRAGMENT_REDUNDANCY )
+///     -m PORT     : port of the metrics endpoint on METRICS_ADDRESS, 0 for none ( default: METRICS_PORT )
+///     -T FILE     : trace of the phases of contacts, in the Chrome trace format ( default: SPAN_FILE_NAME )
 /// \param argc
 /// \param argv
 /// \return
@@ -75,10 +116,47 @@ int main( int argc, char **argv )
 //    return 1;
 
     int status;
+    int option;
+    uint32_t clientAemOption = 0;
+    const char *logFileName = LOG_FILE_NAME;
+    const char *logFormat = LOG_FORMAT;
+    const char *spanFileName = SPAN_FILE_NAME;
+    const char *probeBackend = IO_PROBE_BACKEND;
+    const char *routingPolicy = ROUTING_POLICY;
+    const char *transmitPriority = TRANSMIT_PRIORITY;
+    const char *evictionPolicy = MESSAGES_PUSH_OVERRIDE_POLICY;
+
+    // Parse options
+    while ( -1 != ( option = getopt( argc, argv, "a:n:p:P:o:L:i:r:q:t:e:BF:f:m:T:" ) ) )
+    {
+        switch ( option )
+        {
+            case 'a': clientAemOption = (uint32_t) strtol( optarg, (char **)NULL, STRSEP_BASE_10 ); break;
+            case 'n': aemIpPrefix = optarg; break;
+            case 'p': socketPort = (uint16_t) strtol( optarg, (char **)NULL, STRSEP_BASE_10 ); break;
+            case 'P': socketPeerPort = (uint16_t) strtol( optarg, (char **)NULL, STRSEP_BASE_10 ); break;
+            case 'o': logFileName = optarg; break;
+            case 'L': logFormat = optarg; break;
+            case 'i': probeBackend = optarg; break;
+            case 'r': routingPolicy = optarg; break;
+            case 'q': transmitPriority = optarg; break;
+            case 'e': evictionPolicy = optarg; break;
+            case 'B': broadcastMode = true; break;
+            case 'F': payloadLength = (uint32_t) strtol( optarg, (char **)NULL, STRSEP_BASE_10 ); break;
+            case 'f': fragmentRedundancy = strtof( optarg, (char **)NULL ); break;
+            case 'm': metricsPort = (uint16_t) strtol( optarg, (char **)NULL, STRSEP_BASE_10 ); break;
+            case 'T': spanFileName = optarg; break;
+            case 't': messageTtl = (uint32_t) strtol( optarg, (char **)NULL, STRSEP_BASE_10 ); break;
+            default:
+                fprintf( stderr, "Usage: %s [-a AEM] [-n IP_PREFIX] [-p PORT] [-P PEER_PORT] [-o LOG_FILE] [-L LOG_FORMAT] [-i PROBE_BACKEND] "
+                                 "[-r ROUTING_POLICY] [-q TRANSMIT_PRIORITY] [-t TTL] [-e EVICTION_POLICY] [-B] [-F PAYLOAD_LEN] [-f REDUNDANCY] [-m METRICS_PORT] [-T TRACE_FILE] [MAX_EXECUTION_TIME] [SETUP_DATE_TIME_AEM]\n", argv[0] );
+                exit( EXIT_FAILURE );
+        }
+    }
 
     // Set max execution time ( in seconds )
-    executionTimeRequested = ( argc < 2 ) ? MAX_EXECUTION_TIME :
-            (uint32_t) strtol( argv[1], (char **)NULL, STRSEP_BASE_10 );
+    executionTimeRequested = ( argc - optind < 1 ) ? MAX_EXECUTION_TIME :
+            (uint32_t) strtol( argv[optind], (char **)NULL, STRSEP_BASE_10 );
 
     // Initialize RNG
     srand((unsigned int) time( NULL ));
@@ -93,33 +171,51 @@ int main( int argc, char **argv )
     status = pthread_mutex_init( &availableThreadsLock, NULL );
     if ( status != 0 )
         error( status, "\tmain(): pthread_mutex_init( activeDevicesLock ) failed" );
-    status = pthread_mutex_init( &messagesStatsLock, NULL );
-    if ( status != 0 )
-        error( status, "\tmain(): pthread_mutex_init( messagesStatsLock ) failed" );
     status = pthread_mutex_init( &logEventLock, NULL );
     if ( status != 0 )
         error( status, "\tmain(): pthread_mutex_init( logEventLock ) failed" );
 
+    // Block SIGALRM in all threads, except for the alarm thread
+    sigemptyset( &alarmSignals );
+    sigaddset( &alarmSignals, SIGALRM );
+    status = pthread_sigmask( SIG_BLOCK, &alarmSignals, NULL );
+    if ( status != 0 )
+        error( status, "\tmain(): pthread_sigmask() failed" );
+
+    status = pthread_create( &alarmThread, NULL, (void *) alarm_worker, NULL );
+    if ( status != 0 )
+        error( status, "\tmain(): pthread_create( alarmThread ) failed" );
+
     // Get AEM of running device
-    CLIENT_AEM = getClientAem("wlan0");
+    CLIENT_AEM = ( 0 < clientAemOption ) ? clientAemOption : getClientAem("wlan0");
     printf( "AEM = %d\n", CLIENT_AEM );
 
+    // Initialize backend of probes
+    io_probe_setup( probeBackend );
+
+    // Initialize routing policy
+    routing_setup( routingPolicy );
+    routing_priority_setup( transmitPriority );
+    messages_eviction_setup( evictionPolicy );
+
     // Initialize types
     messagesHead = 0;
     inboxHead = 0;
 
     // Initialize logger
-    log_tearUp( "session1.json" );
-    messagesStats.produced = 0;
-    messagesStats.received = 0;
-    messagesStats.received_for_me = 0;
-    messagesStats.transmitted = 0;
-    messagesStats.transmitted_to_recipient = 0;
+    log_format_setup( logFormat );
+    log_tearUp( logFileName );
+    status = pthread_create( &loggerThread, NULL, (void *) log_worker, NULL );
+    if ( status != 0 )
+        error( status, "\tmain(): pthread_create( loggerThread ) failed" );
+    memset( &messagesStats, 0, sizeof( MessagesStats ) );
+    span_tearUp( spanFileName );
 
     // Setup datetime
     if ( 1 == SYNC_DATETIME )
     {
-        setupDatetimeAem = ( argc < 3 ) ? SETUP_DATETIME_AEM : (uint32_t) strtol( argv[1], (char **)NULL, STRSEP_BASE_10 );
+        setupDatetimeAem = ( argc - optind < 2 ) ? SETUP_DATETIME_AEM :
+                (uint32_t) strtol( argv[optind + 1], (char **)NULL, STRSEP_BASE_10 );
         if ( setupDatetimeAem > 0 )
         {
             if ( CLIENT_AEM == setupDatetimeAem )
@@ -133,7 +229,6 @@ int main( int argc, char **argv )
             {
                 // Setup alarm for setup
                 alarm( SETUP_DATETIME_TIMEOUT );
-                signal( SIGALRM, onSetupAlarm );
 
                 // Receive & set datetime from datetime server
                 if ( false == communication_datetime_receiver() )
@@ -146,8 +241,29 @@ int main( int argc, char **argv )
     clock_gettime(CLOCK_REALTIME, &executionTimeActualStart);
 
     // Setup alarm
+    executionStarted = true;
     alarm( executionTimeRequested );
-    signal( SIGALRM, onAlarm );
+
+    // Start expiry of messages ( in a new thread )
+    status = pthread_create(&expiryThread, NULL, (void *) messages_expiry_worker, NULL);
+    if ( status != 0 )
+        error( status, "\tmain(): pthread_create( expiryThread ) failed" );
+
+    // Start broadcasting to neighbours ( in a new thread )
+    if ( broadcastMode )
+    {
+        status = pthread_create(&broadcastThread, NULL, (void *) broadcast_worker, NULL);
+        if ( status != 0 )
+            error( status, "\tmain(): pthread_create( broadcastThread ) failed" );
+    }
+
+    // Start serving metrics ( in a new thread )
+    if ( metricsPort > 0 )
+    {
+        status = pthread_create(&metricsThread, NULL, (void *) metrics_worker, NULL);
+        if ( status != 0 )
+            error( status, "\tmain(): pthread_create( metricsThread ) failed" );
+    }
 
     // Start polling client ( in a new thread )
     status = pthread_create(&pollingThread, NULL, (void *) polling_worker, NULL);
@@ -165,6 +281,20 @@ int main( int argc, char **argv )
     return EXIT_SUCCESS;
 }
 
+static void *alarm_worker(void)
+{
+    int signo;
+
+    while ( 0 != sigwait( &alarmSignals, &signo ) );
+
+    if ( executionStarted )
+        onAlarm( signo );
+    else
+        onSetupAlarm( signo );
+
+    return NULL;
+}
+
 static void onAlarm( int signo )
 {
     int status;
@@ -179,6 +309,39 @@ static void onAlarm( int signo )
     if ( status != 0 )
         error( status, "\tonAlarm(): pthread_join() on producerThread failed" );
 
+    // Kill Expiry Thread
+    status = pthread_cancel( expiryThread );
+    if ( status != 0 )
+        error( status, "\tonAlarm(): pthread_cancel() on expiryThread failed" );
+
+    status = pthread_join( expiryThread, NULL );
+    if ( status != 0 )
+        error( status, "\tonAlarm(): pthread_join() on expiryThread failed" );
+
+    // Kill Broadcast Thread
+    if ( broadcastMode )
+    {
+        status = pthread_cancel( broadcastThread );
+        if ( status != 0 )
+            error( status, "\tonAlarm(): pthread_cancel() on broadcastThread failed" );
+
+        status = pthread_join( broadcastThread, NULL );
+        if ( status != 0 )
+            error( status, "\tonAlarm(): pthread_join() on broadcastThread failed" );
+    }
+
+    // Kill Metrics Thread
+    if ( metricsPort > 0 )
+    {
+        status = pthread_cancel( metricsThread );
+        if ( status != 0 )
+            error( status, "\tonAlarm(): pthread_cancel() on metricsThread failed" );
+
+        status = pthread_join( metricsThread, NULL );
+        if ( status != 0 )
+            error( status, "\tonAlarm(): pthread_join() on metricsThread failed" );
+    }
+
     // Kill Polling Thread
     status = pthread_cancel( pollingThread );
     if ( status != 0 )
@@ -213,10 +376,18 @@ static void onAlarm( int signo )
 
     double executionTimeActual = (double)executionTimeActualSeconds + (double)executionTimeActualNanoSeconds/(double)1e9;
 
+    // Stop Logger Thread ( once it has written what is queued; events of contacts in progress stay unterminated )
+    log_worker_stop();
+    status = pthread_join( loggerThread, NULL );
+    if ( status != 0 )
+        error( status, "\tonAlarm(): pthread_join() on loggerThread failed" );
+
     // Close logger
-    messagesStats.producedDelayAvg /= ( float ) messagesStats.produced; // avg
-    messagesStats.producedDelayAvg /= 60.0;                             // sec --> min
+    messagesStats.producedDelayAvg /= ( float ) messagesStats.productions;  // avg, per round: not per fragment
+    messagesStats.producedDelayAvg /= 60.0;                                 // sec --> min
     log_tearDown(executionTimeActual);
+    span_tearDown();
+    profile_dump( stdout );
 
     exit( EXIT_SUCCESS );
 }
@@ -0,0 +1,23 @@
+#!/bin/bash
+#
+# Runs N devices on this host, each one on its own loopback address ( 127.0.80.yy ).
+# Usage: ./run-loopback.sh [N] [DURATION_SECS] [PROBE_BACKEND]
+# With TRACE=1, each device also traces the phases of its contacts ( load ./loopback/trace_*.json in ui.perfetto.dev ).
+#
+
+N=${1:-4}
+DURATION=${2:-60}
+PROBE_BACKEND=${3:-epoll}
+BUILD_DIR=./build-loopback
+
+make BUILD_DIR=$BUILD_DIR CFLAGS="-O2 -DCLIENT_AEM_LIST_HEADER='\"aem_list_loopback.h\"' -DAEM_IP_PREFIX='\"127.0\"'" || exit 1
+
+mkdir -p ./loopback
+for (( i = 0; i < N; i++ )); do
+    AEM=$(( 8000 + i ))
+    $BUILD_DIR/final -a $AEM -n 127.0 -i $PROBE_BACKEND -o ./loopback/session_$AEM.ndjson -m $(( 9180 + i )) ${TRACE:+-T ./loopback/trace_$AEM.json} $DURATION > ./loopback/stdout_$AEM.log 2>&1 &
+    echo "Started $AEM at 127.0.80.$i ( pid $!, metrics on http://127.0.0.1:$(( 9180 + i ))/metrics )"
+done
+
+wait
+echo "Logs in ./loopback"
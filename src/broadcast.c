@@ -0,0 +1,395 @@
+#include "conf.h"
+#include "broadcast.h"
+#include "communication.h"
+#include "routing.h"
+#include "server.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------------------------
+
+extern uint32_t CLIENT_AEM;
+extern Message *MESSAGES_BUFFER;
+extern pthread_mutex_t messagesBufferLock;
+
+//------------------------------------------------------------------------------------------------
+
+/* Datagrams ( all start with a type & the AEM of a device, as %04u ) */
+#define BROADCAST_DATAGRAM_HELLO 'H'           // "H" + AEM of sender + latest batch ( %010u )
+#define BROADCAST_DATAGRAM_DATA 'D'            // "D" + AEM of sender + batch ( %010u ) + datagram ( %02u ) + datagrams of
+                                               // batch ( %02u ), then entries of copies ( %04u ), TTL ( %06u ) & message
+#define BROADCAST_DATAGRAM_NACK 'N'            // "N" + AEM of batch's sender + batch ( %010u ) + missing datagrams ( %02u
+                                               // each; none: the whole batch )
+
+#define BROADCAST_HEADER_LEN ( 1 + 4 + 10 + 2 + 2 )
+#define BROADCAST_ENTRY_LEN ( 4 + 6 + MESSAGE_SERIALIZED_LEN )
+#define BROADCAST_DATAGRAM_MESSAGES 4          // 19 + 4 * 287 = 1167 bytes: fits an Ethernet frame
+#define BROADCAST_DATAGRAM_LEN ( BROADCAST_HEADER_LEN + BROADCAST_DATAGRAM_MESSAGES * BROADCAST_ENTRY_LEN )
+
+/* A batch sent, kept for repairs */
+typedef struct broadcast_batch_t {
+    uint32_t batch;                     // 0: none
+    uint8_t datagramsN;
+    char datagrams[BROADCAST_BATCH_DATAGRAMS][BROADCAST_DATAGRAM_LEN];
+    size_t lengths[BROADCAST_BATCH_DATAGRAMS];
+    uint32_t repairs;                   // datagrams NACKed since last repair ( bit mask )
+} BroadcastBatch;
+
+/* What we received of a batch of a neighbour */
+typedef struct broadcast_received_t {
+    uint32_t batch;                     // 0: none
+    uint8_t datagramsN;                 // 0: unknown ( none of its datagrams received yet )
+    uint32_t received;                  // datagrams received ( bit mask )
+    uint64_t nackAt;                    // ms when missing datagrams are NACKed ( 0: none missing / gave up )
+    uint8_t nacks;
+} BroadcastReceived;
+
+/* What we heard from a neighbour */
+typedef struct broadcast_peer_t {
+    uint64_t heardAt;                   // ms ( 0: never )
+    uint32_t batchLast;
+    BroadcastReceived batches[BROADCAST_BATCHES_KEPT];  // latest batches, each at batch % BROADCAST_BATCHES_KEPT
+} BroadcastPeer;
+
+/* A message of a batch & a neighbour it is transmitted to */
+typedef struct broadcast_pair_t {
+    uint16_t message_i;
+    uint32_t neighbour_i;
+} BroadcastPair;
+
+bool broadcastMode = BROADCAST_MODE;
+
+static BroadcastBatch batches[BROADCAST_BATCHES_KEPT];
+static uint32_t batchLast = 0;
+static BroadcastPeer peers[CLIENT_AEM_LIST_LENGTH];
+static BroadcastPair pairs[BROADCAST_BATCH_DATAGRAMS * BROADCAST_DATAGRAM_MESSAGES * CLIENT_AEM_LIST_LENGTH];  // of the batch being built
+static struct sockaddr_in groupAddress;
+
+/// \brief Monotonic clock ( ms ).
+static uint64_t broadcast_now(void)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+/// \brief Time at which the missing datagrams of a batch are NACKed, jittered so that the first NACK suppresses the rest.
+static uint64_t broadcast_nack_at(uint64_t now)
+{
+    return now + BROADCAST_NACK_DELAY + (uint64_t) ( rand() % ( BROADCAST_NACK_DELAY + 1 ) );
+}
+
+/// \brief Sends $datagram to the multicast group. Losses are left to NACKs.
+static void broadcast_send(int32_t socket_fd, const char *datagram, size_t length)
+{
+    if ( sendto( socket_fd, datagram, length, 0, (struct sockaddr *) &groupAddress, sizeof( groupAddress ) ) < 0 )
+        perror( "broadcast_send(): sendto()" );
+}
+
+/// \brief NACKs the missing datagrams of $received, a batch of device $aem ( the whole batch, if none was received ).
+static void broadcast_nack(int32_t socket_fd, uint32_t aem, BroadcastReceived *received, uint64_t now)
+{
+    char datagram[1 + 4 + 10 + 2 * BROADCAST_BATCH_DATAGRAMS + 1];
+    int length = snprintf( datagram, sizeof( datagram ), "%c%04u%010u", BROADCAST_DATAGRAM_NACK, aem, received->batch );
+
+    for ( uint8_t datagram_i = 0; datagram_i < received->datagramsN; datagram_i++ )
+    {
+        if ( 0 == ( received->received & ( 1U << datagram_i ) ) )
+            length += snprintf( datagram + length, sizeof( datagram ) - length, "%02u", datagram_i );
+    }
+
+    broadcast_send( socket_fd, datagram, (size_t) length );
+    received->nackAt = ++received->nacks < BROADCAST_NACKS_MAX ? now + 2 * BROADCAST_NACK_DELAY : 0;
+}
+
+/// \brief Keeps track of the batches of $peer up to $batch: the ones not received yet are NACKed as a whole, unless
+/// a datagram of theirs shows up first. Batches sent before we first heard of $peer are not asked for.
+static void broadcast_batches_heard(BroadcastPeer *peer, uint32_t batch, uint64_t now)
+{
+    if ( batch <= peer->batchLast )
+        return;
+
+    for ( uint32_t missed = peer->batchLast + 1; missed <= batch; missed++ )
+    {
+        if ( missed + BROADCAST_BATCHES_KEPT <= batch )
+            continue;
+
+        peer->batches[ missed % BROADCAST_BATCHES_KEPT ] =
+            (BroadcastReceived){ .batch = missed, .nackAt = 0 == peer->batchLast ? 0 : now };
+    }
+    peer->batchLast = batch;
+}
+
+/// \brief Handles a data datagram of $sender: stores its messages & keeps track of what is missing from its batch.
+static void broadcast_receive_data(Device sender, const char *datagram, size_t length, uint64_t now)
+{
+    BroadcastPeer *peer = &peers[sender.aemIndex];
+    BroadcastReceived *received;
+    uint32_t batch;
+    uint8_t datagram_i, datagramsN;
+    char frame[MESSAGE_SERIALIZED_LEN];
+    MessageMetadata metadata;
+
+    if ( 3 != sscanf( datagram + 5, "%10u%2hhu%2hhu", &batch, &datagram_i, &datagramsN ) )
+        return;
+    if ( 0 == batch || 0 == datagramsN || datagramsN > BROADCAST_BATCH_DATAGRAMS || datagram_i >= datagramsN )
+        return;
+
+    // Bookkeeping of batches still kept by the sender ( repairs of older ones are still worth their messages )
+    broadcast_batches_heard( peer, batch, now );
+    received = &peer->batches[ batch % BROADCAST_BATCHES_KEPT ];
+    if ( received->batch == batch )
+    {
+        if ( received->received & ( 1U << datagram_i ) )
+            return;
+
+        received->datagramsN = datagramsN;
+        received->received |= 1U << datagram_i;
+        received->nackAt = received->received == ( ( 1ULL << datagramsN ) - 1 ) ? 0 :
+            ( received->nacks < BROADCAST_NACKS_MAX ? broadcast_nack_at( now ) : 0 );
+    }
+
+    for ( const char *entry = datagram + BROADCAST_HEADER_LEN; entry + BROADCAST_ENTRY_LEN <= datagram + length;
+          entry += BROADCAST_ENTRY_LEN )
+    {
+        sscanf( entry, "%4hu%6u", &metadata.copies, &metadata.ttl );
+        memcpy( frame, entry + 10, MESSAGE_SERIALIZED_LEN );
+        frame[MESSAGE_SERIALIZED_LEN - 1] = '\0';
+
+        communication_receive( frame, sender, &metadata );
+    }
+}
+
+/// \brief Handles a NACK: schedules the repair of our batches, or holds back our own NACK of someone else's batch.
+static void broadcast_receive_nack(const char *datagram, size_t length, uint64_t now)
+{
+    uint32_t aem, batch;
+    int32_t aem_i;
+
+    if ( 2 != sscanf( datagram + 1, "%4u%10u", &aem, &batch ) )
+        return;
+
+    if ( CLIENT_AEM == aem )
+    {
+        BroadcastBatch *kept = &batches[ batch % BROADCAST_BATCHES_KEPT ];
+        if ( kept->batch != batch )
+            return;
+
+        if ( length <= 1 + 4 + 10 )
+            kept->repairs = (uint32_t) ( ( 1ULL << kept->datagramsN ) - 1 );
+        for ( size_t digits_i = 1 + 4 + 10; digits_i + 2 <= length; digits_i += 2 )
+        {
+            uint8_t datagram_i = (uint8_t) ( 10 * ( datagram[digits_i] - '0' ) + ( datagram[digits_i + 1] - '0' ) );
+            if ( datagram_i < kept->datagramsN )
+                kept->repairs |= 1U << datagram_i;
+        }
+        return;
+    }
+
+    // Repair is on its way to us too
+    aem_i = binary_search_index( CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, aem );
+    if ( aem_i >= 0 )
+    {
+        BroadcastReceived *received = &peers[aem_i].batches[ batch % BROADCAST_BATCHES_KEPT ];
+        if ( received->batch == batch && 0 != received->nackAt )
+            received->nackAt = now + 2 * BROADCAST_NACK_DELAY;
+    }
+}
+
+/// \brief Serializes the next batch: messages that routing allows to transmit to at least one neighbour, each with the
+/// copies & TTL it is handed along with ( a single copy: every neighbour may pick it up ). Marks them as transmitted to
+/// those neighbours, in the same hold of messagesBufferLock: neighbours that miss any will NACK it.
+/// \param kept result batch
+/// \param neighbours
+/// \param neighboursN
+/// \return FALSE if there was nothing left to transmit
+static bool broadcast_batch(BroadcastBatch *kept, const Device *neighbours, uint32_t neighboursN)
+{
+    uint16_t slots[BROADCAST_BATCH_DATAGRAMS * BROADCAST_DATAGRAM_MESSAGES];
+    uint16_t slotsN = 0;
+    uint32_t pairsN = 0;
+
+    pthread_mutex_lock( &messagesBufferLock );
+    for ( uint16_t message_i = 0; message_i < MESSAGES_SIZE && slotsN < BROADCAST_BATCH_DATAGRAMS * BROADCAST_DATAGRAM_MESSAGES; message_i++ )
+    {
+        uint32_t pairsBefore = pairsN;
+
+        for ( uint32_t neighbour_i = 0; neighbour_i < neighboursN; neighbour_i++ )
+        {
+            if ( routing_should_transmit( &MESSAGES_BUFFER[message_i], neighbours[neighbour_i] ) )
+                pairs[pairsN++] = (BroadcastPair){ .message_i = message_i, .neighbour_i = neighbour_i };
+        }
+        if ( pairsN > pairsBefore )
+            slots[slotsN++] = message_i;
+    }
+    if ( 0 == slotsN )
+    {
+        pthread_mutex_unlock( &messagesBufferLock );
+        return false;
+    }
+
+    kept->batch = ++batchLast;
+    kept->datagramsN = (uint8_t) ( ( slotsN + BROADCAST_DATAGRAM_MESSAGES - 1 ) / BROADCAST_DATAGRAM_MESSAGES );
+    kept->repairs = 0;
+    for ( uint8_t datagram_i = 0; datagram_i < kept->datagramsN; datagram_i++ )
+    {
+        char *datagram = kept->datagrams[datagram_i];
+
+        snprintf( datagram, BROADCAST_DATAGRAM_LEN, "%c%04u%010u%02u%02u", BROADCAST_DATAGRAM_DATA, CLIENT_AEM, kept->batch,
+                  datagram_i, kept->datagramsN );
+        kept->lengths[datagram_i] = BROADCAST_HEADER_LEN;
+
+        for ( uint16_t slot_i = datagram_i * BROADCAST_DATAGRAM_MESSAGES;
+              slot_i < slotsN && slot_i < ( datagram_i + 1 ) * BROADCAST_DATAGRAM_MESSAGES; slot_i++ )
+        {
+            char *entry = datagram + kept->lengths[datagram_i];
+            uint32_t ttl = MESSAGES_BUFFER[ slots[slot_i] ].ttl;
+
+            snprintf( entry, 11, "%04u%06u", 1, ttl < 1000000 ? ttl : 999999 );
+            memset( entry + 10, 0, MESSAGE_SERIALIZED_LEN );
+            implode( "_", MESSAGES_BUFFER[ slots[slot_i] ], entry + 10 );
+            kept->lengths[datagram_i] += BROADCAST_ENTRY_LEN;
+        }
+    }
+
+    // As decided above: eviction & expiry cannot have reused the slots in between
+    for ( uint32_t pair_i = 0; pair_i < pairsN; pair_i++ )
+        communication_transmitted_locked( neighbours[ pairs[pair_i].neighbour_i ], pairs[pair_i].message_i );
+    pthread_mutex_unlock( &messagesBufferLock );
+
+    return true;
+}
+
+/// \brief One round: a hello, then batches for the devices heard lately, as long as there is something to send.
+static void broadcast_round(int32_t socket_fd, uint64_t now)
+{
+    Device neighbours[CLIENT_AEM_LIST_LENGTH];
+    uint32_t neighboursN = 0;
+    char hello[1 + 4 + 10 + 1];
+
+    snprintf( hello, sizeof( hello ), "%c%04u%010u", BROADCAST_DATAGRAM_HELLO, CLIENT_AEM, batchLast );
+    broadcast_send( socket_fd, hello, strlen( hello ) );
+
+    for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
+    {
+        if ( peers[device_i].heardAt > 0 && now - peers[device_i].heardAt < BROADCAST_NEIGHBOUR_TIMEOUT )
+            neighbours[neighboursN++] = (Device){ .AEM = CLIENT_AEM_LIST[device_i], .aemIndex = (int32_t) device_i };
+    }
+    if ( 0 == neighboursN )
+        return;
+
+    for ( int batch_i = 0; batch_i < BROADCAST_BATCHES_KEPT; batch_i++ )
+    {
+        BroadcastBatch *kept = &batches[ ( batchLast + 1 ) % BROADCAST_BATCHES_KEPT ];
+
+        if ( !broadcast_batch( kept, neighbours, neighboursN ) )
+            break;
+        for ( uint8_t datagram_i = 0; datagram_i < kept->datagramsN; datagram_i++ )
+            broadcast_send( socket_fd, kept->datagrams[datagram_i], kept->lengths[datagram_i] );
+    }
+}
+
+/// \brief Broadcast loop ( POSIX thread compatible function ). Disseminates messages to all neighbours at once over UDP
+/// multicast, receives the ones disseminated by them & repairs losses on negative acknowledgements ( NACKs ).
+void broadcast_worker(void)
+{
+    int32_t socket_fd;
+    struct sockaddr_in address;
+    struct ip_mreq membership;
+    struct in_addr interface;
+    struct pollfd pfd;
+    char datagram[BROADCAST_DATAGRAM_LEN + 1];
+    uint64_t now, roundAt;
+    ssize_t n;
+    int option = 1;
+
+    // Join the group on the interface of this device's IP ( multicast is looped back, for devices on the same host )
+    socket_fd = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    if ( socket_fd < 0 )
+        error( socket_fd, "broadcast_worker(): socket() failed" );
+    setsockopt( socket_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof( option ) );
+
+    bzero( (char *) &address, sizeof( address ) );
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl( INADDR_ANY );
+    address.sin_port = htons( BROADCAST_PORT );
+    if ( bind( socket_fd, (struct sockaddr *) &address, sizeof( address ) ) < 0 )
+        error( -1, "broadcast_worker(): bind() failed" );
+
+    interface.s_addr = inet_addr( aem2ip( CLIENT_AEM ) );
+    membership.imr_multiaddr.s_addr = inet_addr( BROADCAST_GROUP );
+    membership.imr_interface = interface;
+    if ( setsockopt( socket_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof( membership ) ) < 0
+         || setsockopt( socket_fd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof( interface ) ) < 0
+         || setsockopt( socket_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &option, sizeof( option ) ) < 0 )
+        error( -1, "broadcast_worker(): setsockopt() failed" );
+
+    groupAddress = address;
+    groupAddress.sin_addr.s_addr = membership.imr_multiaddr.s_addr;
+
+    pfd.fd = socket_fd;
+    pfd.events = POLLIN;
+    roundAt = broadcast_now();
+
+    while ( 1 )
+    {
+        poll( &pfd, 1, BROADCAST_NACK_DELAY / 4 );
+        now = broadcast_now();
+
+        // Receive
+        while ( ( n = recv( socket_fd, datagram, BROADCAST_DATAGRAM_LEN, MSG_DONTWAIT ) ) > 4 )
+        {
+            Device sender = { .AEM = 0, .aemIndex = -1 };
+
+            datagram[n] = '\0';
+            if ( BROADCAST_DATAGRAM_NACK == datagram[0] )
+            {
+                broadcast_receive_nack( datagram, (size_t) n, now );
+                continue;
+            }
+
+            sscanf( datagram + 1, "%4u", &sender.AEM );
+            sender.aemIndex = binary_search_index( CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, sender.AEM );
+            if ( sender.aemIndex < 0 || CLIENT_AEM == sender.AEM )
+                continue;
+
+            peers[sender.aemIndex].heardAt = now;
+            if ( BROADCAST_DATAGRAM_DATA == datagram[0] && (size_t) n >= BROADCAST_HEADER_LEN )
+                broadcast_receive_data( sender, datagram, (size_t) n, now );
+            else if ( BROADCAST_DATAGRAM_HELLO == datagram[0] && (size_t) n >= 1 + 4 + 10 )
+                broadcast_batches_heard( &peers[sender.aemIndex], (uint32_t) strtoul( datagram + 5, NULL, STRSEP_BASE_10 ), now );
+        }
+
+        // NACK what is still missing
+        for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
+        {
+            for ( int batch_i = 0; peers[device_i].heardAt > 0 && batch_i < BROADCAST_BATCHES_KEPT; batch_i++ )
+            {
+                BroadcastReceived *received = &peers[device_i].batches[batch_i];
+                if ( 0 != received->nackAt && now >= received->nackAt )
+                    broadcast_nack( socket_fd, CLIENT_AEM_LIST[device_i], received, now );
+            }
+        }
+
+        // Repair what was NACKed ( once for all devices that NACKed it )
+        for ( int batch_i = 0; batch_i < BROADCAST_BATCHES_KEPT; batch_i++ )
+        {
+            for ( uint8_t datagram_i = 0; 0 != batches[batch_i].repairs && datagram_i < batches[batch_i].datagramsN; datagram_i++ )
+            {
+                if ( batches[batch_i].repairs & ( 1U << datagram_i ) )
+                    broadcast_send( socket_fd, batches[batch_i].datagrams[datagram_i], batches[batch_i].lengths[datagram_i] );
+            }
+            batches[batch_i].repairs = 0;
+        }
+
+        if ( now >= roundAt )
+        {
+            broadcast_round( socket_fd, now );
+            roundAt = now + BROADCAST_INTERVAL;
+        }
+    }
+}
@@ -4,17 +4,21 @@
 #include "server.h"
 #include "utils.h"
 #include "communication.h"
+#include "io.h"
+#include "span.h"
 
 //------------------------------------------------------------------------------------------------
 
-extern pthread_mutex_t messagesBufferLock, availableThreadsLock, logEventLock;
+extern pthread_mutex_t messagesBufferLock, availableThreadsLock;
 extern MessagesStats messagesStats;
-extern Message MESSAGES_BUFFER[MESSAGES_SIZE];
+extern Message *MESSAGES_BUFFER;
 
 extern pthread_t communicationThreads[COMMUNICATION_WORKERS_MAX];
 extern uint8_t communicationThreadsAvailable;
 
 extern uint32_t CLIENT_AEM;
+extern uint16_t socketPeerPort;
+extern uint32_t payloadLength;
 
 //------------------------------------------------------------------------------------------------
 
@@ -53,10 +57,19 @@ void *polling_worker(void)
             CLIENT_AEM_LIST_LENGTH : CLIENT_AEM_RANGE_LENGTH;
 
     int status;
-    int32_t socket_fd;
     uint32_t aem;
     uint32_t round_i;
 
+    uint32_t probeAems[pollingListLength];
+    uint16_t probeIndexes[pollingListLength];
+    int32_t probeSockets[pollingListLength];
+    uint16_t probeLength;
+    uint16_t probeConnected;
+    struct timespec probedAt;
+    uint64_t span;
+
+    span_thread_name( "polling_worker" );
+
     // Polling loop
     round_i = 0;
     do
@@ -64,35 +77,64 @@ void *polling_worker(void)
         fprintf( stdout, "\tpolling_worker(): round_i = %04d\n", round_i );
 
         // Start a new polling round in the list of AEMs
-        for ( uint16_t client_aem_i = 0; client_aem_i < pollingListLength; client_aem_i++ )
+        for ( uint16_t client_aem_i = 0; client_aem_i < pollingListLength; )
         {
-            // Get aem
-            aem = ( pollingListLength == CLIENT_AEM_RANGE_LENGTH ) ?
-                  ( CLIENT_AEM_RANGE_MIN + client_aem_i ):
-                  CLIENT_AEM_LIST[ client_aem_i ];
+            // Collect the AEMs of the whole round & probe them in one batch ( see io_probe() ): devices that answer are
+            // served in turn, each on a worker thread while any is available, in this thread otherwise
+            for ( probeLength = 0; client_aem_i < pollingListLength; client_aem_i++ )
+            {
+                // Get aem
+                aem = ( pollingListLength == CLIENT_AEM_RANGE_LENGTH ) ?
+                      ( CLIENT_AEM_RANGE_MIN + client_aem_i ):
+                      CLIENT_AEM_LIST[ client_aem_i ];
 
-            // Get socket
-            socket_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+                if ( CLIENT_AEM == aem || devices_exists_aem( aem ) )
+                    continue;
+
+                probeAems[probeLength] = aem;
+                probeIndexes[probeLength++] = client_aem_i;
+            }
 
-            // Try connecting
-            if ( true == socket_connect( socket_fd, aem, SOCKET_PORT ) )
+            // Try connecting ( whole batch at once )
+            if ( 0 == probeLength )
+                continue;
+            span = span_begin();
+            probeConnected = io_probe( probeAems, probeLength, socketPeerPort, probeSockets );
+            if ( 0 == probeConnected )
+                continue;
+            clock_gettime( CLOCK_MONOTONIC, &probedAt );
+            span_end( "connect", span );    // only probes that start contacts: polling never stops
+            span_flush();
+
+            for ( uint16_t probe_i = 0; probe_i < probeLength; probe_i++ )
             {
+                if ( probeSockets[probe_i] < 0 )
+                    continue;
+
+                // Device kept waiting by contacts served before it in this thread: it gave up on this one already
+                if ( elapsed_since( &probedAt ) * 1000 >= SOCKET_IDLE_TIMEOUT )
+                {
+                    close( probeSockets[probe_i] );
+                    continue;
+                }
+
                 //----- NON-CANCELABLE SECTION
                 status = pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, NULL );
                 if ( status != 0 )
                     error( status, "\tpolling_worker(): pthread_setcancelstate( DISABLE ) failed" );
 
                 // Connected > OffLoad to communication worker
-                //  - format arguments
+                //  - format arguments ( freed by communication worker )
                 Device device = {
-                        .AEM = aem,
-                        .aemIndex = client_aem_i
-                };
-                CommunicationWorkerArgs args = {
-                        .connected_socket_fd = (int32_t) socket_fd,
-                        .server = false
+                        .AEM = probeAems[probe_i],
+                        .aemIndex = probeIndexes[probe_i]
                 };
-                memcpy( &args.connected_device, &device, sizeof( Device ) );
+                CommunicationWorkerArgs *args = malloc( sizeof( CommunicationWorkerArgs ) );
+                if ( NULL == args )
+                    error( ENOMEM, "\tpolling_worker(): malloc() failed" );
+                args->connected_socket_fd = probeSockets[probe_i];
+                args->server = false;
+                memcpy( &args->connected_device, &device, sizeof( Device ) );
 
                 //  - open thread
                 if ( communicationThreadsAvailable > 0 )
@@ -102,9 +144,9 @@ void *polling_worker(void)
                     communicationThreadsAvailable--;
                     pthread_mutex_unlock( &availableThreadsLock );
 
-                    args.concurrent = true;
+                    args->concurrent = true;
 
-                    status = pthread_create( &communicationThread, NULL, (void *) communication_worker, &args );
+                    status = pthread_create( &communicationThread, NULL, (void *) communication_worker, args );
                     if ( status != 0 )
                         error( status, "\tpolling_worker(): pthread_create() failed" );
 
@@ -115,8 +157,8 @@ void *polling_worker(void)
                 else
                 {
                     // run in current thread
-                    args.concurrent = false;
-                    communication_worker( &args );
+                    args->concurrent = false;
+                    communication_worker( args );
                 }
 
                 status = pthread_setcancelstate( PTHREAD_CANCEL_ENABLE, NULL );
@@ -131,40 +173,50 @@ void *polling_worker(void)
     while( 1 );
 }
 
-/// \brief Message producer thread. Produces a random message at the end of the pre-defined interval.
+/// \brief Message producer thread. Produces a random message ( or the fragments of a random payload, if $payloadLength )
+/// at the end of the pre-defined interval.
 void *producer_worker(void)
 {
-    Message message;
+    Message messages[UINT8_MAX];
+    uint16_t messagesN;
     uint32_t delay;
     int status;
 
     do
     {
-        pthread_mutex_lock( &logEventLock );
-
-            log_event_start( "production", 0, 0 );
-
-            // Generate
-            generateRandomMessage( &message );
-//            inspect( message, true, stdout );
-
-            //----- NON-CANCELABLE SECTION
-            status = pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, NULL );
-            if ( status != 0 )
-                error( status, "\tproducer_worker(): pthread_setcancelstate( DISABLE ) failed" );
-
-            // Store
-            pthread_mutex_lock( &messagesBufferLock );
-                messages_push( &message );
-            pthread_mutex_unlock( &messagesBufferLock );
-
-            // Log to session.json
-            log_event_message( "produced", &message );
-            log_event_stop();
+        //----- NON-CANCELABLE SECTION
+        status = pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, NULL );
+        if ( status != 0 )
+            error( status, "\tproducer_worker(): pthread_setcancelstate( DISABLE ) failed" );
 
-        pthread_mutex_unlock( &logEventLock );
+        log_event_start( "production", 0, 0 );
 
-        messagesStats.produced++;
+        // Generate
+        if ( payloadLength > 0 )
+        {
+            messagesN = generateRandomPayload( messages );
+        }
+        else
+        {
+            generateRandomMessage( &messages[0] );
+            messagesN = 1;
+        }
+//        inspect( messages[0], true, stdout );
+
+        // Store
+        pthread_mutex_lock( &messagesBufferLock );
+            for ( uint16_t message_i = 0; message_i < messagesN; message_i++ )
+                messages_push( &messages[message_i] );
+        pthread_mutex_unlock( &messagesBufferLock );
+
+        // Log to session.json
+        for ( uint16_t message_i = 0; message_i < messagesN; message_i++ )
+            log_event_message( "produced", &messages[message_i] );
+        log_event_stop();
+        span_flush();
+
+        stats_add( produced, messagesN );
+        stats_add( productions, 1 );
 
         status = pthread_setcancelstate( PTHREAD_CANCEL_ENABLE, NULL );
         if ( status != 0 )
@@ -1,28 +1,45 @@
 #include "conf.h"
 #include "communication.h"
+#include "histogram.h"
+#include "io.h"
 #include "log.h"
+#include "profile.h"
+#include "routing.h"
 #include "server.h"
+#include "span.h"
 #include <arpa/inet.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 
 //------------------------------------------------------------------------------------------------
 
-extern uint32_t CLIENT_AEM;
-extern struct timeval CLIENT_AEM_CONN_START_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT];
-extern struct timeval CLIENT_AEM_CONN_END_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT];
-extern uint8_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH];
+extern uint32_t CLIENT_AEM, setupDatetimeAem;
+extern uint16_t socketPort, socketPeerPort;
+extern uint32_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH];
+extern uint64_t CLIENT_AEM_CONN_DURATION_LIST[CLIENT_AEM_LIST_LENGTH];
 
-extern pthread_mutex_t messagesBufferLock, activeDevicesLock, availableThreadsLock, messagesStatsLock, logEventLock;
+extern pthread_mutex_t messagesBufferLock, activeDevicesLock, availableThreadsLock, logEventLock;
 extern MessagesStats messagesStats;
 
 extern pthread_t communicationThreads[ COMMUNICATION_WORKERS_MAX ];
 extern uint8_t communicationThreadsAvailable;
 
-extern Message MESSAGES_BUFFER[ MESSAGES_SIZE ];
+extern Message *MESSAGES_BUFFER;
+extern uint32_t messageTtl;
 
 //------------------------------------------------------------------------------------------------
 
+/* Control frames ( anything not starting with a digit; ignored by devices that do not know them ) */
+#define COMMUNICATION_FRAME_END_OF_DUMP 'E'    // session mode
+#define COMMUNICATION_FRAME_KEEPALIVE 'K'      // session mode
+#define COMMUNICATION_FRAME_COPIES 'C'         // Spray-and-Wait: "C" + copies of each message of the batch, as %04u
+#define COMMUNICATION_FRAME_TTL 'T'            // "T" + TTL of each message of the batch, as %06u ( secs )
+#define COMMUNICATION_FRAME_SUMMARY 'P'        // PRoPHET: "P" + delivery predictabilities, see routing_summary()
+#define COMMUNICATION_FRAME_SUMMARY_END 'S'    // PRoPHET: end of an advertisement, see communication_summary_exchange()
+
+
 /// \brief Datetime transmitter loop. Transmits current datetime on each new connection.
 void communication_datetime_listener_worker(void)
 {
@@ -34,6 +51,9 @@ void communication_datetime_listener_worker(void)
     int status;
     struct sockaddr_in serverAddress;
     struct sockaddr_in clientAddress;
+    uint64_t span;
+
+    span_thread_name( "datetime_listener_worker" );
 
     // Create the server ( parent ) socket
     server_socket_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -44,7 +64,7 @@ void communication_datetime_listener_worker(void)
     bzero((char *)&serverAddress, sizeof(serverAddress));
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_addr.s_addr = inet_addr( aem2ip( CLIENT_AEM ) );
-    serverAddress.sin_port = htons((unsigned short) ( SOCKET_PORT + 1 ) );  // next port for setup only
+    serverAddress.sin_port = htons((unsigned short) ( socketPort + 1 ) );  // next port for setup only
 
     /* setsockopt: Handy debugging trick that lets
      * us rerun the server immediately after we kill it;
@@ -73,7 +93,11 @@ void communication_datetime_listener_worker(void)
         if (client_socket_fd < 0)
             error(client_socket_fd, "ERROR on accept");
 
+        socket_set_timeouts( client_socket_fd, SOCKET_IDLE_TIMEOUT );
+
+        span = span_begin();
         pthread_mutex_lock( &logEventLock );
+            span_end( "logEventLock", span );
 
             //  - get client address
             char ip[INET_ADDRSTRLEN];
@@ -86,13 +110,14 @@ void communication_datetime_listener_worker(void)
             gettimeofday( &tv, &tz );
 
             //  - send time
-            send( client_socket_fd, &tv, sizeof(struct timeval), 0 );
+            socket_send( client_socket_fd, &tv, sizeof(struct timeval), NULL );
 
             //  - close write stream
             shutdown( client_socket_fd, SHUT_WR );
             close( client_socket_fd );
         
         pthread_mutex_unlock( &logEventLock );
+        span_flush();
 
         fprintf( stdout, "SENT DATETIME TO CLIENT ( current timestamp = %ld )\n", tv.tv_sec );
     }
@@ -115,15 +140,15 @@ bool communication_datetime_receiver()
     do
     {
         // Try connecting
-        if ( true == socket_connect( (int32_t) socket_fd, SETUP_DATETIME_AEM, SOCKET_PORT + 1 ) )
+        if ( true == socket_connect( (int32_t) socket_fd, setupDatetimeAem, socketPeerPort + 1 ) )
         {
-            log_event_start( "datetime", SETUP_DATETIME_AEM, CLIENT_AEM );
+            log_event_start( "datetime", setupDatetimeAem, CLIENT_AEM );
 
             //  - close write stream
             shutdown( socket_fd, SHUT_WR );
 
             //  - get time
-            result = read( socket_fd, &tv, sizeof(struct timeval) ) == sizeof(struct timeval);
+            result = socket_read( socket_fd, &tv, sizeof(struct timeval), NULL ) == sizeof(struct timeval);
 
             //  - get time
             if ( result )
@@ -131,8 +156,7 @@ bool communication_datetime_receiver()
                 previous_now = (uint64_t) time(NULL);
 
                 // Set timezone
-                setenv( "TZ", "Europe/Athens", 1 );
-                tzset();
+                timezone_set( "Europe/Athens" );
 
                 // Set timeval
                 settimeofday( &tv, NULL );
@@ -160,178 +184,753 @@ bool communication_datetime_receiver()
     return result;
 }
 
-/// \brief Handle communication staff with connected device ( POSIX thread compatible function ).
-/// \param thread_args pointer to communicate_args_t type
-void communication_worker(void *thread_args)
+/// \brief Sends a control frame ( of MESSAGE_SERIALIZED_LEN bytes, like every message ) to the connected device.
+/// \param connectedSocket
+/// \param type one of COMMUNICATION_FRAME_*
+/// \param deadline
+/// \return FALSE if the contact must be abandoned, TRUE otherwise
+static bool communication_control_send(int32_t connectedSocket, char type, const ContactDeadline *deadline)
 {
-    CommunicationWorkerArgs *args = (CommunicationWorkerArgs *) thread_args;
-    bool deviceExists;
+    char frame[MESSAGE_SERIALIZED_LEN] = { type };
+    return socket_send( connectedSocket, frame, MESSAGE_SERIALIZED_LEN, deadline );
+}
 
-    // Check if there is an active connection with given device
-    deviceExists = devices_exists( args->connected_device );
+/// \brief Handles a single serialized message received from $connectedDevice: de-duplicates & stores it.
+/// \param messageSerialized
+/// \param connectedDevice
+/// \param metadata carried along with the message ( NULL if none: defaults of this device apply )
+void communication_receive(char *messageSerialized, Device connectedDevice, const MessageMetadata *metadata)
+{
+    Message message;
+    uint64_t span;
+    uint64_t profileStartedAt;
 
-    pthread_mutex_lock( &logEventLock );
-        log_event_start( "connection", args->server ? CLIENT_AEM : args->connected_device.AEM,
-                         args->server ? args->connected_device.AEM : CLIENT_AEM );
+    // Reconstruct message
+    explode( &message, "_", messageSerialized );
+    if ( NULL != metadata )
+    {
+        message.copies = metadata->copies;
+        message.ttl = metadata->ttl;
+    }
+
+    // Expired on the way
+    if ( message.ttl > 0 && message.created_at + message.ttl <= timestamp_now() )
+        return;
 
-        // If no active connection with given device exists
-        if ( !deviceExists && CLIENT_AEM_CONN_N_LIST[ args->connected_device.aemIndex ] <= MAX_CONNECTIONS_WITH_SAME_CLIENT )
+    // Check for duplicates ( copies handed along with a duplicate are kept, not lost ); expired messages leave holes
+    span = span_begin();
+    profileStartedAt = PROFILE_BEGIN();
+    for ( uint16_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+    {
+        if ( 1 == isMessageEqual( &message, &MESSAGES_BUFFER[message_i] ) )
         {
-            // Update active devices
-            pthread_mutex_lock( &activeDevicesLock );
-                devices_push( args->connected_device );
-            pthread_mutex_unlock( &activeDevicesLock );
+            PROFILE_END( PROFILE_DUPLICATE_SCAN, profileStartedAt );
+            span_end( "duplicate_scan", span );
+            if ( routing_copies_enabled() )
+            {
+                pthread_mutex_lock( &messagesBufferLock );
+                    MESSAGES_BUFFER[message_i].copies += message.copies;
+                pthread_mutex_unlock( &messagesBufferLock );
+            }
+            stats_add( duplicates, 1 );
+            return;
+        }
+    }
+    PROFILE_END( PROFILE_DUPLICATE_SCAN, profileStartedAt );
+    span_end( "duplicate_scan", span );
+
+    // Update message's transmitted devices to include sender ( so as not to send back )
+    message.transmitted_devices[ connectedDevice.aemIndex ] = 1;
+
+    // Store in $MESSAGES_BUFFER buffer
+    span = span_begin();
+    pthread_mutex_lock( &messagesBufferLock );
+        span_end( "messagesBufferLock", span );
+        CLIENT_AEM == message.recipient ?
+            inbox_push( &message, &connectedDevice ):
+            messages_push( &message );
+    pthread_mutex_unlock( &messagesBufferLock );
+
+    // Update stats
+    stats_add( received, 1 );
+
+    // Log received message
+    log_event_message( "received", &message );
+}
 
-            gettimeofday( &(CLIENT_AEM_CONN_START_LIST[args->connected_device.aemIndex][CLIENT_AEM_CONN_N_LIST[ args->connected_device.aemIndex ]]), NULL );
+/// \brief Parses a metadata frame ( COMMUNICATION_FRAME_COPIES / COMMUNICATION_FRAME_TTL ) into the metadata of the
+/// next messages of $buffer.
+/// \param buffer
+/// \param frame
+static void communication_metadata_receive(ReceiveBuffer *buffer, const char *frame)
+{
+    int digits = COMMUNICATION_FRAME_COPIES == frame[0] ? 4 : 6;
+    uint16_t entry_i = 0;
 
-            // If device is server, act as transmitter, else act as receiver.
-            //  - forward communication
-            if ( args->server )
-            {
-                communication_transmitter_worker( args->connected_socket_fd, args->connected_device );
-                shutdown( args->connected_socket_fd, SHUT_WR );
+    // First metadata frame of a batch: defaults for whatever the batch's frames leave out
+    if ( !buffer->metadataReceiving )
+    {
+        for ( uint16_t metadata_i = 0; metadata_i < IO_BATCH_LEN; metadata_i++ )
+            buffer->metadata[metadata_i] = (MessageMetadata){ .copies = 1, .ttl = messageTtl };
+        buffer->metadataLength = 0;
+        buffer->metadata_i = 0;
+        buffer->metadataReceiving = true;
+    }
 
-                communication_receiver_worker( args->connected_socket_fd, args->connected_device );
-                shutdown( args->connected_socket_fd, SHUT_RD );
-            }
-            //  - reverse communication
-            else
-            {
-                communication_receiver_worker( args->connected_socket_fd, args->connected_device );
-                shutdown( args->connected_socket_fd, SHUT_RD );
+    for ( const char *entry = frame + 1; entry_i < IO_BATCH_LEN && entry[0] >= '0' && entry[0] <= '9'; entry += digits )
+    {
+        uint32_t value = 0;
 
-                communication_transmitter_worker( args->connected_socket_fd, args->connected_device );
-                shutdown( args->connected_socket_fd, SHUT_WR );
-            }
+        for ( int digit_i = 0; digit_i < digits && entry[digit_i] >= '0' && entry[digit_i] <= '9'; digit_i++ )
+            value = 10 * value + (uint32_t) ( entry[digit_i] - '0' );
 
-            // Update connection time stats
-            gettimeofday( &(CLIENT_AEM_CONN_END_LIST[args->connected_device.aemIndex][CLIENT_AEM_CONN_N_LIST[ args->connected_device.aemIndex ]]), NULL );
+        if ( COMMUNICATION_FRAME_COPIES == frame[0] )
+            buffer->metadata[entry_i++].copies = (uint16_t) value;
+        else
+            buffer->metadata[entry_i++].ttl = value;
+    }
 
-            // Update connection time stats
-            CLIENT_AEM_CONN_N_LIST[ args->connected_device.aemIndex ]++;
+    if ( entry_i > buffer->metadataLength )
+        buffer->metadataLength = entry_i;
+}
+
+/// \brief Handles all complete frames in $buffer, up to ( and including ) an $endFrame control frame.
+/// \param buffer partially received frames; handled frames are removed
+/// \param connectedDevice
+/// \param endFrame COMMUNICATION_FRAME_END_OF_DUMP, COMMUNICATION_FRAME_SUMMARY_END
+/// \return TRUE if an $endFrame frame was consumed, FALSE otherwise
+static bool communication_receiver_consume(ReceiveBuffer *buffer, Device connectedDevice, char endFrame)
+{
+    bool endOfDump = false;
+    size_t offset;
+    uint64_t span = span_begin();
 
-            // Update active devices
-            pthread_mutex_lock( &activeDevicesLock );
-                devices_remove( args->connected_device );
-            pthread_mutex_unlock( &activeDevicesLock );
+    for ( offset = 0; !endOfDump && buffer->length - offset >= MESSAGE_SERIALIZED_LEN; offset += MESSAGE_SERIALIZED_LEN )
+    {
+        char *frame = buffer->data + offset;
+
+        // Successive summary frames form a single advertisement
+        if ( COMMUNICATION_FRAME_SUMMARY == frame[0] )
+        {
+            routing_summary_receive( connectedDevice, frame + 1, !buffer->summaryReceiving );
+            buffer->summaryReceiving = true;
+            continue;
         }
-        else
+        buffer->summaryReceiving = false;
+
+        // Metadata frames at the head of a batch describe its messages
+        if ( COMMUNICATION_FRAME_COPIES == frame[0] || COMMUNICATION_FRAME_TTL == frame[0] )
         {
-            fprintf( stderr, deviceExists ?
-                "Active connection with device found: AEM = %04d. Skipping...":
-                "Max no. of connections with device reached: AEM = %04d. Skipping...", args->connected_device.AEM
-            );
+            communication_metadata_receive( buffer, frame );
+            continue;
         }
+        buffer->metadataReceiving = false;
+
+        // Messages always start with the sender's AEM digits; anything else is a control frame
+        if ( frame[0] >= '0' && frame[0] <= '9' )
+            communication_receive( frame, connectedDevice,
+                                   buffer->metadata_i < buffer->metadataLength ? &buffer->metadata[buffer->metadata_i++] : NULL );
+        else if ( endFrame == frame[0] )
+            endOfDump = true;
+    }
 
-        // Close Socket
-        close( args->connected_socket_fd );
+    // Keep partially received frame ( or frames following end-of-dump ) for next call
+    memmove( buffer->data, buffer->data + offset, buffer->length - offset );
+    buffer->length -= offset;
 
-        // Update number of threads ( since, if this function is called in a new thread, then that thread was detached )
-        if ( args->concurrent )
+    span_end( "consume", span );
+    return endOfDump;
+}
+
+/// \brief Receives & handles frames from $connectedDevice until an $endFrame control frame.
+/// \param connectedSocket
+/// \param connectedDevice
+/// \param buffer partially received frames ( kept between calls )
+/// \param deadline contact deadline; reading stops once it passes
+/// \param endFrame COMMUNICATION_FRAME_END_OF_DUMP, COMMUNICATION_FRAME_SUMMARY_END
+/// \return TRUE if an $endFrame frame was received, FALSE on EOF / timeout / error
+static bool communication_receiver_until(int32_t connectedSocket, Device connectedDevice, ReceiveBuffer *buffer,
+        const ContactDeadline *deadline, char endFrame)
+{
+    size_t n;
+    uint64_t span;
+
+    // Read as many messages as available per read(), handle each complete one
+    while ( false == communication_receiver_consume( buffer, connectedDevice, endFrame ) )
+    {
+        span = span_begin();
+        n = io_recv( connectedSocket, buffer->data + buffer->length, sizeof( buffer->data ) - buffer->length, deadline );
+        span_end( "recv", span );
+        if ( 0 == n )
+            return false;
+
+        if ( 0 != buffer->startedAt.tv_sec )
         {
-            pthread_mutex_lock( &availableThreadsLock );
-            communicationThreadsAvailable++;
-            pthread_mutex_unlock( &availableThreadsLock );
+            histogram_record_elapsed( &messagesStats.first_byte_time, &buffer->startedAt );
+            timerclear( &buffer->startedAt );
         }
+        buffer->length += n;
+    }
 
-        // Finalize event log
-        log_event_stop();
-    pthread_mutex_unlock( &logEventLock );
+    return true;
 }
 
-/// \brief Receiver sub-worker of communication worker ( POSIX thread compatible function ).
-/// \param connectedSocket socket file descriptor with connected device
-/// \param connectedDevice connected device that will send messages
-void communication_receiver_worker(int32_t connectedSocket, Device connectedDevice)
+/// \brief Advertises the routing state of this device ( see routing_summary() ), ended by a summary-end frame.
+/// \param connectedSocket
+/// \param deadline
+/// \return FALSE if the contact must be abandoned, TRUE otherwise
+static bool communication_summary_send(int32_t connectedSocket, const ContactDeadline *deadline)
 {
-    Message message;
-    char messageSerialized[MESSAGE_SERIALIZED_LEN];
+    char framesSerialized[PROPHET_SUMMARY_FRAMES_MAX + 1][MESSAGE_SERIALIZED_LEN];
+    struct iovec frames[PROPHET_SUMMARY_FRAMES_MAX + 1];
+    uint16_t framesN;
+
+    if ( !routing_summary_enabled() )
+        return true;
+
+    framesN = routing_summary( framesSerialized, PROPHET_SUMMARY_FRAMES_MAX );
+    for ( uint16_t frame_i = 0; frame_i < framesN; frame_i++ )
+        framesSerialized[frame_i][0] = COMMUNICATION_FRAME_SUMMARY;
+    memset( framesSerialized[framesN], 0, MESSAGE_SERIALIZED_LEN );
+    framesSerialized[framesN++][0] = COMMUNICATION_FRAME_SUMMARY_END;
 
-    next_loop:
-    while ( read( connectedSocket, messageSerialized, MESSAGE_SERIALIZED_LEN ) == MESSAGE_SERIALIZED_LEN )
+    for ( uint16_t frame_i = 0; frame_i < framesN; frame_i++ )
     {
-        // Reconstruct message
-        explode( &message, "_", messageSerialized );
+        frames[frame_i].iov_base = framesSerialized[frame_i];
+        frames[frame_i].iov_len = MESSAGE_SERIALIZED_LEN;
+    }
+
+    return io_send_batch( connectedSocket, frames, framesN, deadline );
+}
 
-        // Check for duplicates
-        for ( uint16_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+/// \brief Exchanges routing state with $connectedDevice: both devices advertise theirs first, then take the other's.
+/// Frames following the other's advertisement ( start of its dump ) are kept in $buffer.
+/// \param connectedSocket
+/// \param connectedDevice
+/// \param buffer
+/// \param deadline
+/// \return FALSE if the contact must be abandoned, TRUE otherwise
+static bool communication_summary_exchange(int32_t connectedSocket, Device connectedDevice, ReceiveBuffer *buffer,
+        const ContactDeadline *deadline)
+{
+    uint64_t span = span_begin();
+    bool exchanged;
+
+    exchanged = communication_summary_send( connectedSocket, deadline ) &&
+                communication_receiver_until( connectedSocket, connectedDevice, buffer, deadline, COMMUNICATION_FRAME_SUMMARY_END );
+
+    span_end( "summary_exchange", span );
+    return exchanged;
+}
+
+/// \brief Marks $MESSAGES_BUFFER[$message_i] as transmitted to $connectedDevice & updates stats.
+/// \param connectedDevice
+/// \param message_i
+void communication_transmitted(Device connectedDevice, uint16_t message_i)
+{
+    pthread_mutex_lock( &messagesBufferLock );
+        communication_transmitted_locked( connectedDevice, message_i );
+    pthread_mutex_unlock( &messagesBufferLock );
+}
+
+/// \brief Same as communication_transmitted(), for callers that already hold messagesBufferLock: marks the message
+/// they decided to transmit, before the slot can be reused by another.
+/// \param connectedDevice
+/// \param message_i
+void communication_transmitted_locked(Device connectedDevice, uint16_t message_i)
+{
+    // Update Status in $MESSAGES_BUFFER buffer
+    MESSAGES_BUFFER[message_i].transmitted = 1;
+    MESSAGES_BUFFER[message_i].transmitted_devices[ connectedDevice.aemIndex ] = 1;
+    MESSAGES_BUFFER[message_i].transmissions++;
+    routing_transmitted( &MESSAGES_BUFFER[message_i], connectedDevice );
+        if (connectedDevice.AEM == MESSAGES_BUFFER[message_i].recipient )
         {
-            if ( 1 == isMessageEqual(message, MESSAGES_BUFFER[message_i] ) )
-                goto next_loop;
+            MESSAGES_BUFFER[message_i].transmitted_to_recipient = 1;
+            messages_index_remove( message_i );
+        }
+    messages_eviction_update( message_i );
 
-            if (MESSAGES_BUFFER[message_i].created_at == 0 )
-                break;
+    // Update stats
+    stats_add( transmitted, 1 );
+    if ( connectedDevice.AEM == MESSAGES_BUFFER[message_i].recipient )
+        stats_add( transmitted_to_recipient, 1 );
+}
+
+/// \brief Sends a batch of serialized messages in one go and, on success, marks them as transmitted.
+/// \param connectedSocket
+/// \param connectedDevice
+/// \param batch serialized messages, from $batchFirst on ( before that, control frames )
+/// \param batchIndexes index in $MESSAGES_BUFFER of each message in $batch
+/// \param batchFirst
+/// \param batchLength
+/// \param deadline
+/// \return FALSE if the contact must be abandoned, TRUE otherwise
+static bool communication_transmitter_flush(int32_t connectedSocket, Device connectedDevice, const struct iovec *batch,
+        const uint16_t *batchIndexes, int batchFirst, int batchLength, const ContactDeadline *deadline)
+{
+    struct timeval startedAt, finishedAt, elapsed;
+    uint64_t span;
+
+    if ( batchFirst == batchLength )
+        return true;
+
+    // Transmit ( peer stalled / left, or contact deadline passed: abandon contact )
+    gettimeofday( &startedAt, NULL );
+    span = span_begin();
+    if ( false == io_send_batch( connectedSocket, batch, batchLength, deadline ) )
+    {
+        span_end( "send", span );
+        fprintf( stderr, "communication_transmitter_worker(): contact with AEM = %04d abandoned\n", connectedDevice.AEM );
+        return false;
+    }
+    gettimeofday( &finishedAt, NULL );
+    timersub( &finishedAt, &startedAt, &elapsed );
+    span_end( "send", span );
+
+    span = span_begin();
+    for ( int batch_i = batchFirst; batch_i < batchLength; batch_i++ )
+    {
+        histogram_record( &messagesStats.transfer_time,
+                          ( (uint64_t) elapsed.tv_sec * 1000000 + (uint64_t) elapsed.tv_usec ) / (uint64_t) ( batchLength - batchFirst ) );
+        communication_transmitted( connectedDevice, batchIndexes[batch_i] );
+        log_event_message( "transmitted", &MESSAGES_BUFFER[ batchIndexes[batch_i] ] );
+    }
+    span_end( "mark_transmitted", span );
+
+    return true;
+}
+
+/// \brief Plans the initial dump to $connectedDevice ( see routing_plan() ), from the time already spent in the contact.
+/// \param connectedDevice
+/// \param first TRUE if the device will transmit after us
+/// \param startedAt start of the contact ( CLOCK_MONOTONIC )
+/// \return max messages to transmit
+static uint16_t communication_plan(Device connectedDevice, bool first, const struct timespec *startedAt)
+{
+    return routing_plan( connectedDevice, first, elapsed_since( startedAt ) );
+}
+
+/// \brief Estimates the throughput towards $connectedDevice from the dump just sent to it ( see
+/// routing_throughput_observed() ): bytes it acknowledged over the time since the dump started, once they were all
+/// acknowledged. Dumps shorter than a batch are not timed: they fit in the send buffer at once.
+/// \param connectedSocket
+/// \param connectedDevice
+/// \param framesSent frames of the dump, control frames included
+/// \param startedAt start of the dump ( CLOCK_MONOTONIC )
+/// \param deadline
+static void communication_throughput_measure(int32_t connectedSocket, Device connectedDevice, uint64_t framesSent,
+        const struct timespec *startedAt, const ContactDeadline *deadline)
+{
+    uint64_t acked;
+
+    if ( framesSent < IO_BATCH_LEN )
+        return;
+
+    acked = io_send_acked( connectedSocket, framesSent * MESSAGE_SERIALIZED_LEN, deadline );
+    routing_throughput_observed( connectedDevice, acked, elapsed_since( startedAt ) );
+}
+
+/// \brief Messages that can be pushed in a session without blocking: as many as fit in the send buffer of
+/// $connectedSocket ( see io_send_room() ) along with their control frames, a batch at most.
+/// \param connectedSocket
+/// \param summary TRUE if the routing state is advertised first ( see communication_summary_send() )
+/// \return 0 if not even one fits
+static uint16_t communication_session_budget(int32_t connectedSocket, bool summary)
+{
+    size_t frames = io_send_room( connectedSocket ) / MESSAGE_SERIALIZED_LEN;
+    size_t overhead = 2;    // copies & TTLs of the batch
+
+    if ( summary && routing_summary_enabled() )
+        overhead += PROPHET_SUMMARY_FRAMES_MAX + 1;
+    if ( frames <= overhead )
+        return 0;
+
+    return (uint16_t) ( frames - overhead < IO_BATCH_LEN - 2 ? frames - overhead : IO_BATCH_LEN - 2 );
+}
+
+/// \brief Keeps the connection with $connectedDevice open while it stays in range: pushes new messages as soon as they
+/// arrive in $MESSAGES_BUFFER, receives the ones pushed by the device and exchanges keepalives when idle. Pushes go a
+/// batch at a time, no larger than the send buffer has room for, with receiving in between: both devices may push at
+/// once without either blocking on the other to read.
+/// \param connectedSocket
+/// \param connectedDevice
+/// \param buffer frames received after the initial exchange
+/// \param server TRUE if connectedDevice connected to us
+static void communication_session_worker(int32_t connectedSocket, Device connectedDevice, ReceiveBuffer *buffer, bool server)
+{
+    ContactDeadline deadline;
+    struct timespec lastReceived, lastTransmitted;     // CLOCK_MONOTONIC: datetime syncing neither ends nor mutes sessions
+    struct pollfd pfds[2];
+    uint64_t notifications;
+    bool pushing = false;       // messages may be left to push
+    bool summaryPending = false;
+    uint16_t budget;
+    uint64_t framesSent;
+    int event_fd;
+    size_t n;
+
+    // Get notified on each new message
+    event_fd = eventfd( 0, EFD_NONBLOCK );
+    if ( event_fd < 0 )
+    {
+        perror( "communication_session_worker(): eventfd()" );
+        return;
+    }
+    pthread_mutex_lock( &messagesBufferLock );
+        sessions_register( connectedDevice, event_fd );
+    pthread_mutex_unlock( &messagesBufferLock );
+
+    pfds[0].fd = connectedSocket;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = event_fd;
+    pfds[1].events = POLLIN;
+
+    clock_gettime( CLOCK_MONOTONIC, &lastReceived );
+    lastTransmitted = lastReceived;
+
+    // Push whatever arrived while the initial exchange was in progress
+    write( event_fd, &(uint64_t){ 1 }, sizeof( uint64_t ) );
+
+    while ( 1 )
+    {
+        // While pushing, go on as soon as the send buffer has room ( as the device reads ), receiving in between
+        if ( poll( pfds, 2, !pushing ? SESSION_KEEPALIVE_INTERVAL :
+                            communication_session_budget( connectedSocket, summaryPending ) > 0 ? 0 : IO_DRAIN_POLL_INTERVAL ) < 0
+             && EINTR != errno )
+            break;
+
+        // Receive
+        if ( pfds[0].revents & ( POLLIN | POLLHUP | POLLERR ) )
+        {
+            n = io_recv( connectedSocket, buffer->data + buffer->length, sizeof( buffer->data ) - buffer->length, NULL );
+            if ( 0 == n )
+                break;      // device closed the session
+
+            buffer->length += n;
+            clock_gettime( CLOCK_MONOTONIC, &lastReceived );
+
+            // Log as a separate event only if messages ( not just keepalives ) arrived
+            bool hasMessages = false;
+            for ( size_t offset = 0; buffer->length - offset >= MESSAGE_SERIALIZED_LEN; offset += MESSAGE_SERIALIZED_LEN )
+                hasMessages |= buffer->data[offset] >= '0' && buffer->data[offset] <= '9';
+
+            if ( hasMessages )
+            {
+                log_event_start( "session", server ? CLIENT_AEM : connectedDevice.AEM, server ? connectedDevice.AEM : CLIENT_AEM );
+                communication_receiver_consume( buffer, connectedDevice, COMMUNICATION_FRAME_END_OF_DUMP );
+                log_event_stop();
+            }
+            else
+                communication_receiver_consume( buffer, connectedDevice, COMMUNICATION_FRAME_END_OF_DUMP );
         }
 
-        // Update message's transmitted devices to include sender ( so as not to send back )
-        message.transmitted_devices[ connectedDevice.aemIndex ] = 1;
+        // New messages: advertise routing state anew before pushing them
+        if ( pfds[1].revents & POLLIN )
+        {
+            read( event_fd, &notifications, sizeof( uint64_t ) );
+            pushing = true;
+            summaryPending = true;
+        }
 
-        // Store in $MESSAGES_BUFFER buffer
-        pthread_mutex_lock( &messagesBufferLock );
-            CLIENT_AEM == message.recipient ?
-                inbox_push( &message, &connectedDevice ):
-                messages_push( &message );
-        pthread_mutex_unlock( &messagesBufferLock );
+        // Transmit the next batch, if the send buffer has room for it
+        budget = pushing ? communication_session_budget( connectedSocket, summaryPending ) : 0;
+        if ( budget > 0 )
+        {
+            bool hasMessages = false;
+            pthread_mutex_lock( &messagesBufferLock );
+                for ( uint16_t message_i = 0; !hasMessages && message_i < MESSAGES_SIZE; message_i++ )
+                    hasMessages = routing_should_transmit( &MESSAGES_BUFFER[message_i], connectedDevice );
+            pthread_mutex_unlock( &messagesBufferLock );
 
-        // Update stats
-        pthread_mutex_lock( &messagesStatsLock );
-            messagesStats.received++;
-        pthread_mutex_unlock( &messagesStatsLock );
+            if ( hasMessages )
+            {
+                bool transmitted;
+
+                deadline_start( &deadline, SOCKET_TRANSFER_TIMEOUT );
+                log_event_start( "session", server ? CLIENT_AEM : connectedDevice.AEM, server ? connectedDevice.AEM : CLIENT_AEM );
+                transmitted = ( !summaryPending || communication_summary_send( connectedSocket, &deadline ) ) &&
+                              communication_transmitter_worker( connectedSocket, connectedDevice, &deadline, budget, &framesSent );
+                log_event_stop();
+
+                if ( !transmitted )
+                    break;
+                summaryPending = false;
+                pushing = framesSent > 0;
+                clock_gettime( CLOCK_MONOTONIC, &lastTransmitted );
+            }
+            else
+                pushing = false;
+        }
+
+        // Device silent for too long: out of range
+        if ( elapsed_since( &lastReceived ) * 1000 >= SOCKET_IDLE_TIMEOUT )
+            break;
+
+        // Keep session alive
+        if ( elapsed_since( &lastTransmitted ) * 1000 >= SESSION_KEEPALIVE_INTERVAL )
+        {
+            if ( false == communication_control_send( connectedSocket, COMMUNICATION_FRAME_KEEPALIVE, NULL ) )
+                break;
+            clock_gettime( CLOCK_MONOTONIC, &lastTransmitted );
+        }
 
-        // Log received message
-        log_event_message( "received", &message );
+        span_flush();
     }
+
+    pthread_mutex_lock( &messagesBufferLock );
+        sessions_unregister( connectedDevice );
+    pthread_mutex_unlock( &messagesBufferLock );
+    close( event_fd );
 }
 
-/// \brief Transmitter sub-worker of communication worker ( POSIX thread compatible function ).
-/// \param connectedSocket socket file descriptor with connected device
-/// \param connectedDevice connected device that will receive messages
-void communication_transmitter_worker(int32_t connectedSocket, Device connectedDevice)
+/// \brief Handle communication staff with connected device ( POSIX thread compatible function ).
+/// \param thread_args pointer to heap-allocated communicate_args_t type ( freed before returning )
+void communication_worker(void *thread_args)
 {
-    char messageSerialized[MESSAGE_SERIALIZED_LEN + 1];
+    CommunicationWorkerArgs *args = (CommunicationWorkerArgs *) thread_args;
+    ContactDeadline deadline;
+    ReceiveBuffer buffer = { .length = 0 };
+    bool deviceExists;
+    bool contact = false;
+    bool session;
+    bool sessionReady = false;
+    bool cut = false;
+    struct timespec contactStartedAt, dumpStartedAt;   // CLOCK_MONOTONIC: unaffected by datetime syncing
+    uint64_t framesSent = 0;
+    uint64_t contactElapsed;
+    uint64_t contactSpan = span_begin();
+    uint64_t span;
+
+    if ( args->concurrent )
+        span_thread_name( "communication_worker" );
 
-    for ( uint16_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+    // Check if there is an active connection with given device
+    deviceExists = devices_exists( args->connected_device );
+
+    // A persistent session occupies its thread for as long as the device stays in range, so it cannot run serially
+    session = 1 == SESSION_MODE && args->concurrent;
+
+    log_event_start( "connection", args->server ? CLIENT_AEM : args->connected_device.AEM,
+                     args->server ? args->connected_device.AEM : CLIENT_AEM );
+
+    // If no active connection with given device exists
+    if ( !deviceExists )
     {
-        if (-1 == connectedDevice.aemIndex )
+        contact = true;
+
+        // Update active devices
+        pthread_mutex_lock( &activeDevicesLock );
+            devices_push( args->connected_device );
+        pthread_mutex_unlock( &activeDevicesLock );
+
+        gettimeofday( &buffer.startedAt, NULL );
+        clock_gettime( CLOCK_MONOTONIC, &contactStartedAt );
+        routing_encounter( args->connected_device );
+
+        // Whatever happens, the initial exchange will not last more than SOCKET_TRANSFER_TIMEOUT
+        deadline_start( &deadline, SOCKET_TRANSFER_TIMEOUT );
+        span = span_begin();
+
+        // PRoPHET: both devices advertise their predictabilities before either dump, so that even the one transmitting
+        // first routes on what the other knows now ( a failed exchange fails the dumps that follow, too )
+        if ( routing_summary_enabled() )
+            cut = !communication_summary_exchange( args->connected_socket_fd, args->connected_device, &buffer, &deadline );
+
+        // If device is server, act as transmitter, else act as receiver.
+        // End of each dump is signaled by half-closing the socket or, in session mode, by an end-of-dump frame.
+        //  - forward communication
+        //  The device does not transmit before it received our whole dump: timing how fast it does ( once all of it is
+        //  acknowledged ) costs no time of the contact
+        if ( args->server )
+        {
+            clock_gettime( CLOCK_MONOTONIC, &dumpStartedAt );
+            cut |= !communication_transmitter_worker( args->connected_socket_fd, args->connected_device, &deadline,
+                                                      communication_plan( args->connected_device, true, &contactStartedAt ),
+                                                      &framesSent );
+            if ( session )
+                sessionReady = communication_control_send( args->connected_socket_fd, COMMUNICATION_FRAME_END_OF_DUMP, &deadline );
+            else
+                shutdown( args->connected_socket_fd, SHUT_WR );
+            if ( !cut )
+                communication_throughput_measure( args->connected_socket_fd, args->connected_device, framesSent,
+                                                  &dumpStartedAt, &deadline );
+
+            sessionReady &= communication_receiver_worker( args->connected_socket_fd, args->connected_device, &buffer, &deadline );
+            if ( !session )
+                shutdown( args->connected_socket_fd, SHUT_RD );
+        }
+        //  - reverse communication
+        else
         {
-            error(-1, "connectedDevice.aemIndex equals -1. Exiting...");
+            sessionReady = communication_receiver_worker( args->connected_socket_fd, args->connected_device, &buffer, &deadline );
+            if ( !session )
+                shutdown( args->connected_socket_fd, SHUT_RD );
+
+            clock_gettime( CLOCK_MONOTONIC, &dumpStartedAt );
+            cut |= !communication_transmitter_worker( args->connected_socket_fd, args->connected_device, &deadline,
+                                                      communication_plan( args->connected_device, false, &contactStartedAt ),
+                                                      &framesSent );
+            if ( session )
+                sessionReady &= communication_control_send( args->connected_socket_fd, COMMUNICATION_FRAME_END_OF_DUMP, &deadline );
+            else
+                shutdown( args->connected_socket_fd, SHUT_WR );
+            if ( !cut )
+                communication_throughput_measure( args->connected_socket_fd, args->connected_device, framesSent,
+                                                  &dumpStartedAt, &deadline );
         }
+        span_end( "exchange", span );
+    }
+    else
+    {
+        fprintf( stderr, "Active connection with device found: AEM = %04d. Skipping...", args->connected_device.AEM );
+    }
+
+    // Finalize event log
+    log_event_stop();
 
-        if (MESSAGES_BUFFER[message_i].created_at > 0
-            && 0 == MESSAGES_BUFFER[message_i].transmitted_devices[ connectedDevice.aemIndex ]
-            && 0 == MESSAGES_BUFFER[message_i].transmitted_to_recipient
-        )
+    if ( contact )
+    {
+        // Stay connected while device is in range ( session ends when it leaves )
+        if ( session && sessionReady )
         {
-            // ASSERTION
-            if ( CLIENT_AEM == MESSAGES_BUFFER[message_i].recipient )
-                error( -1, "communication_transmitter_worker(): \"Assertion CLIENT_AEM == MESSAGES_BUFFER[message_i].recipient\" failed" );
+            span = span_begin();
+            communication_session_worker( args->connected_socket_fd, args->connected_device, &buffer, args->server );
+            span_end( "session", span );
+            cut = true;
+        }
 
-            // Serialize
-            implode("_", MESSAGES_BUFFER[message_i], messageSerialized );
+        // Update connection time stats
+        contactElapsed = (uint64_t) ( elapsed_since( &contactStartedAt ) * 1e6 );
+        routing_contact_observed( args->connected_device, (double) contactElapsed / 1e6, cut );
 
-            // Transmit
-            send(connectedSocket, messageSerialized , MESSAGE_SERIALIZED_LEN, 0 );
+        histogram_record( &messagesStats.contact_duration, contactElapsed );
+        CLIENT_AEM_CONN_DURATION_LIST[ args->connected_device.aemIndex ] += contactElapsed;
+        CLIENT_AEM_CONN_N_LIST[ args->connected_device.aemIndex ]++;
 
-            // Update Status in $MESSAGES_BUFFER buffer
-            pthread_mutex_lock( &messagesBufferLock );
-                MESSAGES_BUFFER[message_i].transmitted = 1;
-                MESSAGES_BUFFER[message_i].transmitted_devices[ connectedDevice.aemIndex ] = 1;
-                    if (connectedDevice.AEM == MESSAGES_BUFFER[message_i].recipient )
-                    {
-                        MESSAGES_BUFFER[message_i].transmitted_to_recipient = 1;
-                    }
-            pthread_mutex_unlock( &messagesBufferLock );
+        // Update active devices
+        pthread_mutex_lock( &activeDevicesLock );
+            devices_remove( args->connected_device );
+        pthread_mutex_unlock( &activeDevicesLock );
+    }
+
+    // Close Socket
+    close( args->connected_socket_fd );
+    span_end( contact ? "contact" : "contact_skipped", contactSpan );
+    span_flush();
 
-            // Update stats
-            pthread_mutex_lock( &messagesStatsLock );
-                messagesStats.transmitted++;
-                if (connectedDevice.AEM == MESSAGES_BUFFER[message_i].recipient )
-                {
-                    messagesStats.transmitted_to_recipient++;
-                }
-            pthread_mutex_unlock( &messagesStatsLock );
+    // Update number of threads ( since, if this function is called in a new thread, then that thread was detached )
+    if ( args->concurrent )
+    {
+        pthread_mutex_lock( &availableThreadsLock );
+        communicationThreadsAvailable++;
+        pthread_mutex_unlock( &availableThreadsLock );
+    }
+
+    free( args );
+}
 
-            log_event_message( "transmitted", &MESSAGES_BUFFER[message_i] );
+/// \brief Receiver sub-worker of communication worker ( POSIX thread compatible function ).
+/// \param connectedSocket socket file descriptor with connected device
+/// \param connectedDevice connected device that will send messages
+/// \param buffer partially received frames ( kept between calls )
+/// \param deadline contact deadline; reading stops once it passes
+/// \return TRUE if device signaled the end of its dump with a control frame, FALSE on EOF / timeout / error
+bool communication_receiver_worker(int32_t connectedSocket, Device connectedDevice, ReceiveBuffer *buffer, const ContactDeadline *deadline)
+{
+    return communication_receiver_until( connectedSocket, connectedDevice, buffer, deadline, COMMUNICATION_FRAME_END_OF_DUMP );
+}
+
+/// \brief Transmitter sub-worker of communication worker ( POSIX thread compatible function ).
+/// \param connectedSocket socket file descriptor with connected device
+/// \param connectedDevice connected device that will receive messages
+/// \param deadline contact deadline; transmission stops once it passes
+/// \param budget max messages to transmit ( see routing_plan() )
+/// \param framesSent result: frames sent, control frames included ( NULL if not needed )
+/// \return FALSE if the contact was abandoned, TRUE otherwise
+bool communication_transmitter_worker(int32_t connectedSocket, Device connectedDevice, const ContactDeadline *deadline,
+        uint16_t budget, uint64_t *framesSent)
+{
+    char batchSerialized[IO_BATCH_LEN][MESSAGE_SERIALIZED_LEN];
+    struct iovec batch[IO_BATCH_LEN];
+    uint16_t batchIndexes[IO_BATCH_LEN] = { 0 };
+    int batchFirst = 0;
+    int batchLength;
+    int copiesFrame = -1;
+    int ttlFrame;
+    uint16_t queue[MESSAGES_SIZE];
+    uint16_t queueLength;
+    uint64_t framesSentN = 0;
+    uint64_t span;
+    bool transmitted;
+
+    if (-1 == connectedDevice.aemIndex )
+    {
+        error(-1, "connectedDevice.aemIndex equals -1. Exiting...");
+    }
+
+    // Each batch starts with the metadata of its messages: copies handed along ( Spray-and-Wait ) & TTLs. TTLs are
+    // carried whatever the TTL of messages produced here: relayed messages keep theirs
+    if ( routing_copies_enabled() )
+        copiesFrame = batchFirst++;
+    ttlFrame = batchFirst++;
+    for ( int batch_i = 0; batch_i < batchFirst; batch_i++ )
+    {
+        memset( batchSerialized[batch_i], 0, MESSAGE_SERIALIZED_LEN );
+        batchSerialized[batch_i][0] = batch_i == copiesFrame ? COMMUNICATION_FRAME_COPIES : COMMUNICATION_FRAME_TTL;
+        batch[batch_i].iov_base = batchSerialized[batch_i];
+        batch[batch_i].iov_len = MESSAGE_SERIALIZED_LEN;
+    }
+    batchLength = batchFirst;
+
+    // Most valuable messages first, as many as the contact is expected to carry
+    span = span_begin();
+    queueLength = routing_queue( connectedDevice, queue );
+    if ( queueLength > budget )
+        queueLength = budget;
+    span_end( "queue", span );
+
+    span = span_begin();
+    for ( uint16_t queue_i = 0; queue_i < queueLength; queue_i++ )
+    {
+        uint16_t message_i = queue[queue_i];
+
+        // ASSERTION
+        if ( CLIENT_AEM == MESSAGES_BUFFER[message_i].recipient )
+            error( -1, "communication_transmitter_worker(): \"Assertion CLIENT_AEM == MESSAGES_BUFFER[message_i].recipient\" failed" );
+
+        // Serialize into next batch slot
+        implode("_", MESSAGES_BUFFER[message_i], batchSerialized[batchLength] );
+        batch[batchLength].iov_base = batchSerialized[batchLength];
+        batch[batchLength].iov_len = MESSAGE_SERIALIZED_LEN;
+        if ( copiesFrame >= 0 )
+        {
+            uint16_t copies = routing_copies_handed( &MESSAGES_BUFFER[message_i], connectedDevice );
+            snprintf( batchSerialized[copiesFrame] + 1 + 4 * ( batchLength - batchFirst ), 5, "%04u", copies < 10000 ? copies : 9999 );
+        }
+        snprintf( batchSerialized[ttlFrame] + 1 + 6 * ( batchLength - batchFirst ), 7, "%06u",
+                  MESSAGES_BUFFER[message_i].ttl < 1000000 ? MESSAGES_BUFFER[message_i].ttl : 999999 );
+        batchIndexes[batchLength++] = message_i;
+
+        // Transmit full batch
+        if ( IO_BATCH_LEN == batchLength )
+        {
+            span_end( "serialize", span );
+            if ( false == communication_transmitter_flush( connectedSocket, connectedDevice, batch, batchIndexes, batchFirst, batchLength, deadline ) )
+                return false;
+            framesSentN += batchLength;
+            batchLength = batchFirst;
+            span = span_begin();
         }
     }
+    span_end( "serialize", span );
+
+    // Transmit last ( partial ) batch
+    transmitted = communication_transmitter_flush( connectedSocket, connectedDevice, batch, batchIndexes, batchFirst, batchLength, deadline );
+    if ( transmitted && batchLength > batchFirst )
+        framesSentN += batchLength;
+
+    if ( NULL != framesSent )
+        *framesSent = framesSentN;
+    return transmitted;
 }
@@ -0,0 +1,300 @@
+#include "conf.h"
+#include "fragment.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------------------------
+
+// Parity fragments per data fragment ( overridable from the command line )
+float fragmentRedundancy = FRAGMENT_REDUNDANCY;
+
+//------------------------------------------------------------------------------------------------
+
+/* Body of a fragment: "#" + id ( %08X ) + index, dataN, fragmentsN ( %02X each ) + length ( %04X ), then its bytes in
+   hex, so that it stays printable ASCII like any other body ( MESSAGE_BODY_LEN - 1 characters ) */
+#define FRAGMENT_MARK '#'
+#define FRAGMENT_HEADER_LEN ( 1 + 8 + 3 * 2 + 4 )
+#define FRAGMENT_DATA_LEN ( ( MESSAGE_BODY_LEN - 1 - FRAGMENT_HEADER_LEN ) / 2 )
+#define FRAGMENT_DATA_MAX ( ( FRAGMENT_PAYLOAD_MAX + FRAGMENT_DATA_LEN - 1 ) / FRAGMENT_DATA_LEN )
+#define FRAGMENT_FRAGMENTS_MAX 255      // GF(256): parity fragment i is built with 1 / ( i ^ j ), j < i
+
+/* Arithmetic of GF(256), with x^8 + x^4 + x^3 + x^2 + 1 as its polynomial & 2 as its generator */
+static uint8_t gfExp[2 * 255];
+static uint8_t gfLog[256];
+static pthread_once_t gfOnce = PTHREAD_ONCE_INIT;
+
+//------------------------------------------------------------------------------------------------
+
+/// \brief Fills the exponent & logarithm tables of GF(256).
+static void fragment_gf_init(void)
+{
+    uint16_t x = 1;
+
+    for ( uint16_t power = 0; power < 255; power++ )
+    {
+        gfExp[power] = gfExp[power + 255] = (uint8_t) x;
+        gfLog[x] = (uint8_t) power;
+
+        x <<= 1;
+        if ( x & 0x100 )
+            x ^= 0x11D;
+    }
+}
+
+/// \brief $a * $b in GF(256).
+static inline uint8_t fragment_gf_mul(uint8_t a, uint8_t b)
+{
+    return 0 == a || 0 == b ? 0 : gfExp[ gfLog[a] + gfLog[b] ];
+}
+
+/// \brief 1 / $a in GF(256) ( $a != 0 ).
+static inline uint8_t fragment_gf_inv(uint8_t a)
+{
+    return gfExp[ 255 - gfLog[a] ];
+}
+
+/// \brief $row[] += $coefficient * $source[] in GF(256), over $length bytes.
+static void fragment_gf_add_scaled(uint8_t *row, const uint8_t *source, uint8_t coefficient, size_t length)
+{
+    if ( 0 == coefficient )
+        return;
+
+    for ( size_t byte_i = 0; byte_i < length; byte_i++ )
+    {
+        if ( 0 != source[byte_i] )
+            row[byte_i] ^= gfExp[ gfLog[coefficient] + gfLog[ source[byte_i] ] ];
+    }
+}
+
+/// \brief Coefficient of data fragment $data_i in fragment $index: the identity for data fragments, a Cauchy matrix for
+/// parity ones ( any $dataN rows of which, together with the identity's, are linearly independent ).
+static inline uint8_t fragment_coefficient(uint8_t index, uint8_t dataN, uint8_t data_i)
+{
+    if ( index < dataN )
+        return index == data_i ? 1 : 0;
+
+    return fragment_gf_inv( (uint8_t) ( index ^ data_i ) );
+}
+
+/// \brief Value of hex digit $ch.
+/// \return -1 if $ch is not a hex digit
+static inline int fragment_hex(char ch)
+{
+    if ( ch >= '0' && ch <= '9' ) return ch - '0';
+    if ( ch >= 'A' && ch <= 'F' ) return ch - 'A' + 10;
+    if ( ch >= 'a' && ch <= 'f' ) return ch - 'a' + 10;
+    return -1;
+}
+
+/// \brief Parses $digits hex digits of $hex.
+/// \return FALSE if any is not a hex digit
+static bool fragment_hex_parse(const char *hex, uint8_t digits, uint32_t *value)
+{
+    int digit;
+
+    *value = 0;
+    for ( uint8_t digit_i = 0; digit_i < digits; digit_i++ )
+    {
+        if ( ( digit = fragment_hex( hex[digit_i] ) ) < 0 )
+            return false;
+
+        *value = ( *value << 4 ) | (uint32_t) digit;
+    }
+
+    return true;
+}
+
+/// \brief Number of fragments ( data & parity ) a payload of $length bytes is split into.
+/// \param length bytes ( up to FRAGMENT_PAYLOAD_MAX )
+/// \return 0 if $length is out of range
+uint16_t fragment_count(size_t length)
+{
+    uint16_t dataN, fragmentsN;
+
+    if ( 0 == length || length > FRAGMENT_PAYLOAD_MAX || length > 0xFFFF )
+        return 0;
+
+    dataN = (uint16_t) ( ( length + FRAGMENT_DATA_LEN - 1 ) / FRAGMENT_DATA_LEN );
+    if ( dataN > FRAGMENT_FRAGMENTS_MAX )
+        return 0;
+
+    // Parity fragments: $dataN * $fragmentRedundancy, rounded up
+    fragmentsN = dataN + (uint16_t) ( dataN * ( fragmentRedundancy > 0 ? fragmentRedundancy : 0 ) + 0.999f );
+    return fragmentsN > FRAGMENT_FRAGMENTS_MAX ? FRAGMENT_FRAGMENTS_MAX : fragmentsN;
+}
+
+/// \brief Splits $payload into fragments with a systematic Reed-Solomon code over GF(256): the data fragments carry
+/// $payload as is & each parity fragment a combination of all of them, so that ANY $dataN of the fragments reconstruct
+/// $payload. Each fragment is a message body ( printable ASCII ), with its header at the head of it.
+/// \param payload
+/// \param length bytes ( up to FRAGMENT_PAYLOAD_MAX )
+/// \param id identifies the payload among those of its sender
+/// \param bodies result bodies ( room for fragment_count( $length ) )
+/// \return number of fragments, 0 if $length is out of range
+uint16_t fragment_encode(const uint8_t *payload, size_t length, uint32_t id, char (*bodies)[MESSAGE_BODY_LEN])
+{
+    static const char digits[] = "0123456789ABCDEF";
+    uint8_t data[FRAGMENT_DATA_MAX][FRAGMENT_DATA_LEN];
+    uint8_t fragment[FRAGMENT_DATA_LEN];
+    uint16_t fragmentsN = fragment_count( length );
+    uint8_t dataN;
+    char *body;
+
+    if ( 0 == fragmentsN )
+        return 0;
+
+    pthread_once( &gfOnce, fragment_gf_init );
+
+    // Data fragments: the payload, zero-padded to whole fragments
+    dataN = (uint8_t) ( ( length + FRAGMENT_DATA_LEN - 1 ) / FRAGMENT_DATA_LEN );
+    memset( data, 0, dataN * FRAGMENT_DATA_LEN );
+    memcpy( data, payload, length );
+
+    for ( uint16_t index = 0; index < fragmentsN; index++ )
+    {
+        if ( index < dataN )
+        {
+            memcpy( fragment, data[index], FRAGMENT_DATA_LEN );
+        }
+        else
+        {
+            memset( fragment, 0, FRAGMENT_DATA_LEN );
+            for ( uint8_t data_i = 0; data_i < dataN; data_i++ )
+                fragment_gf_add_scaled( fragment, data[data_i], fragment_coefficient( (uint8_t) index, dataN, data_i ),
+                                        FRAGMENT_DATA_LEN );
+        }
+
+        body = bodies[index];
+        snprintf( body, FRAGMENT_HEADER_LEN + 1, "%c%08X%02X%02X%02X%04X", FRAGMENT_MARK, id, (uint8_t) index, dataN,
+                  (uint8_t) fragmentsN, (uint16_t) length );
+        for ( uint8_t byte_i = 0; byte_i < FRAGMENT_DATA_LEN; byte_i++ )
+        {
+            body[FRAGMENT_HEADER_LEN + 2 * byte_i] = digits[ fragment[byte_i] >> 4 ];
+            body[FRAGMENT_HEADER_LEN + 2 * byte_i + 1] = digits[ fragment[byte_i] & 0x0F ];
+        }
+        memset( body + FRAGMENT_HEADER_LEN + 2 * FRAGMENT_DATA_LEN, '\0',
+                MESSAGE_BODY_LEN - FRAGMENT_HEADER_LEN - 2 * FRAGMENT_DATA_LEN );
+    }
+
+    return fragmentsN;
+}
+
+/// \brief Parses the header of a fragment.
+/// \param body message body
+/// \param header result header ( passed as pointer )
+/// \return FALSE if $body is not a fragment
+bool fragment_parse(const char *body, FragmentHeader *header)
+{
+    uint32_t id, index, dataN, fragmentsN, length;
+
+    if ( FRAGMENT_MARK != body[0] )
+        return false;
+
+    if ( !fragment_hex_parse( body + 1, 8, &id ) || !fragment_hex_parse( body + 9, 2, &index ) ||
+         !fragment_hex_parse( body + 11, 2, &dataN ) || !fragment_hex_parse( body + 13, 2, &fragmentsN ) ||
+         !fragment_hex_parse( body + 15, 4, &length ) )
+        return false;
+
+    if ( 0 == dataN || dataN > FRAGMENT_DATA_MAX || dataN > fragmentsN || index >= fragmentsN ||
+         length > dataN * FRAGMENT_DATA_LEN || length <= ( dataN - 1 ) * FRAGMENT_DATA_LEN )
+        return false;
+
+    header->id = id;
+    header->index = (uint8_t) index;
+    header->dataN = (uint8_t) dataN;
+    header->fragmentsN = (uint8_t) fragmentsN;
+    header->length = (uint16_t) length;
+
+    return true;
+}
+
+/// \brief Reconstructs a payload from $bodiesN fragments of it.
+/// \param bodies fragments of the same payload ( at least $dataN distinct ones )
+/// \param bodiesN
+/// \param payload result payload ( room for the length in the fragments' header, up to FRAGMENT_PAYLOAD_MAX bytes )
+/// \param length result bytes of payload
+/// \return FALSE if there are not enough distinct fragments
+bool fragment_decode(const char *const *bodies, uint16_t bodiesN, uint8_t *payload, size_t *length)
+{
+    uint8_t matrix[FRAGMENT_DATA_MAX][FRAGMENT_DATA_MAX];
+    uint8_t rows[FRAGMENT_DATA_MAX][FRAGMENT_DATA_LEN];
+    bool seen[FRAGMENT_FRAGMENTS_MAX] = { false };
+    FragmentHeader first, header;
+    uint8_t rowsN = 0, pivot_i, scale;
+    int high, low;
+
+    if ( 0 == bodiesN || !fragment_parse( bodies[0], &first ) )
+        return false;
+
+    pthread_once( &gfOnce, fragment_gf_init );
+
+    // Collect $dataN distinct fragments: each is a row of the system ( coefficients | bytes )
+    for ( uint16_t body_i = 0; body_i < bodiesN && rowsN < first.dataN; body_i++ )
+    {
+        if ( !fragment_parse( bodies[body_i], &header ) || header.id != first.id || header.dataN != first.dataN ||
+             header.fragmentsN != first.fragmentsN || header.length != first.length || seen[header.index] )
+            continue;
+
+        for ( uint8_t byte_i = 0; byte_i < FRAGMENT_DATA_LEN; byte_i++ )
+        {
+            high = fragment_hex( bodies[body_i][FRAGMENT_HEADER_LEN + 2 * byte_i] );
+            low = fragment_hex( bodies[body_i][FRAGMENT_HEADER_LEN + 2 * byte_i + 1] );
+            if ( high < 0 || low < 0 )
+                return false;
+
+            rows[rowsN][byte_i] = (uint8_t) ( ( high << 4 ) | low );
+        }
+        for ( uint8_t data_i = 0; data_i < first.dataN; data_i++ )
+            matrix[rowsN][data_i] = fragment_coefficient( header.index, first.dataN, data_i );
+
+        seen[header.index] = true;
+        rowsN++;
+    }
+
+    if ( rowsN < first.dataN )
+        return false;
+
+    // Gauss-Jordan elimination: turns the coefficients into the identity, & so the rows into the data fragments
+    for ( uint8_t column_i = 0; column_i < first.dataN; column_i++ )
+    {
+        for ( pivot_i = column_i; pivot_i < first.dataN && 0 == matrix[pivot_i][column_i]; pivot_i++ );
+        if ( pivot_i == first.dataN )
+            return false;
+
+        if ( pivot_i != column_i )
+        {
+            uint8_t swap[FRAGMENT_DATA_MAX > FRAGMENT_DATA_LEN ? FRAGMENT_DATA_MAX : FRAGMENT_DATA_LEN];
+
+            memcpy( swap, matrix[pivot_i], first.dataN );
+            memcpy( matrix[pivot_i], matrix[column_i], first.dataN );
+            memcpy( matrix[column_i], swap, first.dataN );
+
+            memcpy( swap, rows[pivot_i], FRAGMENT_DATA_LEN );
+            memcpy( rows[pivot_i], rows[column_i], FRAGMENT_DATA_LEN );
+            memcpy( rows[column_i], swap, FRAGMENT_DATA_LEN );
+        }
+
+        scale = fragment_gf_inv( matrix[column_i][column_i] );
+        for ( uint8_t data_i = 0; data_i < first.dataN; data_i++ )
+            matrix[column_i][data_i] = fragment_gf_mul( matrix[column_i][data_i], scale );
+        for ( uint8_t byte_i = 0; byte_i < FRAGMENT_DATA_LEN; byte_i++ )
+            rows[column_i][byte_i] = fragment_gf_mul( rows[column_i][byte_i], scale );
+
+        for ( uint8_t row_i = 0; row_i < first.dataN; row_i++ )
+        {
+            if ( row_i == column_i || 0 == ( scale = matrix[row_i][column_i] ) )
+                continue;
+
+            fragment_gf_add_scaled( matrix[row_i], matrix[column_i], scale, first.dataN );
+            fragment_gf_add_scaled( rows[row_i], rows[column_i], scale, FRAGMENT_DATA_LEN );
+        }
+    }
+
+    for ( uint8_t data_i = 0; data_i < first.dataN; data_i++ )
+        memcpy( payload + data_i * FRAGMENT_DATA_LEN, rows[data_i],
+                data_i + 1 < first.dataN ? FRAGMENT_DATA_LEN : first.length - data_i * FRAGMENT_DATA_LEN );
+    *length = first.length;
+
+    return true;
+}
@@ -0,0 +1,142 @@
+#include "heap.h"
+
+/// \brief Places $entry at $entry_i of $heap, keeping track of its position.
+static void heap_place(Heap *heap, size_t entry_i, HeapEntry entry)
+{
+    heap->entries[entry_i] = entry;
+    if ( NULL != heap->positions )
+        heap->positions[entry.value] = entry_i + 1;
+}
+
+/// \brief Moves $entry from $entry_i of $heap up, until its parent's key is not greater.
+static void heap_sift_up(Heap *heap, size_t entry_i, HeapEntry entry)
+{
+    size_t parent_i;
+
+    for ( ; entry_i > 0; entry_i = parent_i )
+    {
+        parent_i = ( entry_i - 1 ) / 2;
+        if ( heap->entries[parent_i].key <= entry.key )
+            break;
+
+        heap_place( heap, entry_i, heap->entries[parent_i] );
+    }
+    heap_place( heap, entry_i, entry );
+}
+
+/// \brief Moves $entry from $entry_i of $heap down, until no child's key is smaller.
+static void heap_sift_down(Heap *heap, size_t entry_i, HeapEntry entry)
+{
+    size_t child_i;
+
+    while ( ( child_i = 2 * entry_i + 1 ) < heap->length )
+    {
+        if ( child_i + 1 < heap->length && heap->entries[child_i + 1].key < heap->entries[child_i].key )
+            child_i++;
+        if ( entry.key <= heap->entries[child_i].key )
+            break;
+
+        heap_place( heap, entry_i, heap->entries[child_i] );
+        entry_i = child_i;
+    }
+    heap_place( heap, entry_i, entry );
+}
+
+/// \brief Removes the entry at $entry_i of $heap, filling its place with the last entry.
+static void heap_remove_at(Heap *heap, size_t entry_i)
+{
+    HeapEntry last;
+
+    if ( NULL != heap->positions )
+        heap->positions[ heap->entries[entry_i].value ] = 0;
+
+    last = heap->entries[--heap->length];
+    if ( entry_i == heap->length )
+        return;
+
+    if ( entry_i > 0 && last.key < heap->entries[ ( entry_i - 1 ) / 2 ].key )
+        heap_sift_up( heap, entry_i, last );
+    else
+        heap_sift_down( heap, entry_i, last );
+}
+
+/// \brief Empties $heap.
+/// \param heap
+void heap_clear(Heap *heap)
+{
+    if ( NULL != heap->positions )
+    {
+        for ( size_t entry_i = 0; entry_i < heap->length; entry_i++ )
+            heap->positions[ heap->entries[entry_i].value ] = 0;
+    }
+
+    heap->length = 0;
+}
+
+/// \brief Entry of $heap with the smallest key.
+/// \param heap
+/// \return NULL if $heap is empty
+const HeapEntry* heap_peek(const Heap *heap)
+{
+    return 0 == heap->length ? NULL : &heap->entries[0];
+}
+
+/// \brief Removes the entry of $heap with the smallest key.
+/// \param heap
+/// \param entry result removed entry
+/// \return FALSE if $heap is empty
+bool heap_pop(Heap *heap, HeapEntry *entry)
+{
+    if ( 0 == heap->length )
+        return false;
+
+    *entry = heap->entries[0];
+    heap_remove_at( heap, 0 );
+
+    return true;
+}
+
+/// \brief Adds $entry to $heap.
+/// \param heap
+/// \param entry
+/// \return FALSE if $heap is full
+bool heap_push(Heap *heap, HeapEntry entry)
+{
+    if ( heap->length == heap->capacity )
+        return false;
+
+    // Sift up from the first free leaf
+    heap_sift_up( heap, heap->length++, entry );
+
+    return true;
+}
+
+/// \brief Sets the key of $value in $heap, adding it if not there. Requires a heap that tracks positions.
+/// \param heap
+/// \param value
+/// \param key
+/// \return FALSE if $heap is full
+bool heap_update(Heap *heap, uint32_t value, uint64_t key)
+{
+    size_t entry_i;
+
+    if ( 0 == heap->positions[value] )
+        return heap_push( heap, (HeapEntry){ key, value } );
+
+    entry_i = heap->positions[value] - 1;
+    if ( key < heap->entries[entry_i].key )
+        heap_sift_up( heap, entry_i, (HeapEntry){ key, value } );
+    else
+        heap_sift_down( heap, entry_i, (HeapEntry){ key, value } );
+
+    return true;
+}
+
+/// \brief Removes $value from $heap ( no-op if not there ). Requires a heap that tracks positions.
+/// \param heap
+/// \param value
+void heap_remove(Heap *heap, uint32_t value)
+{
+    if ( 0 != heap->positions[value] )
+        heap_remove_at( heap, heap->positions[value] - 1 );
+}
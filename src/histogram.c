@@ -0,0 +1,102 @@
+#include "histogram.h"
+
+#define HISTOGRAM_SUB_BUCKETS ( (uint64_t) 1 << HISTOGRAM_PRECISION_BITS )
+
+/// \brief Bucket of $histogram where $value is counted.
+static size_t histogram_bucket(uint64_t value)
+{
+    int shift;
+
+    if ( value >= (uint64_t) 1 << HISTOGRAM_MAGNITUDE_BITS )
+        value = ( (uint64_t) 1 << HISTOGRAM_MAGNITUDE_BITS ) - 1;
+    if ( value < 2 * HISTOGRAM_SUB_BUCKETS )
+        return (size_t) value;
+
+    // Top HISTOGRAM_PRECISION_BITS + 1 bits of $value: bucket in its power of 2
+    shift = 63 - __builtin_clzll( value ) - HISTOGRAM_PRECISION_BITS;
+    return (size_t) ( ( (uint64_t) ( shift + 1 ) << HISTOGRAM_PRECISION_BITS ) + ( value >> shift ) - HISTOGRAM_SUB_BUCKETS );
+}
+
+/// \brief Highest value counted in $bucket_i.
+static uint64_t histogram_bucket_highest(size_t bucket_i)
+{
+    int shift;
+
+    if ( bucket_i < 2 * HISTOGRAM_SUB_BUCKETS )
+        return bucket_i;
+
+    shift = (int) ( bucket_i >> HISTOGRAM_PRECISION_BITS ) - 1;
+    return ( ( ( bucket_i & ( HISTOGRAM_SUB_BUCKETS - 1 ) ) + HISTOGRAM_SUB_BUCKETS + 1 ) << shift ) - 1;
+}
+
+/// \brief Counts $value in $histogram. Any thread may record at any time ( relaxed atomic adds, no lock ).
+/// \param histogram
+/// \param value
+void histogram_record(Histogram *histogram, uint64_t value)
+{
+    __atomic_fetch_add( &histogram->counts[histogram_bucket( value )], 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &histogram->count, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &histogram->sum, value, __ATOMIC_RELAXED );
+}
+
+/// \brief Counts the usecs elapsed since $since in $histogram.
+/// \param histogram
+/// \param since
+void histogram_record_elapsed(Histogram *histogram, const struct timeval *since)
+{
+    struct timeval now, elapsed;
+
+    gettimeofday( &now, NULL );
+    if ( !timercmp( &now, since, > ) )
+    {
+        histogram_record( histogram, 0 );
+        return;
+    }
+
+    timersub( &now, since, &elapsed );
+    histogram_record( histogram, (uint64_t) elapsed.tv_sec * 1000000 + (uint64_t) elapsed.tv_usec );
+}
+
+/// \brief Mean of the values counted in $histogram.
+/// \param histogram
+/// \return 0 if $histogram is empty
+uint64_t histogram_mean(const Histogram *histogram)
+{
+    uint64_t count = __atomic_load_n( &histogram->count, __ATOMIC_RELAXED );
+
+    return 0 == count ? 0 : __atomic_load_n( &histogram->sum, __ATOMIC_RELAXED ) / count;
+}
+
+/// \brief Value below or at which $percentile % of the values counted in $histogram are, as the highest value of its
+/// bucket ( 0: lowest value counted, 100: highest ).
+/// \param histogram
+/// \param percentile in [0, 100] ( clamped )
+/// \return 0 if $histogram is empty
+uint64_t histogram_percentile(const Histogram *histogram, double percentile)
+{
+    uint64_t counts[HISTOGRAM_BUCKETS], count = 0, rank, seen = 0;
+    double rankExact;
+    size_t bucket_i;
+
+    // Snapshot: values recorded meanwhile are either in or out, never half-counted
+    for ( bucket_i = 0; bucket_i < HISTOGRAM_BUCKETS; bucket_i++ )
+    {
+        counts[bucket_i] = __atomic_load_n( &histogram->counts[bucket_i], __ATOMIC_RELAXED );
+        count += counts[bucket_i];
+    }
+    if ( 0 == count )
+        return 0;
+
+    // Rank of the value in [1, count], clamped before the cast: a negative double does not convert to uint64_t
+    rankExact = percentile / 100.0 * (double) count + 0.5;
+    rank = !( rankExact >= 1 ) ? 1 : rankExact > (double) count ? count : (uint64_t) rankExact;     // NaN: 1
+
+    for ( bucket_i = 0; bucket_i < HISTOGRAM_BUCKETS; bucket_i++ )
+    {
+        seen += counts[bucket_i];
+        if ( seen >= rank )
+            break;
+    }
+
+    return histogram_bucket_highest( bucket_i );
+}
@@ -0,0 +1,539 @@
+#include "conf.h"
+#include "io.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define IO_URING_AVAILABLE 1
+        #include <linux/io_uring.h>
+        #include <sys/mman.h>
+        #include <sys/syscall.h>
+    #endif
+#endif
+
+//------------------------------------------------------------------------------------------------
+
+extern uint32_t CLIENT_AEM;
+extern MessagesStats messagesStats;
+
+//------------------------------------------------------------------------------------------------
+
+static const char *ioProbeBackendName = "epoll";
+
+/// \brief Batched probe on epoll: all connects are started non-blocking and awaited together.
+static uint16_t io_epoll_probe(const uint32_t *aems, uint16_t N, uint16_t port, int32_t *connected_fds)
+{
+    struct epoll_event events[IO_BATCH_LEN];
+    bool waiting[N];
+    ContactDeadline deadline;
+    uint16_t pending = 0;
+    uint16_t connected = 0;
+    int epoll_fd;
+
+    epoll_fd = epoll_create1( 0 );
+    if ( epoll_fd < 0 )
+        error( epoll_fd, "\tio_epoll_probe(): epoll_create1() failed" );
+
+    for ( uint16_t i = 0; i < N; i++ )
+    {
+        struct sockaddr_in serverAddress;
+        struct epoll_event event = { .events = EPOLLOUT, .data.u32 = i };
+        int32_t socket_fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP );
+
+        connected_fds[i] = socket_fd;
+        waiting[i] = false;
+        if ( socket_fd < 0 )
+            continue;
+
+        bzero( (char *)&serverAddress, sizeof(serverAddress) );
+        serverAddress.sin_family = AF_INET;
+        serverAddress.sin_port = htons( port );
+        serverAddress.sin_addr.s_addr = inet_addr( aem2ip( aems[i] ) );
+        socket_bind_source( socket_fd );
+
+        if ( 0 == connect( socket_fd, (struct sockaddr *)&serverAddress, sizeof(struct sockaddr) ) )
+            connected++;
+        else if ( EINPROGRESS == errno && 0 == epoll_ctl( epoll_fd, EPOLL_CTL_ADD, socket_fd, &event ) )
+        {
+            waiting[i] = true;
+            pending++;
+        }
+        else
+        {
+            close( socket_fd );
+            connected_fds[i] = -1;
+        }
+    }
+
+    deadline_start( &deadline, SOCKET_CONNECT_TIMEOUT );
+    while ( pending > 0 )
+    {
+        int n = epoll_wait( epoll_fd, events, IO_BATCH_LEN, deadline_remaining( &deadline ) );
+        if ( n < 0 && EINTR == errno )
+            continue;
+        if ( n <= 0 )
+            break;
+
+        for ( int event_i = 0; event_i < n; event_i++ )
+        {
+            uint16_t i = (uint16_t) events[event_i].data.u32;
+            int error_code = 0;
+
+            epoll_ctl( epoll_fd, EPOLL_CTL_DEL, connected_fds[i], NULL );
+            waiting[i] = false;
+            pending--;
+
+            if ( 0 == getsockopt( connected_fds[i], SOL_SOCKET, SO_ERROR, &error_code, &(socklen_t){ sizeof( int ) } ) &&
+                 0 == error_code )
+                connected++;
+            else
+            {
+                close( connected_fds[i] );
+                connected_fds[i] = -1;
+            }
+        }
+    }
+
+    // Whatever is still pending did not make it within SOCKET_CONNECT_TIMEOUT
+    for ( uint16_t i = 0; i < N && pending > 0; i++ )
+    {
+        if ( waiting[i] )
+        {
+            close( connected_fds[i] );
+            connected_fds[i] = -1;
+            pending--;
+        }
+    }
+
+    close( epoll_fd );
+    return connected;
+}
+
+#ifdef IO_URING_AVAILABLE
+
+/* User data of a probe's SQEs: the batch it belongs to ( completions of abandoned batches arrive late & are skipped ),
+ * its index in the batch & whether it is the connect or its timeout */
+#define IO_URING_USER_DATA(batch, index, timeout) ( (uint64_t) (batch) << 32 | (uint64_t) (index) << 1 | ( timeout ) )
+
+/* Minimal io_uring ring ( no liburing dependency ) */
+typedef struct io_ring_t {
+    int fd;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} IoRing;
+
+static IoRing ioRing = { .fd = -1 };
+static uint32_t ioRingBatch;    // batches submitted so far
+
+/// \brief Creates & maps the ring used for batched probes.
+/// \return FALSE if io_uring is not supported by the running kernel ( or is not allowed ), TRUE otherwise
+static bool io_uring_ring_setup(void)
+{
+    struct io_uring_params params;
+    size_t sqLength, cqLength;
+    void *sqPointer, *cqPointer;
+    int fd;
+
+    memset( &params, 0, sizeof( struct io_uring_params ) );
+    fd = (int) syscall( __NR_io_uring_setup, IO_URING_ENTRIES, &params );
+    if ( fd < 0 )
+        return false;
+
+    // IORING_OP_CONNECT & IORING_OP_LINK_TIMEOUT need Linux >= 5.5 ( which is also when FEAT_NODROP appeared )
+    if ( 0 == ( params.features & IORING_FEAT_NODROP ) )
+    {
+        close( fd );
+        return false;
+    }
+
+    sqLength = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+    cqLength = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+        sqLength = cqLength = sqLength > cqLength ? sqLength : cqLength;
+
+    sqPointer = mmap( NULL, sqLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if ( MAP_FAILED == sqPointer )
+    {
+        close( fd );
+        return false;
+    }
+
+    cqPointer = ( params.features & IORING_FEAT_SINGLE_MMAP ) ? sqPointer :
+            mmap( NULL, cqLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+    if ( MAP_FAILED == cqPointer )
+    {
+        munmap( sqPointer, sqLength );
+        close( fd );
+        return false;
+    }
+
+    ioRing.sqes = mmap( NULL, params.sq_entries * sizeof( struct io_uring_sqe ), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if ( MAP_FAILED == ioRing.sqes )
+    {
+        if ( cqPointer != sqPointer )
+            munmap( cqPointer, cqLength );
+        munmap( sqPointer, sqLength );
+        close( fd );
+        return false;
+    }
+
+    ioRing.fd = fd;
+    ioRing.sq_tail = (unsigned *) ( (char *) sqPointer + params.sq_off.tail );
+    ioRing.sq_mask = (unsigned *) ( (char *) sqPointer + params.sq_off.ring_mask );
+    ioRing.sq_array = (unsigned *) ( (char *) sqPointer + params.sq_off.array );
+    ioRing.cq_head = (unsigned *) ( (char *) cqPointer + params.cq_off.head );
+    ioRing.cq_tail = (unsigned *) ( (char *) cqPointer + params.cq_off.tail );
+    ioRing.cq_mask = (unsigned *) ( (char *) cqPointer + params.cq_off.ring_mask );
+    ioRing.cqes = (struct io_uring_cqe *) ( (char *) cqPointer + params.cq_off.cqes );
+
+    return true;
+}
+
+/// \brief Reserves the next submission queue entry ( caller must not queue more than IO_URING_ENTRIES at once ).
+/// \return zeroed sqe
+static struct io_uring_sqe* io_uring_sqe_next(void)
+{
+    unsigned tail = *ioRing.sq_tail;
+    unsigned index = tail & *ioRing.sq_mask;
+    struct io_uring_sqe *sqe = &ioRing.sqes[index];
+
+    memset( sqe, 0, sizeof( struct io_uring_sqe ) );
+    ioRing.sq_array[index] = index;
+    __atomic_store_n( ioRing.sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+    return sqe;
+}
+
+/// \brief Reaps the completions of batch $ioRingBatch that are ready, & the late ones of abandoned batches.
+/// \param connected_fds sockets of the batch: closed & set to -1 if their connect failed
+/// \param reaped result: TRUE for each connect of the batch completed
+/// \param connected incremented on each successful connect
+/// \return number of completions of the batch reaped
+static unsigned io_uring_reap(int32_t *connected_fds, bool *reaped, uint16_t *connected)
+{
+    unsigned head = *ioRing.cq_head;
+    unsigned tail = __atomic_load_n( ioRing.cq_tail, __ATOMIC_ACQUIRE );
+    unsigned completed = 0;
+
+    for ( ; head != tail; head++ )
+    {
+        struct io_uring_cqe *cqe = &ioRing.cqes[head & *ioRing.cq_mask];
+        uint32_t index = (uint32_t) ( cqe->user_data & UINT32_MAX ) >> 1;
+
+        if ( ( cqe->user_data >> 32 ) != ioRingBatch )
+            continue;
+        completed++;
+        if ( cqe->user_data & 1 )
+            continue;
+
+        reaped[index] = true;
+        if ( 0 == cqe->res )
+            ( *connected )++;
+        else
+        {
+            close( connected_fds[index] );
+            connected_fds[index] = -1;
+        }
+    }
+    __atomic_store_n( ioRing.cq_head, head, __ATOMIC_RELEASE );
+
+    return completed;
+}
+
+/// \brief Batched probe on io_uring: one connect + one linked timeout per AEM, all submitted with a single syscall.
+/// Probes the ring fails to submit or to wait for are closed & made again on epoll ( see io_epoll_probe() ).
+static uint16_t io_uring_probe(const uint32_t *aems, uint16_t N, uint16_t port, int32_t *connected_fds)
+{
+    struct sockaddr_in addresses[IO_URING_ENTRIES / 2];
+    struct __kernel_timespec timeout = {
+            .tv_sec = SOCKET_CONNECT_TIMEOUT / 1000,
+            .tv_nsec = ( SOCKET_CONNECT_TIMEOUT % 1000 ) * 1000000L
+    };
+    uint16_t connected = 0;
+
+    for ( uint16_t first = 0; first < N; first += IO_URING_ENTRIES / 2 )
+    {
+        uint16_t batchLength = ( N - first < IO_URING_ENTRIES / 2 ) ? (uint16_t) ( N - first ) : IO_URING_ENTRIES / 2;
+        uint32_t retryAems[IO_URING_ENTRIES / 2];
+        int32_t retryFds[IO_URING_ENTRIES / 2];
+        uint16_t retryIndexes[IO_URING_ENTRIES / 2];
+        uint16_t retryLength = 0;
+        bool reaped[IO_URING_ENTRIES / 2];
+        unsigned submitted = 0;
+        unsigned completed = 0;
+        int consumed;
+
+        // Queue connect() + link timeout for each AEM
+        ioRingBatch++;
+        for ( uint16_t i = 0; i < batchLength; i++ )
+        {
+            int32_t socket_fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP );
+            struct io_uring_sqe *sqe;
+
+            connected_fds[first + i] = socket_fd;
+            reaped[i] = socket_fd < 0;
+            if ( socket_fd < 0 )
+                continue;
+
+            bzero( (char *)&addresses[i], sizeof( struct sockaddr_in ) );
+            addresses[i].sin_family = AF_INET;
+            addresses[i].sin_port = htons( port );
+            addresses[i].sin_addr.s_addr = inet_addr( aem2ip( aems[first + i] ) );
+            socket_bind_source( socket_fd );
+
+            sqe = io_uring_sqe_next();
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->fd = socket_fd;
+            sqe->addr = (uint64_t) (uintptr_t) &addresses[i];
+            sqe->off = sizeof( struct sockaddr_in );
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = IO_URING_USER_DATA( ioRingBatch, i, 0 );
+
+            sqe = io_uring_sqe_next();
+            sqe->opcode = IORING_OP_LINK_TIMEOUT;
+            sqe->addr = (uint64_t) (uintptr_t) &timeout;
+            sqe->len = 1;
+            sqe->user_data = IO_URING_USER_DATA( ioRingBatch, i, 1 );
+
+            submitted += 2;
+        }
+
+        // Submit whole batch. Entries the kernel did not take are taken back: no later batch submits them by mistake
+        consumed = submitted > 0 ? (int) syscall( __NR_io_uring_enter, ioRing.fd, submitted, 0, 0, NULL, 0 ) : 0;
+        if ( consumed < (int) submitted )
+        {
+            if ( consumed < 0 )
+            {
+                perror( "io_uring_probe(): io_uring_enter()" );
+                consumed = 0;
+            }
+            __atomic_store_n( ioRing.sq_tail, *ioRing.sq_tail - ( submitted - (unsigned) consumed ), __ATOMIC_RELEASE );
+        }
+
+        // Wait for all completions ( each connect times out after SOCKET_CONNECT_TIMEOUT )
+        while ( ( completed += io_uring_reap( connected_fds + first, reaped, &connected ) ) < (unsigned) consumed )
+        {
+            if ( syscall( __NR_io_uring_enter, ioRing.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0 ) < 0 && EINTR != errno )
+            {
+                perror( "io_uring_probe(): io_uring_enter()" );
+                break;
+            }
+        }
+
+        // Probes not completed: not handed to anyone as connected, but probed again ( their completions, if they ever
+        // come, are skipped as of an abandoned batch )
+        for ( uint16_t i = 0; i < batchLength; i++ )
+        {
+            if ( reaped[i] )
+                continue;
+
+            close( connected_fds[first + i] );
+            connected_fds[first + i] = -1;
+            retryAems[retryLength] = aems[first + i];
+            retryIndexes[retryLength++] = i;
+        }
+        if ( retryLength > 0 )
+        {
+            connected += io_epoll_probe( retryAems, retryLength, port, retryFds );
+            for ( uint16_t retry_i = 0; retry_i < retryLength; retry_i++ )
+                connected_fds[first + retryIndexes[retry_i]] = retryFds[retry_i];
+        }
+    }
+
+    return connected;
+}
+
+#endif
+
+/// \brief Name of the probe backend actually in use ( after any fallback ).
+/// \return "io_uring" or "epoll"
+const char* io_probe_backend_name(void)
+{
+    return ioProbeBackendName;
+}
+
+/// \brief Tries to connect to all $aems at once. Connects are submitted as a single batch and each one is given
+/// SOCKET_CONNECT_TIMEOUT to complete. Must only be called from one thread ( polling_worker ).
+/// \param aems AEMs to probe
+/// \param N size of $aems
+/// \param port
+/// \param connected_fds result array of size $N: connected socket for i-th AEM, or -1 if unreachable
+/// \return number of connected sockets
+uint16_t io_probe(const uint32_t *aems, uint16_t N, uint16_t port, int32_t *connected_fds)
+{
+    uint16_t connected;
+
+#ifdef IO_URING_AVAILABLE
+    connected = ( ioRing.fd >= 0 ) ?
+            io_uring_probe( aems, N, port, connected_fds ):
+            io_epoll_probe( aems, N, port, connected_fds );
+#else
+    connected = io_epoll_probe( aems, N, port, connected_fds );
+#endif
+
+    // Hand-off connected sockets in blocking mode, bounded by SOCKET_IDLE_TIMEOUT
+    for ( uint16_t i = 0; i < N; i++ )
+    {
+        if ( connected_fds[i] < 0 )
+            continue;
+
+        fcntl( connected_fds[i], F_SETFL, fcntl( connected_fds[i], F_GETFL, 0 ) & ~O_NONBLOCK );
+        socket_set_timeouts( connected_fds[i], SOCKET_IDLE_TIMEOUT );
+    }
+
+    return connected;
+}
+
+/// \brief Single read() of up to $length bytes from $socket_fd, retried on EINTR.
+/// \param socket_fd
+/// \param buffer
+/// \param length
+/// \param deadline contact deadline ( NULL for none )
+/// \return number of bytes read, 0 on EOF / timeout / error / passed deadline
+size_t io_recv(int32_t socket_fd, void *buffer, size_t length, const ContactDeadline *deadline)
+{
+    ssize_t n;
+
+    do
+    {
+        if ( deadline_expired( deadline ) )
+            return 0;
+
+        n = read( socket_fd, buffer, length );
+        stats_add( syscalls, 1 );
+    }
+    while ( n < 0 && EINTR == errno );
+
+    if ( n <= 0 )
+        return 0;
+
+    stats_add( bytes_received, n );
+    return (size_t) n;
+}
+
+/// \brief Sends all $N buffers of $iov to $socket_fd using as few syscalls as possible ( vectored write ).
+/// \param socket_fd
+/// \param iov
+/// \param N number of buffers in $iov ( at most IO_BATCH_LEN )
+/// \param deadline contact deadline ( NULL for none )
+/// \return TRUE if all bytes were sent, FALSE otherwise
+bool io_send_batch(int32_t socket_fd, const struct iovec *iov, int N, const ContactDeadline *deadline)
+{
+    struct iovec pending[IO_BATCH_LEN];
+    struct msghdr header;
+    int first = 0;
+    size_t total = 0, calls = 0;
+    ssize_t n;
+
+    memcpy( pending, iov, N * sizeof( struct iovec ) );
+    memset( &header, 0, sizeof( struct msghdr ) );
+
+    while ( first < N )
+    {
+        if ( deadline_expired( deadline ) )
+            break;
+
+        header.msg_iov = pending + first;
+        header.msg_iovlen = (size_t) ( N - first );
+
+        n = sendmsg( socket_fd, &header, MSG_NOSIGNAL );
+        calls++;
+        if ( n < 0 && EINTR == errno )
+            continue;
+        if ( n <= 0 )
+            break;          // peer stalled for SOCKET_IDLE_TIMEOUT ( EAGAIN ), or left
+
+        total += (size_t) n;
+
+        // Skip fully sent buffers, advance into partially sent one
+        while ( first < N && (size_t) n >= pending[first].iov_len )
+            n -= (ssize_t) pending[first++].iov_len;
+        if ( first < N )
+        {
+            pending[first].iov_base = (char *) pending[first].iov_base + n;
+            pending[first].iov_len -= (size_t) n;
+        }
+    }
+
+    stats_add( syscalls, calls );
+    stats_add( bytes_sent, total );
+    return first == N;
+}
+
+/// \brief Waits until the peer of $socket_fd acknowledged every byte sent to it ( the send queue drained ), or $deadline
+/// passes, & tells how many of the last $bytes sent it did acknowledge. Unlike send() returning, which only means they
+/// were copied into the local send buffer, this tells how many the link actually carried.
+/// \param socket_fd
+/// \param bytes sent lately
+/// \param deadline contact deadline ( NULL for none )
+/// \return bytes of the last $bytes acknowledged ( all of them if the send queue cannot be read )
+uint64_t io_send_acked(int32_t socket_fd, uint64_t bytes, const ContactDeadline *deadline)
+{
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = IO_DRAIN_POLL_INTERVAL * 1000000L };
+    int unacked;
+
+    while ( 1 )
+    {
+        // Bytes not sent yet, or sent but not acknowledged
+        if ( ioctl( socket_fd, SIOCOUTQ, &unacked ) < 0 )
+            return bytes;
+        if ( unacked <= 0 )
+            return bytes;
+        if ( deadline_expired( deadline ) )
+            return (uint64_t) unacked < bytes ? bytes - (uint64_t) unacked : 0;
+
+        nanosleep( &interval, NULL );
+    }
+}
+
+/// \brief Bytes that can be sent to $socket_fd without blocking, as far as can be told: half of its send buffer ( the
+/// kernel doubles SO_SNDBUF to make room for its own bookkeeping ) less the bytes queued ( see io_send_acked() ).
+/// \param socket_fd
+/// \return 0 if the send buffer is full, or cannot be read
+size_t io_send_room(int32_t socket_fd)
+{
+    int size, queued;
+    socklen_t sizeLength = sizeof( size );
+
+    if ( getsockopt( socket_fd, SOL_SOCKET, SO_SNDBUF, &size, &sizeLength ) < 0 || ioctl( socket_fd, SIOCOUTQ, &queued ) < 0 )
+        return 0;
+
+    return size / 2 > queued ? (size_t) ( size / 2 - queued ) : 0;
+}
+
+/// \brief Initializes the requested backend of io_probe(), falling back to epoll if $backend is unavailable. Reads &
+/// writes of contacts are blocking syscalls of their own thread, whatever the backend.
+/// \param backend "io_uring", "epoll"
+void io_probe_setup(const char *backend)
+{
+    ioProbeBackendName = "epoll";
+
+    if ( 0 == strcmp( "io_uring", backend ) )
+    {
+#ifdef IO_URING_AVAILABLE
+        if ( io_uring_ring_setup() )
+            ioProbeBackendName = "io_uring";
+        else
+#endif
+            fprintf( stderr, "io_probe_setup(): io_uring not available. Falling back to epoll...\n" );
+    }
+
+    fprintf( stdout, "Probe backend = %s\n", ioProbeBackendName );
+}
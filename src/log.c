@@ -1,39 +1,352 @@
 #include "conf.h"
 #include "log.h"
+#include "histogram.h"
 #include "utils.h"
+#include "varint.h"
+#include <errno.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 
 //------------------------------------------------------------------------------------------------
 
 extern uint32_t CLIENT_AEM;
-extern struct timeval CLIENT_AEM_CONN_START_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT];
-extern struct timeval CLIENT_AEM_CONN_END_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT];
-extern uint8_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH];
+extern uint32_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH];
+extern uint64_t CLIENT_AEM_CONN_DURATION_LIST[CLIENT_AEM_LIST_LENGTH];
 
 extern uint32_t executionTimeRequested;
 extern MessagesStats messagesStats;
 
-extern Message MESSAGES_BUFFER[ MESSAGES_SIZE ];
-extern InboxMessage INBOX[ INBOX_SIZE ];
+extern Message *MESSAGES_BUFFER;
+extern InboxMessage *INBOX;
 extern messages_head_t inboxHead;
+extern InboxPayload *PAYLOADS;
+extern messages_head_t payloadsHead;
+
+extern char **environ;
 
 //------------------------------------------------------------------------------------------------
 
 static FILE *jsonFilePointer;
+static const char *logFileName;
+static struct timeval sessionStartedAt;
+
+/* Closed segment of the session log, named after the log & its index ( see log_segment_path() ) */
+typedef struct log_segment_t {
+    uint32_t index;
+    pid_t compressor;                   // compressing process, 0 if none
+    bool compressed;
+} LogSegment;
+
+// Closed segments, oldest first
+static LogSegment segments[LOG_SEGMENTS_MAX];
+static uint32_t segmentsN;
+static uint32_t segmentsClosed;
+static struct timespec segmentStartedAt;
+
+// Formats of timestamps
+static const char datetimeFormat[] = "%FT%TZ";
+static const char timeFormat[] = "%H:%M:%S";
+
+/* Formats of the session log */
+typedef enum log_format_t {
+    LOG_FORMAT_NDJSON,
+    LOG_FORMAT_BINARY
+} LogFormat;
+
+static LogFormat logFormat = LOG_FORMAT_NDJSON;
+static const char *logFormatNames[] = { "ndjson", "binary" };
+
+// Binary log: names written as their index in these lists & time of the last record written, in usecs ( times of
+// records are written relative to it )
+static const char *binaryEventTypes[] = LOG_BINARY_EVENT_TYPES;
+static const char *binaryActions[] = LOG_BINARY_ACTIONS;
+static const char *histogramNames[] = LOG_BINARY_HISTOGRAMS;
+static uint64_t binaryPreviousAt;
+
+/* Cell of the ring of records: $sequence tells whose turn it is ( see log_ring_claim() & log_ring_peek() ) */
+typedef struct log_ring_cell_t {
+    size_t sequence;
+    LogRecord record;
+} LogRingCell;
+
+// Multi-producer, single-consumer ring of records ( lock-free )
+static LogRingCell ring[LOG_RING_SIZE];
+static size_t ringTail;                 // next position to claim ( producers )
+static size_t ringHead;                 // next position to format ( logger thread )
+
+static uint32_t eventsN;
+static __thread uint32_t eventCurrent;  // event logged by this thread
+static __thread struct timeval eventStartedAt;
+
+static bool loggerStopping;
+static uint64_t recordsDropped;
+
+//------------------------------------------------------------------------------------------------
+
+/// \brief Claims the next cell of $ring for a record of $kind of this thread's event ( lock-free, from any thread ).
+/// \param kind
+/// \return NULL if $ring is full ( record dropped )
+static LogRingCell *log_ring_claim(uint8_t kind)
+{
+    size_t position = __atomic_load_n( &ringTail, __ATOMIC_RELAXED );
+    LogRingCell *cell;
+    intptr_t lag;
+
+    while ( 1 )
+    {
+        cell = &ring[ position & ( LOG_RING_SIZE - 1 ) ];
+        lag = (intptr_t) __atomic_load_n( &cell->sequence, __ATOMIC_ACQUIRE ) - (intptr_t) position;
+
+        // Free cell: claim it, unless another thread did first ( $position is then reloaded )
+        if ( 0 == lag )
+        {
+            if ( __atomic_compare_exchange_n( &ringTail, &position, position + 1, true, __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED ) )
+                break;
+        }
+        // Cell not formatted yet: full
+        else if ( lag < 0 )
+        {
+            __atomic_add_fetch( &recordsDropped, 1, __ATOMIC_RELAXED );
+            return NULL;
+        }
+        else
+            position = __atomic_load_n( &ringTail, __ATOMIC_RELAXED );
+    }
+
+    cell->record.kind = kind;
+    cell->record.event = eventCurrent;
+    gettimeofday( &cell->record.at, NULL );
+
+    return cell;
+}
+
+/// \brief Hands a claimed cell over to the logger thread.
+/// \param cell
+static void log_ring_commit(LogRingCell *cell)
+{
+    __atomic_store_n( &cell->sequence, cell->sequence + 1, __ATOMIC_RELEASE );
+}
+
+/// \brief Next committed cell of $ring ( logger thread ).
+/// \return NULL if there is none
+static LogRingCell *log_ring_peek(void)
+{
+    LogRingCell *cell = &ring[ ringHead & ( LOG_RING_SIZE - 1 ) ];
+
+    return __atomic_load_n( &cell->sequence, __ATOMIC_ACQUIRE ) == ringHead + 1 ? cell : NULL;
+}
+
+/// \brief Frees a formatted cell for the producers, a lap later ( logger thread ).
+/// \param cell
+static void log_ring_release(LogRingCell *cell)
+{
+    __atomic_store_n( &cell->sequence, ringHead + LOG_RING_SIZE, __ATOMIC_RELEASE );
+    ringHead++;
+}
+
+/// \brief Appends $value to the binary session log as a varint ( see varint_encode() ).
+/// \param value
+static void log_binary_varint(uint64_t value)
+{
+    uint8_t bytes[VARINT_LEN_MAX];
+
+    fwrite( bytes, 1, varint_encode( value, bytes ), jsonFilePointer );
+}
+
+/// \brief Appends signed $value to the binary session log as a zigzag varint ( small magnitudes take few bytes ).
+/// \param value
+static void log_binary_zigzag(int64_t value)
+{
+    log_binary_varint( zigzag_encode( value ) );
+}
+
+/// \brief Appends $name to the binary session log: its index in $names, or LOG_BINARY_NAME_OTHER & the name itself.
+/// \param name
+/// \param names
+/// \param namesN
+static void log_binary_name(const char *name, const char **names, uint8_t namesN)
+{
+    size_t length;
+
+    for ( uint8_t name_i = 0; name_i < namesN; name_i++ )
+    {
+        if ( 0 == strcmp( names[name_i], name ) )
+        {
+            fputc( name_i, jsonFilePointer );
+            return;
+        }
+    }
+
+    length = strlen( name );
+    fputc( LOG_BINARY_NAME_OTHER, jsonFilePointer );
+    log_binary_varint( length );
+    fwrite( name, 1, length, jsonFilePointer );
+}
 
-struct timeval lastEventStart, lastEventStop;
+/// \brief Fingerprint of a message's body ( 32-bit FNV-1a ), written to the binary session log instead of the body.
+/// \param body
+/// \return
+static uint32_t log_binary_fingerprint(const char *body)
+{
+    uint32_t hash = 2166136261u;
+
+    for ( uint16_t char_i = 0; char_i < MESSAGE_BODY_LEN && '\0' != body[char_i]; char_i++ )
+        hash = ( hash ^ (uint8_t) body[char_i] ) * 16777619u;
+
+    return hash;
+}
 
-/// \brief Logs the start of a new event in session.json file
+/// \brief Appends two AEMs of a message ( e.g. sender & recipient ) & the fingerprint of its body to the binary session
+/// log.
+/// \param aemA
+/// \param aemB
+/// \param body
+static void log_binary_message(uint32_t aemA, uint32_t aemB, const char *body)
+{
+    uint32_t fingerprint = log_binary_fingerprint( body );
+    uint8_t bytes[4] = {
+        (uint8_t) fingerprint, (uint8_t) ( fingerprint >> 8 ), (uint8_t) ( fingerprint >> 16 ), (uint8_t) ( fingerprint >> 24 )
+    };
+
+    log_binary_varint( aemA );
+    log_binary_varint( aemB );
+    fwrite( bytes, 1, 4, jsonFilePointer );
+}
+
+/// \brief Writes $record to the binary session log ( logger thread ): its kind, its event, its time relative to the
+/// previous record's & its fields, as varints. Bodies are replaced by their fingerprint, so a record takes ~ 15 bytes.
+/// \param record
+static void log_record_write_binary(const LogRecord *record)
+{
+    uint64_t at = (uint64_t) record->at.tv_sec * 1000000 + (uint64_t) record->at.tv_usec;
+    const Message *message;
+    uint32_t devicesN;
+
+    fputc( record->kind, jsonFilePointer );
+    log_binary_varint( record->event );
+    log_binary_zigzag( (int64_t) ( at - binaryPreviousAt ) );
+    binaryPreviousAt = at;
+
+    switch ( record->kind )
+    {
+        case LOG_RECORD_EVENT_START:
+            log_binary_name( record->data.start.type, binaryEventTypes, sizeof( binaryEventTypes ) / sizeof( char * ) );
+            log_binary_varint( record->data.start.server );
+            log_binary_varint( record->data.start.client );
+            break;
+
+        case LOG_RECORD_MESSAGE:
+            message = &record->data.message.message;
+            log_binary_name( record->data.message.action, binaryActions, sizeof( binaryActions ) / sizeof( char * ) );
+            log_binary_message( message->sender, message->recipient, message->body );
+            log_binary_zigzag( (int64_t) message->created_at - (int64_t) record->at.tv_sec );
+            fputc( ( message->transmitted == 1 ? 1 : 0 ) | ( message->transmitted_to_recipient == 1 ? 2 : 0 ), jsonFilePointer );
+
+            // AEMs of devices transmitted to: count, then each
+            devicesN = 0;
+            for ( uint32_t aem_i = 0; aem_i < CLIENT_AEM_LIST_LENGTH; aem_i++ )
+                devicesN += 1 == message->transmitted_devices[aem_i];
+            log_binary_varint( devicesN );
+            for ( uint32_t aem_i = 0; devicesN > 0 && aem_i < CLIENT_AEM_LIST_LENGTH; aem_i++ )
+            {
+                if ( 1 == message->transmitted_devices[aem_i] )
+                    log_binary_varint( CLIENT_AEM_LIST[aem_i] );
+            }
+            break;
+
+        case LOG_RECORD_DATETIME:
+            log_binary_zigzag( (int64_t) record->data.datetime.previous_now - (int64_t) record->at.tv_sec );
+            log_binary_zigzag( (int64_t) record->data.datetime.new_now - (int64_t) record->at.tv_sec );
+            break;
+
+        case LOG_RECORD_EVENT_STOP:
+        default:
+            log_binary_zigzag( (int64_t) ( at - ( (uint64_t) record->data.stop.startedAt.tv_sec * 1000000 +
+                                                  (uint64_t) record->data.stop.startedAt.tv_usec ) ) );
+            break;
+    }
+}
+
+/// \brief Writes $record as a line of the session log ( logger thread ). Each line is a JSON object, starting with the
+/// kind of record & ( but for records of the whole session ) the event it belongs to: a line never depends on a later
+/// one, so the log is valid up to its last line even if the device powers off. See ndjson2json for the old layout.
+/// \param record
+static void log_record_write_ndjson(const LogRecord *record)
+{
+    char at[STRFTIME_STR_LEN], createdAt[STRFTIME_STR_LEN], newNow[STRFTIME_STR_LEN];
+    const Message *message;
+
+    switch ( record->kind )
+    {
+        case LOG_RECORD_EVENT_START:
+            fprintf( jsonFilePointer, "{\"record\": \"event\", \"event\": %u, \"occured_at\": \"%s\", \"type\": \"%s\", \"server\": \"%u\", \"client\": \"%u\"}\n",
+                    record->event, timestamp2ftime( (uint64_t) record->at.tv_sec, timeFormat, at ), record->data.start.type,
+                    record->data.start.server, record->data.start.client );
+            break;
+
+        case LOG_RECORD_MESSAGE:
+            message = &record->data.message.message;
+            fprintf( jsonFilePointer, "{\"record\": \"message\", \"event\": %u, \"saved_at\": \"%s\", \"action\": \"%s\", \"sender\": \"%u\", \"recipient\": \"%u\", \"created_at\": \"%s\", \"body\": \"%s\", \"transmitted\": \"%s\", \"transmitted_devices\": \"%s\", \"transmitted_to_recipient\": \"%s\"}\n",
+                    record->event, timestamp2ftime( (uint64_t) record->at.tv_sec, datetimeFormat, at ), record->data.message.action,
+                    message->sender, message->recipient, timestamp2ftime( message->created_at, datetimeFormat, createdAt ), message->body,
+                    message->transmitted == 1 ? "TRUE" : "FALSE", getTransmittedDevicesString( message ),
+                    message->transmitted_to_recipient == 1 ? "TRUE" : "FALSE"
+            );
+            break;
+
+        case LOG_RECORD_DATETIME:
+            fprintf( jsonFilePointer, "{\"record\": \"message\", \"event\": %u, \"saved_at\": \"%s\", \"action\": \"%s\", \"previous_now\": \"%s\", \"new_now\": \"%s\"}\n",
+                    record->event, timestamp2ftime( (uint64_t) record->at.tv_sec, datetimeFormat, at ), "datetime",
+                    timestamp2ftime( record->data.datetime.previous_now, datetimeFormat, createdAt ),
+                    timestamp2ftime( record->data.datetime.new_now, datetimeFormat, newNow ) );
+            break;
+
+        case LOG_RECORD_EVENT_STOP:
+        default:
+            fprintf( jsonFilePointer, "{\"record\": \"event_end\", \"event\": %u, \"duration\": \"%f ms\"}\n", record->event,
+                    (double) ( record->at.tv_sec - record->data.stop.startedAt.tv_sec ) * 1000 +
+                    (double) ( record->at.tv_usec - record->data.stop.startedAt.tv_usec ) / 1000 );
+            break;
+    }
+}
+
+/// \brief Writes what is buffered of the session log to disk, so that it survives a crash or power loss ( logger thread ).
+static void log_sync(void)
+{
+    fflush( jsonFilePointer );
+    if ( -1 == fsync( fileno( jsonFilePointer ) ) )
+        perror( "log_sync(): fsync()" );
+}
+
+/// \brief Logs the start of a new event of this thread in session.json file ( queued for log_worker() ). The records this
+/// thread logs up to log_event_stop() belong to it.
 /// \param type
 /// \param server
 /// \param client
 void log_event_start( const char* type, uint32_t server, uint32_t client )
 {
-    gettimeofday( &lastEventStart, NULL );
+    LogRingCell *cell;
+
+    if ( NULL == jsonFilePointer )      // logger not set up ( e.g. in simulator )
+        return;
+
+    eventCurrent = __atomic_add_fetch( &eventsN, 1, __ATOMIC_RELAXED );
+    gettimeofday( &eventStartedAt, NULL );
+    if ( NULL == ( cell = log_ring_claim( LOG_RECORD_EVENT_START ) ) )
+        return;
 
-    fprintf( jsonFilePointer, "{\"occured_at\": \"%s\", \"type\": \"%s\", \"server\": \"%u\", \"client\": \"%u\", \"messages\": [",
-            timestamp2ftime( (uint64_t) time(NULL), "%H:%M:%S" ), type,
-            server, client );
+    strncpy( cell->record.data.start.type, type, LOG_EVENT_TYPE_LEN - 1 );
+    cell->record.data.start.type[LOG_EVENT_TYPE_LEN - 1] = '\0';
+    cell->record.data.start.server = server;
+    cell->record.data.start.client = client;
+
+    log_ring_commit( cell );
 }
 
 /// \brief Logs $message to session.json file
@@ -41,12 +354,16 @@ void log_event_start( const char* type, uint32_t server, uint32_t client )
 /// \param message
 void log_event_message( const char* action, const Message* message )
 {
-    fprintf( jsonFilePointer, "{\"saved_at\": \"%s\", \"action\": \"%s\", \"sender\": \"%u\", \"recipient\": \"%u\", \"created_at\": \"%s\", \"body\": \"%s\", \"transmitted\": \"%s\", \"transmitted_devices\": \"%s\", \"transmitted_to_recipient\": \"%s\"},",
-     timestamp2ftime( (uint64_t) time(NULL), "%FT%TZ" ), action,
-         message->sender, message->recipient, timestamp2ftime( message->created_at, "%FT%TZ" ), message->body,
-         message->transmitted == 1 ? "TRUE" : "FALSE", getTransmittedDevicesString( message ),
-         message->transmitted_to_recipient == 1 ? "TRUE" : "FALSE"
-     );
+    LogRingCell *cell;
+
+    if ( NULL == jsonFilePointer || NULL == ( cell = log_ring_claim( LOG_RECORD_MESSAGE ) ) )
+        return;
+
+    strncpy( cell->record.data.message.action, action, LOG_ACTION_LEN - 1 );
+    cell->record.data.message.action[LOG_ACTION_LEN - 1] = '\0';
+    cell->record.data.message.message = *message;
+
+    log_ring_commit( cell );
 }
 
 /// \brief Logs datetime syncing to session.json file
@@ -54,27 +371,268 @@ void log_event_message( const char* action, const Message* message )
 /// \param new_now
 void log_event_message_datetime( uint64_t previous_now, uint64_t new_now )
 {
-    fprintf( jsonFilePointer, "{\"saved_at\": \"%s\", \"action\": \"%s\", \"previous_now\": \"%s\", \"new_now\": \"%s\"},",
-             timestamp2ftime( (uint64_t) time(NULL), "%FT%TZ" ), "datetime",
-             timestamp2ftime( previous_now, "%FT%TZ" ), timestamp2ftime( new_now, "%FT%TZ" ) );
+    LogRingCell *cell;
+
+    if ( NULL == jsonFilePointer || NULL == ( cell = log_ring_claim( LOG_RECORD_DATETIME ) ) )
+        return;
+
+    cell->record.data.datetime.previous_now = previous_now;
+    cell->record.data.datetime.new_now = new_now;
+
+    log_ring_commit( cell );
 }
 
 /// \brief Logs the end of a new event in session.json file
 void log_event_stop(void)
 {
-    gettimeofday( &lastEventStop, NULL );
+    LogRingCell *cell;
+
+    if ( NULL == jsonFilePointer || NULL == ( cell = log_ring_claim( LOG_RECORD_EVENT_STOP ) ) )
+        return;
+
+    cell->record.data.stop.startedAt = eventStartedAt;
+
+    log_ring_commit( cell );
+}
+
+/// \brief Writes the session record, at the head of each segment of the session log: the start of the session ( & for the
+/// binary log, the magic & the offset of local time, to render times as they were here ).
+static void log_session_write(void)
+{
+    char now[STRFTIME_STR_LEN];
+    struct tm local;
+
+    if ( LOG_FORMAT_BINARY == logFormat )
+    {
+        localtime_r( &sessionStartedAt.tv_sec, &local );
+        binaryPreviousAt = (uint64_t) sessionStartedAt.tv_sec * 1000000 + (uint64_t) sessionStartedAt.tv_usec;
+
+        fprintf( jsonFilePointer, "%s%c", LOG_BINARY_MAGIC, LOG_BINARY_VERSION );
+        fputc( LOG_RECORD_SESSION, jsonFilePointer );
+        log_binary_varint( binaryPreviousAt );
+        log_binary_zigzag( local.tm_gmtoff );
+        log_binary_varint( CLIENT_AEM );
+        log_binary_varint( executionTimeRequested );
+    }
+    else
+        fprintf( jsonFilePointer, "{\"record\": \"session\", \"start\": \"%s\", \"client_aem\": \"%d\", \"requested_duration\":\"%u secs\"}\n",
+                timestamp2ftime( (uint64_t) sessionStartedAt.tv_sec, datetimeFormat, now ), CLIENT_AEM, executionTimeRequested );
+}
+
+/// \brief Path of the segment of the session log with $index, e.g. "session1.ndjson.0003.gz".
+/// \param path result ( room for PATH_MAX characters )
+/// \param index
+/// \param compressed
+static void log_segment_path(char *path, uint32_t index, bool compressed)
+{
+    snprintf( path, PATH_MAX, "%s.%04u%s", logFileName, index, compressed ? LOG_COMPRESS_SUFFIX : "" );
+}
+
+/// \brief Size of the segment of $segments_i, on disk.
+/// \param segment_i
+/// \return 0 if it is missing
+static off_t log_segment_size(uint32_t segment_i)
+{
+    char path[PATH_MAX];
+    struct stat info;
+
+    log_segment_path( path, segments[segment_i].index, segments[segment_i].compressed );
+    return 0 == stat( path, &info ) ? info.st_size : 0;
+}
+
+/// \brief Collects the compressing processes that have exited: a segment is compressed if its process succeeded, or
+/// is kept as is otherwise ( e.g. no LOG_COMPRESS_COMMAND on this device ) ( logger thread ).
+static void log_segments_reap(void)
+{
+    int status;
 
-    double duration = (double) ( lastEventStop.tv_sec - lastEventStart.tv_sec ) * 1000 +
-            (double) ( lastEventStop.tv_usec - lastEventStart.tv_usec ) / 1000;
+    for ( uint32_t segment_i = 0; segment_i < segmentsN; segment_i++ )
+    {
+        if ( 0 == segments[segment_i].compressor ||
+             0 == waitpid( segments[segment_i].compressor, &status, WNOHANG ) )
+            continue;
+
+        segments[segment_i].compressor = 0;
+        segments[segment_i].compressed = WIFEXITED( status ) && 0 == WEXITSTATUS( status );
+    }
+}
+
+/// \brief Deletes the oldest closed segments while they take more than LOG_RETENTION_BYTES, or while there are
+/// LOG_SEGMENTS_MAX of them. Segments still being compressed are kept, & not counted: they are sized once compressed,
+/// rather than at their uncompressed size ( logger thread ).
+static void log_segments_retain(void)
+{
+    char path[PATH_MAX];
+    off_t total = 0;
+
+    log_segments_reap();
+    for ( uint32_t segment_i = 0; segment_i < segmentsN; segment_i++ )
+    {
+        if ( 0 == segments[segment_i].compressor )
+            total += log_segment_size( segment_i );
+    }
+
+    while ( segmentsN > 0 && 0 == segments[0].compressor &&
+            ( LOG_SEGMENTS_MAX == segmentsN || ( 0 < LOG_RETENTION_BYTES && total > LOG_RETENTION_BYTES ) ) )
+    {
+        total -= log_segment_size( 0 );
+        log_segment_path( path, segments[0].index, segments[0].compressed );
+        if ( -1 == remove( path ) )
+            perror( "log_segments_retain(): remove()" );
+
+        memmove( &segments[0], &segments[1], --segmentsN * sizeof( LogSegment ) );
+    }
+}
+
+/// \brief Closes the current segment of the session log, once it is LOG_ROTATE_BYTES long or LOG_ROTATE_INTERVAL secs
+/// old, & starts the next one ( logger thread ). The closed segment is renamed after its index & compressed by
+/// LOG_COMPRESS_COMMAND, in the background; the log being written always has the name it was given.
+/// \param now
+static void log_rotate(const struct timespec *now)
+{
+    char path[PATH_MAX];
+    char *const argv[] = { LOG_COMPRESS_COMMAND, "-f", path, NULL };
+    LogSegment *segment;
+
+    if ( !( ( 0 < LOG_ROTATE_BYTES && ftell( jsonFilePointer ) >= LOG_ROTATE_BYTES ) ||
+            ( 0 < LOG_ROTATE_INTERVAL && now->tv_sec - segmentStartedAt.tv_sec >= LOG_ROTATE_INTERVAL ) ) )
+        return;
+
+    // No room for another closed segment, even after deleting the oldest one
+    log_segments_retain();
+    if ( LOG_SEGMENTS_MAX == segmentsN )
+        return;
+
+    segment = &segments[segmentsN];
+    segment->index = ++segmentsClosed;
+    segment->compressor = 0;
+    segment->compressed = false;
+    log_segment_path( path, segment->index, false );
+
+    log_sync();
+    if ( -1 == rename( logFileName, path ) )
+    {
+        perror( "log_rotate(): rename()" );
+        segmentsClosed--;
+        return;
+    }
+    segmentsN++;
+
+    // Next segment ( the same FILE, so that log_event_*() see no change )
+    if ( NULL == freopen( logFileName, "w", jsonFilePointer ) )
+        error( errno, "log_rotate(): freopen()" );
+    setvbuf( jsonFilePointer, NULL, _IOFBF, LOG_BUFFER_LEN );
+    log_session_write();
+    segmentStartedAt = *now;
+
+    if ( 0 < strlen( LOG_COMPRESS_COMMAND ) &&
+         0 != posix_spawnp( &segment->compressor, LOG_COMPRESS_COMMAND, NULL, NULL, argv, environ ) )
+    {
+        perror( "log_rotate(): posix_spawnp()" );
+        segment->compressor = 0;
+    }
+}
+
+/// \brief Logger loop ( POSIX thread compatible function ). Formats the records queued by the log_event_*() functions
+/// & appends them to the session log, so that no hot path waits for disk I/O or for another thread's event. The log
+/// is flushed to disk every LOG_FSYNC_INTERVAL ms & rotated, see log_rotate(). Returns once log_worker_stop() is called &
+/// nothing is left queued.
+void log_worker(void)
+{
+    struct timespec now, syncedAt;
+    LogRingCell *cell;
+    bool formatted, unsynced = false;
+
+    clock_gettime( CLOCK_MONOTONIC, &syncedAt );
+    segmentStartedAt = syncedAt;
+    while ( 1 )
+    {
+        for ( formatted = false; NULL != ( cell = log_ring_peek() ); formatted = true )
+        {
+            if ( LOG_FORMAT_BINARY == logFormat )
+                log_record_write_binary( &cell->record );
+            else
+                log_record_write_ndjson( &cell->record );
+            log_ring_release( cell );
+        }
+        unsynced |= formatted;
+
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        if ( formatted )
+            log_rotate( &now );
+
+        if ( ( now.tv_sec - syncedAt.tv_sec ) * 1000 + ( now.tv_nsec - syncedAt.tv_nsec ) / 1000000 >= LOG_FSYNC_INTERVAL )
+        {
+            if ( unsynced )
+                log_sync();
+            syncedAt = now;
+            unsynced = false;
+
+            log_segments_retain();
+        }
+
+        if ( !formatted )
+        {
+            if ( __atomic_load_n( &loggerStopping, __ATOMIC_ACQUIRE ) )
+                break;
 
-    removeTrailingCommaFromJson();
-    fprintf( jsonFilePointer, "], \"duration\": \"%f ms\"},", duration );
+            nanosleep( &(struct timespec){ 0, LOG_IDLE_SLEEP * 1000000L }, NULL );
+        }
+    }
+}
+
+/// \brief Makes log_worker() return, once it has written whatever is queued.
+void log_worker_stop(void)
+{
+    __atomic_store_n( &loggerStopping, true, __ATOMIC_RELEASE );
+}
+
+/// \brief Records dropped so far, as the logger's ring was full.
+/// \return
+uint64_t log_records_dropped(void)
+{
+    return __atomic_load_n( &recordsDropped, __ATOMIC_RELAXED );
+}
+
+/// \brief Writes the summary of $histogram ( count, mean & percentiles of its values, in usecs ) to the session log.
+/// \param name_i index of its name in LOG_BINARY_HISTOGRAMS
+/// \param histogram
+static void log_histogram_write(uint8_t name_i, const Histogram *histogram)
+{
+    static const double percentiles[] = { 0, 50, 90, 99, 99.9, 100 };
+    unsigned long long values[6];
+    unsigned long long count = __atomic_load_n( &histogram->count, __ATOMIC_RELAXED );
+    unsigned long long mean = histogram_mean( histogram );
+
+    for ( uint8_t value_i = 0; value_i < 6; value_i++ )
+        values[value_i] = histogram_percentile( histogram, percentiles[value_i] );
+
+    if ( ALSO_LOG_TO_STDOUT )
+        fprintf( stdout, "\t- %-16s: %llu values, mean = %.3f ms, p50 = %.3f ms, p99 = %.3f ms, max = %.3f ms\n",
+                 histogramNames[name_i], count, (double) mean / 1e3, (double) values[1] / 1e3, (double) values[3] / 1e3,
+                 (double) values[5] / 1e3 );
+
+    if ( LOG_FORMAT_BINARY == logFormat )
+    {
+        fputc( LOG_RECORD_HISTOGRAM, jsonFilePointer );
+        log_binary_name( histogramNames[name_i], histogramNames, sizeof( histogramNames ) / sizeof( char * ) );
+        log_binary_varint( count );
+        log_binary_varint( mean );
+        for ( uint8_t value_i = 0; value_i < 6; value_i++ )
+            log_binary_varint( values[value_i] );
+    }
+    else
+        fprintf( jsonFilePointer, "{\"record\": \"histogram\", \"name\": \"%s\", \"unit\": \"us\", \"count\": \"%llu\", \"mean\": \"%llu\", \"min\": \"%llu\", \"p50\": \"%llu\", \"p90\": \"%llu\", \"p99\": \"%llu\", \"p999\": \"%llu\", \"max\": \"%llu\"}\n",
+                 histogramNames[name_i], count, mean, values[0], values[1], values[2], values[3], values[4], values[5] );
 }
 
 /// Append end of session message and closes log file pointer.
 /// \param executionTimeRequested
 void log_tearDown(const double executionTimeActual)
 {
+    char start[STRFTIME_STR_LEN], end[STRFTIME_STR_LEN];
+    double averageDuration;
+
     if ( ALSO_LOG_TO_STDOUT )
     {
         fprintf(stdout, "\n/*\n"
@@ -86,22 +644,58 @@ void log_tearDown(const double executionTimeActual)
                         "| Duration Requested  : %u secs\n"
                         "| Devices Connected   : %d\n"
                         "|\n"
-                        "| Messages Produced   : %u ( avg. delay = %.03f min )\n"
-                        "| Messages Received   : %u (for me: %u)\n"
-                        "| Messages Transmitted: %u (to recipient: %u)\n"
+                        "| Messages Produced   : %llu ( avg. delay = %.03f min )\n"
+                        "| Messages Received   : %llu (for me: %llu, payloads: %llu, duplicates: %llu)\n"
+                        "| Messages Transmitted: %llu (to recipient: %llu)\n"
+                        "| Messages Evicted    : %llu\n"
+                        "| Bytes               : %llu sent, %llu received ( %llu syscalls )\n"
+                        "| Log Records Dropped : %llu\n"
                         "|\n"
                         "*/\n\n\n",
                 executionTimeActual, executionTimeRequested, 0,
-                messagesStats.produced, messagesStats.producedDelayAvg,
-                messagesStats.received, messagesStats.received_for_me,
-                messagesStats.transmitted, messagesStats.transmitted_to_recipient );
+                (unsigned long long) messagesStats.produced, messagesStats.producedDelayAvg,
+                (unsigned long long) messagesStats.received, (unsigned long long) messagesStats.received_for_me,
+                (unsigned long long) messagesStats.payloads_received, (unsigned long long) messagesStats.duplicates,
+                (unsigned long long) messagesStats.transmitted, (unsigned long long) messagesStats.transmitted_to_recipient,
+                (unsigned long long) messagesStats.evicted, (unsigned long long) messagesStats.bytes_sent,
+                (unsigned long long) messagesStats.bytes_received, (unsigned long long) messagesStats.syscalls,
+                (unsigned long long) __atomic_load_n( &recordsDropped, __ATOMIC_RELAXED ) );
     }
 
-    removeTrailingCommaFromJson();
-    fprintf( jsonFilePointer, "], \"duration\": \"%f s\", \"end\": \"%s\", \"stats\": { \"produced\": \"%d\", \"received\": \"%d\", \"received_for_me\": \"%d\", \"transmitted\": \"%d\", \"transmitted_to_recipient\": \"%d\", \"producedDelayAvg\": \"%.2fmin\", \"devices\": [",
-            executionTimeActual, timestamp2ftime( (uint64_t) time(NULL), "%FT%TZ" ),
-            messagesStats.produced, messagesStats.received, messagesStats.received_for_me,
-            messagesStats.transmitted, messagesStats.transmitted_to_recipient, messagesStats.producedDelayAvg );
+    // Events still open ( contacts in progress ) are left with no "event_end" line
+    if ( LOG_FORMAT_BINARY == logFormat )
+    {
+        fputc( LOG_RECORD_END, jsonFilePointer );
+        log_binary_varint( (uint64_t) ( executionTimeActual * 1e6 ) );
+        log_binary_varint( (uint64_t) time(NULL) );
+        log_binary_varint( messagesStats.produced );
+        log_binary_varint( messagesStats.received );
+        log_binary_varint( messagesStats.received_for_me );
+        log_binary_varint( messagesStats.payloads_received );
+        log_binary_varint( messagesStats.transmitted );
+        log_binary_varint( messagesStats.transmitted_to_recipient );
+        log_binary_varint( (uint64_t) ( messagesStats.producedDelayAvg * 100 ) );     // hundredths of min
+        log_binary_varint( messagesStats.duplicates );
+        log_binary_varint( messagesStats.evicted );
+        log_binary_varint( messagesStats.bytes_sent );
+        log_binary_varint( messagesStats.bytes_received );
+        log_binary_varint( messagesStats.syscalls );
+    }
+    else
+        fprintf( jsonFilePointer, "{\"record\": \"end\", \"duration\": \"%f s\", \"end\": \"%s\", \"stats\": { \"produced\": \"%llu\", \"received\": \"%llu\", \"received_for_me\": \"%llu\", \"payloads_received\": \"%llu\", \"transmitted\": \"%llu\", \"transmitted_to_recipient\": \"%llu\", \"producedDelayAvg\": \"%.2fmin\", \"duplicates\": \"%llu\", \"evicted\": \"%llu\", \"bytes_sent\": \"%llu\", \"bytes_received\": \"%llu\", \"syscalls\": \"%llu\"}}\n",
+                executionTimeActual, timestamp2ftime( (uint64_t) time(NULL), datetimeFormat, end ),
+                (unsigned long long) messagesStats.produced, (unsigned long long) messagesStats.received,
+                (unsigned long long) messagesStats.received_for_me, (unsigned long long) messagesStats.payloads_received,
+                (unsigned long long) messagesStats.transmitted, (unsigned long long) messagesStats.transmitted_to_recipient,
+                messagesStats.producedDelayAvg, (unsigned long long) messagesStats.duplicates,
+                (unsigned long long) messagesStats.evicted, (unsigned long long) messagesStats.bytes_sent,
+                (unsigned long long) messagesStats.bytes_received, (unsigned long long) messagesStats.syscalls );
+
+    // Distributions of times ( same order as LOG_BINARY_HISTOGRAMS )
+    log_histogram_write( 0, &messagesStats.contact_duration );
+    log_histogram_write( 1, &messagesStats.transfer_time );
+    log_histogram_write( 2, &messagesStats.first_byte_time );
+    log_histogram_write( 3, &messagesStats.delivery_latency );
 
     // Inspect connections
     if ( ALSO_LOG_TO_STDOUT )
@@ -114,84 +708,141 @@ void log_tearDown(const double executionTimeActual)
         if ( ALSO_LOG_TO_STDOUT )
             fprintf( stdout, "\t- %04d\n", aem );
 
-        if ( 0 < CLIENT_AEM_CONN_N_LIST[device_i] )
-        {
-            fprintf( jsonFilePointer, "{ \"aem\": \"%04d\", \"connections\": [", aem );
+        if ( 0 == CLIENT_AEM_CONN_N_LIST[device_i] )
+            continue;
 
-            double averageDuration = 0.0;
-            for ( uint8_t n = 0; n < CLIENT_AEM_CONN_N_LIST[device_i]; n++ )
-            {
-                double duration = (double)( CLIENT_AEM_CONN_END_LIST[device_i][n].tv_sec - CLIENT_AEM_CONN_START_LIST[device_i][n].tv_sec ) * 1e3 +
-                        (double)( CLIENT_AEM_CONN_END_LIST[device_i][n].tv_usec - CLIENT_AEM_CONN_START_LIST[device_i][n].tv_usec ) * 1e-3;
-
-                if ( ALSO_LOG_TO_STDOUT )
-                    fprintf( stdout, "\t\t start: %lf | end %lf ( duration: %lfms )\n",
-                        CLIENT_AEM_CONN_START_LIST[device_i][n].tv_sec + CLIENT_AEM_CONN_START_LIST[device_i][n].tv_usec * 1e-6,
-                        CLIENT_AEM_CONN_END_LIST[device_i][n].tv_sec + CLIENT_AEM_CONN_END_LIST[device_i][n].tv_usec * 1e-6,
-                        duration
-                    );
-
-                fprintf( jsonFilePointer, "{\"start\": \"%s.%03d\", \"end\": \"%s.%03d\", \"duration\": \"%.2fms\" },",
-                    timestamp2ftime( CLIENT_AEM_CONN_START_LIST[device_i][n].tv_sec, "%H:%M:%S" ), (int)(CLIENT_AEM_CONN_START_LIST[device_i][n].tv_usec * 1e-3),
-                    timestamp2ftime( CLIENT_AEM_CONN_END_LIST[device_i][n].tv_sec, "%H:%M:%S" ), (int)(CLIENT_AEM_CONN_END_LIST[device_i][n].tv_usec * 1e-3),
-                    duration
-                );
-
-                averageDuration += duration;
-            }
+        // Start & end of each contact are in the "connection" events
+        averageDuration = (double) CLIENT_AEM_CONN_DURATION_LIST[device_i] / 1e3 / (double) CLIENT_AEM_CONN_N_LIST[device_i];
+        if ( ALSO_LOG_TO_STDOUT )
+            fprintf( stdout, "\t\t connections: %u ( avg. duration: %lfms )\n", CLIENT_AEM_CONN_N_LIST[device_i], averageDuration );
 
-            removeTrailingCommaFromJson();
-            fprintf( jsonFilePointer, "], \"average_duration\": \"%.2fms\"},", averageDuration / (double) CLIENT_AEM_CONN_N_LIST[device_i] );
+        if ( LOG_FORMAT_BINARY == logFormat )
+        {
+            fputc( LOG_RECORD_DEVICE, jsonFilePointer );
+            log_binary_varint( aem );
+            log_binary_varint( CLIENT_AEM_CONN_N_LIST[device_i] );
+            log_binary_varint( CLIENT_AEM_CONN_DURATION_LIST[device_i] );
         }
+        else
+            fprintf( jsonFilePointer, "{\"record\": \"device\", \"aem\": \"%04d\", \"connections\": \"%u\", \"average_duration\": \"%.2fms\"}\n",
+                     aem, CLIENT_AEM_CONN_N_LIST[device_i], averageDuration );
     }
 
     if ( ALSO_LOG_TO_STDOUT )
         fprintf( stdout, "\n-------------------- end: DEVICES INSPECTION --------------------\n\n" );
 
-    // Finalize & close json file pointer
-    removeTrailingCommaFromJson();
-    fprintf( jsonFilePointer, "], \"buffer_messages\": [" );
-
+    // Contents of buffers
     for ( uint16_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
     {
         Message message = MESSAGES_BUFFER[message_i];
         if ( 0 == message.created_at ) continue;
 
-        fprintf( jsonFilePointer, "{\"sender\": \"%u\", \"recipient\": \"%u\", \"created_at\": \"%s\", \"body\": \"%s\"},",
-             message.sender, message.recipient, timestamp2ftime( message.created_at, "%FT%TZ" ), message.body
+        if ( LOG_FORMAT_BINARY == logFormat )
+        {
+            fputc( LOG_RECORD_BUFFER_MESSAGE, jsonFilePointer );
+            log_binary_message( message.sender, message.recipient, message.body );
+            log_binary_varint( message.created_at );
+            continue;
+        }
+
+        fprintf( jsonFilePointer, "{\"record\": \"buffer_message\", \"sender\": \"%u\", \"recipient\": \"%u\", \"created_at\": \"%s\", \"body\": \"%s\"}\n",
+             message.sender, message.recipient, timestamp2ftime( message.created_at, datetimeFormat, start ), message.body
          );
     }
 
-    removeTrailingCommaFromJson();
-    fprintf( jsonFilePointer, "], \"inbox_messages\": [" );
-
     for (uint16_t inbox_message_i = 0; inbox_message_i < inboxHead; inbox_message_i++ )
     {
         #define inboxMessage INBOX[inbox_message_i]
         if ( 0 == inboxMessage.created_at ) continue;
 
-        fprintf( jsonFilePointer, "{\"sender\": \"%u\", \"created_at\": \"%s\", \"saved_at\": \"%s\", \"body\": \"%s\", \"first_sender\": \"%u\"},",
+        if ( LOG_FORMAT_BINARY == logFormat )
+        {
+            fputc( LOG_RECORD_INBOX_MESSAGE, jsonFilePointer );
+            log_binary_message( inboxMessage.sender, inboxMessage.first_sender, inboxMessage.body );
+            log_binary_varint( inboxMessage.created_at );
+            log_binary_varint( inboxMessage.saved_at );
+            continue;
+        }
+
+        fprintf( jsonFilePointer, "{\"record\": \"inbox_message\", \"sender\": \"%u\", \"created_at\": \"%s\", \"saved_at\": \"%s\", \"body\": \"%s\", \"first_sender\": \"%u\"}\n",
                  inboxMessage.sender,
-                 timestamp2ftime( inboxMessage.created_at, "%FT%TZ" ),
-                 timestamp2ftime( inboxMessage.saved_at, "%FT%TZ" ),
+                 timestamp2ftime( inboxMessage.created_at, datetimeFormat, start ),
+                 timestamp2ftime( inboxMessage.saved_at, datetimeFormat, end ),
                  inboxMessage.body, inboxMessage.first_sender
         );
     }
 
-    removeTrailingCommaFromJson();
-    fprintf( jsonFilePointer, "]}}" );
+    // Payloads reconstructed from fragments in $INBOX
+    for ( messages_head_t payload_i = 0; payload_i < payloadsHead; payload_i++ )
+    {
+        if ( NULL == PAYLOADS[payload_i].data ) continue;
+
+        if ( LOG_FORMAT_BINARY == logFormat )
+        {
+            fputc( LOG_RECORD_PAYLOAD, jsonFilePointer );
+            log_binary_varint( PAYLOADS[payload_i].sender );
+            log_binary_varint( PAYLOADS[payload_i].id );
+            log_binary_varint( PAYLOADS[payload_i].length );
+            log_binary_varint( PAYLOADS[payload_i].saved_at );
+            continue;
+        }
+
+        fprintf( jsonFilePointer, "{\"record\": \"payload\", \"sender\": \"%u\", \"id\": \"%u\", \"length\": \"%zu\", \"saved_at\": \"%s\"}\n",
+                 PAYLOADS[payload_i].sender, PAYLOADS[payload_i].id, PAYLOADS[payload_i].length,
+                 timestamp2ftime( PAYLOADS[payload_i].saved_at, datetimeFormat, end ) );
+    }
+
+    // Finalize & close log file pointer
+    log_sync();
     fclose( jsonFilePointer );
 }
 
-/// Creates / Opens file and add the new session messages
+/// \brief Initializes the requested format of the session log, falling back to "ndjson" if $format is unknown. Must be
+/// called before log_tearUp().
+/// \param format "ndjson", "binary"
+void log_format_setup(const char *format)
+{
+    logFormat = LOG_FORMAT_NDJSON;
+
+    if ( 0 == strcmp( "binary", format ) )
+        logFormat = LOG_FORMAT_BINARY;
+    else if ( 0 != strcmp( "ndjson", format ) )
+        fprintf( stderr, "log_format_setup(): unknown log format \"%s\". Falling back to ndjson...\n", format );
+
+    fprintf( stdout, "Log format = %s\n", logFormatNames[logFormat] );
+}
+
+/// Creates / Opens file and add the new session line. The file is fully buffered: it is written by log_worker() only.
 /// \param jsonFileName
 void log_tearUp(const char *jsonFileName)
 {
-    // Check if session.json file exists
+    // Empty ring of records
+    for ( size_t cell_i = 0; cell_i < LOG_RING_SIZE; cell_i++ )
+        ring[cell_i].sequence = cell_i;
+
+    // Check if session log file exists, or segments of it
+    logFileName = jsonFileName;
     remove( jsonFileName );
-    jsonFilePointer = fopen( jsonFileName, "w+" );
+    for ( uint32_t index = 1; ; index++ )
+    {
+        char path[PATH_MAX];
+        bool removed;
+
+        log_segment_path( path, index, false );
+        removed = 0 == remove( path );
+        log_segment_path( path, index, true );
+        if ( !( 0 == remove( path ) || removed ) )
+            break;
+    }
 
-    const char* nowAsString = timestamp2ftime( (uint64_t) time(NULL), "%FT%TZ" );
+    jsonFilePointer = fopen( jsonFileName, "w" );
+    if ( NULL == jsonFilePointer )
+        error( errno, "log_tearUp(): fopen()" );
+    setvbuf( jsonFilePointer, NULL, _IOFBF, LOG_BUFFER_LEN );
+
+    char now[STRFTIME_STR_LEN];
+    gettimeofday( &sessionStartedAt, NULL );
+    const char* nowAsString = timestamp2ftime( (uint64_t) sessionStartedAt.tv_sec, datetimeFormat, now );
 
     if ( ALSO_LOG_TO_STDOUT )
     {
@@ -207,32 +858,5 @@ void log_tearUp(const char *jsonFileName)
                              "*/\n\n", nowAsString, aem2ip( CLIENT_AEM ), jsonFileName );
     }
 
-    // JSON file start
-    fprintf( jsonFilePointer, "{\"start\": \"%s\", \"client_aem\": \"%d\", \"requested_duration\":\"%u secs\", \"events\": [",
-            nowAsString, CLIENT_AEM, executionTimeRequested );
+    log_session_write();
 }
-
-/// \brief Removes last character from session.json file
-void removeTrailingCommaFromJson(void)
-{
-    fpos_t lastFilePosition;
-    fpos_t endFilePosition;
-
-    // Get end file position
-    fgetpos( jsonFilePointer, &endFilePosition );
-
-    // Go to last character's position
-    if ( -1 == fseek( jsonFilePointer, -1L, SEEK_CUR ) )
-    {
-        perror( "removeTrailingCommaFromJson(): fseek" );
-    }
-
-    // Get last character's position in session.json file
-    fgetpos( jsonFilePointer, &lastFilePosition );
-
-    // Set new write position to last character's position to overwrite character ( if it was comma )
-    if ( -1 == fsetpos( jsonFilePointer, ',' == (char) fgetc( jsonFilePointer ) ? &lastFilePosition : &endFilePosition ) )
-    {
-        perror( "removeTrailingCommaFromJson(): fsetpos()" );
-    }
-}
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include "conf.h"
+#include "metrics.h"
+#include "histogram.h"
+#include "io.h"
+#include "log.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------------------------
+
+extern uint32_t CLIENT_AEM;
+extern MessagesStats messagesStats;
+extern pthread_mutex_t messagesBufferLock;
+extern Message *MESSAGES_BUFFER;
+extern messages_head_t inboxHead;
+extern bool CLIENT_AEM_ACTIVE_LIST[CLIENT_AEM_LIST_LENGTH];
+extern uint8_t communicationThreadsAvailable;
+
+//------------------------------------------------------------------------------------------------
+
+uint16_t metricsPort = METRICS_PORT;
+
+/* Metrics being rendered */
+typedef struct metrics_text_t {
+    char *data;
+    size_t length;
+    size_t size;
+} MetricsText;
+
+/// \brief Appends a formatted line to $text ( whatever does not fit is dropped ).
+static void metrics_printf(MetricsText *text, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    if ( text->length + 1 >= text->size )
+        return;
+
+    va_start( args, format );
+    n = vsnprintf( text->data + text->length, text->size - text->length, format, args );
+    va_end( args );
+
+    if ( n > 0 )
+        text->length = text->length + (size_t) n < text->size ? text->length + (size_t) n : text->size - 1;
+}
+
+/// \brief Appends a metric with a single sample & no labels.
+static void metrics_sample(MetricsText *text, const char *name, const char *type, const char *help, double value)
+{
+    metrics_printf( text, "# HELP final_%s %s\n# TYPE final_%s %s\nfinal_%s %.17g\n", name, help, name, type, name, value );
+}
+
+/// \brief Appends $histogram ( usecs ) as a summary in seconds: its p50, p90, p99 & p99.9, sum & count.
+static void metrics_summary(MetricsText *text, const char *name, const char *help, const Histogram *histogram)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    metrics_printf( text, "# HELP final_%s_seconds %s\n# TYPE final_%s_seconds summary\n", name, help, name );
+    for ( uint8_t quantile_i = 0; quantile_i < sizeof( quantiles ) / sizeof( double ); quantile_i++ )
+        metrics_printf( text, "final_%s_seconds{quantile=\"%g\"} %.6f\n", name, quantiles[quantile_i],
+                        (double) histogram_percentile( histogram, quantiles[quantile_i] * 100 ) / 1e6 );
+    metrics_printf( text, "final_%s_seconds_sum %.6f\nfinal_%s_seconds_count %llu\n",
+                    name, (double) __atomic_load_n( &histogram->sum, __ATOMIC_RELAXED ) / 1e6,
+                    name, (unsigned long long) __atomic_load_n( &histogram->count, __ATOMIC_RELAXED ) );
+}
+
+/// \brief Renders the metrics of this device in the Prometheus text format.
+/// \param buffer
+/// \param size of $buffer
+/// \return length of the metrics ( truncated to $size - 1 )
+size_t metrics_render(char *buffer, size_t size)
+{
+    MetricsText text = { buffer, 0, size };
+    uint32_t buffered = 0, pending = 0, contacts = 0;
+
+    if ( 0 == size )
+        return 0;
+    buffer[0] = '\0';
+
+    pthread_mutex_lock( &messagesBufferLock );
+        for ( messages_head_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+        {
+            if ( 0 == MESSAGES_BUFFER[message_i].created_at )
+                continue;
+
+            buffered++;
+            pending += !MESSAGES_BUFFER[message_i].transmitted_to_recipient;
+        }
+    pthread_mutex_unlock( &messagesBufferLock );
+
+    for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
+        contacts += CLIENT_AEM_ACTIVE_LIST[device_i];
+
+    metrics_printf( &text, "# HELP final_info Device & its configuration\n# TYPE final_info gauge\n"
+                           "final_info{aem=\"%04u\",probe_backend=\"%s\"} 1\n", CLIENT_AEM, io_probe_backend_name() );
+
+    // State
+    metrics_sample( &text, "messages_buffered", "gauge", "Messages in the buffer", buffered );
+    metrics_sample( &text, "messages_pending", "gauge", "Messages in the buffer not yet delivered to their recipient", pending );
+    metrics_sample( &text, "messages_buffer_slots", "gauge", "Size of the buffer ( MESSAGES_SIZE )", MESSAGES_SIZE );
+    metrics_sample( &text, "inbox_messages", "gauge", "Messages in the inbox", __atomic_load_n( &inboxHead, __ATOMIC_RELAXED ) );
+    metrics_sample( &text, "inbox_slots", "gauge", "Size of the inbox ( INBOX_SIZE )", INBOX_SIZE );
+    metrics_sample( &text, "contacts_active", "gauge", "Devices in contact", contacts );
+    metrics_sample( &text, "communication_workers_busy", "gauge", "Communication workers serving a contact",
+                    COMMUNICATION_WORKERS_MAX - __atomic_load_n( &communicationThreadsAvailable, __ATOMIC_RELAXED ) );
+
+    // Counters
+#define METRICS_COUNTER(counter, name, help) \
+    metrics_sample( &text, name "_total", "counter", help, (double) __atomic_load_n( &messagesStats.counter, __ATOMIC_RELAXED ) )
+    METRICS_COUNTER( produced, "messages_produced", "Messages produced" );
+    METRICS_COUNTER( received, "messages_received", "Messages received & stored" );
+    METRICS_COUNTER( received_for_me, "messages_received_for_me", "Messages received for this device" );
+    METRICS_COUNTER( payloads_received, "payloads_received", "Payloads reconstructed from their fragments" );
+    METRICS_COUNTER( transmitted, "messages_transmitted", "Messages transmitted" );
+    METRICS_COUNTER( transmitted_to_recipient, "messages_transmitted_to_recipient", "Messages transmitted to their recipient" );
+    METRICS_COUNTER( duplicates, "messages_duplicates", "Received messages dropped, as already in the buffer" );
+    METRICS_COUNTER( evicted, "messages_evicted", "Messages overwritten before reaching their recipient" );
+    METRICS_COUNTER( bytes_sent, "bytes_sent", "Bytes sent in contacts" );
+    METRICS_COUNTER( bytes_received, "bytes_received", "Bytes received in contacts" );
+    METRICS_COUNTER( syscalls, "socket_syscalls", "read() / send() / sendmsg() calls on connected sockets" );
+#undef METRICS_COUNTER
+    metrics_sample( &text, "log_records_dropped_total", "counter", "Records dropped, as the logger's ring was full",
+                    (double) log_records_dropped() );
+
+    // Times
+    metrics_summary( &text, "contact_duration", "Duration of contacts", &messagesStats.contact_duration );
+    metrics_summary( &text, "transfer_time", "Time to send a message, as its share of its batch", &messagesStats.transfer_time );
+    metrics_summary( &text, "first_byte_time", "Time from the start of a contact to its first byte received", &messagesStats.first_byte_time );
+    metrics_summary( &text, "delivery_latency", "Time from creation to reception of messages for this device", &messagesStats.delivery_latency );
+
+    return text.length;
+}
+
+/// \brief Writes all $length bytes of $data to $socket_fd ( not counted in messagesStats: not a contact ). A scraper
+/// that hangs up early gets EPIPE, not the SIGPIPE that would end this process.
+static void metrics_write(int socket_fd, const char *data, size_t length)
+{
+    ssize_t n;
+
+    while ( length > 0 && ( ( n = send( socket_fd, data, length, MSG_NOSIGNAL ) ) > 0 || EINTR == errno ) )
+    {
+        if ( n > 0 )
+        {
+            data += n;
+            length -= (size_t) n;
+        }
+    }
+}
+
+/// \brief Metrics endpoint loop ( POSIX thread compatible function ). Serves the live state of this device over HTTP,
+/// on METRICS_ADDRESS : $metricsPort, in the Prometheus text format: occupancy of buffers, active contacts, counters of
+/// messagesStats & percentiles of its histograms. Returns at once if the endpoint cannot be opened.
+void metrics_worker(void)
+{
+    static char response[METRICS_RESPONSE_LEN];
+    static const char notFound[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    char request[1024], header[256];
+    struct sockaddr_in address;
+    int server_socket_fd, client_socket_fd, headerLength;
+    size_t length;
+    ssize_t n;
+
+    server_socket_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    if ( server_socket_fd < 0 )
+    {
+        perror( "metrics_worker(): socket()" );
+        return;
+    }
+    setsockopt( server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof( int ) );
+
+    bzero( (char *) &address, sizeof( address ) );
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr( METRICS_ADDRESS );
+    address.sin_port = htons( metricsPort );
+    if ( bind( server_socket_fd, (struct sockaddr *) &address, sizeof( struct sockaddr_in ) ) < 0 ||
+         listen( server_socket_fd, SOCKET_LISTEN_QUEUE_LEN ) < 0 )
+    {
+        fprintf( stderr, "metrics_worker(): cannot listen on %s:%u ( %s ). No metrics...\n", METRICS_ADDRESS, metricsPort,
+                 strerror( errno ) );
+        close( server_socket_fd );
+        return;
+    }
+    fprintf( stdout, "Metrics on http://%s:%u/metrics\n", METRICS_ADDRESS, metricsPort );
+
+    while ( 1 )
+    {
+        client_socket_fd = accept( server_socket_fd, NULL, NULL );
+        if ( client_socket_fd < 0 )
+            continue;
+        socket_set_timeouts( client_socket_fd, SOCKET_IDLE_TIMEOUT );
+
+        // Request line is all that matters: "GET /metrics HTTP/1.1"
+        n = read( client_socket_fd, request, sizeof( request ) - 1 );
+        if ( n > 0 )
+        {
+            request[n] = '\0';
+            if ( 0 == strncmp( request, "GET /metrics ", 13 ) || 0 == strncmp( request, "GET / ", 6 ) )
+            {
+                length = metrics_render( response, sizeof( response ) );
+                headerLength = snprintf( header, sizeof( header ), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                                   "Content-Length: %zu\r\nConnection: close\r\n\r\n", length );
+                metrics_write( client_socket_fd, header, (size_t) headerLength );
+                metrics_write( client_socket_fd, response, length );
+            }
+            else
+                metrics_write( client_socket_fd, notFound, sizeof( notFound ) - 1 );
+        }
+
+        close( client_socket_fd );
+    }
+}
@@ -0,0 +1,133 @@
+#include "profile.h"
+#include "histogram.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------------------------
+
+/* Timings of a thread: recorded by that thread alone */
+typedef struct profile_thread_t {
+    Histogram durations[PROFILE_FUNCTIONS_N];
+    struct profile_thread_t *next;
+} ProfileThread;
+
+static const char *profileFunctionNames[PROFILE_FUNCTIONS_N] = {
+        "explode", "implode", "isMessageEqual", "messages_push", "inbox_push", "duplicate_scan"
+};
+
+static __thread ProfileThread *profileThread;
+static ProfileThread *profileThreads;                   // timings of the threads running
+static Histogram profileExited[PROFILE_FUNCTIONS_N];    // timings of the threads that exited
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t profileKey;
+static pthread_once_t profileKeyOnce = PTHREAD_ONCE_INIT;
+
+//------------------------------------------------------------------------------------------------
+
+/// \brief Adds the values counted in $from to $into.
+/// \param into
+/// \param from
+static void profile_merge(Histogram *into, const Histogram *from)
+{
+    for ( size_t bucket_i = 0; bucket_i < HISTOGRAM_BUCKETS; bucket_i++ )
+        into->counts[bucket_i] += __atomic_load_n( &from->counts[bucket_i], __ATOMIC_RELAXED );
+    into->count += __atomic_load_n( &from->count, __ATOMIC_RELAXED );
+    into->sum += __atomic_load_n( &from->sum, __ATOMIC_RELAXED );
+}
+
+/// \brief Folds the timings of an exiting thread into $profileExited ( destructor of $profileKey ).
+/// \param thread timings of the exiting thread
+static void profile_thread_exit(void *thread)
+{
+    ProfileThread **link;
+
+    pthread_mutex_lock( &profileLock );
+        for ( link = &profileThreads; *link != thread; link = &( *link )->next )
+            ;
+        *link = ( (ProfileThread *) thread )->next;
+
+        for ( int function_i = 0; function_i < PROFILE_FUNCTIONS_N; function_i++ )
+            profile_merge( &profileExited[function_i], &( (ProfileThread *) thread )->durations[function_i] );
+    pthread_mutex_unlock( &profileLock );
+
+    free( thread );
+}
+
+/// \brief Creates $profileKey ( once ).
+static void profile_key_create(void)
+{
+    int status = pthread_key_create( &profileKey, profile_thread_exit );
+    if ( status != 0 )
+        error( status, "\tprofile_key_create(): pthread_key_create() failed" );
+}
+
+/// \brief Counts a call of $function that started at $startedAt & returns now, in the timings of the calling thread
+/// ( thread-local: no lock, no cache line shared with other threads ).
+/// \param function
+/// \param startedAt as returned by profile_now()
+void profile_record(ProfileFunction function, uint64_t startedAt)
+{
+    uint64_t finishedAt = profile_now();
+
+    // First call of this thread: its timings outlive it ( see profile_thread_exit() )
+    if ( NULL == profileThread )
+    {
+        profileThread = calloc( 1, sizeof( ProfileThread ) );
+        if ( NULL == profileThread )
+            error( ENOMEM, "\tprofile_record(): calloc() failed" );
+
+        pthread_once( &profileKeyOnce, profile_key_create );
+        pthread_setspecific( profileKey, profileThread );
+
+        pthread_mutex_lock( &profileLock );
+            profileThread->next = profileThreads;
+            profileThreads = profileThread;
+        pthread_mutex_unlock( &profileLock );
+    }
+
+    histogram_record( &profileThread->durations[function], finishedAt - startedAt );
+}
+
+/// \brief Writes the calls & distribution of times ( nsecs ) of each hot path to $stream, over all threads, whether
+/// running or exited. Writes nothing unless PROFILE is 1.
+/// \param stream
+void profile_dump(FILE *stream)
+{
+    static Histogram durations;
+    uint64_t timerCost = UINT64_MAX;
+
+    if ( 1 != PROFILE )
+        return;
+
+    // Every time includes a clock read: its cost ( the cheapest of many ) is reported along
+    for ( int read_i = 0; read_i < 1000; read_i++ )
+    {
+        uint64_t startedAt = profile_now();
+        uint64_t cost = profile_now() - startedAt;
+        if ( cost < timerCost )
+            timerCost = cost;
+    }
+
+    fprintf( stream, "\n-------------------- start: PROFILE ( nsecs ) --------------------\n" );
+    pthread_mutex_lock( &profileLock );
+        for ( int function_i = 0; function_i < PROFILE_FUNCTIONS_N; function_i++ )
+        {
+            memset( &durations, 0, sizeof( Histogram ) );
+            profile_merge( &durations, &profileExited[function_i] );
+            for ( ProfileThread *thread = profileThreads; NULL != thread; thread = thread->next )
+                profile_merge( &durations, &thread->durations[function_i] );
+
+            fprintf( stream, "\t- %-16s: %llu calls, mean = %llu, p50 = %llu, p90 = %llu, p99 = %llu, max = %llu\n",
+                     profileFunctionNames[function_i], (unsigned long long) durations.count,
+                     (unsigned long long) histogram_mean( &durations ),
+                     (unsigned long long) histogram_percentile( &durations, 50 ),
+                     (unsigned long long) histogram_percentile( &durations, 90 ),
+                     (unsigned long long) histogram_percentile( &durations, 99 ),
+                     (unsigned long long) histogram_percentile( &durations, 100 ) );
+        }
+    pthread_mutex_unlock( &profileLock );
+    fprintf( stream, "\t( each time includes a clock read of ~%llu nsecs )\n", (unsigned long long) timerCost );
+    fprintf( stream, "-------------------- end: PROFILE --------------------\n\n" );
+}
@@ -0,0 +1,462 @@
+#include "conf.h"
+#include "routing.h"
+#include "server.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------------------------
+
+extern uint32_t CLIENT_AEM;
+extern Message *MESSAGES_BUFFER;
+extern pthread_mutex_t messagesBufferLock;
+
+//------------------------------------------------------------------------------------------------
+
+typedef enum routing_policy_t {
+    ROUTING_EPIDEMIC,
+    ROUTING_SPRAY_AND_WAIT,
+    ROUTING_PROPHET
+} RoutingPolicy;
+
+static RoutingPolicy routingPolicy = ROUTING_EPIDEMIC;
+static const char *routingPolicyNames[] = { "epidemic", "spray_and_wait", "prophet" };
+
+typedef enum transmit_priority_t {
+    PRIORITY_SLOT,
+    PRIORITY_FEWEST_COPIES,
+    PRIORITY_OLDEST,
+    PRIORITY_YOUNGEST
+} TransmitPriority;
+
+static TransmitPriority transmitPriority = PRIORITY_FEWEST_COPIES;
+static const char *transmitPriorityNames[] = { "slot", "fewest_copies", "oldest", "youngest" };
+
+/* A message eligible for transmission & its sort key ( lower is sent first ) */
+typedef struct transmit_candidate_t {
+    uint64_t key;
+    uint16_t message_i;
+} TransmitCandidate;
+
+// PRoPHET: predictabilities of the running device ( point to another device's store while the simulator has it loaded )
+static Predictabilities predictabilitiesStorage;
+Predictabilities *PREDICTABILITIES = &predictabilitiesStorage;
+
+// PRoPHET: predictabilities each device advertised last time we met it
+static float peerPredictabilities[CLIENT_AEM_LIST_LENGTH][CLIENT_AEM_LIST_LENGTH];
+static pthread_mutex_t predictabilitiesLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Estimates of the contacts with each device, then of contacts with any device, for devices not met yet ( point to
+// another device's store while the simulator has it loaded )
+static ContactEstimate contactEstimatesStorage[CLIENT_AEM_LIST_LENGTH + 1];
+ContactEstimate *CONTACT_ESTIMATES = contactEstimatesStorage;
+static pthread_mutex_t estimatesLock = PTHREAD_MUTEX_INITIALIZER;
+
+bool transferPlanning = TRANSFER_PLANNING;
+
+/// \brief Ages predictabilities of this device by PROPHET_GAMMA for each PROPHET_AGING_UNIT passed since last aging.
+/// Must be called with predictabilitiesLock held.
+static void routing_prophet_age(void)
+{
+    uint64_t now = timestamp_now();
+    uint64_t units;
+    float factor = 1.0f;
+
+    if ( 0 == PREDICTABILITIES->aged_at || now < PREDICTABILITIES->aged_at )
+    {
+        PREDICTABILITIES->aged_at = now;
+        return;
+    }
+
+    units = ( now - PREDICTABILITIES->aged_at ) / PROPHET_AGING_UNIT;
+    if ( 0 == units )
+        return;
+    PREDICTABILITIES->aged_at += units * PROPHET_AGING_UNIT;
+
+    for ( uint64_t unit_i = 0; unit_i < units && factor > 0.0f; unit_i++ )
+        factor = factor * PROPHET_GAMMA < 1e-4f ? 0.0f : factor * PROPHET_GAMMA;
+
+    for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
+        PREDICTABILITIES->values[device_i] *= factor;
+}
+
+/// \brief Orders candidates by key, then by slot ( qsort() comparator ).
+static int routing_candidate_compare(const void *a, const void *b)
+{
+    const TransmitCandidate *candidateA = (const TransmitCandidate *) a;
+    const TransmitCandidate *candidateB = (const TransmitCandidate *) b;
+
+    if ( candidateA->key != candidateB->key )
+        return ( candidateA->key > candidateB->key ) - ( candidateA->key < candidateB->key );
+    return ( candidateA->message_i > candidateB->message_i ) - ( candidateA->message_i < candidateB->message_i );
+}
+
+/// \brief Sort key of $message in the selected priority order ( lower is sent first ).
+static uint64_t routing_priority_key(const Message *message)
+{
+    switch ( transmitPriority )
+    {
+        case PRIORITY_FEWEST_COPIES: return message->transmissions;
+        case PRIORITY_OLDEST: return message->created_at;
+        case PRIORITY_YOUNGEST: return UINT32_MAX - ( message->created_at & UINT32_MAX );
+        default: return 0;
+    }
+}
+
+/// \brief Moves $estimate towards $sample ( EWMA ); the first sample is taken as is.
+static float routing_ewma(float estimate, float sample, bool first)
+{
+    return first ? sample : estimate + PLANNING_EWMA_ALPHA * ( sample - estimate );
+}
+
+/// \brief Parses $N decimal digits starting at $digits.
+static uint32_t routing_digits(const char *digits, int N)
+{
+    uint32_t number = 0;
+
+    for ( int digit_i = 0; digit_i < N; digit_i++ )
+        number = 10 * number + (uint32_t) ( digits[digit_i] - '0' );
+
+    return number;
+}
+
+/// \brief Number of copies a newly produced message starts with ( Spray-and-Wait ).
+/// \return
+uint16_t routing_copies_initial(void)
+{
+    return ROUTING_SPRAY_AND_WAIT == routingPolicy ? SPRAY_AND_WAIT_COPIES : 1;
+}
+
+/// \brief Checks if the selected routing policy hands out copies along with messages ( control frame per batch ).
+/// \return TRUE for Spray-and-Wait, FALSE for epidemic routing
+bool routing_copies_enabled(void)
+{
+    return ROUTING_SPRAY_AND_WAIT == routingPolicy;
+}
+
+/// \brief Checks if the selected routing policy advertises its state to devices met ( see routing_summary() ).
+/// \return TRUE for PRoPHET, FALSE otherwise
+bool routing_summary_enabled(void)
+{
+    return ROUTING_PROPHET == routingPolicy;
+}
+
+/// \brief Number of copies of $message handed to $connectedDevice along with the message. Binary Spray-and-Wait: half
+/// of the copies go to each relay, the recipient gets the message itself ( no more copies needed ).
+/// \param message
+/// \param connectedDevice
+/// \return
+uint16_t routing_copies_handed(const Message *message, Device connectedDevice)
+{
+    if ( ROUTING_SPRAY_AND_WAIT != routingPolicy || connectedDevice.AEM == message->recipient )
+        return 1;
+
+    return message->copies / 2;
+}
+
+/// \brief Updates $estimate with the duration of a contact. A contact that ended before the device left ( both dumps
+/// completed ) only shows that the device stays at least that long: it may raise the estimate but never sets or
+/// shortens it, else each planned dump would shorten the next. Must be called with estimatesLock held.
+static void routing_contact_estimate(ContactEstimate *estimate, double duration, bool cut)
+{
+    if ( !cut && ( 0 == estimate->contacts || duration <= estimate->duration ) )
+        return;
+
+    estimate->duration = routing_ewma( estimate->duration, (float) duration, 0 == estimate->contacts );
+    if ( estimate->contacts < UINT16_MAX )
+        estimate->contacts++;
+}
+
+/// \brief Updates the estimated duration of contacts with $connectedDevice ( & with any device ) after one ended.
+/// \param connectedDevice
+/// \param duration secs the contact lasted
+/// \param cut TRUE if the contact ended because the device left ( or stalled )
+void routing_contact_observed(Device connectedDevice, double duration, bool cut)
+{
+    if ( connectedDevice.aemIndex < 0 )
+        return;
+
+    pthread_mutex_lock( &estimatesLock );
+        routing_contact_estimate( &CONTACT_ESTIMATES[ connectedDevice.aemIndex ], duration, cut );
+        routing_contact_estimate( &CONTACT_ESTIMATES[ CLIENT_AEM_LIST_LENGTH ], duration, cut );
+    pthread_mutex_unlock( &estimatesLock );
+}
+
+/// \brief Plans the dump to $connectedDevice: how many messages of the transmit queue fit in what is expected to be left
+/// of the contact, so that a short contact carries the top of the queue instead of being cut off mid-dump. The device
+/// that transmits first plans for half of it, to leave the rest to the other.
+/// \param connectedDevice
+/// \param first TRUE if the device will transmit after us, in the same contact
+/// \param elapsed secs since the contact started
+/// \return max messages to transmit ( MESSAGES_SIZE if there is nothing to plan with )
+uint16_t routing_plan(Device connectedDevice, bool first, double elapsed)
+{
+    ContactEstimate peer, any;
+    double duration, throughput, messages;
+
+    if ( !transferPlanning || connectedDevice.aemIndex < 0 )
+        return MESSAGES_SIZE;
+
+    pthread_mutex_lock( &estimatesLock );
+        peer = CONTACT_ESTIMATES[ connectedDevice.aemIndex ];
+        any = CONTACT_ESTIMATES[ CLIENT_AEM_LIST_LENGTH ];
+    pthread_mutex_unlock( &estimatesLock );
+
+    // Device not met yet: as any device
+    duration = peer.contacts > 0 ? peer.duration : any.duration;
+    throughput = peer.throughput > 0.0f ? peer.throughput : any.throughput;
+    if ( 0 == any.contacts || throughput <= 0.0 )
+        return MESSAGES_SIZE;
+
+    messages = ( first ? 0.5 : 1.0 ) * ( PLANNING_MARGIN * duration - elapsed ) * throughput / MESSAGE_SERIALIZED_LEN;
+    if ( messages < PLANNING_MESSAGES_MIN )
+        return PLANNING_MESSAGES_MIN;
+
+    return messages < MESSAGES_SIZE ? (uint16_t) messages : MESSAGES_SIZE;
+}
+
+/// \brief Updates routing state on the start of a contact with $connectedDevice. PRoPHET: predictability of meeting
+/// the device again increases.
+/// \param connectedDevice
+void routing_encounter(Device connectedDevice)
+{
+    float *predictability;
+
+    if ( ROUTING_PROPHET != routingPolicy || connectedDevice.aemIndex < 0 )
+        return;
+
+    pthread_mutex_lock( &predictabilitiesLock );
+        routing_prophet_age();
+        predictability = &PREDICTABILITIES->values[ connectedDevice.aemIndex ];
+        *predictability += ( 1.0f - *predictability ) * PROPHET_P_INIT;
+    pthread_mutex_unlock( &predictabilitiesLock );
+}
+
+/// \brief Initializes the requested routing policy, falling back to epidemic routing if $policy is unknown.
+/// \param policy "epidemic", "spray_and_wait", "prophet"
+void routing_setup(const char *policy)
+{
+    routingPolicy = ROUTING_EPIDEMIC;
+
+    if ( 0 == strcmp( "spray_and_wait", policy ) )
+        routingPolicy = ROUTING_SPRAY_AND_WAIT;
+    else if ( 0 == strcmp( "prophet", policy ) )
+        routingPolicy = ROUTING_PROPHET;
+    else if ( 0 != strcmp( "epidemic", policy ) )
+        fprintf( stderr, "routing_setup(): unknown routing policy \"%s\". Falling back to epidemic...\n", policy );
+
+    fprintf( stdout, "Routing policy = %s\n", routingPolicyNames[routingPolicy] );
+}
+
+/// \brief Initializes the requested order of transmissions, falling back to "fewest_copies" if $priority is unknown.
+/// \param priority "slot", "fewest_copies", "oldest", "youngest"
+void routing_priority_setup(const char *priority)
+{
+    transmitPriority = PRIORITY_FEWEST_COPIES;
+
+    for ( int priority_i = 0; priority_i <= PRIORITY_YOUNGEST; priority_i++ )
+    {
+        if ( 0 == strcmp( transmitPriorityNames[priority_i], priority ) )
+            transmitPriority = (TransmitPriority) priority_i;
+    }
+    if ( 0 != strcmp( transmitPriorityNames[transmitPriority], priority ) )
+        fprintf( stderr, "routing_priority_setup(): unknown priority \"%s\". Falling back to fewest_copies...\n", priority );
+
+    fprintf( stdout, "Transmit priority = %s\n", transmitPriorityNames[transmitPriority] );
+}
+
+/// \brief Builds the transmit queue for $connectedDevice: the messages of $MESSAGES_BUFFER that routing allows to
+/// transmit, those addressed to the device first ( so that they make it even through short contacts; found through
+/// the recipient index ), then the rest, each in the selected priority order:
+///     - slot: order in $MESSAGES_BUFFER
+///     - fewest_copies: least spread first ( fewest devices transmitted to )
+///     - oldest / youngest: by creation time
+/// \param connectedDevice
+/// \param queue result indexes in $MESSAGES_BUFFER ( MESSAGES_SIZE at most )
+/// \return length of $queue
+uint16_t routing_queue(Device connectedDevice, uint16_t *queue)
+{
+    TransmitCandidate candidates[MESSAGES_SIZE];
+    uint16_t candidatesN = 0, directN, pendingN;
+
+    // Messages addressed to connected device, straight from the recipient index
+    pthread_mutex_lock( &messagesBufferLock );
+        pendingN = messages_pending_for( connectedDevice, queue );
+    pthread_mutex_unlock( &messagesBufferLock );
+    for ( uint16_t pending_i = 0; pending_i < pendingN; pending_i++ )
+    {
+        if ( !routing_should_transmit( &MESSAGES_BUFFER[ queue[pending_i] ], connectedDevice ) )
+            continue;
+
+        candidates[candidatesN].key = routing_priority_key( &MESSAGES_BUFFER[ queue[pending_i] ] );
+        candidates[candidatesN++].message_i = queue[pending_i];
+    }
+    qsort( candidates, candidatesN, sizeof( TransmitCandidate ), routing_candidate_compare );
+    directN = candidatesN;
+
+    // Then the rest
+    for ( uint16_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+    {
+        const Message *message = &MESSAGES_BUFFER[message_i];
+
+        if ( connectedDevice.AEM == message->recipient || !routing_should_transmit( message, connectedDevice ) )
+            continue;
+
+        candidates[candidatesN].key = routing_priority_key( message );
+        candidates[candidatesN++].message_i = message_i;
+    }
+    qsort( candidates + directN, candidatesN - directN, sizeof( TransmitCandidate ), routing_candidate_compare );
+
+    for ( uint16_t candidate_i = 0; candidate_i < candidatesN; candidate_i++ )
+        queue[candidate_i] = candidates[candidate_i].message_i;
+
+    return candidatesN;
+}
+
+/// \brief Routing decision: checks if $message should be transmitted to $connectedDevice.
+///     - epidemic: every message is transmitted to every device that has not received it yet, until it reaches its
+///       recipient
+///     - spray_and_wait: same, but only while the message has copies to hand out ( spray phase ); the last copy is
+///       kept for its recipient ( wait phase )
+///     - prophet: same, but only to devices more likely to meet the recipient than this device is
+/// \param message
+/// \param connectedDevice
+/// \return TRUE if $message should be transmitted, FALSE otherwise
+bool routing_should_transmit(const Message *message, Device connectedDevice)
+{
+    int32_t recipient_i;
+    bool closer;
+
+    if ( 0 == message->created_at
+         || 0 != message->transmitted_devices[ connectedDevice.aemIndex ]
+         || 0 != message->transmitted_to_recipient
+         || ( message->ttl > 0 && message->created_at + message->ttl <= timestamp_now() ) )
+        return false;
+
+    if ( ROUTING_EPIDEMIC == routingPolicy || connectedDevice.AEM == message->recipient )
+        return true;
+
+    if ( ROUTING_SPRAY_AND_WAIT == routingPolicy )
+        return message->copies > 1;
+
+    recipient_i = binary_search_index( CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, message->recipient );
+    if ( recipient_i < 0 )
+        return false;
+
+    // Advertisements of other contacts are taken concurrently
+    pthread_mutex_lock( &predictabilitiesLock );
+        closer = peerPredictabilities[ connectedDevice.aemIndex ][ recipient_i ] > PREDICTABILITIES->values[ recipient_i ];
+    pthread_mutex_unlock( &predictabilitiesLock );
+
+    return closer;
+}
+
+/// \brief Serializes the routing state advertised to devices before the dumps of each contact. PRoPHET: the non-zero
+/// predictabilities of this device, as entries of AEM ( %04u ) & predictability in thousandths ( %03u ).
+/// \param frames result frames; the payload of each one starts at [1] ( [0] is left to the caller, for the frame type )
+/// \param framesMax
+/// \return number of frames used, 0 if the selected routing policy advertises nothing
+uint16_t routing_summary(char frames[][MESSAGE_SERIALIZED_LEN], uint16_t framesMax)
+{
+    uint16_t framesN = 0;
+    size_t offset = MESSAGE_SERIALIZED_LEN;
+
+    if ( ROUTING_PROPHET != routingPolicy )
+        return 0;
+
+    pthread_mutex_lock( &predictabilitiesLock );
+        routing_prophet_age();
+
+        for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
+        {
+            uint32_t thousandths = (uint32_t) ( 1000.0f * PREDICTABILITIES->values[device_i] );
+            if ( 0 == thousandths )
+                continue;
+
+            // Next frame ( keep a '\0' after the last entry )
+            if ( offset + 7 >= MESSAGE_SERIALIZED_LEN )
+            {
+                if ( framesN == framesMax )
+                    break;
+                memset( frames[framesN++], 0, MESSAGE_SERIALIZED_LEN );
+                offset = 1;
+            }
+
+            snprintf( frames[framesN - 1] + offset, 8, "%04u%03u", CLIENT_AEM_LIST[device_i] % 10000,
+                      thousandths > 999 ? 999 : thousandths );
+            offset += 7;
+        }
+    pthread_mutex_unlock( &predictabilitiesLock );
+
+    return framesN;
+}
+
+/// \brief Handles the routing state advertised by $connectedDevice ( see routing_summary() ). PRoPHET: keeps the
+/// device's predictabilities & updates ours transitively ( if the device is likely to meet X, so are we ).
+/// \param connectedDevice
+/// \param payload frame payload
+/// \param first TRUE for the first frame of an advertisement ( previous one of the device is discarded )
+void routing_summary_receive(Device connectedDevice, const char *payload, bool first)
+{
+    float *peer;
+
+    if ( ROUTING_PROPHET != routingPolicy || connectedDevice.aemIndex < 0 )
+        return;
+
+    pthread_mutex_lock( &predictabilitiesLock );
+        peer = peerPredictabilities[ connectedDevice.aemIndex ];
+        routing_prophet_age();
+        if ( first )
+            memset( peer, 0, CLIENT_AEM_LIST_LENGTH * sizeof( float ) );
+
+        for ( const char *entry = payload; entry - payload + 7 < MESSAGE_SERIALIZED_LEN && entry[0] >= '0' && entry[0] <= '9'; entry += 7 )
+        {
+            uint32_t aem = routing_digits( entry, 4 );
+            int32_t device_i = binary_search_index( CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, aem );
+            float transitive;
+
+            if ( device_i < 0 )
+                continue;
+
+            peer[device_i] = (float) routing_digits( entry + 4, 3 ) / 1000.0f;
+            if ( CLIENT_AEM == aem )
+                continue;
+
+            transitive = PREDICTABILITIES->values[ connectedDevice.aemIndex ] * peer[device_i] * PROPHET_BETA;
+            if ( transitive > PREDICTABILITIES->values[device_i] )
+                PREDICTABILITIES->values[device_i] = transitive;
+        }
+    pthread_mutex_unlock( &predictabilitiesLock );
+}
+
+/// \brief Updates the estimated throughput towards $connectedDevice ( & towards any device ) after a dump.
+/// \param connectedDevice
+/// \param bytes transmitted & acknowledged by the device ( not just handed to the socket )
+/// \param secs from the start of the dump until they were acknowledged
+void routing_throughput_observed(Device connectedDevice, uint64_t bytes, double secs)
+{
+    ContactEstimate *peer, *any;
+    float sample;
+
+    if ( connectedDevice.aemIndex < 0 || secs <= 0.0 )
+        return;
+    sample = (float) ( (double) bytes / secs );
+
+    pthread_mutex_lock( &estimatesLock );
+        peer = &CONTACT_ESTIMATES[ connectedDevice.aemIndex ];
+        any = &CONTACT_ESTIMATES[ CLIENT_AEM_LIST_LENGTH ];
+        peer->throughput = routing_ewma( peer->throughput, sample, peer->throughput <= 0.0f );
+        any->throughput = routing_ewma( any->throughput, sample, any->throughput <= 0.0f );
+    pthread_mutex_unlock( &estimatesLock );
+}
+
+/// \brief Updates routing state of $message after it was transmitted to $connectedDevice ( e.g. copies left ).
+/// \param message
+/// \param connectedDevice
+void routing_transmitted(Message *message, Device connectedDevice)
+{
+    if ( ROUTING_SPRAY_AND_WAIT == routingPolicy && connectedDevice.AEM != message->recipient )
+        message->copies -= routing_copies_handed( message, connectedDevice );
+}
@@ -3,7 +3,16 @@
 #include "log.h"
 #include "utils.h"
 #include "communication.h"
+#include "fragment.h"
+#include "heap.h"
+#include "histogram.h"
+#include "profile.h"
+#include "span.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 //------------------------------------------------------------------------------------------------
 
@@ -14,18 +23,63 @@ extern pthread_t communicationThreads[COMMUNICATION_WORKERS_MAX];
 extern uint8_t communicationThreadsAvailable;
 
 extern uint32_t CLIENT_AEM;
+extern uint16_t socketPort;
+extern Predictabilities *PREDICTABILITIES;
+extern ContactEstimate *CONTACT_ESTIMATES;
 
 //------------------------------------------------------------------------------------------------
 
 /* messagesHead is in range: [0, $MESSAGES_SIZE - 1] */
 messages_head_t messagesHead;
 messages_head_t inboxHead;
-Message MESSAGES_BUFFER[ MESSAGES_SIZE ];
-InboxMessage INBOX[ INBOX_SIZE ];
+
+// Buffers of the running device ( point to another device's store while the simulator has it loaded )
+static Message messagesBufferStorage[ MESSAGES_SIZE ];
+static InboxMessage inboxStorage[ INBOX_SIZE ];
+Message *MESSAGES_BUFFER = messagesBufferStorage;
+InboxMessage *INBOX = inboxStorage;
+
+// Payloads whose fragments reached $INBOX: each has at least one message there, hence room for as many as it holds
+static InboxPayload payloadsStorage[ INBOX_SIZE ];
+InboxPayload *PAYLOADS = payloadsStorage;
+messages_head_t payloadsHead;
+
+// Expiry of messages with a TTL: slot of each message, keyed on created_at + ttl. Entries of overwritten messages are
+// left behind & skipped when popped, hence the room for twice the buffer's messages.
+static HeapEntry expiriesStorage[ 2 * MESSAGES_SIZE ];
+static Heap expiries = { expiriesStorage, 0, 2 * MESSAGES_SIZE, NULL };
+
+uint32_t messageTtl = MESSAGE_TTL;
+
+typedef enum eviction_policy_t {
+    EVICTION_UNSET,
+    EVICTION_BLIND,
+    EVICTION_SENT_ONLY,
+    EVICTION_MOST_REPLICATED,
+    EVICTION_OLDEST,
+    EVICTION_SHORTEST_TTL
+} EvictionPolicy;
+
+static EvictionPolicy evictionPolicy = EVICTION_UNSET;
+static const char *evictionPolicyNames[] = { "", "blind", "sent_only", "most_replicated", "oldest", "shortest_ttl" };
+
+// Eviction order of the messages of $MESSAGES_BUFFER ( policies from most_replicated on ): slot of each message, keyed
+// on the selected policy. Own messages are left out.
+static HeapEntry evictionsStorage[ MESSAGES_SIZE ];
+static size_t evictionsPositions[ MESSAGES_SIZE ];
+static Heap evictions = { evictionsStorage, 0, MESSAGES_SIZE, evictionsPositions };
+
+// Pending messages of each recipient ( points to another device's index while the simulator has its store loaded )
+static RecipientIndex recipientIndexStorage;
+static RecipientIndex *recipientIndex = &recipientIndexStorage;
 
 // Active flag for each AEM
 bool CLIENT_AEM_ACTIVE_LIST[ CLIENT_AEM_LIST_LENGTH ] = {false};
 
+// Event fd of the persistent session open with each AEM ( 0 if none: stdin is never a session's eventfd )
+int CLIENT_AEM_SESSION_LIST[ CLIENT_AEM_LIST_LENGTH ] = {0};
+static uint32_t sessionsOpen = 0;
+
 
 /// \brief Check if $device exists $activeDevices FIFO queue.
 /// \param device
@@ -65,16 +119,69 @@ void devices_remove(Device device)
         CLIENT_AEM_ACTIVE_LIST[ device.aemIndex ] = 0;
 }
 
+/// \brief Counts a fragment of a payload of $sender that reached $INBOX ( through whichever carrier ) & reconstructs the
+/// payload into $PAYLOADS once $header->dataN of its fragments did.
+/// \param sender
+/// \param header
+/// \return TRUE if the payload was just reconstructed ( by the fragment last pushed to $INBOX )
+static bool inbox_payload_push(uint32_t sender, const FragmentHeader *header)
+{
+    const char *bodies[UINT8_MAX];
+    uint16_t bodiesN = 0;
+    InboxPayload *payload = NULL;
+    FragmentHeader other;
+
+    for ( messages_head_t payload_i = 0; payload_i < payloadsHead && NULL == payload; payload_i++ )
+    {
+        if ( PAYLOADS[payload_i].sender == sender && PAYLOADS[payload_i].id == header->id &&
+             PAYLOADS[payload_i].fragmentsN == header->fragmentsN )
+            payload = &PAYLOADS[payload_i];
+    }
+    if ( NULL == payload )
+    {
+        payload = &PAYLOADS[payloadsHead++];
+        *payload = (InboxPayload){ .sender = sender, .id = header->id, .dataN = header->dataN, .fragmentsN = header->fragmentsN };
+    }
+    payload->fragmentsReceived++;
+
+    // Fragments beyond the first $dataN ones are of an already reconstructed payload
+    if ( NULL != payload->data || payload->fragmentsReceived < payload->dataN )
+        return false;
+
+    // Enough of its fragments arrived: these are looked up once
+    for ( messages_head_t inbox_message_i = 0; inbox_message_i < inboxHead && bodiesN < UINT8_MAX; inbox_message_i++ )
+    {
+        if ( INBOX[inbox_message_i].sender == sender && fragment_parse( INBOX[inbox_message_i].body, &other ) &&
+             other.id == header->id && other.fragmentsN == header->fragmentsN && other.length == header->length )
+            bodies[bodiesN++] = INBOX[inbox_message_i].body;
+    }
+
+    payload->data = malloc( header->length > 0 ? header->length : 1 );
+    if ( NULL == payload->data )
+        error( ENOMEM, "\tinbox_payload_push(): malloc() failed" );
+    if ( !fragment_decode( bodies, bodiesN, payload->data, &payload->length ) )
+    {
+        free( payload->data );
+        payload->data = NULL;
+        return false;
+    }
+    payload->saved_at = timestamp_now();
+
+    return true;
+}
+
 /// Push message to $INBOX buffer, checking for existence.
 /// \param message
 /// \param device used to keep stats of the first device that gave us our message
 void inbox_push(Message *message, Device *device)
 {
+    uint64_t profileStartedAt = PROFILE_BEGIN();
+
     // Cast Message to InboxMessage
     InboxMessage inboxMessage = {
             .sender = message->sender,
             .created_at = message->created_at,
-            .saved_at = (uint64_t) time( NULL ),
+            .saved_at = timestamp_now(),
             .first_sender = device->AEM
     };
     strcpy( inboxMessage.body, message->body );
@@ -82,13 +189,23 @@ void inbox_push(Message *message, Device *device)
     // Check if message exists
     for (uint16_t inbox_message_i = 0; inbox_message_i < inboxHead; inbox_message_i++ )
     {
-        if ( 1 == isMessageEqualInbox( inboxMessage, INBOX[inbox_message_i] ) )
+        if ( 1 == isMessageEqualInbox( &inboxMessage, &INBOX[inbox_message_i] ) )
+        {
+            PROFILE_END( PROFILE_INBOX_PUSH, profileStartedAt );
             return;
+        }
 
         if ( INBOX[inbox_message_i].created_at == 0 )
             break;
     }
 
+    // Inbox full
+    if ( INBOX_SIZE == inboxHead )
+    {
+        PROFILE_END( PROFILE_INBOX_PUSH, profileStartedAt );
+        return;
+    }
+
     // Place message at buffer's head
     memcpy((void *) ( INBOX + inboxHead ), (void *) &inboxMessage, sizeof( InboxMessage ) );
 
@@ -96,15 +213,190 @@ void inbox_push(Message *message, Device *device)
     inboxHead++;
 
     // Update stats
-    messagesStats.received_for_me++;
+    stats_add( received_for_me, 1 );
+    histogram_record( &messagesStats.delivery_latency,
+                      inboxMessage.saved_at > inboxMessage.created_at ? ( inboxMessage.saved_at - inboxMessage.created_at ) * 1000000 : 0 );
+
+    // Fragment of a payload
+    FragmentHeader header;
+    if ( fragment_parse( inboxMessage.body, &header ) && inbox_payload_push( inboxMessage.sender, &header ) )
+        stats_add( payloads_received, 1 );
+
+    PROFILE_END( PROFILE_INBOX_PUSH, profileStartedAt );
+}
+
+/// \brief Resolves the name of an eviction policy.
+/// \param policy
+/// \return EVICTION_UNSET if $policy is unknown
+static EvictionPolicy messages_eviction_resolve(const char *policy)
+{
+    for ( int policy_i = EVICTION_BLIND; policy_i <= EVICTION_SHORTEST_TTL; policy_i++ )
+    {
+        if ( 0 == strcmp( evictionPolicyNames[policy_i], policy ) )
+            return (EvictionPolicy) policy_i;
+    }
+
+    return EVICTION_UNSET;
+}
+
+/// \brief Eviction key of $MESSAGES_BUFFER[$message_i] in the selected policy ( lower is evicted first ). Holes &
+/// messages already delivered to their recipient come first, since they are of no use to anyone.
+/// \param message_i
+/// \return
+static uint64_t messages_eviction_key(messages_head_t message_i)
+{
+    const Message *message = &MESSAGES_BUFFER[message_i];
+
+    if ( 0 == message->created_at || message->transmitted_to_recipient )
+        return 0;
+
+    switch ( evictionPolicy )
+    {
+        case EVICTION_MOST_REPLICATED: return 1 + UINT16_MAX - message->transmissions;
+        case EVICTION_OLDEST: return message->created_at;
+        default: return message->ttl > 0 ? message->created_at + message->ttl : UINT64_MAX;
+    }
+}
+
+/// \brief Initializes the requested eviction policy, falling back to "blind" if $policy is unknown:
+///     - blind: overwrite the message at $messagesHead
+///     - sent_only: overwrite the next hole or transmitted message from $messagesHead on
+///     - most_replicated: evict the message transmitted to the most devices first
+///     - oldest: evict the oldest message first
+///     - shortest_ttl: evict the message closest to expiring first ( those that never expire last )
+/// Every policy but blind & sent_only fills holes & drops messages delivered to their recipient first, and evicts own
+/// messages ( produced by this device ) only once nothing else is left.
+/// \param policy
+void messages_eviction_setup(const char *policy)
+{
+    evictionPolicy = messages_eviction_resolve( policy );
+    if ( EVICTION_UNSET == evictionPolicy )
+    {
+        fprintf( stderr, "messages_eviction_setup(): unknown eviction policy \"%s\". Falling back to blind...\n", policy );
+        evictionPolicy = EVICTION_BLIND;
+    }
+
+    messages_eviction_rebuild();
+    fprintf( stdout, "Eviction policy = %s\n", evictionPolicyNames[evictionPolicy] );
+}
+
+/// \brief Places $MESSAGES_BUFFER[$message_i] in the eviction order anew, after it changed.
+/// \param message_i
+void messages_eviction_update(messages_head_t message_i)
+{
+    if ( evictionPolicy < EVICTION_MOST_REPLICATED )
+        return;
+
+    if ( MESSAGES_BUFFER[message_i].created_at > 0 && CLIENT_AEM == MESSAGES_BUFFER[message_i].sender )
+        heap_remove( &evictions, message_i );
+    else
+        heap_update( &evictions, message_i, messages_eviction_key( message_i ) );
+}
+
+/// \brief Rebuilds the eviction order from the messages of $MESSAGES_BUFFER.
+void messages_eviction_rebuild(void)
+{
+    heap_clear( &evictions );
+    for ( messages_head_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+        messages_eviction_update( message_i );
+}
+
+/// \brief Lists $MESSAGES_BUFFER[$message_i] under its recipient, if it is one of CLIENT_AEM_LIST.
+/// \param message_i
+static void messages_index_add(messages_head_t message_i)
+{
+    int32_t recipient_i = binary_search_index( CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, MESSAGES_BUFFER[message_i].recipient );
+
+    if ( recipient_i < 0 )
+        return;
+
+    recipientIndex->recipients[message_i] = recipient_i + 1;
+    recipientIndex->prev[message_i] = 0;
+    recipientIndex->next[message_i] = recipientIndex->heads[recipient_i];
+    if ( 0 != recipientIndex->heads[recipient_i] )
+        recipientIndex->prev[ recipientIndex->heads[recipient_i] - 1 ] = message_i + 1;
+    recipientIndex->heads[recipient_i] = message_i + 1;
+}
+
+/// \brief Unlists $MESSAGES_BUFFER[$message_i] from its recipient's pending messages ( no-op if not listed ).
+/// \param message_i
+void messages_index_remove(messages_head_t message_i)
+{
+    int32_t recipient_i = recipientIndex->recipients[message_i] - 1;
+    messages_head_t prev = recipientIndex->prev[message_i];
+    messages_head_t next = recipientIndex->next[message_i];
+
+    if ( recipient_i < 0 )
+        return;
+
+    if ( 0 != prev )
+        recipientIndex->next[prev - 1] = next;
+    else
+        recipientIndex->heads[recipient_i] = next;
+    if ( 0 != next )
+        recipientIndex->prev[next - 1] = prev;
+
+    recipientIndex->recipients[message_i] = 0;
+}
+
+/// \brief Finds the messages of $MESSAGES_BUFFER pending for $device as their recipient, in O(pending).
+/// \param device
+/// \param slots result slots in $MESSAGES_BUFFER ( room for MESSAGES_SIZE )
+/// \return number of messages found
+uint16_t messages_pending_for(Device device, uint16_t *slots)
+{
+    uint16_t slotsN = 0;
+
+    if ( device.aemIndex < 0 )
+        return 0;
+
+    for ( messages_head_t link = recipientIndex->heads[device.aemIndex]; 0 != link && slotsN < MESSAGES_SIZE;
+          link = recipientIndex->next[link - 1] )
+        slots[slotsN++] = link - 1;
+
+    return slotsN;
+}
+
+/// \brief Schedules expiry of $MESSAGES_BUFFER[$message_i], if it has a TTL.
+/// \param message_i
+static void messages_expiry_schedule(messages_head_t message_i)
+{
+    const Message *message = &MESSAGES_BUFFER[message_i];
+
+    if ( 0 == message->ttl )
+        return;
+
+    // Full of entries of overwritten messages: start over from the messages in the buffer
+    if ( false == heap_push( &expiries, (HeapEntry){ message->created_at + message->ttl, message_i } ) )
+    {
+        heap_clear( &expiries );
+        for ( messages_head_t slot_i = 0; slot_i < MESSAGES_SIZE; slot_i++ )
+        {
+            if ( MESSAGES_BUFFER[slot_i].created_at > 0 && MESSAGES_BUFFER[slot_i].ttl > 0 )
+                heap_push( &expiries, (HeapEntry){ MESSAGES_BUFFER[slot_i].created_at + MESSAGES_BUFFER[slot_i].ttl, slot_i } );
+        }
+    }
 }
 
 /// \brief Push $message to $messages circle buffer. Updates $messageHead acc. to selected override policy.
 /// \param message
 void messages_push(Message *message)
 {
+    uint64_t profileStartedAt = PROFILE_BEGIN();
+    uint64_t span = span_begin();
+
+    if ( EVICTION_UNSET == evictionPolicy )
+    {
+        evictionPolicy = messages_eviction_resolve( MESSAGES_PUSH_OVERRIDE_POLICY );
+        messages_eviction_rebuild();
+    }
+
     // Find where to place new message
-    if ( 0 == strcmp( "sent_only", MESSAGES_PUSH_OVERRIDE_POLICY ) )
+    if ( evictionPolicy >= EVICTION_MOST_REPLICATED && 0 != evictions.length )
+    {
+        messagesHead = (messages_head_t) heap_peek( &evictions )->value;
+    }
+    else if ( EVICTION_SENT_ONLY == evictionPolicy )
     {
         messages_head_t messagesHeadOriginal = messagesHead;
 
@@ -134,13 +426,149 @@ void messages_push(Message *message)
     }
 
     // Place message at buffer's head
+    if ( MESSAGES_BUFFER[messagesHead].created_at > 0 && !MESSAGES_BUFFER[messagesHead].transmitted_to_recipient )
+        stats_add( evicted, 1 );
+    messages_index_remove( messagesHead );
     memcpy((void *) (MESSAGES_BUFFER + messagesHead ), (void *) message, sizeof( Message ) );
+    messages_index_add( messagesHead );
+    messages_expiry_schedule( messagesHead );
+    messages_eviction_update( messagesHead );
 
     // Increment head
     if ( ++messagesHead == MESSAGES_SIZE )
     {
         messagesHead = 0;
     }
+
+    // Wake up open sessions to push new message
+    sessions_notify();
+    span_end( "messages_push", span );
+    PROFILE_END( PROFILE_MESSAGES_PUSH, profileStartedAt );
+}
+
+/// \brief Drops messages of $MESSAGES_BUFFER that expired by $now, leaving holes in their slots.
+/// \param now timestamp
+/// \return number of messages dropped
+uint16_t messages_expire(uint64_t now)
+{
+    const HeapEntry *next;
+    HeapEntry entry;
+    uint16_t expired = 0;
+
+    while ( NULL != ( next = heap_peek( &expiries ) ) && next->key <= now )
+    {
+        Message *message;
+
+        heap_pop( &expiries, &entry );
+        message = &MESSAGES_BUFFER[entry.value];
+
+        // Slot may have been overwritten since
+        if ( message->created_at > 0 && message->ttl > 0 && message->created_at + message->ttl <= now )
+        {
+            message->created_at = 0;
+            messages_index_remove( entry.value );
+            messages_eviction_update( entry.value );
+            expired++;
+        }
+    }
+
+    return expired;
+}
+
+/// \brief Expiry loop. Drops expired messages of $MESSAGES_BUFFER as soon as they expire ( at most
+/// MESSAGES_EXPIRY_INTERVAL later ), so that they neither take up slots nor airtime.
+void messages_expiry_worker(void)
+{
+    const HeapEntry *next;
+    uint64_t now, wait;
+
+    while ( 1 )
+    {
+        now = timestamp_now();
+
+        pthread_mutex_lock( &messagesBufferLock );
+            messages_expire( now );
+            next = heap_peek( &expiries );
+            wait = ( NULL != next && next->key > now && ( next->key - now ) * 1000 < MESSAGES_EXPIRY_INTERVAL ) ?
+                ( next->key - now ) * 1000 : MESSAGES_EXPIRY_INTERVAL;
+        pthread_mutex_unlock( &messagesBufferLock );
+
+        nanosleep( &(struct timespec){ .tv_sec = wait / 1000, .tv_nsec = ( wait % 1000 ) * 1000000 }, NULL );
+    }
+}
+
+/// \brief Notify all open persistent sessions that new messages arrived in $MESSAGES_BUFFER.
+void sessions_notify(void)
+{
+    if ( 0 == sessionsOpen )
+        return;
+
+    for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
+    {
+        if ( CLIENT_AEM_SESSION_LIST[device_i] > 0 )
+            write( CLIENT_AEM_SESSION_LIST[device_i], &(uint64_t){ 1 }, sizeof( uint64_t ) );
+    }
+}
+
+/// \brief Register the persistent session with $device, to be notified through $event_fd on new messages.
+/// \param device
+/// \param event_fd
+void sessions_register(Device device, int event_fd)
+{
+    device.aemIndex = resolveAemIndex( device );
+    if ( device.aemIndex > -1 )
+    {
+        sessionsOpen += ( 0 == CLIENT_AEM_SESSION_LIST[ device.aemIndex ] );
+        CLIENT_AEM_SESSION_LIST[ device.aemIndex ] = event_fd;
+    }
+}
+
+/// \brief Unregister the persistent session with $device.
+/// \param device
+void sessions_unregister(Device device)
+{
+    device.aemIndex = resolveAemIndex( device );
+    if ( device.aemIndex > -1 )
+    {
+        sessionsOpen -= ( 0 != CLIENT_AEM_SESSION_LIST[ device.aemIndex ] );
+        CLIENT_AEM_SESSION_LIST[ device.aemIndex ] = 0;
+    }
+}
+
+/// \brief Makes $store the store of the running device.
+/// \param store
+void store_load(const Store *store)
+{
+    CLIENT_AEM = store->aem;
+    MESSAGES_BUFFER = store->messages;
+    messagesHead = store->messagesHead;
+    INBOX = store->inbox;
+    inboxHead = store->inboxHead;
+    PAYLOADS = store->payloads;
+    payloadsHead = store->payloadsHead;
+    PREDICTABILITIES = store->predictabilities;
+    expiries = store->expiries;
+    recipientIndex = store->recipients;
+    evictions = store->evictions;
+    CONTACT_ESTIMATES = store->estimates;
+}
+
+/// \brief Saves the store of the running device ( as modified since store_load() ) back to $store.
+/// \param store
+void store_save(Store *store)
+{
+    store->aem = CLIENT_AEM;
+    store->messages = MESSAGES_BUFFER;
+    store->messagesHead = messagesHead;
+    store->inbox = INBOX;
+    store->inboxHead = inboxHead;
+    store->payloads = PAYLOADS;
+    store->payloadsHead = payloadsHead;
+    store->predictabilities = PREDICTABILITIES;
+    store->expiries = expiries;
+    store->recipients = recipientIndex;
+    store->evictions = evictions;
+    store->estimates = CONTACT_ESTIMATES;
 }
 
 /// \brief Main server loop. Calls communication_thread() on each new connection.
@@ -161,7 +589,7 @@ void listening_worker()
     bzero((char *)&serverAddress, sizeof(serverAddress));
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_addr.s_addr = inet_addr( aem2ip( CLIENT_AEM ) );
-    serverAddress.sin_port = htons((unsigned short)SOCKET_PORT );
+    serverAddress.sin_port = htons((unsigned short)socketPort );
 
     // setsockopt: Handy debugging trick that lets us rerun the server immediately after we kill it;
     // otherwise we have to wait about 20 secs. Eliminates "ERROR on binding: Address already in use" error.
@@ -186,6 +614,9 @@ void listening_worker()
         if (client_socket_fd < 0)
             error(client_socket_fd, "ERROR on accept");
 
+        // Bound every read() / send() with the connected device
+        socket_set_timeouts( client_socket_fd, SOCKET_IDLE_TIMEOUT );
+
         // Connected > OffLoad to communication worker
         //  - get client address
         char ip[INET_ADDRSTRLEN];
@@ -197,11 +628,12 @@ void listening_worker()
                 .AEM = clientAem,
                 .aemIndex = binary_search_index( CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, clientAem )
         };
-        CommunicationWorkerArgs args = {
-                .connected_socket_fd = (int32_t) client_socket_fd,
-                .server = true
-        };
-        memcpy( &args.connected_device, &device, sizeof( Device ) );
+        CommunicationWorkerArgs *args = malloc( sizeof( CommunicationWorkerArgs ) );    // freed by communication worker
+        if ( NULL == args )
+            error( ENOMEM, "\tserver_listen(): malloc() failed" );
+        args->connected_socket_fd = (int32_t) client_socket_fd;
+        args->server = true;
+        memcpy( &args->connected_device, &device, sizeof( Device ) );
 
         //  - open thread
         if ( communicationThreadsAvailable > 0 )
@@ -212,9 +644,9 @@ void listening_worker()
                 communicationThreadsAvailable--;
             pthread_mutex_unlock( &availableThreadsLock );
 
-            args.concurrent = true;
+            args->concurrent = true;
 
-            status = pthread_create( &communicationThread, NULL, (void *) communication_worker, &args );
+            status = pthread_create( &communicationThread, NULL, (void *) communication_worker, args );
             if ( status != 0 )
                 error( status, "\tserver_listen(): pthread_create() failed" );
 
@@ -225,8 +657,8 @@ void listening_worker()
         else
         {
             // run in main thread
-            args.concurrent = false;
-            communication_worker( &args );
+            args->concurrent = false;
+            communication_worker( args );
         }
     }
 }
@@ -0,0 +1,198 @@
+#include "conf.h"
+#include "span.h"
+#include "types.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------------------------
+
+extern uint32_t CLIENT_AEM;
+
+//------------------------------------------------------------------------------------------------
+
+/* Events of a thread not yet written to the trace: appended by that thread alone */
+typedef struct span_thread_t {
+    char events[SPAN_THREAD_BUFFER_LEN];
+    size_t length;
+} SpanThread;
+
+static FILE *spanFile;
+static bool spanEnabled = false;    // read without $spanLock: spans cost a single branch while not traced
+static pthread_mutex_t spanLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread long spanThread;    // thread id of the calling thread, as shown by top -H
+static __thread SpanThread *spanBuffer;
+static pthread_key_t spanKey;
+static pthread_once_t spanKeyOnce = PTHREAD_ONCE_INIT;
+
+/// \brief Current time ( nsecs since the epoch ): the traces of devices running on the same host line up.
+/// \return
+static uint64_t span_now(void)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+/// \brief Appends $length bytes of $events to the trace. Writing is not interrupted by thread cancellation, so that
+/// $spanLock is never left locked.
+/// \param events
+/// \param length
+static void span_write(const char *events, size_t length)
+{
+    int cancelState;
+
+    if ( 0 == length )
+        return;
+
+    pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &cancelState );
+    pthread_mutex_lock( &spanLock );
+        if ( NULL != spanFile )
+            fwrite( events, 1, length, spanFile );
+    pthread_mutex_unlock( &spanLock );
+    pthread_setcancelstate( cancelState, NULL );
+}
+
+/// \brief Writes the events buffered by an exiting thread & frees its buffer ( destructor of $spanKey ).
+/// \param thread buffer of the exiting thread
+static void span_thread_exit(void *thread)
+{
+    span_write( ( (SpanThread *) thread )->events, ( (SpanThread *) thread )->length );
+    free( thread );
+}
+
+/// \brief Creates $spanKey ( once ).
+static void span_key_create(void)
+{
+    int status = pthread_key_create( &spanKey, span_thread_exit );
+    if ( status != 0 )
+        error( status, "\tspan_key_create(): pthread_key_create() failed" );
+}
+
+/// \brief Thread id of the calling thread.
+/// \return
+static long span_thread(void)
+{
+    if ( 0 == spanThread )
+        spanThread = syscall( SYS_gettid );
+
+    return spanThread;
+}
+/// \brief Opens the trace of phases of this session ( see span_end() ): a JSON array of events in the Chrome trace
+/// format, loaded as is by chrome://tracing & ui.perfetto.dev. Events are appended only: a trace cut by a crash loads
+/// too. Spans are not traced unless this is called.
+/// \param fileName "" for none
+void span_tearUp(const char *fileName)
+{
+    if ( NULL == fileName || '\0' == fileName[0] )
+        return;
+
+    spanFile = fopen( fileName, "w" );
+    if ( NULL == spanFile )
+    {
+        fprintf( stderr, "span_tearUp(): cannot open \"%s\": spans not traced\n", fileName );
+        return;
+    }
+    setvbuf( spanFile, NULL, _IOFBF, SPAN_FILE_BUFFER_LEN );
+
+    // Every event that follows starts with a separator
+    fprintf( spanFile, "[{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %u, \"tid\": 0, \"args\": {\"name\": \"AEM %04u\"}}",
+             CLIENT_AEM, CLIENT_AEM );
+    __atomic_store_n( &spanEnabled, true, __ATOMIC_RELEASE );
+}
+
+/// \brief Starts a span of the calling thread.
+/// \return its start ( nsecs ), to be passed to span_end(); 0 if spans are not traced
+uint64_t span_begin(void)
+{
+    if ( !__atomic_load_n( &spanEnabled, __ATOMIC_RELAXED ) )
+        return 0;
+
+    return span_now();
+}
+
+/// \brief Ends the span started at $startedAt by the calling thread & buffers it, as a complete event of this device
+/// ( process ) & thread. Buffered events are written to the trace by span_flush(), so that spans ended while holding
+/// a lock ( e.g. messagesBufferLock ) do no I/O; only a full buffer is written right away.
+/// \param name phase of the span ( a string literal )
+/// \param startedAt as returned by span_begin()
+void span_end(const char *name, uint64_t startedAt)
+{
+    uint64_t duration;
+    int length;
+
+    if ( 0 == startedAt )
+        return;
+
+    duration = span_now() - startedAt;
+
+    // First span of this thread: its events outlive it ( see span_thread_exit() )
+    if ( NULL == spanBuffer )
+    {
+        spanBuffer = calloc( 1, sizeof( SpanThread ) );
+        if ( NULL == spanBuffer )
+            error( ENOMEM, "\tspan_end(): calloc() failed" );
+
+        pthread_once( &spanKeyOnce, span_key_create );
+        pthread_setspecific( spanKey, spanBuffer );
+    }
+    if ( SPAN_THREAD_BUFFER_LEN - spanBuffer->length < SPAN_EVENT_LEN )
+        span_flush();
+
+    // Times of the Chrome trace format are in usecs
+    length = snprintf( spanBuffer->events + spanBuffer->length, SPAN_EVENT_LEN,
+            ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %llu.%03u, \"dur\": %llu.%03u, \"pid\": %u, \"tid\": %ld}", name,
+            (unsigned long long) ( startedAt / 1000 ), (unsigned int) ( startedAt % 1000 ),
+            (unsigned long long) ( duration / 1000 ), (unsigned int) ( duration % 1000 ), CLIENT_AEM, span_thread() );
+    if ( length > 0 && length < SPAN_EVENT_LEN )
+        spanBuffer->length += (size_t) length;
+}
+
+/// \brief Writes the spans buffered by the calling thread to the trace. Called where the thread holds no lock, e.g.
+/// at the end of each contact; the spans of a thread that exits are written anyway.
+void span_flush(void)
+{
+    if ( NULL == spanBuffer )
+        return;
+
+    span_write( spanBuffer->events, spanBuffer->length );
+    spanBuffer->length = 0;
+}
+
+/// \brief Names the calling thread in the trace.
+/// \param name
+void span_thread_name(const char *name)
+{
+    char event[SPAN_EVENT_LEN];
+    int length;
+
+    if ( !__atomic_load_n( &spanEnabled, __ATOMIC_RELAXED ) )
+        return;
+
+    length = snprintf( event, SPAN_EVENT_LEN,
+            ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %u, \"tid\": %ld, \"args\": {\"name\": \"%s\"}}",
+            CLIENT_AEM, span_thread(), name );
+    if ( length > 0 )
+        span_write( event, (size_t) length < SPAN_EVENT_LEN ? (size_t) length : SPAN_EVENT_LEN - 1 );
+}
+
+/// \brief Closes the trace, with the spans buffered by the calling thread. Spans buffered by threads still running, or
+/// ended afterwards, are not traced.
+void span_tearDown(void)
+{
+    if ( !__atomic_load_n( &spanEnabled, __ATOMIC_RELAXED ) )
+        return;
+    __atomic_store_n( &spanEnabled, false, __ATOMIC_RELAXED );
+    span_flush();
+
+    pthread_mutex_lock( &spanLock );
+        fprintf( spanFile, "\n]\n" );
+        fclose( spanFile );
+        spanFile = NULL;
+    pthread_mutex_unlock( &spanLock );
+}
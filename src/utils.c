@@ -1,24 +1,44 @@
 #include "conf.h"
 #include "utils.h"
+#include "fragment.h"
 #include "log.h"
+#include "profile.h"
+#include "routing.h"
 #include "server.h"
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <sys/socket.h>
 
 //------------------------------------------------------------------------------------------------
 
 extern uint32_t CLIENT_AEM;
-extern struct timeval CLIENT_AEM_CONN_START_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT];
-extern struct timeval CLIENT_AEM_CONN_END_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT];
-extern uint8_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH];
+extern uint32_t messageTtl;
 
-extern pthread_mutex_t messagesBufferLock, activeDevicesLock, availableThreadsLock, messagesStatsLock;
+extern pthread_mutex_t messagesBufferLock, activeDevicesLock, availableThreadsLock;
 extern MessagesStats messagesStats;
 
 extern pthread_t communicationThreads[COMMUNICATION_WORKERS_MAX];
 extern uint8_t communicationThreadsAvailable;
 
-extern Message MESSAGES_BUFFER[ MESSAGES_SIZE ];
+extern Message *MESSAGES_BUFFER;
+
+//------------------------------------------------------------------------------------------------
+
+// Addressing of devices ( overridable from the command line, e.g. to run many devices on one host )
+const char *aemIpPrefix = AEM_IP_PREFIX;
+uint16_t socketPort = SOCKET_PORT;          // port this device listens on
+uint16_t socketPeerPort = SOCKET_PORT;      // port other devices listen on
+
+// Bytes of each payload produced, in fragments ( 0: single messages; overridable from the command line )
+uint32_t payloadLength = PRODUCER_PAYLOAD_LEN;
+
+// Virtual clock ( set by the simulator; 0 to use the system's clock )
+uint64_t timestampVirtualNow = 0;
+
+// Time zone changes ( see timezone_set() ): each thread drops what timestamp2ftime() cached on the next change
+static uint32_t timezoneGeneration = 0;
 
 //------------------------------------------------------------------------------------------------
 
@@ -28,7 +48,7 @@ extern Message MESSAGES_BUFFER[ MESSAGES_SIZE ];
 const char* aem2ip(uint32_t aem)
 {
     static char ip[INET_ADDRSTRLEN];
-    sprintf( ip, "10.0.%02d.%02d", (int) aem / 100, aem % 100 );
+    snprintf( ip, INET_ADDRSTRLEN, "%s.%u.%u", aemIpPrefix, ( aem / 100 ) % 256, aem % 100 );
 
     return ip;
 }
@@ -72,6 +92,61 @@ int32_t binary_search_index(const uint32_t *haystack, size_t N, uint32_t needle)
     return -1;
 }
 
+/// \brief Check if given contact $deadline has passed.
+/// \param deadline
+/// \return TRUE if the contact must be abandoned, FALSE otherwise
+bool deadline_expired(const ContactDeadline *deadline)
+{
+    if ( NULL == deadline )
+        return false;
+
+    return 0 == deadline_remaining( deadline );
+}
+
+/// \brief Milliseconds left until contact $deadline passes.
+/// \param deadline
+/// \return 0 if passed
+int deadline_remaining(const ContactDeadline *deadline)
+{
+    struct timespec now;
+    int64_t remaining;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    remaining = (int64_t) ( deadline->expires_at.tv_sec - now.tv_sec ) * 1000000000 +
+                (int64_t) ( deadline->expires_at.tv_nsec - now.tv_nsec );
+    if ( remaining <= 0 )
+        return 0;
+
+    // Round up: less than a millisecond left is not passed yet
+    return (int) ( ( remaining + 999999 ) / 1000000 );
+}
+
+/// \brief Start a new contact deadline, $timeout milliseconds from now.
+/// \param deadline the result deadline ( passed as pointer )
+/// \param timeout in milliseconds
+void deadline_start(ContactDeadline *deadline, uint32_t timeout)
+{
+    clock_gettime( CLOCK_MONOTONIC, &deadline->expires_at );
+    deadline->expires_at.tv_sec += timeout / 1000;
+    deadline->expires_at.tv_nsec += (long) ( timeout % 1000 ) * 1000000;
+    if ( deadline->expires_at.tv_nsec >= 1000000000 )
+    {
+        deadline->expires_at.tv_sec++;
+        deadline->expires_at.tv_nsec -= 1000000000;
+    }
+}
+
+/// \brief Secs elapsed since $since, on CLOCK_MONOTONIC ( unaffected by datetime syncing, as contact deadlines ).
+/// \param since as read by clock_gettime( CLOCK_MONOTONIC )
+/// \return
+double elapsed_since(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (double) ( now.tv_sec - since->tv_sec ) + (double) ( now.tv_nsec - since->tv_nsec ) / 1e9;
+}
+
 /// \brief Un-serializes message-as-a-string, re-creating initial message.
 /// \param message the result message ( passes as a pointer )
 /// \param glue the connective character(s); acts as the separator between successive message fields
@@ -79,7 +154,9 @@ int32_t binary_search_index(const uint32_t *haystack, size_t N, uint32_t needle)
 /// \return a message struct of type message_t
 void explode(Message *message, const char *glue, char *messageSerialized)
 {
+    uint64_t profileStartedAt = PROFILE_BEGIN();
     char *messageCopy = strdup( messageSerialized );
+    void *messageCopyPointer = ( void * ) messageCopy;
 
     // Start exploding string
     message->sender = (uint32_t) strtol( strsep( &messageCopy, glue ), (char **)NULL, STRSEP_BASE_10 );
@@ -87,13 +164,18 @@ void explode(Message *message, const char *glue, char *messageSerialized)
     message->created_at = (uint64_t) strtoll(strsep(&messageCopy, glue ), (char **)NULL, STRSEP_BASE_10 );
 
     memcpy( message->body, strsep( &messageCopy, glue ), MESSAGE_BODY_LEN );
-    free( messageCopy );
+    free( messageCopyPointer );
 
     // Set message's metadata
     message->transmitted = 0;
     message->transmitted_to_recipient = 0;
+    message->copies = 1;
+    message->transmissions = 0;
+    message->ttl = messageTtl;
     for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
         message->transmitted_devices[device_i] = 0;
+
+    PROFILE_END( PROFILE_EXPLODE, profileStartedAt );
 }
 
 /// \brief Generates a new message from this client towards $recipient with $body as content.
@@ -104,11 +186,15 @@ void generateMessage(Message *message, uint32_t recipient, const char * body)
 {
     message->sender = CLIENT_AEM;
     message->recipient = recipient;
-    message->created_at = (uint64_t) time(NULL );
+    message->created_at = timestamp_now();
 
     memcpy( message->body, body, MESSAGE_BODY_LEN );
 
     message->transmitted = 0;
+    message->transmitted_to_recipient = 0;
+    message->copies = routing_copies_initial();
+    message->transmissions = 0;
+    message->ttl = messageTtl;
     for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
         message->transmitted_devices[device_i] = 0;
 }
@@ -121,20 +207,9 @@ void generateMessage(Message *message, uint32_t recipient, const char * body)
 /// \param message result message ( passed as pointer )
 void generateRandomMessage(Message *message)
 {
-    uint32_t recipient;
+    uint32_t recipient = generateRandomRecipient();
     char body[MESSAGE_BODY_LEN];
 
-    srand( (unsigned int) time(NULL) );
-
-    //  - random recipient
-    do
-    {
-        recipient = ( !strcmp( "range", CLIENT_AEM_SOURCE ) ) ?
-                    (uint32_t) (rand() % (CLIENT_AEM_RANGE_MAX + 1 - CLIENT_AEM_RANGE_MIN ) + CLIENT_AEM_RANGE_MIN):
-                    CLIENT_AEM_LIST[( rand() % CLIENT_AEM_LIST_LENGTH )];
-    }
-    while( recipient == CLIENT_AEM );
-
     //  - random body
     char ch;
     for ( int byte_i = 0; byte_i < MESSAGE_BODY_LEN - 1; byte_i ++ )
@@ -148,12 +223,55 @@ void generateRandomMessage(Message *message)
     generateMessage( message, recipient, body );
 }
 
+/// \brief Generates a new random payload of $payloadLength bytes towards a random recipient, as the messages of its
+/// fragments ( see fragment_encode() ).
+/// \param messages result messages ( room for UINT8_MAX )
+/// \return number of messages, 0 if $payloadLength is out of range
+uint16_t generateRandomPayload(Message *messages)
+{
+    uint32_t recipient = generateRandomRecipient();
+    uint8_t payload[FRAGMENT_PAYLOAD_MAX];
+    char bodies[UINT8_MAX][MESSAGE_BODY_LEN];
+    uint16_t fragmentsN;
+
+    if ( payloadLength > FRAGMENT_PAYLOAD_MAX )
+        return 0;
+
+    for ( uint32_t byte_i = 0; byte_i < payloadLength; byte_i++ )
+        payload[byte_i] = (uint8_t) rand();
+
+    fragmentsN = fragment_encode( payload, payloadLength, (uint32_t) rand(), bodies );
+    for ( uint16_t fragment_i = 0; fragment_i < fragmentsN; fragment_i++ )
+        generateMessage( &messages[fragment_i], recipient, bodies[fragment_i] );
+
+    return fragmentsN;
+}
+
+/// \brief Generates a random recipient ( any device but this one ).
+/// \return AEM
+uint32_t generateRandomRecipient(void)
+{
+    uint32_t recipient;
+
+    do
+    {
+        recipient = ( !strcmp( "range", CLIENT_AEM_SOURCE ) ) ?
+                    (uint32_t) (rand() % (CLIENT_AEM_RANGE_MAX + 1 - CLIENT_AEM_RANGE_MIN ) + CLIENT_AEM_RANGE_MIN):
+                    CLIENT_AEM_LIST[( rand() % CLIENT_AEM_LIST_LENGTH )];
+    }
+    while( recipient == CLIENT_AEM );
+
+    return recipient;
+}
+
 /// \brief Serializes a message ( of message_t type ) into a 277-characters string.
 /// \param glue the connective character(s); to be placed between successive message fields
 /// \param message the message to be serialized
 /// \param messageSerialized a string containing all message fields glued together using $glue
 void implode(const char *glue, const Message message, char *messageSerialized)
 {
+    uint64_t profileStartedAt = PROFILE_BEGIN();
+
     // Begin copying fields and adding glue
     //  - sender{glue}recipient{glue}created_at{glue}body
     // sprintf(messageSerialized, MESSAGE_SERIALIZED_LEN, "%04d%s%04d%s%010ld%s%s",
@@ -163,6 +281,8 @@ void implode(const char *glue, const Message message, char *messageSerialized)
              message.created_at, glue,
              message.body
     );
+
+    PROFILE_END( PROFILE_IMPLODE, profileStartedAt );
 }
 
 /// \brief Get a string with CSV of transmitted devices of given $message
@@ -193,10 +313,12 @@ const char* getTransmittedDevicesString( const Message* message )
 /// \param metadata show/hide metadata information from message
 void inspect(const Message message, bool metadata, FILE *fp)
 {
+    char createdAt[STRFTIME_STR_LEN];
+
     // Print main fields
     fprintf( fp, "message = {\n\tsender = %04d,\n\trecipient = %04d,\n\tcreated_at = %lu ( %s ),\n\tbody = %s\n",
             message.sender, message.recipient, message.created_at,
-            timestamp2ftime( message.created_at, "%a, %d %b %Y @ %T" ), message.body
+            timestamp2ftime( message.created_at, "%a, %d %b %Y @ %T", createdAt ), message.body
     );
 
     // Print metadata
@@ -243,31 +365,29 @@ uint32_t ip2aem(const char *ip)
 /// \param message1
 /// \param message2
 /// \return
-bool isMessageEqual(Message message1, Message message2)
+bool isMessageEqual(const Message *message1, const Message *message2)
 {
-    if ( message1.sender != message2.sender )
-        return false;
-    if ( message1.recipient != message2.recipient )
-        return false;
-    if ( message1.created_at != message2.created_at )
-        return false;
-    if ( 0 != strcmp( message1.body, message2.body ) )
-        return false;
-
-    return true;
+    uint64_t profileStartedAt = PROFILE_BEGIN();
+    bool equal = message1->sender == message2->sender &&
+                 message1->recipient == message2->recipient &&
+                 message1->created_at == message2->created_at &&
+                 0 == strcmp( message1->body, message2->body );
+
+    PROFILE_END( PROFILE_IS_MESSAGE_EQUAL, profileStartedAt );
+    return equal;
 }
 
 /// \brief Check if two messages have exactly the same values in ALL of their fields.
 /// \param message1
 /// \param message2
 /// \return
-bool isMessageEqualInbox(InboxMessage message1, InboxMessage message2)
+bool isMessageEqualInbox(const InboxMessage *message1, const InboxMessage *message2)
 {
-    if ( message1.sender != message2.sender )
+    if ( message1->sender != message2->sender )
         return false;
-    if ( message1.created_at != message2.created_at )
+    if ( message1->created_at != message2->created_at )
         return false;
-    if ( 0 != strcmp( message1.body, message2.body ) )
+    if ( 0 != strcmp( message1->body, message2->body ) )
         return false;
 
     return true;
@@ -284,6 +404,22 @@ inline int32_t resolveAemIndex( Device device )
     return device.aemIndex;
 }
 
+/// \brief Binds $socket_fd to this device's own address, so that the other device can resolve our AEM from the connection.
+/// ( Required when many devices share one host; a no-op in practice when each device has its own interface. )
+/// \param socket_fd
+void socket_bind_source( int32_t socket_fd )
+{
+    struct sockaddr_in clientAddress;
+
+    bzero((char *)&clientAddress, sizeof(clientAddress));
+    clientAddress.sin_family = AF_INET;
+    clientAddress.sin_port = 0;
+    clientAddress.sin_addr.s_addr = inet_addr( aem2ip( CLIENT_AEM ) );
+
+    // If our address is not assigned to any interface, leave source address to the kernel
+    bind( socket_fd, (struct sockaddr *)&clientAddress, sizeof(struct sockaddr_in) );
+}
+
 /// \brief Tries to connect via $socket_fd to given AEM (creating respective IP address) & port.
 /// \param socket_fd
 /// \param aem
@@ -293,6 +429,8 @@ bool socket_connect( int32_t socket_fd, uint32_t aem, uint16_t port )
 {
     struct sockaddr_in serverAddress;
     const char *ip;
+    int flags;
+    int status;
 
     if ( CLIENT_AEM == aem || devices_exists_aem( aem ) )
         return false;
@@ -305,37 +443,217 @@ bool socket_connect( int32_t socket_fd, uint32_t aem, uint16_t port )
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_port = htons( port );
     serverAddress.sin_addr.s_addr = inet_addr( ip );
-    
-    bool return_value = connect( socket_fd, (struct sockaddr *)&serverAddress, sizeof(struct sockaddr) ) >= 0 ?
-            true : false;
 
-    return return_value;
+    // Connect from our own address
+    socket_bind_source( socket_fd );
+
+    // Connect in non-blocking mode, so that an unreachable peer costs at most SOCKET_CONNECT_TIMEOUT
+    flags = fcntl( socket_fd, F_GETFL, 0 );
+    fcntl( socket_fd, F_SETFL, flags | O_NONBLOCK );
+
+    status = connect( socket_fd, (struct sockaddr *)&serverAddress, sizeof(struct sockaddr) );
+    if ( status < 0 && EINPROGRESS == errno )
+    {
+        struct pollfd pfd = { .fd = socket_fd, .events = POLLOUT };
+        int error_code = 0;
+
+        status = -1;
+        if ( 1 == poll( &pfd, 1, SOCKET_CONNECT_TIMEOUT ) &&
+             0 == getsockopt( socket_fd, SOL_SOCKET, SO_ERROR, &error_code, &(socklen_t){ sizeof( int ) } ) &&
+             0 == error_code )
+            status = 0;
+    }
+
+    fcntl( socket_fd, F_SETFL, flags );
+    if ( status < 0 )
+        return false;
+
+    // Bound every subsequent read() / send() on this socket
+    socket_set_timeouts( socket_fd, SOCKET_IDLE_TIMEOUT );
+
+    return true;
+}
+
+/// \brief Reads exactly $length bytes from $socket_fd, unless EOF, an I/O timeout or the contact $deadline is reached.
+/// \param socket_fd
+/// \param buffer
+/// \param length
+/// \param deadline contact deadline ( NULL for none )
+/// \return number of bytes actually read
+size_t socket_read( int32_t socket_fd, void *buffer, size_t length, const ContactDeadline *deadline )
+{
+    size_t total = 0, calls = 0;
+    ssize_t n;
+
+    while ( total < length )
+    {
+        if ( deadline_expired( deadline ) )
+            break;
+
+        n = read( socket_fd, (char *) buffer + total, length - total );
+        calls++;
+        if ( n < 0 && EINTR == errno )
+            continue;
+        if ( n <= 0 )
+            break;          // EOF, or no data for SOCKET_IDLE_TIMEOUT ( EAGAIN ), or connection error
+
+        total += (size_t) n;
+    }
+
+    stats_add( syscalls, calls );
+    stats_add( bytes_received, total );
+    return total;
+}
+
+/// \brief Sends exactly $length bytes to $socket_fd, unless an I/O timeout or the contact $deadline is reached.
+/// \param socket_fd
+/// \param buffer
+/// \param length
+/// \param deadline contact deadline ( NULL for none )
+/// \return TRUE if all bytes were sent, FALSE otherwise
+bool socket_send( int32_t socket_fd, const void *buffer, size_t length, const ContactDeadline *deadline )
+{
+    size_t total = 0, calls = 0;
+    ssize_t n;
+
+    while ( total < length )
+    {
+        if ( deadline_expired( deadline ) )
+            break;
+
+        n = send( socket_fd, (const char *) buffer + total, length - total, MSG_NOSIGNAL );
+        calls++;
+        if ( n < 0 && EINTR == errno )
+            continue;
+        if ( n <= 0 )
+            break;          // peer stalled for SOCKET_IDLE_TIMEOUT ( EAGAIN ), or left
+
+        total += (size_t) n;
+    }
+
+    stats_add( syscalls, calls );
+    stats_add( bytes_sent, total );
+    return total == length;
 }
 
-/// \brief Convert given UNIX timestamp to a formatted datetime string with given $format.
+/// \brief Sets receive & send timeouts of $socket_fd, so that no read() / send() stalls for more than $timeout.
+/// \param socket_fd
+/// \param timeout in milliseconds
+/// \return FALSE on error, TRUE on success
+bool socket_set_timeouts( int32_t socket_fd, uint32_t timeout )
+{
+    struct timeval tv = {
+            .tv_sec = timeout / 1000,
+            .tv_usec = ( timeout % 1000 ) * 1000
+    };
+
+    if ( setsockopt( socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const void *)&tv, sizeof(struct timeval) ) < 0 )
+    {
+        perror("setsockopt ( SO_RCVTIMEO )");
+        return false;
+    }
+    if ( setsockopt( socket_fd, SOL_SOCKET, SO_SNDTIMEO, (const void *)&tv, sizeof(struct timeval) ) < 0 )
+    {
+        perror("setsockopt ( SO_SNDTIMEO )");
+        return false;
+    }
+
+    return true;
+}
+
+/// \brief Current UNIX timestamp, from the virtual clock if one is set ( simulator ), otherwise from the system's clock.
+/// \return seconds since epoch
+uint64_t timestamp_now(void)
+{
+    return ( 0 < timestampVirtualNow ) ? timestampVirtualNow : (uint64_t) time( NULL );
+}
+
+/// \brief Sets the time zone of this process ( as the TZ environment variable ) & invalidates what timestamp2ftime()
+/// cached in any thread.
+/// \param zone e.g. "Europe/Athens"
+void timezone_set(const char *zone)
+{
+    setenv( "TZ", zone, 1 );
+    tzset();
+    __atomic_add_fetch( &timezoneGeneration, 1, __ATOMIC_RELEASE );
+}
+
+/// \brief Convert given UNIX timestamp to a formatted datetime string with given $format, into $buffer. Allocates
+/// nothing: the timestamps formatted lately by the calling thread are cached, so formatting the same second again is a
+/// copy, & so is the local date & time of its hour. Caches are keyed by the contents of $format ( any string will do )
+/// & dropped when the time zone is changed through timezone_set().
 /// \param timestamp UNIX timestamp ( uint64_t )
-/// \param format strftime-compatible format
-/// \return the resulting datetime string
-const char* timestamp2ftime( const uint64_t timestamp, const char *format )
+/// \param format strftime-compatible format ( cached if shorter than STRFTIME_FORMAT_LEN characters )
+/// \param buffer result string ( room for STRFTIME_STR_LEN characters )
+/// \return $buffer
+const char* timestamp2ftime( const uint64_t timestamp, const char *format, char *buffer )
 {
 //    // Format datetime stings in Greek
 //    setlocale( LC_TIME, "el_GR.UTF-8" );
 
-    static char* returnString;
-    struct tm* tmp;
+    static __thread struct {
+        uint64_t timestamp;
+        char format[STRFTIME_FORMAT_LEN];
+        char string[STRFTIME_STR_LEN];
+    } cache[STRFTIME_CACHE_SIZE];
+    static __thread struct tm hourTm;               // local time at the start of $hourStart
+    static __thread uint64_t hourStart = UINT64_MAX;
+    static __thread uint32_t generation;            // of the time zone cached
+    uint32_t generationNow = __atomic_load_n( &timezoneGeneration, __ATOMIC_ACQUIRE );
+    size_t formatLength = strnlen( format, STRFTIME_FORMAT_LEN );
+    bool cacheable = formatLength < STRFTIME_FORMAT_LEN;
+    uint32_t formatHash = 0;
+    uint8_t cache_i;
+    char *string;
+    time_t seconds = (time_t) timestamp;
+    struct tm tm;
+
+    // Time zone changed: whatever was cached is of the previous one
+    if ( generation != generationNow )
+    {
+        memset( cache, 0, sizeof( cache ) );
+        hourStart = UINT64_MAX;
+        generation = generationNow;
+    }
+
+    for ( size_t char_i = 0; char_i < formatLength; char_i++ )
+        formatHash = 31 * formatHash + (uint8_t) format[char_i];
+    cache_i = (uint8_t) ( ( timestamp ^ formatHash ) & ( STRFTIME_CACHE_SIZE - 1 ) );
+
+    // Same second & format as lately
+    if ( cacheable && cache[cache_i].timestamp == timestamp && 0 == memcmp( cache[cache_i].format, format, formatLength + 1 ) )
+        return memcpy( buffer, cache[cache_i].string, STRFTIME_STR_LEN );
 
-    returnString = malloc( 50 * sizeof( char ) );
-    tmp = localtime((const time_t *) &( timestamp ));
-    if ( tmp == NULL )
+    // Same hour as lately: only minutes & seconds differ ( time zone offsets change on the hour )
+    if ( timestamp - hourStart < 3600 )
     {
-        perror( "\ttimestamp2ftime(): localtime() error" );
-        exit( EXIT_FAILURE );
+        tm = hourTm;
+        tm.tm_min = (int) ( timestamp - hourStart ) / 60;
+        tm.tm_sec = (int) ( timestamp - hourStart ) % 60;
+    }
+    else
+    {
+        if ( NULL == localtime_r( &seconds, &tm ) )
+        {
+            perror( "\ttimestamp2ftime(): localtime() error" );
+            exit( EXIT_FAILURE );
+        }
+
+        hourStart = timestamp - (uint64_t) ( tm.tm_min * 60 + tm.tm_sec );
+        hourTm = tm;
+        hourTm.tm_min = hourTm.tm_sec = 0;
     }
-    if ( 0 == strftime( returnString, UINT32_MAX, format, tmp ) )
+
+    string = cacheable ? cache[cache_i].string : buffer;
+    if ( 0 == strftime( string, STRFTIME_STR_LEN, format, &tm ) )
     {
         fprintf( stderr, "\ttimestamp2ftime(): strftime() error" );
         exit( EXIT_FAILURE );
     }
+    if ( !cacheable )
+        return buffer;
+    cache[cache_i].timestamp = timestamp;
+    memcpy( cache[cache_i].format, format, formatLength + 1 );
 
-    return returnString;
-}
\ No newline at end of file
+    return memcpy( buffer, string, STRFTIME_STR_LEN );
+}
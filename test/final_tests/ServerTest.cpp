@@ -1,4 +1,5 @@
 #include <cstddef>
+#include <thread>
 #include "gtest/gtest.h"
 extern "C" {
     #include "conf.h"
@@ -6,8 +7,15 @@ extern "C" {
     #include "server.h"
     #include "utils.h"
     #include "client.h"
+    #include "fragment.h"
+    #include "histogram.h"
+    #include "io.h"
+    #include "routing.h"
+    #include "varint.h"
 
+    #include <arpa/inet.h>
     #include <sodium.h>
+    #include <unistd.h>
 }
 
 #define GOUT(STREAM) \
@@ -28,7 +36,7 @@ pthread_t communicationThreads[COMMUNICATION_WORKERS_MAX];
 uint8_t communicationThreadsAvailable = COMMUNICATION_WORKERS_MAX;
 
 static pthread_t pollingThread, producerThread, datetimeListenerThread;
-pthread_mutex_t messagesBufferLock, activeDevicesLock, availableThreadsLock, messagesStatsLock, logLock, logEventLock;
+pthread_mutex_t messagesBufferLock, activeDevicesLock, availableThreadsLock, logLock, logEventLock;
 
 //DevicesQueue activeDevicesQueue;
 MessagesStats messagesStats;
@@ -36,10 +44,9 @@ MessagesStats messagesStats;
 uint32_t CLIENT_AEM;
 uint32_t setupDatetimeAem;
 
-// Communication time for each device
-struct timeval CLIENT_AEM_CONN_START_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT] = {0, 0};
-struct timeval CLIENT_AEM_CONN_END_LIST[CLIENT_AEM_LIST_LENGTH][MAX_CONNECTIONS_WITH_SAME_CLIENT] = {0, 0};
-uint8_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH] = {0};
+// Contacts with each device & their total duration ( usecs ): distribution of durations is in messagesStats
+uint32_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH] = {0};
+uint64_t CLIENT_AEM_CONN_DURATION_LIST[CLIENT_AEM_LIST_LENGTH] = {0};
 
 //------------------------------------------------------------------------------------------------
 
@@ -47,8 +54,10 @@ uint8_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH] = {0};
 /* messagesHead is in range: [0, $MESSAGES_SIZE - 1] */
 extern messages_head_t messagesHead;
 extern messages_head_t inboxHead;
-extern Message MESSAGES_BUFFER[ MESSAGES_SIZE ];
+extern Message *MESSAGES_BUFFER;
 extern InboxMessage *INBOX;
+extern messages_head_t payloadsHead;
+extern InboxPayload *PAYLOADS;
 
 // Active flag for each AEM
 extern bool CLIENT_AEM_ACTIVE_LIST[CLIENT_AEM_LIST_LENGTH];
@@ -69,6 +78,7 @@ protected:
         messagesStats.transmitted = 0;
         messagesStats.transmitted_to_recipient = 0;
         messagesStats.produced = 0;
+        messagesStats.productions = 0;
         messagesStats.producedDelayAvg = 0.0F;
 
         // Set max execution time ( in seconds )
@@ -83,6 +93,7 @@ protected:
         // Initialize types
         messagesHead = 0;
         inboxHead = 0;
+        payloadsHead = 0;
 
         // Initialize INBOX buffer
         INBOX = (InboxMessage *) malloc(INBOX_SIZE * sizeof( InboxMessage ) );
@@ -96,17 +107,85 @@ protected:
         messagesStats.transmitted_to_recipient = 0;
     }
 
+    /// \brief Makes an empty store the store of the running device ( the original one is restored by TearDown() ), for
+    /// tests of what is kept along with $MESSAGES_BUFFER: expiries, index of recipients & eviction order.
+    void StoreFresh()
+    {
+        store_save( &storeOriginal );
+
+        store.aem = CLIENT_AEM;
+        store.messages = (Message *) calloc( MESSAGES_SIZE, sizeof( Message ) );
+        store.inbox = (InboxMessage *) calloc( INBOX_SIZE, sizeof( InboxMessage ) );
+        store.payloads = (InboxPayload *) calloc( INBOX_SIZE, sizeof( InboxPayload ) );
+        store.predictabilities = (Predictabilities *) calloc( 1, sizeof( Predictabilities ) );
+        store.expiries = Heap{ (HeapEntry *) calloc( 2 * MESSAGES_SIZE, sizeof( HeapEntry ) ), 0, 2 * MESSAGES_SIZE, nullptr };
+        store.recipients = (RecipientIndex *) calloc( 1, sizeof( RecipientIndex ) );
+        store.evictions = Heap{ (HeapEntry *) calloc( MESSAGES_SIZE, sizeof( HeapEntry ) ), 0, MESSAGES_SIZE,
+                                (size_t *) calloc( MESSAGES_SIZE, sizeof( size_t ) ) };
+        store.estimates = (ContactEstimate *) calloc( CLIENT_AEM_LIST_LENGTH + 1, sizeof( ContactEstimate ) );
+
+        store_load( &store );
+    }
+
+    /// \brief Pushes a message of $sender to $MESSAGES_BUFFER.
+    /// \param sender
+    /// \param recipient
+    /// \param createdAt
+    /// \param ttl
+    /// \return slot it was placed at ( MESSAGES_SIZE if not found )
+    static messages_head_t MessagePush(uint32_t sender, uint32_t recipient, uint64_t createdAt, uint32_t ttl)
+    {
+        Message message;
+        messages_head_t message_i;
+
+        generateRandomMessage( &message );
+        message.sender = sender;
+        message.recipient = recipient;
+        message.created_at = createdAt;
+        message.ttl = ttl;
+        messages_push( &message );
+
+        // Wherever the eviction policy chose
+        for ( message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+        {
+            if ( 0 == strcmp( MESSAGES_BUFFER[message_i].body, message.body ) )
+                break;
+        }
+        return message_i;
+    }
+
+    Store store{};
+    Store storeOriginal{};
+
 public:
 
     void TearDown( ) override
     {
+        // Restore original store
+        if ( nullptr != store.messages )
+        {
+            store_load( &storeOriginal );
+            messages_eviction_setup( MESSAGES_PUSH_OVERRIDE_POLICY );
+
+            free( store.messages );
+            free( store.inbox );
+            free( store.payloads );
+            free( store.predictabilities );
+            free( store.expiries.entries );
+            free( store.recipients );
+            free( store.evictions.entries );
+            free( store.evictions.positions );
+            free( store.estimates );
+            store = Store{};
+        }
+
         // Restore active devices
         for (bool & i : CLIENT_AEM_ACTIVE_LIST)
             i = false;
 
         // Restore $messagesHead back to 0
         //  - "erase" all MESSAGES_BUFFER
-        memset(&MESSAGES_BUFFER, 0, MESSAGES_SIZE * sizeof(Message) );
+        memset(MESSAGES_BUFFER, 0, MESSAGES_SIZE * sizeof(Message) );
         //  - set $messagesHead
         messagesHead = 0;
         inboxHead = 0;
@@ -226,6 +305,68 @@ TEST_F(ServerTest, MessagesPushSimple)
     EXPECT_EQ(messagesHead, 2);
 }
 
+/// \brief Tests server > inbox_push() function, with the fragments of a payload: any $dataN of them reconstruct it
+/// into $PAYLOADS.
+TEST_F(ServerTest, InboxPushPayload)
+{
+    uint8_t payload[1000], decoded[FRAGMENT_PAYLOAD_MAX];
+    char bodies[UINT8_MAX][MESSAGE_BODY_LEN];
+    const char *received[UINT8_MAX];
+    FragmentHeader header;
+    Device carrier = {.AEM = 8600};
+    Message message;
+    size_t length;
+    uint16_t fragmentsN, receivedN = 0;
+
+    for ( uint8_t &byte : payload )
+        byte = (uint8_t) randombytes_random();
+
+    fragmentsN = fragment_encode( payload, sizeof( payload ), 42, bodies );
+    ASSERT_TRUE( fragment_parse( bodies[0], &header ) );
+    ASSERT_GT( fragmentsN, header.dataN );
+
+    // Lose the first & last data fragments, then as many more as there are parity fragments
+    for ( uint16_t fragment_i = fragmentsN; fragment_i-- > 0; )
+    {
+        if ( 0 == fragment_i || header.dataN - 1 == fragment_i ||
+             ( fragment_i % 2 == 1 && fragment_i < 2 * ( fragmentsN - header.dataN - 2 ) ) )
+            continue;
+        if ( receivedN < header.dataN )
+            received[receivedN++] = bodies[fragment_i];
+    }
+    ASSERT_EQ( header.dataN, receivedN );
+
+    // One fragment short
+    EXPECT_FALSE( fragment_decode( received, receivedN - 1, decoded, &length ) );
+
+    // Reconstructed once $dataN fragments reached INBOX
+    messagesStats.payloads_received = 0;
+    for ( uint16_t received_i = 0; received_i < receivedN; received_i++ )
+    {
+        generateMessage( &message, CLIENT_AEM, received[received_i] );
+        message.sender = 8001;
+        inbox_push( &message, &carrier );
+
+        EXPECT_EQ( received_i + 1 == receivedN ? 1 : 0, messagesStats.payloads_received );
+    }
+
+    ASSERT_EQ( 1, payloadsHead );
+    EXPECT_EQ( 8001, PAYLOADS[0].sender );
+    EXPECT_EQ( 42, PAYLOADS[0].id );
+    EXPECT_EQ( header.dataN, PAYLOADS[0].fragmentsReceived );
+    ASSERT_NE( nullptr, PAYLOADS[0].data );
+    ASSERT_EQ( sizeof( payload ), PAYLOADS[0].length );
+    EXPECT_EQ( 0, memcmp( payload, PAYLOADS[0].data, sizeof( payload ) ) );
+
+    // Fragments beyond the first $dataN ones count along, but do not reconstruct it again
+    generateMessage( &message, CLIENT_AEM, bodies[0] );
+    message.sender = 8001;
+    inbox_push( &message, &carrier );
+    EXPECT_EQ( 1, payloadsHead );
+    EXPECT_EQ( header.dataN + 1, PAYLOADS[0].fragmentsReceived );
+    EXPECT_EQ( 1, messagesStats.payloads_received );
+}
+
 /// \brief Tests utils > messages_push() function.
 TEST_F(ServerTest, MessagesPushFull)
 {
@@ -309,6 +450,458 @@ TEST_F(ServerTest, MessagesPushFull)
     EXPECT_EQ( messagesHead, real_value );
 }
 
+/// \brief Tests server > messages_expire() function: messages are dropped in order of expiry, once it passed, & those
+/// without a TTL never.
+TEST_F(ServerTest, MessagesExpire)
+{
+    messages_head_t soon, later, never, latest;
+
+    StoreFresh();
+    soon = MessagePush( 8001, 8600, 1000, 5 );
+    never = MessagePush( 8001, 8600, 1000, 0 );
+    later = MessagePush( 8001, 8600, 1000, 10 );
+    latest = MessagePush( 8001, 8600, 990, 30 );
+
+    EXPECT_EQ( 0, messages_expire( 1004 ) );
+    EXPECT_EQ( 1, messages_expire( 1005 ) );
+    EXPECT_EQ( 0, MESSAGES_BUFFER[soon].created_at );
+    EXPECT_NE( 0, MESSAGES_BUFFER[later].created_at );
+
+    EXPECT_EQ( 0, messages_expire( 1005 ) );
+    EXPECT_EQ( 2, messages_expire( 1020 ) );
+    EXPECT_EQ( 0, MESSAGES_BUFFER[later].created_at );
+    EXPECT_EQ( 0, MESSAGES_BUFFER[latest].created_at );
+
+    EXPECT_EQ( 0, messages_expire( UINT32_MAX ) );
+    EXPECT_EQ( 1000, MESSAGES_BUFFER[never].created_at );
+}
+
+/// \brief Tests server > messages_expire() function, with slots overwritten before their message expired: the expiry
+/// left behind is skipped, & the expiries of a full heap are rebuilt from the buffer.
+TEST_F(ServerTest, MessagesExpireOverwritten)
+{
+    messages_head_t overwritten;
+
+    StoreFresh();
+    overwritten = MessagePush( 8001, 8600, 1000, 5 );
+    messagesHead = overwritten;
+    ASSERT_EQ( overwritten, MessagePush( 8001, 8600, 1000, 0 ) );
+    EXPECT_EQ( 0, messages_expire( 2000 ) );
+    EXPECT_EQ( 1000, MESSAGES_BUFFER[overwritten].created_at );
+
+    // Twice as many messages as slots ( blind eviction ): the expiries of evicted ones overflow the heap
+    for ( uint32_t message_i = 0; message_i < 2 * MESSAGES_SIZE + 1; message_i++ )
+        MessagePush( 8001, 8600, 1000 + message_i, 100 );
+
+    // Oldest message kept is the one pushed after the first $MESSAGES_SIZE + 1
+    EXPECT_EQ( 0, messages_expire( 1000 + MESSAGES_SIZE + 100 ) );
+    EXPECT_EQ( 1, messages_expire( 1000 + MESSAGES_SIZE + 101 ) );
+    EXPECT_EQ( MESSAGES_SIZE - 1, messages_expire( 1000 + 2 * MESSAGES_SIZE + 100 ) );
+    for ( messages_head_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+        EXPECT_EQ( 0, MESSAGES_BUFFER[message_i].created_at );
+}
+
+/// \brief Tests server > messages_pending_for() & messages_index_remove() functions: the index of recipients follows
+/// messages as they are pushed, overwritten, unlisted & expired.
+TEST_F(ServerTest, MessagesIndex)
+{
+    Device device1 = {.AEM = 8600}, device2 = {.AEM = 8723};
+    messages_head_t slots1[3], slots2[2];
+    uint16_t slots[MESSAGES_SIZE];
+
+    device1.aemIndex = resolveAemIndex( device1 );
+    device2.aemIndex = resolveAemIndex( device2 );
+
+    StoreFresh();
+    for ( messages_head_t &slot : slots1 )
+        slot = MessagePush( 8001, device1.AEM, 1000, 0 );
+    for ( messages_head_t &slot : slots2 )
+        slot = MessagePush( 8001, device2.AEM, 1000, 10 );
+    MessagePush( 8001, 1, 1000, 0 );    // recipient out of CLIENT_AEM_LIST: not listed
+
+    // Latest first
+    ASSERT_EQ( 3, messages_pending_for( device1, slots ) );
+    EXPECT_EQ( slots1[2], slots[0] );
+    EXPECT_EQ( slots1[1], slots[1] );
+    EXPECT_EQ( slots1[0], slots[2] );
+    ASSERT_EQ( 2, messages_pending_for( device2, slots ) );
+    EXPECT_EQ( slots2[1], slots[0] );
+    EXPECT_EQ( slots2[0], slots[1] );
+    EXPECT_EQ( 0, messages_pending_for( Device{.AEM = 1, .aemIndex = -1}, slots ) );
+
+    // Unlisted from the middle, twice
+    messages_index_remove( slots1[1] );
+    messages_index_remove( slots1[1] );
+    ASSERT_EQ( 2, messages_pending_for( device1, slots ) );
+    EXPECT_EQ( slots1[2], slots[0] );
+    EXPECT_EQ( slots1[0], slots[1] );
+
+    // Overwritten by a message to another recipient
+    messagesHead = slots1[2];
+    ASSERT_EQ( slots1[2], MessagePush( 8001, device2.AEM, 1000, 0 ) );
+    ASSERT_EQ( 1, messages_pending_for( device1, slots ) );
+    EXPECT_EQ( slots1[0], slots[0] );
+    ASSERT_EQ( 3, messages_pending_for( device2, slots ) );
+    EXPECT_EQ( slots1[2], slots[0] );
+
+    // Expired
+    EXPECT_EQ( 2, messages_expire( 1010 ) );
+    ASSERT_EQ( 1, messages_pending_for( device2, slots ) );
+    EXPECT_EQ( slots1[2], slots[0] );
+
+    messages_index_remove( slots1[0] );
+    EXPECT_EQ( 0, messages_pending_for( device1, slots ) );
+}
+
+/// \brief Tests server > messages_push() function with the "blind" & "sent_only" eviction policies: the message at
+/// $messagesHead is overwritten, or the next hole / transmitted one from there on.
+TEST_F(ServerTest, MessagesEvictionBlindSentOnly)
+{
+    StoreFresh();
+    messages_eviction_setup( "blind" );
+    for ( messages_head_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+        ASSERT_EQ( message_i, MessagePush( 8001, 8600, 1000 + message_i, 0 ) );
+    MESSAGES_BUFFER[5].transmitted = 1;
+    messagesHead = 3;
+    EXPECT_EQ( 3, MessagePush( 8001, 8600, 5000, 0 ) );
+    EXPECT_EQ( 4, messagesHead );
+
+    messages_eviction_setup( "sent_only" );
+    EXPECT_EQ( 5, MessagePush( 8001, 8600, 5000, 0 ) );
+    EXPECT_EQ( 6, messagesHead );
+
+    // Searched past the end of the buffer, from its start
+    MESSAGES_BUFFER[2].transmitted = 1;
+    EXPECT_EQ( 2, MessagePush( 8001, 8600, 5000, 0 ) );
+
+    // Nothing transmitted: overwrite at $messagesHead
+    EXPECT_EQ( 3, MessagePush( 8001, 8600, 5000, 0 ) );
+}
+
+/// \brief Tests server > messages_push() function with the "most_replicated" eviction policy: holes first, then
+/// messages delivered to their recipient, then the most transmitted messages; own messages last.
+TEST_F(ServerTest, MessagesEvictionMostReplicated)
+{
+    messages_head_t own;
+
+    StoreFresh();
+    messages_eviction_setup( "most_replicated" );
+    own = MessagePush( CLIENT_AEM, 8600, 1000, 0 );
+    for ( messages_head_t message_i = 1; message_i < MESSAGES_SIZE; message_i++ )
+        MessagePush( 8001, 8600, 1000, 0 );
+    for ( messages_head_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+        ASSERT_NE( 0, MESSAGES_BUFFER[message_i].created_at ) << "hole left at " << message_i;
+
+    for ( messages_head_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+        MESSAGES_BUFFER[message_i].transmissions = 1 + message_i % 7;
+    ASSERT_TRUE( 200 != own && 300 != own && 400 != own && 500 != own );
+    MESSAGES_BUFFER[own].transmissions = 60;
+    MESSAGES_BUFFER[200].transmissions = 50;
+    MESSAGES_BUFFER[300].transmissions = 40;
+    messages_eviction_rebuild();
+    EXPECT_EQ( 200, MessagePush( 8001, 8600, 5000, 0 ) );
+
+    // Updated in place
+    MESSAGES_BUFFER[400].transmissions = 45;
+    messages_eviction_update( 400 );
+    EXPECT_EQ( 400, MessagePush( 8001, 8600, 5000, 0 ) );
+
+    MESSAGES_BUFFER[500].transmitted_to_recipient = 1;
+    messages_eviction_update( 500 );
+    EXPECT_EQ( 500, MessagePush( 8001, 8600, 5000, 0 ) );
+
+    EXPECT_EQ( 300, MessagePush( 8001, 8600, 5000, 0 ) );
+}
+
+/// \brief Tests server > messages_push() function with the "oldest" eviction policy: the oldest message is evicted
+/// first; own messages last.
+TEST_F(ServerTest, MessagesEvictionOldest)
+{
+    messages_head_t slots[MESSAGES_SIZE];
+
+    // Created in shuffled order, $slots by age
+    StoreFresh();
+    messages_eviction_setup( "oldest" );
+    for ( uint32_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+    {
+        uint32_t age = ( message_i * 7919 ) % MESSAGES_SIZE;
+        slots[age] = MessagePush( 1 == age ? CLIENT_AEM : 8001, 8600, 1000 + age, 0 );
+    }
+
+    EXPECT_EQ( slots[0], MessagePush( 8001, 8600, 5000, 0 ) );
+    EXPECT_EQ( slots[2], MessagePush( 8001, 8600, 5000, 0 ) );
+    EXPECT_EQ( slots[3], MessagePush( 8001, 8600, 5000, 0 ) );
+
+    MESSAGES_BUFFER[slots[10]].transmitted_to_recipient = 1;
+    messages_eviction_update( slots[10] );
+    EXPECT_EQ( slots[10], MessagePush( 8001, 8600, 5000, 0 ) );
+    EXPECT_EQ( slots[4], MessagePush( 8001, 8600, 5000, 0 ) );
+}
+
+/// \brief Tests server > messages_push() function with the "shortest_ttl" eviction policy: the message closest to
+/// expiring is evicted first; those that never expire last.
+TEST_F(ServerTest, MessagesEvictionShortestTtl)
+{
+    messages_head_t slots[MESSAGES_SIZE];
+
+    // Expiring in shuffled order, $slots by expiry; $slots[0] never expires
+    StoreFresh();
+    messages_eviction_setup( "shortest_ttl" );
+    for ( uint32_t message_i = 0; message_i < MESSAGES_SIZE; message_i++ )
+    {
+        uint32_t ttl = ( message_i * 7919 ) % MESSAGES_SIZE;
+        slots[ttl] = MessagePush( 8001, 8600, 1000, ttl );
+    }
+
+    EXPECT_EQ( slots[1], MessagePush( 8001, 8600, 5000, 0 ) );
+    EXPECT_EQ( slots[2], MessagePush( 8001, 8600, 5000, 0 ) );
+
+    MESSAGES_BUFFER[slots[10]].transmitted_to_recipient = 1;
+    messages_eviction_update( slots[10] );
+    EXPECT_EQ( slots[10], MessagePush( 8001, 8600, 5000, 0 ) );
+    EXPECT_EQ( slots[3], MessagePush( 8001, 8600, 5000, 0 ) );
+
+    // Every message that expires goes before the one that never does
+    for ( uint32_t message_i = 4; message_i < MESSAGES_SIZE; message_i++ )
+    {
+        if ( 10 != message_i )
+            ASSERT_EQ( slots[message_i], MessagePush( 8001, 8600, 5000, 0 ) );
+    }
+    EXPECT_EQ( 1000, MESSAGES_BUFFER[slots[0]].created_at );
+}
+
+/// \brief Tests utils > timestamp2ftime() function: cached formatting matches strftime() within & across hours, for
+/// formats of the same contents at any address, & after the time zone is changed.
+TEST_F(ServerTest, Timestamp2ftime)
+{
+    const char *zoneOriginal = getenv( "TZ" );
+    std::string zoneRestore = nullptr == zoneOriginal ? "" : zoneOriginal;
+    char format[STRFTIME_FORMAT_LEN] = "%H:%M:%S";
+    char buffer[STRFTIME_STR_LEN];
+
+    timezone_set( "UTC" );
+    EXPECT_STREQ( "00:59:59", timestamp2ftime( 3599, format, buffer ) );
+    EXPECT_STREQ( "01:00:00", timestamp2ftime( 3600, format, buffer ) );
+    EXPECT_STREQ( "01:59:59", timestamp2ftime( 7199, format, buffer ) );
+    EXPECT_STREQ( "00:59:59", timestamp2ftime( 3599, format, buffer ) );
+    EXPECT_STREQ( "00:59:59", timestamp2ftime( 3599, format, buffer ) );
+
+    // Same address, other contents
+    strcpy( format, "%d %b %Y %H" );
+    EXPECT_STREQ( "01 Jan 1970 00", timestamp2ftime( 3599, format, buffer ) );
+    EXPECT_STREQ( "01 Jan 1970 01", timestamp2ftime( 3600, format, buffer ) );
+    EXPECT_STREQ( "01:00:00", timestamp2ftime( 3600, "%H:%M:%S", buffer ) );
+
+    // Too long to be cached
+    EXPECT_STREQ( "1970-01-01 @ 01:00:00 ( UTC )", timestamp2ftime( 3600, "%Y-%m-%d @ %H:%M:%S ( %Z )", buffer ) );
+
+    // Dropped on a change of time zone, also across the switch to daylight saving time
+    timezone_set( "Europe/Athens" );
+    EXPECT_STREQ( "02:59:59", timestamp2ftime( 3599, "%H:%M:%S", buffer ) );
+    EXPECT_STREQ( "03:00:00", timestamp2ftime( 3600, "%H:%M:%S", buffer ) );
+    EXPECT_STREQ( "02:59:59 EET", timestamp2ftime( 1616893199, "%H:%M:%S %Z", buffer ) );
+    EXPECT_STREQ( "04:00:00 EEST", timestamp2ftime( 1616893200, "%H:%M:%S %Z", buffer ) );
+    EXPECT_STREQ( "04:00:01 EEST", timestamp2ftime( 1616893201, "%H:%M:%S %Z", buffer ) );
+
+    timezone_set( "UTC" );
+    EXPECT_STREQ( "01:00:00", timestamp2ftime( 3600, "%H:%M:%S", buffer ) );
+
+    timezone_set( zoneRestore.c_str() );
+    if ( nullptr == zoneOriginal )
+    {
+        unsetenv( "TZ" );
+        tzset();
+    }
+}
+
+/// \brief Tests varint > varint_encode() / varint_decode() & zigzag_encode() / zigzag_decode() functions: known
+/// encodings, round-trips at the edges of each byte length & of 64 bits, truncated input.
+TEST_F(ServerTest, VarintZigzag)
+{
+    uint8_t bytes[VARINT_LEN_MAX];
+    uint64_t value;
+
+    ASSERT_EQ( 1, varint_encode( 0, bytes ) );
+    EXPECT_EQ( 0x00, bytes[0] );
+    ASSERT_EQ( 1, varint_encode( 127, bytes ) );
+    EXPECT_EQ( 0x7F, bytes[0] );
+    ASSERT_EQ( 2, varint_encode( 128, bytes ) );
+    EXPECT_EQ( 0x80, bytes[0] );
+    EXPECT_EQ( 0x01, bytes[1] );
+    ASSERT_EQ( 2, varint_encode( 300, bytes ) );
+    EXPECT_EQ( 0xAC, bytes[0] );
+    EXPECT_EQ( 0x02, bytes[1] );
+    ASSERT_EQ( VARINT_LEN_MAX, varint_encode( UINT64_MAX, bytes ) );
+    EXPECT_EQ( 0x01, bytes[VARINT_LEN_MAX - 1] );
+
+    for ( uint8_t bits = 0; bits <= 64; bits++ )
+    {
+        uint64_t edge = bits < 64 ? ( (uint64_t) 1 << bits ) : 0;
+        for ( uint64_t expected : { edge - 1, edge, edge + 1 } )
+        {
+            size_t length = varint_encode( expected, bytes );
+
+            ASSERT_EQ( length, varint_decode( bytes, bytes + length, &value ) ) << expected;
+            EXPECT_EQ( expected, value );
+
+            // Cut short
+            EXPECT_EQ( 0, varint_decode( bytes, bytes + length - 1, &value ) ) << expected;
+        }
+    }
+
+    // Longer than 64 bits
+    memset( bytes, 0x80, VARINT_LEN_MAX );
+    EXPECT_EQ( 0, varint_decode( bytes, bytes + VARINT_LEN_MAX, &value ) );
+
+    EXPECT_EQ( 0, zigzag_encode( 0 ) );
+    EXPECT_EQ( 1, zigzag_encode( -1 ) );
+    EXPECT_EQ( 2, zigzag_encode( 1 ) );
+    EXPECT_EQ( 3, zigzag_encode( -2 ) );
+    EXPECT_EQ( UINT64_MAX - 1, zigzag_encode( INT64_MAX ) );
+    EXPECT_EQ( UINT64_MAX, zigzag_encode( INT64_MIN ) );
+    for ( int64_t expected : { (int64_t) 0, (int64_t) -1, (int64_t) 1, (int64_t) -64, (int64_t) 64, (int64_t) -7200,
+                               (int64_t) 1616893200, INT64_MAX, INT64_MIN, INT64_MIN + 1 } )
+        EXPECT_EQ( expected, zigzag_decode( zigzag_encode( expected ) ) );
+}
+
+/// \brief Tests histogram > histogram_percentile() & histogram_mean() functions: every percentile is the highest value
+/// of its bucket, no lower than the value ranked there & higher by 1 / 2^HISTOGRAM_PRECISION_BITS of it at most.
+TEST_F(ServerTest, HistogramPercentile)
+{
+    static Histogram histogram;
+    const uint64_t largest = ( (uint64_t) 1 << HISTOGRAM_MAGNITUDE_BITS ) - 1;
+    uint64_t previous;
+
+    // Empty
+    memset( &histogram, 0, sizeof( Histogram ) );
+    EXPECT_EQ( 0, histogram_percentile( &histogram, 0 ) );
+    EXPECT_EQ( 0, histogram_percentile( &histogram, 50 ) );
+    EXPECT_EQ( 0, histogram_percentile( &histogram, 100 ) );
+    EXPECT_EQ( 0, histogram_mean( &histogram ) );
+
+    // A single value: exact below 2^( HISTOGRAM_PRECISION_BITS + 1 ), within precision above
+    for ( uint8_t bits = 0; bits <= HISTOGRAM_MAGNITUDE_BITS; bits++ )
+    {
+        uint64_t edge = (uint64_t) 1 << bits;
+        for ( uint64_t value : { edge - 1, edge, edge + 1, edge + edge / 3 } )
+        {
+            if ( value > largest )
+                continue;
+
+            memset( &histogram, 0, sizeof( Histogram ) );
+            histogram_record( &histogram, value );
+            EXPECT_EQ( histogram_percentile( &histogram, 0 ), histogram_percentile( &histogram, 100 ) ) << value;
+            EXPECT_LE( value, histogram_percentile( &histogram, 50 ) ) << value;
+            EXPECT_LE( histogram_percentile( &histogram, 50 ), value + ( value >> HISTOGRAM_PRECISION_BITS ) ) << value;
+            if ( value < 2 * ( (uint64_t) 1 << HISTOGRAM_PRECISION_BITS ) )
+                EXPECT_EQ( value, histogram_percentile( &histogram, 50 ) );
+        }
+    }
+
+    // Clamped to the largest value
+    memset( &histogram, 0, sizeof( Histogram ) );
+    histogram_record( &histogram, largest + 1000 );
+    EXPECT_EQ( largest, histogram_percentile( &histogram, 100 ) );
+
+    // 1, 2, ... 10000
+    memset( &histogram, 0, sizeof( Histogram ) );
+    for ( uint64_t value = 1; value <= 10000; value++ )
+        histogram_record( &histogram, value );
+    EXPECT_EQ( 5000, histogram_mean( &histogram ) );
+    EXPECT_EQ( 1, histogram_percentile( &histogram, 0 ) );
+    for ( uint64_t ranked : { (uint64_t) 5000, (uint64_t) 9000, (uint64_t) 9900, (uint64_t) 10000 } )
+    {
+        uint64_t percentile = histogram_percentile( &histogram, (double) ranked / 100 );
+
+        EXPECT_LE( ranked, percentile );
+        EXPECT_LE( percentile, ranked + ( ranked >> HISTOGRAM_PRECISION_BITS ) );
+    }
+
+    // Out of range
+    EXPECT_EQ( histogram_percentile( &histogram, 0 ), histogram_percentile( &histogram, -5 ) );
+    EXPECT_EQ( histogram_percentile( &histogram, 100 ), histogram_percentile( &histogram, 150 ) );
+
+    previous = 0;
+    for ( int percentile = 0; percentile <= 100; percentile++ )
+    {
+        EXPECT_LE( previous, histogram_percentile( &histogram, percentile ) ) << percentile;
+        previous = histogram_percentile( &histogram, percentile );
+    }
+}
+
+/// \brief Tests io > io_send_acked() & routing > routing_plan() functions: over a slow link, throughput is measured as
+/// fast as the peer takes the bytes ( not as fast as send() copies them ), so the plan of the next dump shrinks.
+TEST_F(ServerTest, ThroughputSlowLinkShrinksPlan)
+{
+    const size_t chunk = 10 * MESSAGE_SERIALIZED_LEN;
+    const double linkRate = (double) chunk / 0.010;         // bytes / sec: a chunk every 10 ms
+    char frames[IO_BATCH_LEN][MESSAGE_SERIALIZED_LEN];
+    struct iovec batch[IO_BATCH_LEN];
+    struct sockaddr_in address = {};
+    socklen_t addressLength = sizeof( address );
+    struct timespec startedAt;
+    int listen_fd, socket_fd, peer_fd, window = 4096;
+    uint64_t bytes = 0, acked;
+    double secs, rate;
+    Device device = {.AEM = 8600};
+
+    // Loopback connection whose peer has a small window & reads slowly: bytes stay unacknowledged in our send queue
+    listen_fd = socket( AF_INET, SOCK_STREAM, 0 );
+    ASSERT_LE( 0, listen_fd );
+    setsockopt( listen_fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof( window ) );
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    ASSERT_EQ( 0, bind( listen_fd, (struct sockaddr *) &address, sizeof( address ) ) );
+    ASSERT_EQ( 0, listen( listen_fd, 1 ) );
+    getsockname( listen_fd, (struct sockaddr *) &address, &addressLength );
+    socket_fd = socket( AF_INET, SOCK_STREAM, 0 );
+    ASSERT_EQ( 0, connect( socket_fd, (struct sockaddr *) &address, sizeof( address ) ) );
+    peer_fd = accept( listen_fd, nullptr, nullptr );
+    ASSERT_LE( 0, peer_fd );
+
+    std::thread peer( [peer_fd, chunk]() {
+        char data[10 * MESSAGE_SERIALIZED_LEN];
+        while ( read( peer_fd, data, chunk ) > 0 )
+            usleep( 10000 );
+    } );
+
+    for ( int frame_i = 0; frame_i < IO_BATCH_LEN; frame_i++ )
+    {
+        memset( frames[frame_i], 'x', MESSAGE_SERIALIZED_LEN );
+        batch[frame_i].iov_base = frames[frame_i];
+        batch[frame_i].iov_len = MESSAGE_SERIALIZED_LEN;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &startedAt );
+    for ( int batch_i = 0; batch_i < 8; batch_i++ )
+    {
+        ASSERT_TRUE( io_send_batch( socket_fd, batch, IO_BATCH_LEN, nullptr ) );
+        bytes += IO_BATCH_LEN * MESSAGE_SERIALIZED_LEN;
+    }
+    acked = io_send_acked( socket_fd, bytes, nullptr );
+    secs = elapsed_since( &startedAt );
+    rate = (double) acked / secs;
+
+    shutdown( socket_fd, SHUT_WR );
+    peer.join();
+    close( socket_fd );
+    close( peer_fd );
+    close( listen_fd );
+
+    EXPECT_EQ( bytes, acked );
+    EXPECT_LT( rate, 2 * linkRate );
+    EXPECT_GT( rate, linkRate / 4 );
+
+    // Contacts of 1 sec: about as many messages as the link carries in 80% of it, not the whole buffer
+    StoreFresh();
+    device.aemIndex = resolveAemIndex( device );
+    EXPECT_EQ( MESSAGES_SIZE, routing_plan( device, false, 0.0 ) );
+    routing_contact_observed( device, 1.0, true );
+    routing_throughput_observed( device, acked, secs );
+    EXPECT_LT( routing_plan( device, false, 0.0 ), MESSAGES_SIZE );
+    EXPECT_LE( routing_plan( device, false, 0.0 ), (uint16_t) ( PLANNING_MARGIN * 2 * linkRate / MESSAGE_SERIALIZED_LEN ) );
+    EXPECT_LE( routing_plan( device, true, 0.0 ), routing_plan( device, false, 0.0 ) / 2 + 1 );
+}
+
 
 
 
@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+#include "types.h"
+#include "varint.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//------------------------------------------------------------------------------------------------
+
+static const uint8_t *cursor;           // next byte of the log to decode
+static const uint8_t *logEnd;
+
+static int64_t utcOffset;               // secs local time of the device was ahead of UTC
+static uint64_t previousAt;             // usecs, see log_record_write_binary()
+static bool csv;
+static FILE *output;
+
+static const char *eventTypes[] = LOG_BINARY_EVENT_TYPES;
+static const char *actions[] = LOG_BINARY_ACTIONS;
+static const char *histograms[] = LOG_BINARY_HISTOGRAMS;
+
+//------------------------------------------------------------------------------------------------
+
+/// \brief Decodes a varint ( see log_binary_varint() ).
+/// \param value result
+/// \return FALSE if the log ends first
+static bool decode_varint(uint64_t *value)
+{
+    size_t length = varint_decode( cursor, logEnd, value );
+
+    cursor += length;
+    return length > 0;
+}
+
+/// \brief Decodes a zigzag varint ( see log_binary_zigzag() ).
+/// \param value result
+/// \return FALSE if the log ends first
+static bool decode_zigzag(int64_t *value)
+{
+    uint64_t zigzag;
+
+    if ( !decode_varint( &zigzag ) )
+        return false;
+
+    *value = zigzag_decode( zigzag );
+    return true;
+}
+
+/// \brief Decodes a varint that must fit in 32 bits ( AEMs, counters ).
+/// \param value result
+/// \return FALSE if the log ends first
+static bool decode_u32(uint32_t *value)
+{
+    uint64_t value64;
+
+    if ( !decode_varint( &value64 ) )
+        return false;
+
+    *value = (uint32_t) value64;
+    return true;
+}
+
+/// \brief Decodes a name ( see log_binary_name() ).
+/// \param name result ( room for $size characters )
+/// \param size
+/// \param names
+/// \param namesN
+/// \return FALSE if the log ends first
+static bool decode_name(char *name, size_t size, const char **names, uint8_t namesN)
+{
+    uint64_t length;
+
+    if ( cursor >= logEnd )
+        return false;
+
+    if ( LOG_BINARY_NAME_OTHER != *cursor )
+    {
+        snprintf( name, size, "%s", *cursor < namesN ? names[*cursor] : "unknown" );
+        cursor++;
+        return true;
+    }
+
+    cursor++;
+    if ( !decode_varint( &length ) || length > (uint64_t) ( logEnd - cursor ) )
+        return false;
+
+    snprintf( name, size, "%.*s", (int) length, (const char *) cursor );
+    cursor += length;
+    return true;
+}
+
+/// \brief Decodes two AEMs & a fingerprint ( see log_binary_message() ).
+/// \return FALSE if the log ends first
+static bool decode_message(uint32_t *aemA, uint32_t *aemB, uint32_t *fingerprint)
+{
+    if ( !decode_u32( aemA ) || !decode_u32( aemB ) || logEnd - cursor < 4 )
+        return false;
+
+    *fingerprint = (uint32_t) cursor[0] | (uint32_t) cursor[1] << 8 | (uint32_t) cursor[2] << 16 | (uint32_t) cursor[3] << 24;
+    cursor += 4;
+    return true;
+}
+
+/// \brief Formats $timestamp as the device's local time, like timestamp2ftime() did on the device.
+/// \param timestamp secs since epoch
+/// \param format strftime-compatible format
+/// \param buffer result string ( room for STRFTIME_STR_LEN characters )
+/// \return $buffer
+static const char *decode_time(int64_t timestamp, const char *format, char *buffer)
+{
+    time_t local = (time_t) ( timestamp + utcOffset );
+    struct tm tm;
+
+    gmtime_r( &local, &tm );
+    strftime( buffer, STRFTIME_STR_LEN, format, &tm );
+    return buffer;
+}
+
+/// \brief Decodes the record of $kind at $cursor & writes it out, as the line the NDJSON log would have ( bodies are
+/// replaced by "fingerprint" ) or as a CSV row.
+/// \param kind LogRecordKind
+/// \return FALSE if the log ends first ( nothing is written )
+static bool decode_record(uint8_t kind)
+{
+    char at[STRFTIME_STR_LEN], other[STRFTIME_STR_LEN], name[64], devices[6 * 256] = "";
+    uint32_t event = 0, aemA, aemB, fingerprint, values[8];
+    int64_t delta, createdAt;
+    uint64_t atUs = previousAt, value, value2;
+    uint8_t flags;
+
+    // Records of events: event & time
+    if ( kind <= LOG_RECORD_EVENT_STOP )
+    {
+        if ( !decode_u32( &event ) || !decode_zigzag( &delta ) )
+            return false;
+        atUs = previousAt + (uint64_t) delta;
+    }
+
+    switch ( kind )
+    {
+        case LOG_RECORD_EVENT_START:
+            if ( !decode_name( name, sizeof( name ), eventTypes, sizeof( eventTypes ) / sizeof( char * ) ) ||
+                 !decode_u32( &aemA ) || !decode_u32( &aemB ) )
+                return false;
+
+            decode_time( (int64_t) ( atUs / 1000000 ), csv ? "%FT%TZ" : "%H:%M:%S", at );
+            if ( csv )
+                fprintf( output, "event,%u,%s,%s,%u,%u,,,,\n", event, at, name, aemA, aemB );
+            else
+                fprintf( output, "{\"record\": \"event\", \"event\": %u, \"occured_at\": \"%s\", \"type\": \"%s\", \"server\": \"%u\", \"client\": \"%u\"}\n",
+                         event, at, name, aemA, aemB );
+            break;
+
+        case LOG_RECORD_MESSAGE:
+            if ( !decode_name( name, sizeof( name ), actions, sizeof( actions ) / sizeof( char * ) ) ||
+                 !decode_message( &aemA, &aemB, &fingerprint ) || !decode_zigzag( &createdAt ) || cursor >= logEnd )
+                return false;
+            flags = *cursor++;
+            if ( !decode_u32( &values[0] ) )
+                return false;
+            for ( uint32_t device_i = 0; device_i < values[0]; device_i++ )
+            {
+                if ( !decode_u32( &values[1] ) )
+                    return false;
+                if ( strlen( devices ) + 6 < sizeof( devices ) )
+                    sprintf( devices + strlen( devices ), "%s%04u", 0 == device_i ? "" : ",", values[1] );
+            }
+
+            decode_time( (int64_t) ( atUs / 1000000 ), "%FT%TZ", at );
+            decode_time( (int64_t) ( atUs / 1000000 ) + createdAt, "%FT%TZ", other );
+            if ( csv )
+                fprintf( output, "message,%u,%s,%s,%u,%u,%s,%08x,\"%s\",\n", event, at, name, aemA, aemB, other,
+                         fingerprint, devices );
+            else
+                fprintf( output, "{\"record\": \"message\", \"event\": %u, \"saved_at\": \"%s\", \"action\": \"%s\", \"sender\": \"%u\", \"recipient\": \"%u\", \"created_at\": \"%s\", \"fingerprint\": \"%08x\", \"transmitted\": \"%s\", \"transmitted_devices\": \"%s\", \"transmitted_to_recipient\": \"%s\"}\n",
+                         event, at, name, aemA, aemB, other, fingerprint, flags & 1 ? "TRUE" : "FALSE", devices,
+                         flags & 2 ? "TRUE" : "FALSE" );
+            break;
+
+        case LOG_RECORD_DATETIME:
+            if ( !decode_zigzag( &delta ) || !decode_zigzag( &createdAt ) )
+                return false;
+
+            decode_time( (int64_t) ( atUs / 1000000 ), "%FT%TZ", at );
+            if ( csv )
+                fprintf( output, "message,%u,%s,datetime,,,%s,,,\n", event, at,
+                         decode_time( (int64_t) ( atUs / 1000000 ) + createdAt, "%FT%TZ", other ) );
+            else
+            {
+                fprintf( output, "{\"record\": \"message\", \"event\": %u, \"saved_at\": \"%s\", \"action\": \"datetime\", ", event, at );
+                fprintf( output, "\"previous_now\": \"%s\", ", decode_time( (int64_t) ( atUs / 1000000 ) + delta, "%FT%TZ", other ) );
+                fprintf( output, "\"new_now\": \"%s\"}\n", decode_time( (int64_t) ( atUs / 1000000 ) + createdAt, "%FT%TZ", other ) );
+            }
+            break;
+
+        case LOG_RECORD_EVENT_STOP:
+            if ( !decode_zigzag( &delta ) )
+                return false;
+
+            if ( csv )
+                fprintf( output, "event_end,%u,%s,,,,,,,%f\n", event,
+                         decode_time( (int64_t) ( atUs / 1000000 ), "%FT%TZ", at ), (double) delta / 1000 );
+            else
+                fprintf( output, "{\"record\": \"event_end\", \"event\": %u, \"duration\": \"%f ms\"}\n", event,
+                         (double) delta / 1000 );
+            break;
+
+        case LOG_RECORD_SESSION:
+            if ( !decode_varint( &value ) || !decode_zigzag( &utcOffset ) || !decode_u32( &aemA ) || !decode_u32( &values[0] ) )
+                return false;
+            atUs = value;
+
+            decode_time( (int64_t) ( atUs / 1000000 ), "%FT%TZ", at );
+            if ( csv )
+                fprintf( output, "session,,%s,,%u,,,,,%f\n", at, aemA, (double) values[0] * 1000 );
+            else
+                fprintf( output, "{\"record\": \"session\", \"start\": \"%s\", \"client_aem\": \"%u\", \"requested_duration\":\"%u secs\"}\n",
+                         at, aemA, values[0] );
+            break;
+
+        case LOG_RECORD_END:
+        {
+            unsigned long long stats[12];
+
+            if ( !decode_varint( &value ) || !decode_varint( &value2 ) )
+                return false;
+            for ( uint8_t stat_i = 0; stat_i < 12; stat_i++ )
+            {
+                uint64_t stat;
+
+                if ( !decode_varint( &stat ) )
+                    return false;
+                stats[stat_i] = stat;
+            }
+
+            decode_time( (int64_t) value2, "%FT%TZ", at );
+            if ( csv )
+                fprintf( output, "end,,%s,,,,,,,%f\n", at, (double) value / 1000 );
+            else
+                fprintf( output, "{\"record\": \"end\", \"duration\": \"%f s\", \"end\": \"%s\", \"stats\": { \"produced\": \"%llu\", \"received\": \"%llu\", \"received_for_me\": \"%llu\", \"payloads_received\": \"%llu\", \"transmitted\": \"%llu\", \"transmitted_to_recipient\": \"%llu\", \"producedDelayAvg\": \"%.2fmin\", \"duplicates\": \"%llu\", \"evicted\": \"%llu\", \"bytes_sent\": \"%llu\", \"bytes_received\": \"%llu\", \"syscalls\": \"%llu\"}}\n",
+                         (double) value / 1e6, at, stats[0], stats[1], stats[2], stats[3], stats[4], stats[5],
+                         (double) stats[6] / 100, stats[7], stats[8], stats[9], stats[10], stats[11] );
+            break;
+        }
+
+        case LOG_RECORD_DEVICE:
+        {
+            double averageDuration;
+
+            if ( !decode_u32( &aemA ) || !decode_u32( &values[0] ) || !decode_varint( &value ) )
+                return false;
+
+            averageDuration = values[0] > 0 ? (double) value / 1e3 / values[0] : 0.0;
+            if ( csv )
+                fprintf( output, "device,,,,%u,,,,,%f\n", aemA, averageDuration );
+            else
+                fprintf( output, "{\"record\": \"device\", \"aem\": \"%04u\", \"connections\": \"%u\", \"average_duration\": \"%.2fms\"}\n",
+                         aemA, values[0], averageDuration );
+            break;
+        }
+
+        case LOG_RECORD_HISTOGRAM:
+        {
+            unsigned long long summary[8];
+
+            if ( !decode_name( name, sizeof( name ), histograms, sizeof( histograms ) / sizeof( char * ) ) )
+                return false;
+            for ( uint8_t summary_i = 0; summary_i < 8; summary_i++ )
+            {
+                if ( !decode_varint( &value ) )
+                    return false;
+                summary[summary_i] = value;
+            }
+
+            if ( csv )
+                fprintf( output, "histogram,,,%s,,,,,,%f\n", name, (double) summary[3] / 1e3 );
+            else
+                fprintf( output, "{\"record\": \"histogram\", \"name\": \"%s\", \"unit\": \"us\", \"count\": \"%llu\", \"mean\": \"%llu\", \"min\": \"%llu\", \"p50\": \"%llu\", \"p90\": \"%llu\", \"p99\": \"%llu\", \"p999\": \"%llu\", \"max\": \"%llu\"}\n",
+                         name, summary[0], summary[1], summary[2], summary[3], summary[4], summary[5], summary[6], summary[7] );
+            break;
+        }
+
+        case LOG_RECORD_BUFFER_MESSAGE:
+            if ( !decode_message( &aemA, &aemB, &fingerprint ) || !decode_varint( &value ) )
+                return false;
+
+            decode_time( (int64_t) value, "%FT%TZ", other );
+            if ( csv )
+                fprintf( output, "buffer_message,,,,%u,%u,%s,%08x,,\n", aemA, aemB, other, fingerprint );
+            else
+                fprintf( output, "{\"record\": \"buffer_message\", \"sender\": \"%u\", \"recipient\": \"%u\", \"created_at\": \"%s\", \"fingerprint\": \"%08x\"}\n",
+                         aemA, aemB, other, fingerprint );
+            break;
+
+        case LOG_RECORD_INBOX_MESSAGE:
+            if ( !decode_message( &aemA, &aemB, &fingerprint ) || !decode_varint( &value ) || !decode_varint( &value2 ) )
+                return false;
+
+            decode_time( (int64_t) value, "%FT%TZ", other );
+            decode_time( (int64_t) value2, "%FT%TZ", at );
+            if ( csv )
+                fprintf( output, "inbox_message,,%s,,%u,%u,%s,%08x,,\n", at, aemA, aemB, other, fingerprint );
+            else
+                fprintf( output, "{\"record\": \"inbox_message\", \"sender\": \"%u\", \"created_at\": \"%s\", \"saved_at\": \"%s\", \"fingerprint\": \"%08x\", \"first_sender\": \"%u\"}\n",
+                         aemA, other, at, fingerprint, aemB );
+            break;
+
+        case LOG_RECORD_PAYLOAD:
+            if ( !decode_u32( &aemA ) || !decode_u32( &values[0] ) || !decode_varint( &value ) || !decode_varint( &value2 ) )
+                return false;
+
+            decode_time( (int64_t) value2, "%FT%TZ", at );
+            if ( csv )
+                fprintf( output, "payload,,%s,%u,%u,,,,,\n", at, values[0], aemA );
+            else
+                fprintf( output, "{\"record\": \"payload\", \"sender\": \"%u\", \"id\": \"%u\", \"length\": \"%llu\", \"saved_at\": \"%s\"}\n",
+                         aemA, values[0], (unsigned long long) value, at );
+            break;
+
+        default:
+            return false;
+    }
+
+    previousAt = atUs;
+    return true;
+}
+
+/// \brief Renders a binary session log ( see log_format_setup() ) for reports: as the lines of the NDJSON log ( e.g. for
+/// ndjson2json ), with fingerprints instead of bodies, or as CSV with one row per record. A record cut short by a crash
+/// ends the log.
+/// \example ./Decode session1.bin > session1.ndjson
+/// \example ./Decode -c session1.bin session1.csv
+/// Options:
+///     -c          : CSV, with columns record, event, at, name ( type of event / action ), aem_a ( server / sender ),
+///                   aem_b ( client / recipient ), created_at, fingerprint, transmitted_devices, duration_ms ( device:
+///                   average of its contacts, histogram: median )
+/// \param argc
+/// \param argv
+/// \return
+int main( int argc, char **argv )
+{
+    uint8_t *log;
+    long logLength;
+    FILE *fp;
+    int option;
+
+    while ( -1 != ( option = getopt( argc, argv, "c" ) ) )
+    {
+        switch ( option )
+        {
+            case 'c': csv = true; break;
+            default:
+                fprintf( stderr, "Usage: %s [-c] SESSION_LOG [OUTPUT]\n", argv[0] );
+                return EXIT_FAILURE;
+        }
+    }
+    if ( argc - optind < 1 )
+    {
+        fprintf( stderr, "Usage: %s [-c] SESSION_LOG [OUTPUT]\n", argv[0] );
+        return EXIT_FAILURE;
+    }
+
+    // Read whole log
+    fp = fopen( argv[optind], "rb" );
+    if ( NULL == fp )
+    {
+        perror( "main(): fopen()" );
+        return EXIT_FAILURE;
+    }
+    fseek( fp, 0L, SEEK_END );
+    logLength = ftell( fp );
+    rewind( fp );
+
+    log = malloc( (size_t) logLength + 1 );
+    if ( NULL == log || (size_t) logLength != fread( log, 1, (size_t) logLength, fp ) )
+    {
+        perror( "main(): fread()" );
+        return EXIT_FAILURE;
+    }
+    fclose( fp );
+
+    cursor = log;
+    logEnd = log + logLength;
+    if ( logLength < 5 || 0 != memcmp( log, LOG_BINARY_MAGIC, 4 ) )
+    {
+        fprintf( stderr, "%s is not a binary session log\n", argv[optind] );
+        return EXIT_FAILURE;
+    }
+
+    output = argc - optind > 1 ? fopen( argv[optind + 1], "w" ) : stdout;
+    if ( NULL == output )
+    {
+        perror( "main(): fopen()" );
+        return EXIT_FAILURE;
+    }
+    if ( csv )
+        fprintf( output, "record,event,at,name,aem_a,aem_b,created_at,fingerprint,transmitted_devices,duration_ms\n" );
+
+    while ( cursor < logEnd )
+    {
+        const uint8_t *recordStart = cursor;
+
+        // Head of the log
+        if ( logEnd - cursor >= 5 && 0 == memcmp( cursor, LOG_BINARY_MAGIC, 4 ) )
+        {
+            if ( LOG_BINARY_VERSION != cursor[4] )
+            {
+                fprintf( stderr, "Version %u of binary session log is not supported\n", cursor[4] );
+                return EXIT_FAILURE;
+            }
+            cursor += 5;
+            continue;
+        }
+
+        cursor++;
+        if ( !decode_record( *recordStart ) )
+        {
+            fprintf( stderr, "Log ends with an incomplete or unknown record, at byte %ld\n", (long) ( recordStart - log ) );
+            break;
+        }
+    }
+
+    free( log );
+    return 0 == fclose( output ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE                     // getline()
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------------------------
+
+/* Growing text buffer */
+typedef struct text_t {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Text;
+
+/* Event whose "event_end" line has not been read yet */
+typedef struct open_event_t {
+    unsigned int event;
+    Text text;                          // the event's object, up to ( & including ) its messages
+    bool hasMessages;
+} OpenEvent;
+
+static OpenEvent *openEvents;
+static size_t openEventsN;
+
+static Text devices, histograms, bufferMessages, inboxMessages;
+static bool hasEvents;
+
+//------------------------------------------------------------------------------------------------
+
+/// \brief Appends $length bytes of $string to $text.
+/// \param text
+/// \param string
+/// \param length
+static void text_append(Text *text, const char *string, size_t length)
+{
+    if ( text->length + length + 1 > text->capacity )
+    {
+        text->capacity = 2 * ( text->length + length + 1 );
+        text->data = realloc( text->data, text->capacity );
+        if ( NULL == text->data )
+        {
+            perror( "text_append(): realloc()" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    memcpy( text->data + text->length, string, length );
+    text->length += length;
+    text->data[text->length] = '\0';
+}
+
+/// \brief Appends the fields of a record to $text: $fields is the rest of the line after its record & event keys, up to
+/// the closing brace ( excluded ).
+/// \param text
+/// \param fields
+/// \param separator written first, if $text is not empty
+static void text_append_fields(Text *text, const char *fields, const char *separator)
+{
+    size_t length = strlen( fields );
+
+    if ( text->length > 0 )
+        text_append( text, separator, strlen( separator ) );
+    text_append( text, "{", 1 );
+    text_append( text, fields, length );
+}
+
+/// \brief Finds the open event with id $event.
+/// \param event
+/// \return NULL if there is none
+static OpenEvent *open_event_find(unsigned int event)
+{
+    for ( size_t event_i = 0; event_i < openEventsN; event_i++ )
+    {
+        if ( openEvents[event_i].event == event )
+            return &openEvents[event_i];
+    }
+
+    return NULL;
+}
+
+/// \brief Writes $openEvent to the "events" array & forgets about it.
+/// \param output
+/// \param openEvent
+/// \param duration value of "duration", NULL for an unterminated event
+static void open_event_write(FILE *output, OpenEvent *openEvent, const char *duration)
+{
+    fprintf( output, "%s%s]", hasEvents ? "," : "", openEvent->text.data );
+    if ( NULL != duration )
+        fprintf( output, ", \"duration\": %s", duration );
+    fprintf( output, "}" );
+    hasEvents = true;
+
+    free( openEvent->text.data );
+    *openEvent = openEvents[--openEventsN];
+}
+
+/// \brief Converts a session log ( newline-delimited JSON, see log_tearUp() ) to the single JSON document the session
+/// logs used to be, e.g. for WebReport. Events are written in the order they ended; events that never ended ( device
+/// powered off ) come last, with no duration. Lines that are not records ( e.g. the last one, cut by a crash ) are
+/// skipped. A rotated log is converted from its segments, oldest first ( see log_rotate() ).
+/// \example ./Ndjson2json session1.ndjson session1.json
+/// \example zcat -f session1.ndjson.* session1.ndjson | ./Ndjson2json /dev/stdin session1.json
+/// \param argc
+/// \param argv
+/// \return
+int main( int argc, char **argv )
+{
+    FILE *input, *output;
+    char *line = NULL, kind[32];
+    size_t lineCapacity = 0;
+    ssize_t lineLength;
+    bool hasSession = false, hasEnd = false;
+
+    if ( argc < 2 )
+    {
+        fprintf( stderr, "Usage: %s SESSION_LOG [OUTPUT]\n", argv[0] );
+        return EXIT_FAILURE;
+    }
+
+    input = fopen( argv[1], "r" );
+    output = argc > 2 ? fopen( argv[2], "w" ) : stdout;
+    if ( NULL == input || NULL == output )
+    {
+        perror( "main(): fopen()" );
+        return EXIT_FAILURE;
+    }
+
+    while ( 0 < ( lineLength = getline( &line, &lineCapacity, input ) ) )
+    {
+        unsigned int event;
+        char *fields;
+        int offset = 0;
+        OpenEvent *openEvent;
+
+        // Strip "}\n": $fields are then the rest of the object
+        while ( lineLength > 0 && ( '\n' == line[lineLength - 1] || '\r' == line[lineLength - 1] ) )
+            line[--lineLength] = '\0';
+        if ( lineLength < 2 || '}' != line[lineLength - 1] )
+            continue;
+        line[--lineLength] = '\0';
+
+        if ( 1 != sscanf( line, "{\"record\": \"%31[^\"]\", %n", kind, &offset ) || 0 == offset )
+            continue;
+        fields = line + offset;
+
+        // Records of the whole session ( each segment of a rotated log starts with the session record )
+        if ( 0 == strcmp( "session", kind ) )
+        {
+            if ( !hasSession )
+                fprintf( output, "{%s, \"events\": [", fields );
+            hasSession = true;
+            continue;
+        }
+        if ( !hasSession )
+            continue;
+
+        if ( 0 == strcmp( "end", kind ) )
+        {
+            // Unterminated events
+            while ( openEventsN > 0 )
+                open_event_write( output, &openEvents[0], NULL );
+
+            // Stats ( the object is left open, for devices & buffers )
+            fields[strlen( fields ) - 1] = '\0';
+            fprintf( output, "], %s", fields );
+            hasEnd = true;
+            continue;
+        }
+        if ( 0 == strcmp( "device", kind ) )
+        {
+            text_append_fields( &devices, fields, "," );
+            text_append( &devices, "}", 1 );
+            continue;
+        }
+        if ( 0 == strcmp( "histogram", kind ) )
+        {
+            text_append_fields( &histograms, fields, "," );
+            text_append( &histograms, "}", 1 );
+            continue;
+        }
+        if ( 0 == strcmp( "buffer_message", kind ) )
+        {
+            text_append_fields( &bufferMessages, fields, "," );
+            text_append( &bufferMessages, "}", 1 );
+            continue;
+        }
+        if ( 0 == strcmp( "inbox_message", kind ) )
+        {
+            text_append_fields( &inboxMessages, fields, "," );
+            text_append( &inboxMessages, "}", 1 );
+            continue;
+        }
+
+        // Records of an event
+        offset = 0;
+        if ( 1 != sscanf( fields, "\"event\": %u, %n", &event, &offset ) || 0 == offset )
+            continue;
+        fields += offset;
+
+        openEvent = open_event_find( event );
+        if ( 0 == strcmp( "event", kind ) && NULL == openEvent )
+        {
+            openEvents = realloc( openEvents, ( openEventsN + 1 ) * sizeof( OpenEvent ) );
+            if ( NULL == openEvents )
+            {
+                perror( "main(): realloc()" );
+                return EXIT_FAILURE;
+            }
+            openEvent = &openEvents[openEventsN++];
+            openEvent->event = event;
+            openEvent->text = (Text){ NULL, 0, 0 };
+            openEvent->hasMessages = false;
+
+            text_append_fields( &openEvent->text, fields, "," );
+            text_append( &openEvent->text, ", \"messages\": [", strlen( ", \"messages\": [" ) );
+        }
+        // Start of the event was dropped ( logger's ring was full )
+        else if ( NULL == openEvent )
+            continue;
+        else if ( 0 == strcmp( "message", kind ) )
+        {
+            if ( openEvent->hasMessages )
+                text_append( &openEvent->text, ",", 1 );
+            text_append( &openEvent->text, "{", 1 );
+            text_append( &openEvent->text, fields, strlen( fields ) );
+            text_append( &openEvent->text, "}", 1 );
+            openEvent->hasMessages = true;
+        }
+        else if ( 0 == strcmp( "event_end", kind ) )
+            open_event_write( output, openEvent, strstr( fields, "\"duration\": " ) ? fields + strlen( "\"duration\": " ) : NULL );
+    }
+
+    if ( !hasSession )
+    {
+        fprintf( stderr, "%s is not a session log\n", argv[1] );
+        return EXIT_FAILURE;
+    }
+
+    // Session cut short ( device powered off ): no duration, end or stats of it
+    if ( !hasEnd )
+    {
+        while ( openEventsN > 0 )
+            open_event_write( output, &openEvents[0], NULL );
+        fprintf( output, "], \"stats\": {" );
+    }
+    else
+        fprintf( output, ", " );
+
+    fprintf( output, "\"devices\": [%s], \"histograms\": [%s], \"buffer_messages\": [%s], \"inbox_messages\": [%s]}}\n",
+             devices.length > 0 ? devices.data : "", histograms.length > 0 ? histograms.data : "",
+             bufferMessages.length > 0 ? bufferMessages.data : "",
+             inboxMessages.length > 0 ? inboxMessages.data : "" );
+
+    free( line );
+    fclose( input );
+    return 0 == fclose( output ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,667 @@
+#define _GNU_SOURCE
+#include "conf.h"
+#include "trace.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------------------------
+
+extern char **environ;
+
+#ifndef REPLAY_CONFIG
+    #define REPLAY_LINKS_MAX 256            // max connections relayed at once
+    #define REPLAY_LINK_BUFFER_LEN 16384    // bytes buffered per direction of a connection
+    #define REPLAY_TICK 10                  // ms between refills of bandwidth tokens
+    #define REPLAY_BURST 0.1                // secs of bandwidth that can be sent at once
+    #define REPLAY_MARGIN 10                // secs devices keep running after the last contact
+#endif
+
+//------------------------------------------------------------------------------------------------
+
+/* Bytes in flight from one end of a relayed connection to the other */
+typedef struct replay_direction_t {
+    char data[REPLAY_LINK_BUFFER_LEN];
+    size_t length;
+    bool eof;                           // source closed its write side
+    bool shut;                          // ... and that was forwarded to the destination
+} ReplayDirection;
+
+/* A connection relayed by the proxy: fds[0] connected to us ( initiator ), fds[1] is our connection to the target */
+typedef struct replay_link_t {
+    int fds[2];
+    ReplayDirection directions[2];      // [i]: from fds[i] to fds[1 - i]
+    size_t contact_i;
+    bool used;
+} ReplayLink;
+
+/* A replayed device: its node instance & the proxy's listening socket in front of it, open only while the device is
+ * in range of some other device ( otherwise connections to it are refused, like connections to an absent device ) */
+typedef struct replay_device_t {
+    uint32_t aem;
+    int listener;
+    uint32_t contactsN;                 // contacts in progress
+    pid_t pid;
+} ReplayDevice;
+
+static ReplayDevice *devices;
+static size_t devicesN;
+static ReplayLink links[REPLAY_LINKS_MAX];
+static double *tokens;                  // bandwidth tokens of each contact ( bytes )
+static bool *active;                    // contact in progress
+
+static const char *ipPrefix = "127.0";
+
+/// \brief Orders AEMs ( qsort() comparator ).
+static int replay_aem_compare(const void *a, const void *b)
+{
+    uint32_t aemA = *(const uint32_t *) a;
+    uint32_t aemB = *(const uint32_t *) b;
+
+    return ( aemA > aemB ) - ( aemA < aemB );
+}
+
+/// \brief Address of device with $aem ( same scheme as aem2ip() ).
+/// \param aem
+/// \param port
+/// \param address result address
+static void replay_address(uint32_t aem, uint16_t port, struct sockaddr_in *address)
+{
+    char ip[INET_ADDRSTRLEN];
+
+    snprintf( ip, INET_ADDRSTRLEN, "%s.%u.%u", ipPrefix, ( aem / 100 ) % 256, aem % 100 );
+    memset( address, 0, sizeof( struct sockaddr_in ) );
+    address->sin_family = AF_INET;
+    address->sin_port = htons( port );
+    address->sin_addr.s_addr = inet_addr( ip );
+}
+
+/// \brief Seconds elapsed since $start.
+static double replay_elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (double) ( now.tv_sec - start->tv_sec ) + (double) ( now.tv_nsec - start->tv_nsec ) / 1e9;
+}
+
+/// \brief Closes $socket_fd with a reset, so that the connecting device sees the peer as unreachable.
+static void replay_reset(int socket_fd)
+{
+    struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+
+    setsockopt( socket_fd, SOL_SOCKET, SO_LINGER, (const void *) &lin, sizeof( struct linger ) );
+    close( socket_fd );
+}
+
+/// \brief Collects the devices of $trace.
+/// \param trace
+/// \return TRUE on success
+static bool replay_devices_setup(const ContactTrace *trace)
+{
+    uint32_t *aems = malloc( 2 * trace->length * sizeof( uint32_t ) );
+
+    if ( NULL == aems )
+        return false;
+
+    // Unique AEMs
+    for ( size_t contact_i = 0; contact_i < trace->length; contact_i++ )
+    {
+        aems[2 * contact_i] = trace->contacts[contact_i].aemA;
+        aems[2 * contact_i + 1] = trace->contacts[contact_i].aemB;
+    }
+    qsort( aems, 2 * trace->length, sizeof( uint32_t ), replay_aem_compare );
+
+    devices = calloc( 2 * trace->length, sizeof( ReplayDevice ) );
+    if ( NULL == devices )
+        return false;
+
+    for ( size_t aem_i = 0; aem_i < 2 * trace->length; aem_i++ )
+    {
+        if ( devicesN > 0 && devices[devicesN - 1].aem == aems[aem_i] )
+            continue;
+
+        devices[devicesN].aem = aems[aem_i];
+        devices[devicesN++].listener = -1;
+    }
+
+    free( aems );
+    return true;
+}
+
+/// \brief Updates the contacts in progress of device with $aem: the proxy listens in front of the device while that
+/// is in range of any other device.
+/// \param aem
+/// \param started TRUE when a contact of the device starts, FALSE when it ends
+/// \param proxyPort port devices connect to
+static void replay_device_contact(uint32_t aem, bool started, uint16_t proxyPort)
+{
+    ReplayDevice *device = bsearch( &aem, devices, devicesN, sizeof( ReplayDevice ), replay_aem_compare );
+    struct sockaddr_in address;
+    int status = 1;
+
+    if ( !started )
+    {
+        // Out of range: pending connections are reset
+        if ( 0 == --device->contactsN && device->listener >= 0 )
+        {
+            close( device->listener );
+            device->listener = -1;
+        }
+        return;
+    }
+
+    if ( 0 != device->contactsN++ )
+        return;
+
+    device->listener = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP );
+    if ( device->listener < 0 )
+        return;
+
+    setsockopt( device->listener, SOL_SOCKET, SO_REUSEADDR, (const void *) &status, sizeof( int ) );
+    replay_address( aem, proxyPort, &address );
+    if ( bind( device->listener, (struct sockaddr *) &address, sizeof( struct sockaddr_in ) ) < 0 ||
+         listen( device->listener, SOCKET_LISTEN_QUEUE_LEN ) < 0 )
+    {
+        perror( "replay_device_contact(): bind() / listen()" );
+        close( device->listener );
+        device->listener = -1;
+    }
+}
+
+/// \brief Starts a node instance for every device. Devices listen on $nodePort & connect to the proxy on $proxyPort.
+/// \param executable e.g. "./build-loopback/final"
+/// \param outputDirectory where session logs & output of each device are saved
+/// \param nodePort
+/// \param proxyPort
+/// \param duration secs each device will run
+/// \return TRUE on success
+static bool replay_devices_start(const char *executable, const char *outputDirectory, uint16_t nodePort,
+        uint16_t proxyPort, uint32_t duration)
+{
+    char aem[16], listenPort[8], peerPort[8], durationString[16];
+    char sessionFileName[PATH_MAX], outputFileName[PATH_MAX];
+
+    snprintf( listenPort, sizeof( listenPort ), "%u", nodePort );
+    snprintf( peerPort, sizeof( peerPort ), "%u", proxyPort );
+    snprintf( durationString, sizeof( durationString ), "%u", duration );
+
+    for ( size_t device_i = 0; device_i < devicesN; device_i++ )
+    {
+        posix_spawn_file_actions_t actions;
+        char *argv[] = {
+            (char *) executable, "-a", aem, "-n", (char *) ipPrefix, "-p", listenPort, "-P", peerPort,
+            "-o", sessionFileName, durationString, NULL
+        };
+
+        snprintf( aem, sizeof( aem ), "%u", devices[device_i].aem );
+        snprintf( sessionFileName, PATH_MAX, "%s/session_%04u.ndjson", outputDirectory, devices[device_i].aem );
+        snprintf( outputFileName, PATH_MAX, "%s/output_%04u.log", outputDirectory, devices[device_i].aem );
+
+        posix_spawn_file_actions_init( &actions );
+        posix_spawn_file_actions_addopen( &actions, STDOUT_FILENO, outputFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        posix_spawn_file_actions_adddup2( &actions, STDOUT_FILENO, STDERR_FILENO );
+
+        if ( 0 != posix_spawn( &devices[device_i].pid, executable, &actions, NULL, argv, environ ) )
+        {
+            perror( "replay_devices_start(): posix_spawn()" );
+            posix_spawn_file_actions_destroy( &actions );
+            return false;
+        }
+
+        posix_spawn_file_actions_destroy( &actions );
+    }
+
+    return true;
+}
+
+/// \brief Finds the contact of $trace between $aemA & $aemB that is in progress.
+/// \return index of contact, or -1 if devices are not in range
+static ssize_t replay_contact_find(const ContactTrace *trace, size_t contactsStarted, uint32_t aemA, uint32_t aemB)
+{
+    for ( size_t contact_i = 0; contact_i < contactsStarted; contact_i++ )
+    {
+        const Contact *contact = &trace->contacts[contact_i];
+
+        if ( active[contact_i] &&
+             ( ( contact->aemA == aemA && contact->aemB == aemB ) || ( contact->aemA == aemB && contact->aemB == aemA ) ) )
+            return (ssize_t) contact_i;
+    }
+
+    return -1;
+}
+
+/// \brief Closes both ends of $link.
+static void replay_link_close(ReplayLink *link)
+{
+    close( link->fds[0] );
+    close( link->fds[1] );
+    link->used = false;
+}
+
+/// \brief Accepts a connection towards $target: if the connecting device is in range of the target, connects to the
+/// target on behalf of it ( from its own address, so that the target sees who connected ) & starts relaying.
+/// \param trace
+/// \param contactsStarted
+/// \param target
+/// \param nodePort
+static void replay_accept(const ContactTrace *trace, size_t contactsStarted, const ReplayDevice *target, uint16_t nodePort)
+{
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof( struct sockaddr_in );
+    unsigned int ipParts[4];
+    char ip[INET_ADDRSTRLEN];
+    uint32_t source;
+    ssize_t contact_i;
+    int accepted_fd, target_fd;
+    size_t link_i;
+
+    accepted_fd = accept4( target->listener, (struct sockaddr *) &address, &addressLength, SOCK_NONBLOCK );
+    if ( accepted_fd < 0 )
+        return;
+
+    // Resolve AEM of connecting device ( see ip2aem() )
+    inet_ntop( AF_INET, &address.sin_addr, ip, INET_ADDRSTRLEN );
+    sscanf( ip, "%u.%u.%u.%u", &ipParts[0], &ipParts[1], &ipParts[2], &ipParts[3] );
+    source = ipParts[2] * 100 + ipParts[3];
+
+    // Not in range / no free link
+    contact_i = replay_contact_find( trace, contactsStarted, source, target->aem );
+    for ( link_i = 0; link_i < REPLAY_LINKS_MAX && links[link_i].used; link_i++ );
+    if ( contact_i < 0 || REPLAY_LINKS_MAX == link_i )
+    {
+        replay_reset( accepted_fd );
+        return;
+    }
+
+    // Connect to target as the connecting device ( loopback: completes at once )
+    target_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    replay_address( source, 0, &address );
+    bind( target_fd, (struct sockaddr *) &address, sizeof( struct sockaddr_in ) );
+    replay_address( target->aem, nodePort, &address );
+    if ( connect( target_fd, (struct sockaddr *) &address, sizeof( struct sockaddr_in ) ) < 0 )
+    {
+        close( target_fd );
+        replay_reset( accepted_fd );
+        return;
+    }
+    fcntl( target_fd, F_SETFL, fcntl( target_fd, F_GETFL, 0 ) | O_NONBLOCK );
+
+    memset( &links[link_i], 0, sizeof( ReplayLink ) );
+    links[link_i].fds[0] = accepted_fd;
+    links[link_i].fds[1] = target_fd;
+    links[link_i].contact_i = (size_t) contact_i;
+    links[link_i].used = true;
+}
+
+/// \brief Moves bytes of $link in both directions, as far as sockets & bandwidth tokens of its contact allow.
+static void replay_link_relay(ReplayLink *link)
+{
+    for ( int side = 0; side < 2 && link->used; side++ )
+    {
+        ReplayDirection *direction = &link->directions[side];
+        int source_fd = link->fds[side], destination_fd = link->fds[1 - side];
+        ssize_t n;
+
+        // Read ( only as much as bandwidth allows )
+        if ( 0 == direction->length && !direction->eof && tokens[link->contact_i] >= 1.0 )
+        {
+            size_t allowed = tokens[link->contact_i] < REPLAY_LINK_BUFFER_LEN ?
+                (size_t) tokens[link->contact_i] : REPLAY_LINK_BUFFER_LEN;
+
+            n = read( source_fd, direction->data, allowed );
+            if ( n > 0 )
+            {
+                direction->length = (size_t) n;
+                tokens[link->contact_i] -= (double) n;
+            }
+            else if ( 0 == n )
+                direction->eof = true;
+            else if ( EAGAIN != errno && EINTR != errno )
+            {
+                replay_link_close( link );
+                return;
+            }
+        }
+
+        // Write
+        if ( direction->length > 0 )
+        {
+            n = send( destination_fd, direction->data, direction->length, MSG_NOSIGNAL );
+            if ( n > 0 )
+            {
+                memmove( direction->data, direction->data + n, direction->length - (size_t) n );
+                direction->length -= (size_t) n;
+            }
+            else if ( n < 0 && EAGAIN != errno && EINTR != errno )
+            {
+                replay_link_close( link );
+                return;
+            }
+        }
+
+        // Forward half-close
+        if ( direction->eof && 0 == direction->length && !direction->shut )
+        {
+            shutdown( destination_fd, SHUT_WR );
+            direction->shut = true;
+        }
+    }
+
+    if ( link->used && link->directions[0].shut && link->directions[1].shut )
+        replay_link_close( link );
+}
+
+/// \brief Replays $trace: devices can reach each other only through the proxy & only during their contacts, at
+/// $bandwidth bytes / sec per contact ( shared by both directions, like a Wi-Fi link ).
+/// \param trace
+/// \param bandwidth bytes / sec
+/// \param speedup contacts are replayed $speedup times faster
+/// \param proxyPort
+/// \param nodePort
+static void replay_run(const ContactTrace *trace, double bandwidth, double speedup, uint16_t proxyPort, uint16_t nodePort)
+{
+    struct pollfd pfds[REPLAY_LINKS_MAX * 2 + devicesN];
+    double traceEnd = 0.0, previousElapsed = 0.0;
+    size_t contactsStarted = 0;
+    struct timespec start;
+
+    for ( size_t contact_i = 0; contact_i < trace->length; contact_i++ )
+        if ( trace->contacts[contact_i].end > traceEnd )
+            traceEnd = trace->contacts[contact_i].end;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    while ( 1 )
+    {
+        double elapsed = replay_elapsed( &start );
+        double now = elapsed * speedup;
+        nfds_t pfdsN = 0;
+
+        if ( now >= traceEnd )
+            break;
+
+        // Start contacts
+        for ( ; contactsStarted < trace->length && trace->contacts[contactsStarted].start <= now; contactsStarted++ )
+        {
+            tokens[contactsStarted] = bandwidth * REPLAY_BURST;
+            active[contactsStarted] = true;
+            replay_device_contact( trace->contacts[contactsStarted].aemA, true, proxyPort );
+            replay_device_contact( trace->contacts[contactsStarted].aemB, true, proxyPort );
+        }
+
+        // End contacts / refill tokens of contacts in progress
+        for ( size_t contact_i = 0; contact_i < contactsStarted; contact_i++ )
+        {
+            if ( !active[contact_i] )
+                continue;
+            if ( trace->contacts[contact_i].end <= now )
+            {
+                active[contact_i] = false;
+                replay_device_contact( trace->contacts[contact_i].aemA, false, proxyPort );
+                replay_device_contact( trace->contacts[contact_i].aemB, false, proxyPort );
+                continue;
+            }
+
+            tokens[contact_i] += bandwidth * ( elapsed - previousElapsed );
+            if ( tokens[contact_i] > bandwidth * REPLAY_BURST )
+                tokens[contact_i] = bandwidth * REPLAY_BURST;
+        }
+        previousElapsed = elapsed;
+
+        // Out of range: drop connections of finished contacts
+        for ( size_t link_i = 0; link_i < REPLAY_LINKS_MAX; link_i++ )
+        {
+            if ( links[link_i].used && trace->contacts[links[link_i].contact_i].end <= now )
+            {
+                replay_reset( links[link_i].fds[0] );
+                replay_reset( links[link_i].fds[1] );
+                links[link_i].used = false;
+            }
+        }
+
+        // Wait for connections & data
+        for ( size_t device_i = 0; device_i < devicesN; device_i++ )
+            pfds[pfdsN++] = (struct pollfd){ .fd = devices[device_i].listener, .events = POLLIN };
+        for ( size_t link_i = 0; link_i < REPLAY_LINKS_MAX; link_i++ )
+        {
+            for ( int side = 0; side < 2; side++ )
+            {
+                short events = 0;
+                if ( !links[link_i].used )
+                    continue;
+
+                if ( 0 == links[link_i].directions[side].length && !links[link_i].directions[side].eof &&
+                     tokens[links[link_i].contact_i] >= 1.0 )
+                    events |= POLLIN;
+                if ( links[link_i].directions[1 - side].length > 0 )
+                    events |= POLLOUT;
+
+                pfds[pfdsN++] = (struct pollfd){ .fd = events ? links[link_i].fds[side] : -1, .events = events };
+            }
+        }
+
+        if ( poll( pfds, pfdsN, REPLAY_TICK ) <= 0 )
+            continue;
+
+        for ( size_t device_i = 0; device_i < devicesN; device_i++ )
+        {
+            if ( pfds[device_i].revents & POLLIN )
+                replay_accept( trace, contactsStarted, &devices[device_i], nodePort );
+        }
+
+        for ( size_t link_i = 0; link_i < REPLAY_LINKS_MAX; link_i++ )
+        {
+            if ( links[link_i].used )
+                replay_link_relay( &links[link_i] );
+        }
+    }
+
+    for ( size_t link_i = 0; link_i < REPLAY_LINKS_MAX; link_i++ )
+    {
+        if ( links[link_i].used )
+            replay_link_close( &links[link_i] );
+    }
+    for ( size_t device_i = 0; device_i < devicesN; device_i++ )
+    {
+        if ( devices[device_i].listener >= 0 )
+            close( devices[device_i].listener );
+    }
+}
+
+/// \brief Reads stats of session log written by a replayed device ( "end" line, see log_tearDown() ).
+/// \param fileName
+/// \param stats result: produced, received_for_me, transmitted
+/// \return TRUE if stats were found
+static bool replay_session_stats(const char *fileName, unsigned int stats[3])
+{
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    bool found = false;
+    FILE *fp;
+
+    fp = fopen( fileName, "r" );
+    if ( NULL == fp )
+        return false;
+
+    while ( !found && 0 < getline( &line, &lineCapacity, fp ) )
+    {
+        char *statsStart;
+
+        if ( 0 != strncmp( line, "{\"record\": \"end\", ", strlen( "{\"record\": \"end\", " ) ) ||
+             NULL == ( statsStart = strstr( line, "\"stats\": { " ) ) )
+            continue;
+
+        found = 3 == sscanf( statsStart, "\"stats\": { \"produced\": \"%u\", \"received\": \"%*u\", "
+                                         "\"received_for_me\": \"%u\", \"payloads_received\": \"%*u\", \"transmitted\": \"%u\"",
+                                         &stats[0], &stats[1], &stats[2] );
+    }
+
+    free( line );
+    fclose( fp );
+    return found;
+}
+
+/// \brief Prints results of the replay, collected from the session logs of all devices.
+/// \param outputDirectory
+/// \param contactsN
+static void replay_report(const char *outputDirectory, size_t contactsN)
+{
+    unsigned int produced = 0, deliveredToMe = 0, transmitted = 0, stats[3];
+    double syncTime = 0.0, startedAt;
+    size_t syncsN = 0, devicesReported = 0;
+    char fileName[PATH_MAX];
+
+    for ( size_t device_i = 0; device_i < devicesN; device_i++ )
+    {
+        ContactTrace syncs = { NULL, 0, 0 };
+
+        snprintf( fileName, PATH_MAX, "%s/session_%04u.ndjson", outputDirectory, devices[device_i].aem );
+        if ( replay_session_stats( fileName, stats ) )
+        {
+            produced += stats[0];
+            deliveredToMe += stats[1];
+            transmitted += stats[2];
+            devicesReported++;
+        }
+
+        // Sync time: duration of each exchange
+        if ( trace_load_session( &syncs, fileName, &startedAt ) )
+        {
+            for ( size_t sync_i = 0; sync_i < syncs.length; sync_i++ )
+                syncTime += syncs.contacts[sync_i].end - syncs.contacts[sync_i].start;
+            syncsN += syncs.length;
+        }
+        trace_free( &syncs );
+    }
+
+    fprintf( stdout, "/*\n"
+                     "|--------------------------------------------------------------------------\n"
+                     "| REPLAY\n"
+                     "|--------------------------------------------------------------------------\n"
+                     "|\n"
+                     "| Devices             : %zu ( %zu reported )\n"
+                     "| Contacts            : %zu\n"
+                     "|\n"
+                     "| Messages Produced   : %u\n"
+                     "| Messages Delivered  : %u ( ratio = %.4f )\n"
+                     "| Messages Transmitted: %u\n"
+                     "| Sync Time           : avg = %.2f ms ( %zu exchanges )\n"
+                     "|\n"
+                     "*/\n",
+             devicesN, devicesReported, contactsN, produced,
+             deliveredToMe, produced > 0 ? (double) deliveredToMe / produced : 0.0, transmitted,
+             syncsN > 0 ? 1000.0 * syncTime / (double) syncsN : 0.0, syncsN );
+}
+
+/// \brief Contact-trace replay harness: replays the contacts of real session logs ( or of a contact-trace CSV ) against
+/// local node instances, through a traffic-shaping proxy that stands in for the Wi-Fi link.
+/// \example ./Replay -x ./build-loopback/final -o ./replay session_8600.ndjson session_9026.ndjson
+/// \example ./Replay -x ./build-loopback/final -c contacts.csv -b 250000 -t 4
+/// \example ./Replay -w contacts.csv session_8600.ndjson session_9026.ndjson    ( extract trace only, e.g. for Simulator )
+/// Options:
+///     -x FILE     : node executable ( built with AEM_IP_PREFIX & an AEM list covering all devices of the trace )
+///     -c FILE     : contact schedule, CSV with lines "start,end,aemA,aemB", instead of session logs
+///     -w FILE     : save the contact schedule as CSV
+///     -b BYTES    : bandwidth of a contact, in bytes / sec ( default: 1000000 )
+///     -t SPEEDUP  : replay contacts SPEEDUP times faster ( default: 1 )
+///     -g SECS     : merge contacts of the same devices less than SECS apart ( default: 0 )
+///     -m SECS     : min duration of a contact ( default: 1 )
+///     -n PREFIX   : first two octets of every device's IP ( default: "127.0" )
+///     -P PORT     : port devices connect to ( proxy ); devices listen on PORT + 2 ( default: SOCKET_PORT )
+///     -o DIR      : where session logs & output of devices are saved ( default: "./replay" )
+/// \param argc
+/// \param argv
+/// \return
+int main( int argc, char **argv )
+{
+    int option;
+    const char *executable = NULL, *traceFileName = NULL, *traceOutputFileName = NULL;
+    const char *outputDirectory = "./replay";
+    double bandwidth = 1e6, speedup = 1.0, mergeGap = 0.0, minLength = 1.0;
+    double origin = 0.0, startedAt, traceEnd = 0.0;
+    uint16_t proxyPort = SOCKET_PORT;
+    ContactTrace trace = { NULL, 0, 0 };
+
+    // Parse options
+    while ( -1 != ( option = getopt( argc, argv, "x:c:w:b:t:g:m:n:P:o:" ) ) )
+    {
+        switch ( option )
+        {
+            case 'x': executable = optarg; break;
+            case 'c': traceFileName = optarg; break;
+            case 'w': traceOutputFileName = optarg; break;
+            case 'b': bandwidth = strtod( optarg, NULL ); break;
+            case 't': speedup = strtod( optarg, NULL ); break;
+            case 'g': mergeGap = strtod( optarg, NULL ); break;
+            case 'm': minLength = strtod( optarg, NULL ); break;
+            case 'n': ipPrefix = optarg; break;
+            case 'P': proxyPort = (uint16_t) strtoul( optarg, NULL, STRSEP_BASE_10 ); break;
+            case 'o': outputDirectory = optarg; break;
+            default:
+                fprintf( stderr, "Usage: %s [-x FINAL] [-c CONTACTS_CSV] [-w CONTACTS_CSV] [-b BANDWIDTH] [-t SPEEDUP] "
+                                 "[-g MERGE_GAP] [-m MIN_LENGTH] [-n IP_PREFIX] [-P PORT] [-o OUT_DIR] "
+                                 "[SESSION_JSON...]\n", argv[0] );
+                exit( EXIT_FAILURE );
+        }
+    }
+
+    // Load contact schedule: from CSV, or from session logs of all devices ( starting from the earliest session )
+    if ( NULL != traceFileName )
+    {
+        if ( false == trace_load( &trace, traceFileName ) )
+            exit( EXIT_FAILURE );
+    }
+    for ( int arg_i = optind; arg_i < argc; arg_i++ )
+    {
+        if ( false == trace_load_session( &trace, argv[arg_i], &startedAt ) )
+            exit( EXIT_FAILURE );
+        if ( optind == arg_i || startedAt < origin )
+            origin = startedAt;
+    }
+    trace_finalize( &trace, origin, mergeGap, minLength );
+
+    for ( size_t contact_i = 0; contact_i < trace.length; contact_i++ )
+        if ( trace.contacts[contact_i].end > traceEnd )
+            traceEnd = trace.contacts[contact_i].end;
+    fprintf( stdout, "Contacts: %zu ( %.0f secs )\n", trace.length, traceEnd );
+
+    if ( NULL != traceOutputFileName && false == trace_save( &trace, traceOutputFileName ) )
+        exit( EXIT_FAILURE );
+    if ( NULL == executable || 0 == trace.length )
+        return EXIT_SUCCESS;
+
+    // Proxy in front of every device, then the devices themselves
+    tokens = calloc( trace.length, sizeof( double ) );
+    active = calloc( trace.length, sizeof( bool ) );
+    mkdir( outputDirectory, 0755 );
+    if ( NULL == tokens || NULL == active || false == replay_devices_setup( &trace ) ||
+         false == replay_devices_start( executable, outputDirectory, proxyPort + 2, proxyPort,
+                                        (uint32_t) ( traceEnd / speedup ) + REPLAY_MARGIN ) )
+        exit( EXIT_FAILURE );
+
+    replay_run( &trace, bandwidth, speedup, proxyPort, proxyPort + 2 );
+
+    // Wait for devices to finish their sessions
+    for ( size_t device_i = 0; device_i < devicesN; device_i++ )
+        waitpid( devices[device_i].pid, NULL, 0 );
+
+    replay_report( outputDirectory, trace.length );
+
+    trace_free( &trace );
+    free( tokens );
+    free( active );
+    free( devices );
+    return EXIT_SUCCESS;
+}
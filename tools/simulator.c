@@ -0,0 +1,457 @@
+#include "conf.h"
+#include "communication.h"
+#include "fragment.h"
+#include "profile.h"
+#include "routing.h"
+#include "server.h"
+#include "trace.h"
+#include "utils.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+//------------------------------------------------------------------------------------------------
+
+// Globals of the running device ( normally defined in main.c )
+uint32_t executionTimeRequested;
+
+pthread_t communicationThreads[COMMUNICATION_WORKERS_MAX];
+uint8_t communicationThreadsAvailable = COMMUNICATION_WORKERS_MAX;
+
+pthread_mutex_t messagesBufferLock = PTHREAD_MUTEX_INITIALIZER, activeDevicesLock = PTHREAD_MUTEX_INITIALIZER,
+    availableThreadsLock = PTHREAD_MUTEX_INITIALIZER, logLock = PTHREAD_MUTEX_INITIALIZER, logEventLock = PTHREAD_MUTEX_INITIALIZER;
+
+MessagesStats messagesStats;
+
+uint32_t CLIENT_AEM;
+uint32_t setupDatetimeAem;
+
+uint32_t CLIENT_AEM_CONN_N_LIST[CLIENT_AEM_LIST_LENGTH];
+uint64_t CLIENT_AEM_CONN_DURATION_LIST[CLIENT_AEM_LIST_LENGTH];
+
+//------------------------------------------------------------------------------------------------
+
+extern messages_head_t inboxHead;
+extern InboxMessage *INBOX;
+extern Message *MESSAGES_BUFFER;
+extern uint64_t timestampVirtualNow;
+extern uint32_t messageTtl;
+extern bool transferPlanning;
+extern uint32_t payloadLength;
+extern float fragmentRedundancy;
+
+// Virtual time of the start of the simulation ( 2020-01-01T00:00:00Z )
+#define SIMULATOR_EPOCH 1577836800
+
+/* A message production of a device */
+typedef struct production_t {
+    double at;
+    uint32_t device_i;
+} Production;
+
+/* Totals of a simulation */
+typedef struct simulator_stats_t {
+    uint64_t produced;
+    uint64_t payloads;                  // produced, in fragments
+    uint64_t delivered;
+    uint64_t transmitted;
+    uint64_t expired;
+    uint64_t contacts;
+    uint64_t *latencies;                // of each delivered message ( secs )
+} SimulatorStats;
+
+static Store *stores;
+static SimulatorStats stats;
+static char frames[MESSAGES_SIZE][MESSAGE_SERIALIZED_LEN];
+static MessageMetadata framesMetadata[MESSAGES_SIZE];
+static uint16_t queue[MESSAGES_SIZE];
+static char summaries[2][PROPHET_SUMMARY_FRAMES_MAX][MESSAGE_SERIALIZED_LEN];
+
+/// \brief Orders productions by time ( qsort() comparator ).
+static int simulator_production_compare(const void *a, const void *b)
+{
+    const Production *productionA = (const Production *) a;
+    const Production *productionB = (const Production *) b;
+
+    return ( productionA->at > productionB->at ) - ( productionA->at < productionB->at );
+}
+
+/// \brief Orders latencies ( qsort() comparator ).
+static int simulator_latency_compare(const void *a, const void *b)
+{
+    uint64_t latencyA = *(const uint64_t *) a;
+    uint64_t latencyB = *(const uint64_t *) b;
+
+    return ( latencyA > latencyB ) - ( latencyA < latencyB );
+}
+
+/// \brief Schedules the productions of all devices, with a random delay in PRODUCER_DELAY_RANGE between successive ones
+/// ( like producer_worker() ).
+/// \param duration secs
+/// \param productionsN result number of productions
+/// \return productions, sorted by time
+static Production *simulator_productions(double duration, size_t *productionsN)
+{
+    size_t capacity = (size_t) ( CLIENT_AEM_LIST_LENGTH * ( duration / PRODUCER_DELAY_RANGE_MIN + 1 ) );
+    Production *productions = malloc( capacity * sizeof( Production ) );
+    if ( NULL == productions )
+        error( ENOMEM, "simulator_productions(): malloc() failed" );
+
+    *productionsN = 0;
+    for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
+    {
+        double at = 0.0;
+        while ( 1 )
+        {
+            at += rand() % ( PRODUCER_DELAY_RANGE_MAX + 1 - PRODUCER_DELAY_RANGE_MIN ) + PRODUCER_DELAY_RANGE_MIN;
+            if ( at >= duration )
+                break;
+
+            productions[*productionsN].at = at;
+            productions[*productionsN].device_i = device_i;
+            ( *productionsN )++;
+        }
+    }
+
+    qsort( productions, *productionsN, sizeof( Production ), simulator_production_compare );
+    return productions;
+}
+
+/// \brief A device produces a new random message ( or the fragments of a random payload, if $payloadLength ).
+/// \param device_i
+static void simulator_produce(uint32_t device_i)
+{
+    static Message messages[UINT8_MAX];
+    uint16_t messagesN = 1;
+
+    store_load( &stores[device_i] );
+        if ( payloadLength > 0 )
+            messagesN = generateRandomPayload( messages );
+        else
+            generateRandomMessage( &messages[0] );
+
+        for ( uint16_t message_i = 0; message_i < messagesN; message_i++ )
+            messages_push( &messages[message_i] );
+    store_save( &stores[device_i] );
+
+    stats.produced += messagesN;
+    stats.payloads += payloadLength > 0 ? 1 : 0;
+}
+
+/// \brief One direction of a contact: device $from_i transmits up to $framesMax messages to device $to_i, using the same
+/// routing decisions, serialization & storage as communication_worker(). Routing state advertised by devices is kept
+/// once for all devices ( not per device that received it ).
+/// \param from_i
+/// \param to_i
+/// \param framesMax
+/// \param first TRUE if device $to_i transmits after this, in the same contact ( see routing_plan() )
+/// \param elapsed secs since the contact started
+/// \return number of messages transmitted
+static uint32_t simulator_transmit(uint32_t from_i, uint32_t to_i, uint32_t framesMax, bool first, double elapsed)
+{
+    Device from = { .AEM = stores[from_i].aem, .aemIndex = (int32_t) from_i };
+    Device to = { .AEM = stores[to_i].aem, .aemIndex = (int32_t) to_i };
+    uint32_t framesN = 0;
+    uint16_t queueLength;
+
+    // Transmitter
+    store_load( &stores[from_i] );
+        stats.expired += messages_expire( timestampVirtualNow );
+        queueLength = routing_queue( to, queue );
+        if ( framesMax > routing_plan( to, first, elapsed ) )
+            framesMax = routing_plan( to, first, elapsed );
+        for ( uint16_t queue_i = 0; queue_i < queueLength && framesN < framesMax; queue_i++ )
+        {
+            framesMetadata[framesN].copies = routing_copies_handed( &MESSAGES_BUFFER[queue[queue_i]], to );
+            framesMetadata[framesN].ttl = MESSAGES_BUFFER[queue[queue_i]].ttl;
+            implode( "_", MESSAGES_BUFFER[queue[queue_i]], frames[framesN++] );
+            communication_transmitted( to, queue[queue_i] );
+        }
+    store_save( &stores[from_i] );
+
+    // Receiver
+    store_load( &stores[to_i] );
+        for ( uint32_t frame_i = 0; frame_i < framesN; frame_i++ )
+        {
+            messages_head_t inboxHeadBefore = inboxHead;
+
+            communication_receive( frames[frame_i], from, &framesMetadata[frame_i] );
+
+            if ( inboxHead > inboxHeadBefore )
+            {
+                stats.latencies[stats.delivered++] = timestampVirtualNow - INBOX[inboxHead - 1].created_at;
+            }
+        }
+    store_save( &stores[to_i] );
+
+    stats.transmitted += framesN;
+    return framesN;
+}
+
+/// \brief Exchange of routing state at the start of a contact: both devices advertise theirs before taking the other's
+/// ( see communication_summary_exchange() ).
+/// \param a_i
+/// \param b_i
+static void simulator_summaries(uint32_t a_i, uint32_t b_i)
+{
+    Device a = { .AEM = stores[a_i].aem, .aemIndex = (int32_t) a_i };
+    Device b = { .AEM = stores[b_i].aem, .aemIndex = (int32_t) b_i };
+    uint16_t summaryA, summaryB;
+
+    store_load( &stores[a_i] );
+        summaryA = routing_summary( summaries[0], PROPHET_SUMMARY_FRAMES_MAX );
+    store_save( &stores[a_i] );
+    store_load( &stores[b_i] );
+        summaryB = routing_summary( summaries[1], PROPHET_SUMMARY_FRAMES_MAX );
+        for ( uint16_t summary_i = 0; summary_i < summaryA; summary_i++ )
+            routing_summary_receive( a, summaries[0][summary_i] + 1, 0 == summary_i );
+    store_save( &stores[b_i] );
+    store_load( &stores[a_i] );
+        for ( uint16_t summary_i = 0; summary_i < summaryB; summary_i++ )
+            routing_summary_receive( b, summaries[1][summary_i] + 1, 0 == summary_i );
+    store_save( &stores[a_i] );
+}
+
+/// \brief A contact between two devices: $contact->aemA connects to $contact->aemB and each transmits its messages to
+/// the other in turn, sharing what the contact's duration & $bandwidth allow. Each device then updates its estimates of
+/// contacts with the other, the way communication_worker() does.
+/// \param contact
+/// \param bandwidth bytes / sec
+static void simulator_contact(const Contact *contact, double bandwidth)
+{
+    int32_t a_i = binary_search_index( CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, contact->aemA );
+    int32_t b_i = binary_search_index( CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, contact->aemB );
+    double framesMax, duration;
+    uint32_t framesA, framesB;
+    bool cut;
+
+    if ( a_i < 0 || b_i < 0 )
+        return;
+
+    store_load( &stores[a_i] );
+        routing_encounter( (Device){ .AEM = contact->aemB, .aemIndex = b_i } );
+    store_save( &stores[a_i] );
+    store_load( &stores[b_i] );
+        routing_encounter( (Device){ .AEM = contact->aemA, .aemIndex = a_i } );
+    store_save( &stores[b_i] );
+
+    framesMax = ( contact->end - contact->start ) * bandwidth / MESSAGE_SERIALIZED_LEN;
+    if ( framesMax > UINT32_MAX )
+        framesMax = UINT32_MAX;
+
+    // Both advertise their routing state, then client transmits first, then server ( see communication_worker() )
+    simulator_summaries( (uint32_t) a_i, (uint32_t) b_i );
+    framesA = simulator_transmit( (uint32_t) a_i, (uint32_t) b_i, (uint32_t) framesMax, true, 0.0 );
+    framesMax -= framesA;
+    framesB = simulator_transmit( (uint32_t) b_i, (uint32_t) a_i, (uint32_t) framesMax, false,
+                                  framesA * MESSAGE_SERIALIZED_LEN / bandwidth );
+    framesMax -= framesB;
+
+    // Contact either ran out, or lasted as long as the dumps
+    cut = framesMax < 1.0;
+    duration = cut ? contact->end - contact->start : ( framesA + framesB ) * MESSAGE_SERIALIZED_LEN / bandwidth;
+    store_load( &stores[a_i] );
+        routing_contact_observed( (Device){ .AEM = contact->aemB, .aemIndex = b_i }, duration, cut );
+        if ( framesA >= IO_BATCH_LEN )
+            routing_throughput_observed( (Device){ .AEM = contact->aemB, .aemIndex = b_i }, framesA * MESSAGE_SERIALIZED_LEN,
+                                         framesA * MESSAGE_SERIALIZED_LEN / bandwidth );
+    store_save( &stores[a_i] );
+    store_load( &stores[b_i] );
+        routing_contact_observed( (Device){ .AEM = contact->aemA, .aemIndex = a_i }, duration, cut );
+        if ( framesB >= IO_BATCH_LEN )
+            routing_throughput_observed( (Device){ .AEM = contact->aemA, .aemIndex = a_i }, framesB * MESSAGE_SERIALIZED_LEN,
+                                         framesB * MESSAGE_SERIALIZED_LEN / bandwidth );
+    store_save( &stores[b_i] );
+
+    stats.contacts++;
+}
+
+/// \brief Prints simulation results.
+/// \param duration simulated secs
+/// \param wallTime real secs
+static void simulator_report(double duration, double wallTime)
+{
+    double latencyAvg = 0.0;
+    uint64_t latencyMedian = 0, latency95 = 0;
+
+    if ( stats.delivered > 0 )
+    {
+        qsort( stats.latencies, stats.delivered, sizeof( uint64_t ), simulator_latency_compare );
+        for ( uint64_t delivered_i = 0; delivered_i < stats.delivered; delivered_i++ )
+            latencyAvg += (double) stats.latencies[delivered_i];
+        latencyAvg /= (double) stats.delivered;
+        latencyMedian = stats.latencies[stats.delivered / 2];
+        latency95 = stats.latencies[stats.delivered * 95 / 100];
+    }
+
+    fprintf( stdout, "/*\n"
+                     "|--------------------------------------------------------------------------\n"
+                     "| SIMULATION\n"
+                     "|--------------------------------------------------------------------------\n"
+                     "|\n"
+                     "| Devices             : %u\n"
+                     "| Duration Simulated  : %.0f secs ( in %.3f secs )\n"
+                     "| Contacts            : %llu\n"
+                     "|\n"
+                     "| Messages Produced   : %llu\n"
+                     "| Messages Delivered  : %llu ( ratio = %.4f )\n"
+                     "| Latency             : avg = %.1f secs, median = %llu secs, p95 = %llu secs\n"
+                     "| Messages Transmitted: %llu ( %llu bytes, %.2f per delivered message )\n"
+                     "| Messages Expired    : %llu\n"
+                     "| Payloads Delivered  : %llu of %llu\n"
+                     "|\n"
+                     "*/\n",
+             CLIENT_AEM_LIST_LENGTH, duration, wallTime, (unsigned long long) stats.contacts,
+             (unsigned long long) stats.produced,
+             (unsigned long long) stats.delivered, stats.produced > 0 ? (double) stats.delivered / (double) stats.produced : 0.0,
+             latencyAvg, (unsigned long long) latencyMedian, (unsigned long long) latency95,
+             (unsigned long long) stats.transmitted, (unsigned long long) ( stats.transmitted * MESSAGE_SERIALIZED_LEN ),
+             stats.delivered > 0 ? (double) stats.transmitted / (double) stats.delivered : 0.0,
+             (unsigned long long) stats.expired, (unsigned long long) messagesStats.payloads_received, (unsigned long long) stats.payloads );
+}
+
+/// \brief Discrete-event simulator: runs CLIENT_AEM_LIST_LENGTH devices against a contact schedule & a virtual clock.
+/// \example ./Simulator -d 7200 -r 6 -l 30
+/// \example ./Simulator -c contacts.csv -b 250000
+/// Options:
+///     -c FILE     : contact schedule, CSV with lines "start,end,aemA,aemB" ( default: random schedule )
+///     -d SECS     : simulated duration ( default: MAX_EXECUTION_TIME )
+///     -r RATE     : contacts per device per hour, for the random schedule ( default: 6 )
+///     -l SECS     : mean contact duration, for the random schedule ( default: 30 )
+///     -b BYTES    : bandwidth of a contact, in bytes / sec ( default: 1000000 )
+///     -s SEED     : RNG seed ( default: current time )
+///     -R POLICY   : routing policy, "epidemic", "spray_and_wait" or "prophet" ( default: ROUTING_POLICY )
+///     -Q PRIORITY : order of transmissions, "slot", "fewest_copies", "oldest" or "youngest" ( default: TRANSMIT_PRIORITY )
+///     -T SECS     : TTL of produced messages ( default: MESSAGE_TTL )
+///     -E POLICY   : eviction policy of a full buffer, "blind", "sent_only", "most_replicated", "oldest" or
+///                   "shortest_ttl" ( default: MESSAGES_PUSH_OVERRIDE_POLICY )
+///     -W 0|1      : plan dumps to fit the expected window of each contact ( default: TRANSFER_PLANNING )
+///     -F BYTES    : produce payloads of BYTES, split into fragments, instead of single messages ( default:
+///                   PRODUCER_PAYLOAD_LEN )
+///     -f RATIO    : parity fragments per data fragment of payloads ( default: FRAGMENT_REDUNDANCY )
+/// \param argc
+/// \param argv
+/// \return
+int main( int argc, char **argv )
+{
+    int option;
+    const char *traceFileName = NULL;
+    double duration = MAX_EXECUTION_TIME;
+    double rate = 6.0;
+    double meanLength = 30.0;
+    double bandwidth = 1e6;
+    unsigned int seed = (unsigned int) time( NULL );
+    const char *routingPolicy = ROUTING_POLICY;
+    const char *transmitPriority = TRANSMIT_PRIORITY;
+    const char *evictionPolicy = MESSAGES_PUSH_OVERRIDE_POLICY;
+
+    ContactTrace trace = { NULL, 0, 0 };
+    Production *productions;
+    size_t productionsN;
+    struct timespec wallStart, wallFinish;
+
+    // Parse options
+    while ( -1 != ( option = getopt( argc, argv, "c:d:r:l:b:s:R:Q:T:E:W:F:f:" ) ) )
+    {
+        switch ( option )
+        {
+            case 'c': traceFileName = optarg; break;
+            case 'd': duration = strtod( optarg, NULL ); break;
+            case 'r': rate = strtod( optarg, NULL ); break;
+            case 'l': meanLength = strtod( optarg, NULL ); break;
+            case 'b': bandwidth = strtod( optarg, NULL ); break;
+            case 's': seed = (unsigned int) strtoul( optarg, NULL, STRSEP_BASE_10 ); break;
+            case 'R': routingPolicy = optarg; break;
+            case 'Q': transmitPriority = optarg; break;
+            case 'E': evictionPolicy = optarg; break;
+            case 'W': transferPlanning = 0 != strtol( optarg, NULL, STRSEP_BASE_10 ); break;
+            case 'T': messageTtl = (uint32_t) strtoul( optarg, NULL, STRSEP_BASE_10 ); break;
+            case 'F': payloadLength = (uint32_t) strtoul( optarg, NULL, STRSEP_BASE_10 ); break;
+            case 'f': fragmentRedundancy = strtof( optarg, NULL ); break;
+            default:
+                fprintf( stderr, "Usage: %s [-c CONTACTS_CSV] [-d DURATION] [-r RATE] [-l MEAN_CONTACT_LENGTH] "
+                                 "[-b BANDWIDTH] [-s SEED] [-R ROUTING_POLICY] "
+                                 "[-Q TRANSMIT_PRIORITY] [-T TTL] [-E EVICTION_POLICY] [-W 0|1] [-F PAYLOAD_LEN] [-f REDUNDANCY]\n", argv[0] );
+                exit( EXIT_FAILURE );
+        }
+    }
+
+    srand( seed );
+    routing_setup( routingPolicy );
+    routing_priority_setup( transmitPriority );
+    messages_eviction_setup( evictionPolicy );
+    executionTimeRequested = (uint32_t) duration;
+
+    // Initialize stores of all devices
+    stores = calloc( CLIENT_AEM_LIST_LENGTH, sizeof( Store ) );
+    if ( NULL == stores )
+        error( ENOMEM, "main(): calloc() failed" );
+    for ( uint32_t device_i = 0; device_i < CLIENT_AEM_LIST_LENGTH; device_i++ )
+    {
+        stores[device_i].aem = CLIENT_AEM_LIST[device_i];
+        stores[device_i].messages = calloc( MESSAGES_SIZE, sizeof( Message ) );
+        stores[device_i].inbox = calloc( INBOX_SIZE, sizeof( InboxMessage ) );
+        stores[device_i].payloads = calloc( INBOX_SIZE, sizeof( InboxPayload ) );
+        stores[device_i].predictabilities = calloc( 1, sizeof( Predictabilities ) );
+        stores[device_i].expiries = (Heap){ calloc( 2 * MESSAGES_SIZE, sizeof( HeapEntry ) ), 0, 2 * MESSAGES_SIZE, NULL };
+        stores[device_i].recipients = calloc( 1, sizeof( RecipientIndex ) );
+        stores[device_i].evictions = (Heap){ calloc( MESSAGES_SIZE, sizeof( HeapEntry ) ), 0, MESSAGES_SIZE,
+                                             calloc( MESSAGES_SIZE, sizeof( size_t ) ) };
+        stores[device_i].estimates = calloc( CLIENT_AEM_LIST_LENGTH + 1, sizeof( ContactEstimate ) );
+        if ( NULL == stores[device_i].messages || NULL == stores[device_i].inbox || NULL == stores[device_i].payloads
+             || NULL == stores[device_i].predictabilities
+             || NULL == stores[device_i].expiries.entries || NULL == stores[device_i].recipients
+             || NULL == stores[device_i].evictions.entries || NULL == stores[device_i].evictions.positions
+             || NULL == stores[device_i].estimates )
+            error( ENOMEM, "main(): calloc() failed" );
+
+        store_load( &stores[device_i] );
+            messages_eviction_rebuild();
+        store_save( &stores[device_i] );
+    }
+
+    // Load / generate contact schedule
+    if ( NULL != traceFileName )
+    {
+        if ( false == trace_load( &trace, traceFileName ) )
+            exit( EXIT_FAILURE );
+    }
+    else
+        trace_generate( &trace, CLIENT_AEM_LIST, CLIENT_AEM_LIST_LENGTH, duration, rate, meanLength );
+
+    productions = simulator_productions( duration, &productionsN );
+
+    // Each message produced can be delivered at most once
+    stats.latencies = malloc( ( productionsN * ( payloadLength > 0 ? fragment_count( payloadLength ) : 1 ) + 1 ) *
+                              sizeof( uint64_t ) );
+    if ( NULL == stats.latencies )
+        error( ENOMEM, "main(): malloc() failed" );
+
+    // Run events in time order
+    clock_gettime( CLOCK_MONOTONIC, &wallStart );
+    for ( size_t contact_i = 0, production_i = 0; contact_i < trace.length || production_i < productionsN; )
+    {
+        bool isProduction = contact_i == trace.length ||
+            ( production_i < productionsN && productions[production_i].at <= trace.contacts[contact_i].start );
+        double at = isProduction ? productions[production_i].at : trace.contacts[contact_i].start;
+
+        if ( at >= duration )
+            break;
+
+        timestampVirtualNow = SIMULATOR_EPOCH + (uint64_t) at;
+
+        if ( isProduction )
+            simulator_produce( productions[production_i++].device_i );
+        else
+            simulator_contact( &trace.contacts[contact_i++], bandwidth );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &wallFinish );
+
+    simulator_report( duration, (double) ( wallFinish.tv_sec - wallStart.tv_sec ) +
+        (double) ( wallFinish.tv_nsec - wallStart.tv_nsec ) / 1e9 );
+    profile_dump( stdout );
+
+    trace_free( &trace );
+    free( productions );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE                     // timegm()
+#include "trace.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// \brief Orders contacts by start time ( qsort() comparator ).
+static int trace_compare(const void *a, const void *b)
+{
+    const Contact *contactA = (const Contact *) a;
+    const Contact *contactB = (const Contact *) b;
+
+    return ( contactA->start > contactB->start ) - ( contactA->start < contactB->start );
+}
+
+/// \brief Orders contacts by pair of devices ( regardless of who connected to whom ), then by start time ( qsort()
+/// comparator ).
+static int trace_compare_pair(const void *a, const void *b)
+{
+    const Contact *contactA = (const Contact *) a;
+    const Contact *contactB = (const Contact *) b;
+    uint32_t minA = contactA->aemA < contactA->aemB ? contactA->aemA : contactA->aemB;
+    uint32_t minB = contactB->aemA < contactB->aemB ? contactB->aemA : contactB->aemB;
+    uint32_t maxA = contactA->aemA ^ contactA->aemB ^ minA;
+    uint32_t maxB = contactB->aemA ^ contactB->aemB ^ minB;
+
+    if ( minA != minB )
+        return ( minA > minB ) - ( minA < minB );
+    if ( maxA != maxB )
+        return ( maxA > maxB ) - ( maxA < maxB );
+    return trace_compare( a, b );
+}
+
+/// \brief Checks if $contactA & $contactB are between the same devices ( regardless of who connected to whom ).
+static bool trace_same_pair(const Contact *contactA, const Contact *contactB)
+{
+    return ( contactA->aemA == contactB->aemA && contactA->aemB == contactB->aemB )
+        || ( contactA->aemA == contactB->aemB && contactA->aemB == contactB->aemA );
+}
+
+/// \brief Appends $contact to $trace, growing its array as needed.
+/// \param trace
+/// \param contact
+static void trace_append(ContactTrace *trace, const Contact *contact)
+{
+    if ( trace->length == trace->capacity )
+    {
+        trace->capacity = ( 0 == trace->capacity ) ? 1024 : 2 * trace->capacity;
+        trace->contacts = realloc( trace->contacts, trace->capacity * sizeof( Contact ) );
+        if ( NULL == trace->contacts )
+        {
+            perror( "trace_append(): realloc()" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    trace->contacts[trace->length++] = *contact;
+}
+
+/// \brief Prepares contacts of $trace for replay: shifts times by -$origin, merges contacts between the same devices
+/// that overlap or are less than $mergeGap apart & extends contacts shorter than $minLength.
+/// \param trace
+/// \param origin secs ( e.g. start of the earliest session, for contacts loaded from session logs )
+/// \param mergeGap secs
+/// \param minLength secs
+void trace_finalize(ContactTrace *trace, double origin, double mergeGap, double minLength)
+{
+    size_t merged_i = 0;
+
+    if ( 0 == trace->length )
+        return;
+
+    for ( size_t contact_i = 0; contact_i < trace->length; contact_i++ )
+    {
+        if ( trace->contacts[contact_i].end - trace->contacts[contact_i].start < minLength )
+            trace->contacts[contact_i].end = trace->contacts[contact_i].start + minLength;
+    }
+
+    // Merge successive contacts of each pair
+    qsort( trace->contacts, trace->length, sizeof( Contact ), trace_compare_pair );
+    for ( size_t contact_i = 1; contact_i < trace->length; contact_i++ )
+    {
+        Contact *merged = &trace->contacts[merged_i];
+        const Contact *contact = &trace->contacts[contact_i];
+
+        if ( trace_same_pair( merged, contact ) && contact->start <= merged->end + mergeGap )
+        {
+            if ( contact->end > merged->end )
+                merged->end = contact->end;
+        }
+        else
+            trace->contacts[++merged_i] = *contact;
+    }
+    trace->length = merged_i + 1;
+
+    qsort( trace->contacts, trace->length, sizeof( Contact ), trace_compare );
+    for ( size_t contact_i = 0; contact_i < trace->length; contact_i++ )
+    {
+        trace->contacts[contact_i].start -= origin;
+        trace->contacts[contact_i].end -= origin;
+    }
+}
+
+/// \brief Frees all contacts of $trace.
+/// \param trace
+void trace_free(ContactTrace *trace)
+{
+    free( trace->contacts );
+    trace->contacts = NULL;
+    trace->length = 0;
+    trace->capacity = 0;
+}
+
+/// \brief Generates a random contact schedule between $N devices: each device meets a random other device
+/// $rate times per hour ( on average ), for an exponentially distributed duration.
+/// \param trace result trace
+/// \param aems AEMs of devices
+/// \param N size of $aems
+/// \param duration length of schedule ( secs )
+/// \param rate contacts per device per hour
+/// \param meanLength mean duration of a contact ( secs )
+void trace_generate(ContactTrace *trace, const uint32_t *aems, size_t N, double duration, double rate, double meanLength)
+{
+    size_t contactsN;
+    Contact contact;
+
+    trace->contacts = NULL;
+    trace->length = 0;
+    trace->capacity = 0;
+    if ( N < 2 )
+        return;
+
+    // Each contact involves two devices
+    contactsN = (size_t) ( (double) N * rate * duration / 3600.0 / 2.0 );
+    for ( size_t contact_i = 0; contact_i < contactsN; contact_i++ )
+    {
+        size_t a = (size_t) rand() % N;
+        size_t b = (size_t) rand() % ( N - 1 );
+        if ( b >= a ) b++;
+
+        contact.start = duration * rand() / ( (double) RAND_MAX + 1.0 );
+        contact.end = contact.start + 1.0 - meanLength * log( 1.0 - rand() / ( (double) RAND_MAX + 1.0 ) );
+        contact.aemA = aems[a];
+        contact.aemB = aems[b];
+
+        trace_append( trace, &contact );
+    }
+
+    qsort( trace->contacts, trace->length, sizeof( Contact ), trace_compare );
+}
+
+/// \brief Loads a contact schedule from a CSV file with lines "start,end,aemA,aemB". Lines that do not start with a
+/// number ( e.g. a header ) are skipped.
+/// \param trace result trace ( contacts are appended )
+/// \param fileName
+/// \return TRUE on success, FALSE if file could not be read
+bool trace_load(ContactTrace *trace, const char *fileName)
+{
+    char line[256];
+    Contact contact;
+    FILE *fp;
+
+    fp = fopen( fileName, "r" );
+    if ( NULL == fp )
+    {
+        perror( "trace_load(): fopen()" );
+        return false;
+    }
+
+    while ( NULL != fgets( line, sizeof( line ), fp ) )
+    {
+        if ( 4 != sscanf( line, "%lf,%lf,%u,%u", &contact.start, &contact.end, &contact.aemA, &contact.aemB ) )
+            continue;
+        if ( contact.end < contact.start || contact.aemA == contact.aemB )
+            continue;
+
+        trace_append( trace, &contact );
+    }
+
+    fclose( fp );
+
+    qsort( trace->contacts, trace->length, sizeof( Contact ), trace_compare );
+    return true;
+}
+
+/* Event of a newline-delimited session log, until its "event_end" line */
+typedef struct trace_session_event_t {
+    unsigned int event;
+    Contact contact;
+} TraceSessionEvent;
+
+/// \brief Time of day $hours:$minutes:$seconds of a session, as secs since epoch: events only carry time of day, so
+/// days are counted from session's start on.
+/// \param sessionDay start of the day of the last event ( updated past midnight )
+/// \param previousTime time of the last event ( updated )
+/// \return
+static time_t trace_session_time(time_t *sessionDay, time_t *previousTime, unsigned int hours, unsigned int minutes,
+                                 unsigned int seconds)
+{
+    time_t eventTime = *sessionDay + hours * 3600 + minutes * 60 + seconds;
+
+    // Past midnight
+    if ( eventTime + 12 * 3600 < *previousTime )
+    {
+        *sessionDay += 24 * 3600;
+        eventTime += 24 * 3600;
+    }
+
+    return *previousTime = eventTime;
+}
+
+/// \brief Extracts the contacts recorded in a newline-delimited session log ( see log_tearUp() ): an event's start
+/// & duration are on separate lines, that of its start & its "event_end".
+/// \param trace result trace ( contacts are appended )
+/// \param log whole session log
+/// \param sessionDay start of the day the session started
+/// \param previousTime start of session
+static void trace_load_session_lines(ContactTrace *trace, char *log, time_t sessionDay, time_t previousTime)
+{
+    TraceSessionEvent *events = NULL;
+    size_t eventsN = 0, eventsCapacity = 0;
+
+    for ( char *line = log, *lineEnd; NULL != line && '\0' != *line; line = NULL == lineEnd ? NULL : lineEnd + 1 )
+    {
+        unsigned int event, hours, minutes, seconds;
+        char type[16];
+        double durationMs;
+        Contact contact;
+
+        lineEnd = strchr( line, '\n' );
+
+        if ( 7 == sscanf( line, "{\"record\": \"event\", \"event\": %u, \"occured_at\": \"%u:%u:%u\", \"type\": \"%15[^\"]\", \"server\": \"%u\", \"client\": \"%u\"",
+                          &event, &hours, &minutes, &seconds, type, &contact.aemB, &contact.aemA ) )
+        {
+            contact.start = contact.end = (double) trace_session_time( &sessionDay, &previousTime, hours, minutes, seconds );
+            if ( ( 0 != strcmp( "connection", type ) && 0 != strcmp( "session", type ) ) || contact.aemA == contact.aemB )
+                continue;
+
+            if ( eventsN == eventsCapacity )
+            {
+                eventsCapacity = 0 == eventsCapacity ? 16 : 2 * eventsCapacity;
+                events = realloc( events, eventsCapacity * sizeof( TraceSessionEvent ) );
+                if ( NULL == events )
+                {
+                    perror( "trace_load_session_lines(): realloc()" );
+                    exit( EXIT_FAILURE );
+                }
+            }
+            events[eventsN].event = event;
+            events[eventsN++].contact = contact;
+        }
+        else if ( 2 == sscanf( line, "{\"record\": \"event_end\", \"event\": %u, \"duration\": \"%lf ms\"", &event, &durationMs ) )
+        {
+            for ( size_t event_i = 0; event_i < eventsN; event_i++ )
+            {
+                if ( events[event_i].event != event )
+                    continue;
+
+                events[event_i].contact.end = events[event_i].contact.start + durationMs / 1000.0;
+                trace_append( trace, &events[event_i].contact );
+                events[event_i] = events[--eventsN];
+                break;
+            }
+        }
+    }
+
+    // Unterminated events ( e.g. device powered off ) have no duration
+    for ( size_t event_i = 0; event_i < eventsN; event_i++ )
+        trace_append( trace, &events[event_i].contact );
+
+    free( events );
+}
+
+/// \\brief Extracts the contacts recorded in a session log ( "connection" & "session" events written by
+/// log_event_start() / log_event_stop() ), either newline-delimited or converted to a single JSON document by
+/// ndjson2json. Times are absolute ( secs since epoch ), see trace_finalize().
+/// \param trace result trace ( contacts are appended )
+/// \param fileName session log, e.g. "session1.ndjson"
+/// \param startedAt result start of session ( secs since epoch )
+/// \return TRUE on success, FALSE if file could not be read
+bool trace_load_session(ContactTrace *trace, const char *fileName, double *startedAt)
+{
+    const char *eventStart = "{\"occured_at\": \"";
+    struct tm sessionStart = { 0 };
+    time_t sessionDay, previousTime;
+    char *log, *cursor;
+    long logLength;
+    FILE *fp;
+
+    // Read whole log ( message bodies never contain '"', so looking for keys is safe )
+    fp = fopen( fileName, "r" );
+    if ( NULL == fp )
+    {
+        perror( "trace_load_session(): fopen()" );
+        return false;
+    }
+    fseek( fp, 0L, SEEK_END );
+    logLength = ftell( fp );
+    rewind( fp );
+
+    log = malloc( (size_t) logLength + 1 );
+    if ( NULL == log || (size_t) logLength != fread( log, 1, (size_t) logLength, fp ) )
+    {
+        perror( "trace_load_session(): fread()" );
+        free( log );
+        fclose( fp );
+        return false;
+    }
+    log[logLength] = '\0';
+    fclose( fp );
+
+    // Events only carry time of day: count days from session's start ( log_tearUp() )
+    cursor = strstr( log, "\"start\": \"" );
+    if ( NULL == cursor || NULL == strptime( cursor + strlen( "\"start\": \"" ), "%Y-%m-%dT%H:%M:%S", &sessionStart ) )
+    {
+        fprintf( stderr, "trace_load_session(): %s is not a session log\n", fileName );
+        free( log );
+        return false;
+    }
+    previousTime = timegm( &sessionStart );
+    *startedAt = (double) previousTime;
+    sessionStart.tm_hour = sessionStart.tm_min = sessionStart.tm_sec = 0;
+    sessionDay = timegm( &sessionStart );
+
+    // Newline-delimited log, else a single JSON document ( converted by ndjson2json )
+    if ( 0 == strncmp( log, "{\"record\": ", strlen( "{\"record\": " ) ) )
+    {
+        trace_load_session_lines( trace, log, sessionDay, previousTime );
+        cursor = NULL;
+    }
+    else
+        cursor = strstr( cursor, eventStart );
+
+    while ( NULL != cursor )
+    {
+        char *nextEvent = strstr( cursor + 1, eventStart );
+        char *duration = strstr( cursor, "], \"duration\": \"" );
+        unsigned int hours, minutes, seconds;
+        char type[16], unit;
+        double durationMs = 0.0;
+        Contact contact;
+
+        if ( 6 == sscanf( cursor, "{\"occured_at\": \"%u:%u:%u\", \"type\": \"%15[^\"]\", \"server\": \"%u\", \"client\": \"%u\"",
+                &hours, &minutes, &seconds, type, &contact.aemB, &contact.aemA ) )
+        {
+            time_t eventTime = trace_session_time( &sessionDay, &previousTime, hours, minutes, seconds );
+
+            // Unterminated events ( e.g. device powered off ) have no duration
+            if ( NULL != duration && ( NULL == nextEvent || duration < nextEvent ) &&
+                 2 != sscanf( duration, "], \"duration\": \"%lf m%c", &durationMs, &unit ) )
+                durationMs = 0.0;               // session's duration ( secs ), not the event's
+
+            if ( ( 0 == strcmp( "connection", type ) || 0 == strcmp( "session", type ) ) && contact.aemA != contact.aemB )
+            {
+                contact.start = (double) eventTime;
+                contact.end = contact.start + durationMs / 1000.0;
+                trace_append( trace, &contact );
+            }
+        }
+
+        cursor = nextEvent;
+    }
+
+    free( log );
+
+    qsort( trace->contacts, trace->length, sizeof( Contact ), trace_compare );
+    return true;
+}
+
+/// \brief Saves $trace as a CSV file with lines "start,end,aemA,aemB".
+/// \param trace
+/// \param fileName
+/// \return TRUE on success, FALSE if file could not be written
+bool trace_save(const ContactTrace *trace, const char *fileName)
+{
+    FILE *fp = fopen( fileName, "w" );
+    if ( NULL == fp )
+    {
+        perror( "trace_save(): fopen()" );
+        return false;
+    }
+
+    fprintf( fp, "start,end,aemA,aemB\n" );
+    for ( size_t contact_i = 0; contact_i < trace->length; contact_i++ )
+    {
+        fprintf( fp, "%.3f,%.3f,%u,%u\n", trace->contacts[contact_i].start, trace->contacts[contact_i].end,
+                 trace->contacts[contact_i].aemA, trace->contacts[contact_i].aemB );
+    }
+
+    return 0 == fclose( fp );
+}
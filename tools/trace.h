@@ -0,0 +1,67 @@
+#ifndef FINAL_TRACE_H
+#define FINAL_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A contact between two devices ( times in seconds since the start of the trace ) */
+typedef struct contact_t {
+    double start;
+    double end;
+    uint32_t aemA;
+    uint32_t aemB;
+} Contact;
+
+/* Contact schedule, sorted by start time */
+typedef struct contact_trace_t {
+    Contact *contacts;
+    size_t length;
+    size_t capacity;
+} ContactTrace;
+
+/// \brief Prepares contacts of $trace for replay: shifts times by -$origin, merges contacts between the same devices
+/// that overlap or are less than $mergeGap apart & extends contacts shorter than $minLength.
+/// \param trace
+/// \param origin secs ( e.g. start of the earliest session, for contacts loaded from session logs )
+/// \param mergeGap secs
+/// \param minLength secs
+void trace_finalize(ContactTrace *trace, double origin, double mergeGap, double minLength);
+
+/// \brief Frees all contacts of $trace.
+/// \param trace
+void trace_free(ContactTrace *trace);
+
+/// \brief Generates a random contact schedule between $N devices: each device meets a random other device
+/// $rate times per hour ( on average ), for an exponentially distributed duration.
+/// \param trace result trace
+/// \param aems AEMs of devices
+/// \param N size of $aems
+/// \param duration length of schedule ( secs )
+/// \param rate contacts per device per hour
+/// \param meanLength mean duration of a contact ( secs )
+void trace_generate(ContactTrace *trace, const uint32_t *aems, size_t N, double duration, double rate, double meanLength);
+
+/// \brief Loads a contact schedule from a CSV file with lines "start,end,aemA,aemB". Lines that do not start with a
+/// number ( e.g. a header ) are skipped.
+/// \param trace result trace ( contacts are appended )
+/// \param fileName
+/// \return TRUE on success, FALSE if file could not be read
+bool trace_load(ContactTrace *trace, const char *fileName);
+
+/// \brief Extracts the contacts recorded in a session log ( "connection" & "session" events written by
+/// log_event_start() / log_event_stop() ), either newline-delimited or converted to a single JSON document by
+/// ndjson2json. Times are absolute ( secs since epoch ), see trace_finalize().
+/// \param trace result trace ( contacts are appended )
+/// \param fileName session log, e.g. "session1.ndjson"
+/// \param startedAt result start of session ( secs since epoch )
+/// \return TRUE on success, FALSE if file could not be read
+bool trace_load_session(ContactTrace *trace, const char *fileName, double *startedAt);
+
+/// \brief Saves $trace as a CSV file with lines "start,end,aemA,aemB".
+/// \param trace
+/// \param fileName
+/// \return TRUE on success, FALSE if file could not be written
+bool trace_save(const ContactTrace *trace, const char *fileName);
+
+#endif //FINAL_TRACE_H